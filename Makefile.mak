@@ -1,25 +1,90 @@
 # Compiler and flags
 CXX = g++
-CXXFLAGS = -std=c++11 -Wall -g
+# Set ARCHFLAGS=-mavx2 (or -march=native) to enable the AVX2 kernels
+ARCHFLAGS ?=
+# Set TRACE=1 to compile in the instrumentation (see trace.h); run make
+# clean when switching, as objects are not rebuilt for it
+ifdef TRACE
+TRACEFLAGS = -DCV_TRACE
+endif
+CXXFLAGS = -std=c++11 -Wall -g -O2 -pthread $(ARCHFLAGS) $(TRACEFLAGS)
 
-# Source and object files
-SRCS = s1.cc s2.cc s3.cc image.cc
-OBJS = $(SRCS:.cc=.o)
+# Shared library sources
+LIB_SRCS = image.cc tiled_image.cc sphere.cc components.cc photometric.cc thread_pool.cc calibration_cache.cc \
+	synthetic.cc trace.cc depth.cc filter.cc histogram.cc
+LIB_OBJS = $(LIB_SRCS:.cc=.o)
 
-# Output executable
-EXEC = program
+# One executable per program, plus the benchmarks
+EXECS = s1 s2 s3 s4 stream serve batch bench_io bench_pipeline
 
-# Target to build the executable
-$(EXEC): $(OBJS)
-	$(CXX) $(CXXFLAGS) -o $(EXEC) $(OBJS)
+# Self-checks of the library against reference implementations, run by make
+CHECKS = check_components check_filter check_contour
+
+all: $(EXECS) check
+
+# Run every check; the build fails with the first that does
+check: $(CHECKS)
+	@for c in $(CHECKS); do ./$$c || exit 1; done
+
+# Target to build each executable
+s1: s1.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+s2: s2.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+s3: s3.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+s4: s4.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+stream: stream.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+serve: serve.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+batch: batch.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+bench_io: bench_io.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+bench_pipeline: bench_pipeline.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+check_components: check_components.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+check_filter: check_filter.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
+
+check_contour: check_contour.o $(LIB_OBJS)
+	$(CXX) $(CXXFLAGS) -o $@ $^
 
 # Rule to compile .cc files to .o files
 .cc.o:
 	$(CXX) $(CXXFLAGS) -c $<
 
+# Every object depends on the image header
+$(LIB_OBJS) s1.o s2.o s3.o s4.o stream.o serve.o batch.o bench_io.o bench_pipeline.o check_components.o check_filter.o check_contour.o: image.h
+sphere.o s1.o s2.o batch.o bench_pipeline.o check_contour.o: sphere.h
+photometric.o s3.o stream.o serve.o batch.o bench_pipeline.o: photometric.h thread_pool.h
+stream.o: bounded_queue.h
+thread_pool.o: thread_pool.h
+tiled_image.o sphere.o photometric.o calibration_cache.o s1.o s2.o s3.o stream.o serve.o batch.o bench_pipeline.o: tiled_image.h
+depth.o s4.o bench_pipeline.o: depth.h thread_pool.h
+components.o sphere.o check_components.o: components.h
+filter.o s1.o s3.o bench_pipeline.o check_filter.o: filter.h thread_pool.h
+histogram.o s1.o s3.o batch.o: histogram.h thread_pool.h
+calibration_cache.o s1.o s2.o batch.o: calibration_cache.h sphere.h
+synthetic.o bench_pipeline.o check_contour.o: synthetic.h sphere.h
+trace.o image.o tiled_image.o sphere.o components.o photometric.o depth.o filter.o histogram.o s1.o s2.o s3.o s4.o stream.o serve.o batch.o: trace.h
+
 # Clean up build files
 clean:
-	rm -f $(OBJS) $(EXEC)
+	rm -f *.o $(EXECS) $(CHECKS)
 
 # Phony targets
-.PHONY: clean
+.PHONY: all check clean
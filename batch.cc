@@ -0,0 +1,253 @@
+// Runs the whole s1 -> s2 -> s3 pipeline over many objects in one process.
+// Each rig is calibrated once, and its light matrix stays in memory for
+// every object photographed with it.
+//
+// Manifest lines (blank lines and lines starting with '#' are skipped):
+//   rig <name> <threshold> <sphere image> <sphere image 1> ... <sphere image N>
+//   object <rig name> <threshold> <normals image> <albedo image> <image 1> ... <image N>
+// The first sphere image locates the sphere (as in s1), the other N give
+// one light direction each (as in s2); objects need one image per light,
+// and are solved only where one of them is brighter than the object's
+// threshold (as in s3; a negative threshold solves every pixel).
+// A rig threshold of "auto" is chosen by Otsu's method from the first
+// sphere image (as with s1 --auto-threshold), an object's from its images
+// (as with s3 --auto-threshold).
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "calibration_cache.h"
+#include "histogram.h"
+#include "image.h"
+#include "photometric.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace ComputerVisionProjects;
+
+// Everything needed to solve the objects photographed with one rig
+struct Rig {
+    SphereParameters sphere;
+    std::vector<std::vector<double>> directions;
+    LightMatrix lights;
+};
+
+// Function to parse a threshold field: an integer, or "auto" for Otsu's threshold
+bool parseThreshold(const std::string& field, int& threshold, bool& autoThreshold) {
+    autoThreshold = field == "auto";
+    threshold = 0;
+    if (autoThreshold) return true;
+    std::istringstream word(field);
+    if (!(word >> threshold) || !word.eof()) {
+        std::cerr << "Error: Threshold " << field << " is not an integer or auto." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Function to compute the cache key of a rig: its threshold and the contents of its sphere images
+bool rigCacheKey(const std::vector<std::string>& fields, int threshold, bool autoThreshold, uint64_t& key) {
+    ContentHash hash;
+    hash.UpdateString("batch rig highlights");
+    if (autoThreshold) {
+        hash.UpdateString("otsu");
+    } else {
+        hash.UpdateValue(threshold);
+    }
+    for (size_t i = 1; i < fields.size(); ++i) {
+        if (!HashFile(fields[i], &hash)) return false;
+    }
+    key = hash.Digest();
+    return true;
+}
+
+// Function to calibrate a rig from the fields of its manifest line:
+// <threshold> <sphere image> <sphere image 1> ... <sphere image N>
+// With a cache directory, a rig whose threshold and sphere images are unchanged is loaded instead.
+bool calibrateRig(const std::vector<std::string>& fields, const std::string& cacheDirectory, Rig& rig, bool& cached) {
+    if (fields.size() < 5) {
+        std::cerr << "Error: A rig needs a threshold, a sphere image and at least three light images." << std::endl;
+        return false;
+    }
+    int threshold;
+    bool autoThreshold;
+    if (!parseThreshold(fields[0], threshold, autoThreshold)) return false;
+
+    uint64_t key = 0;
+    Calibration calibration;
+    cached = !cacheDirectory.empty() && rigCacheKey(fields, threshold, autoThreshold, key) &&
+        LoadCalibration(cacheDirectory, key, &calibration) &&
+        calibration.has_sphere && calibration.directions.size() == fields.size() - 2;
+    if (cached) {
+        rig.sphere = calibration.sphere;
+        rig.directions = calibration.directions;
+        return ComputeLightMatrix(rig.directions, &rig.lights);
+    }
+
+    // Sphere images are read at full precision, whatever their depth
+    Image16 image;
+    if (!ReadImage(fields[1], &image)) {
+        std::cerr << "Error: Unable to read the PGM file " << fields[1] << std::endl;
+        return false;
+    }
+    if (autoThreshold) {
+        // The sphere is the pixels at or above the threshold, Otsu's bright class those above its level
+        std::vector<uint64_t> histogram;
+        ComputeHistogram(image.View(), nullptr, &histogram);
+        threshold = OtsuThreshold(histogram) + 1;
+    }
+    if (!LocateSphere(image.View(), threshold, &rig.sphere)) {
+        std::cerr << "Error: No circle detected in " << fields[1] << std::endl;
+        return false;
+    }
+
+    // The light images are searched together, in one pass over the sphere
+    std::vector<Image16> lightImages(fields.size() - 2);
+    std::vector<ImageView<uint16_t>> views;
+    for (size_t i = 2; i < fields.size(); ++i) {
+        if (!ReadImage(fields[i], &lightImages[i - 2]) || lightImages[i - 2].num_rows() != image.num_rows() ||
+            lightImages[i - 2].num_columns() != image.num_columns()) {
+            std::cerr << "Error: Could not read sphere image " << fields[i] << " at the size of " << fields[1] << std::endl;
+            return false;
+        }
+        views.push_back(lightImages[i - 2].View());
+    }
+    ComputeLightDirections(views, rig.sphere, 0, &rig.directions);
+
+    if (!ComputeLightMatrix(rig.directions, &rig.lights)) {
+        std::cerr << "Error: Light directions do not determine the normals." << std::endl;
+        return false;
+    }
+
+    if (!cacheDirectory.empty()) {
+        calibration.has_sphere = true;
+        calibration.sphere = rig.sphere;
+        calibration.directions = rig.directions;
+        StoreCalibration(cacheDirectory, key, calibration);
+    }
+    return true;
+}
+
+// Function to solve one object from the fields of its manifest line:
+// <threshold> <normals image> <albedo image> <image 1> ... <image N>
+bool solveObject(const std::vector<std::string>& fields, const Rig& rig, ThreadPool& pool,
+                 bool stream, size_t bandRows) {
+    if (fields.size() != 3 + rig.directions.size()) {
+        std::cerr << "Error: Expected a threshold, two output images and one image per light direction (" << rig.directions.size() << ")." << std::endl;
+        return false;
+    }
+    int threshold;
+    bool autoThreshold;
+    if (!parseThreshold(fields[0], threshold, autoThreshold)) return false;
+    const std::string& normalsFile = fields[1];
+    const std::string& albedoFile = fields[2];
+    std::vector<std::string> imageFiles(fields.begin() + 3, fields.end());
+    std::vector<ImageReader> readers;
+    if (!OpenObjectImages(imageFiles, &readers)) {
+        return false;
+    }
+    if (autoThreshold) {
+        // From the brightest image at each pixel, which the foreground is tested on
+        std::vector<uint64_t> histogram;
+        ComputeMaximumHistogram(readers, &pool, &histogram);
+        threshold = OtsuThreshold(histogram);
+    }
+
+    // Only the foreground is solved, as s3 does
+    if (stream) {
+        return StreamNormalsAndAlbedo(readers, rig.lights, threshold, &pool, bandRows, normalsFile, albedoFile);
+    }
+    ForegroundMask mask;
+    if (threshold >= 0) ComputeForegroundMask(readers, threshold, &pool, &mask);
+    Image normalsImage, albedoImage;
+    ComputeNormalsAndAlbedo(readers, rig.lights, threshold < 0 ? nullptr : &mask, &pool, &normalsImage, &albedoImage);
+    return WriteImage(normalsFile, normalsImage) && WriteImage(albedoFile, albedoImage);
+}
+
+int main(int argc, char** argv) {
+    // Pull out the options, leaving the positional arguments
+    size_t threads = 0;  // One per hardware thread
+    bool stream = false;
+    size_t bandRows = 64;
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::string cacheDirectory;  // No caching unless given
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--stream") {
+            stream = true;
+        } else if (std::string(argv[i]) == "--band-rows" && i + 1 < argc) {
+            bandRows = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (std::string(argv[i]) == "--cache" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() != 2) {
+        std::cerr << "Usage: batch [--threads N] [--stream [--band-rows N]] [--cache DIR] [--trace FILE] [--metrics FILE] {manifest file}" << std::endl;
+        return 1;
+    }
+    std::ifstream manifest(args[1]);
+    if (!manifest) {
+        std::cerr << "Error: Could not open manifest file " << args[1] << std::endl;
+        return 1;
+    }
+
+    // Traces are written on return
+    TraceSession trace(traceFile, metricsFile);
+
+    ThreadPool pool(threads);
+    std::map<std::string, Rig> rigs;
+    int lineNumber = 0, solved = 0, failed = 0;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        ++lineNumber;
+        std::istringstream words(line);
+        std::string kind, name, field;
+        if (!(words >> kind) || kind[0] == '#') continue;
+        words >> name;
+        std::vector<std::string> fields;
+        while (words >> field) fields.push_back(field);
+
+        if (kind == "rig") {
+            Rig rig;
+            bool cached = false;
+            if (!calibrateRig(fields, cacheDirectory, rig, cached)) {
+                std::cerr << "Line " << lineNumber << ": rig " << name << " not calibrated." << std::endl;
+                ++failed;
+                continue;
+            }
+            std::cout << "Rig " << name << ": sphere center (" << rig.sphere.center_x << ", " << rig.sphere.center_y
+                      << "), radius " << rig.sphere.radius << ", " << rig.directions.size() << " lights" << (cached ? " (cached)" : "") << std::endl;
+            rigs[name] = rig;
+        } else if (kind == "object") {
+            std::map<std::string, Rig>::const_iterator rig = rigs.find(name);
+            if (rig == rigs.end()) {
+                std::cerr << "Line " << lineNumber << ": unknown rig " << name << std::endl;
+                ++failed;
+            } else if (!solveObject(fields, rig->second, pool, stream, bandRows)) {
+                std::cerr << "Line " << lineNumber << ": object not solved." << std::endl;
+                ++failed;
+            } else {
+                ++solved;
+            }
+        } else {
+            std::cerr << "Line " << lineNumber << ": unknown entry " << kind << std::endl;
+            ++failed;
+        }
+    }
+
+    std::cout << solved << " objects solved, " << failed << " failures." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
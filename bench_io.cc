@@ -0,0 +1,154 @@
+// Microbenchmark for pgm reading and writing: compares the per-pixel
+// fgetc()/fputc() functions the library used to have with ReadImage(),
+// MapImage() and WriteImage(), in bytes per second.
+// Usage: bench_io [rows columns [iterations]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "image.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+// The original ReadImage(): one fgetc() and one SetPixel() per pixel.
+bool LegacyReadImage(const std::string &filename, Image *an_image) {
+  FILE *input = fopen(filename.c_str(), "rb");
+  if (input == 0) return false;
+  char line[1024];
+  if (fread(line, 1, 3, input) != 3 || strncmp(line, "P5\n", 3)) {
+    fclose(input);
+    return false;
+  }
+  do {
+    if (fgets(line, sizeof line, input) == nullptr) {
+      fclose(input);
+      return false;
+    }
+  } while (*line == '#');
+  int num_columns, num_rows;
+  sscanf(line, "%d %d\n", &num_columns, &num_rows);
+  an_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+  if (fgets(line, sizeof line, input) == nullptr) {
+    fclose(input);
+    return false;
+  }
+  int levels;
+  sscanf(line, "%d\n", &levels);
+  an_image->SetNumberGrayLevels(levels);
+  for (int i = 0; i < num_rows; ++i) {
+    for (int j = 0; j < num_columns; ++j) {
+      const int byte = fgetc(input);
+      if (byte == EOF) {
+        fclose(input);
+        return false;
+      }
+      an_image->SetPixel(i, j, byte);
+    }
+  }
+  fclose(input);
+  return true;
+}
+
+// The original WriteImage(): one GetPixel() and one fputc() per pixel.
+bool LegacyWriteImage(const std::string &filename, const Image &an_image) {
+  FILE *output = fopen(filename.c_str(), "w");
+  if (output == 0) return false;
+  const int num_rows = an_image.num_rows();
+  const int num_columns = an_image.num_columns();
+  fprintf(output, "P5\n#\n%d %d\n%03d\n", num_columns, num_rows,
+          static_cast<int>(an_image.num_gray_levels()));
+  for (int i = 0; i < num_rows; ++i) {
+    for (int j = 0; j < num_columns; ++j) {
+      if (fputc(an_image.GetPixel(i, j), output) == EOF) {
+        fclose(output);
+        return false;
+      }
+    }
+  }
+  fclose(output);
+  return true;
+}
+
+// Runs operation iterations times and prints its throughput, given that
+// each run moves bytes bytes.
+template <typename Operation>
+void Report(const char *name, int iterations, size_t bytes,
+            Operation operation) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int k = 0; k < iterations; ++k) {
+    if (!operation()) {
+      std::cerr << name << ": failed" << std::endl;
+      exit(1);
+    }
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const double seconds = elapsed.count() / iterations;
+  printf("%-20s %10.3f ms %12.1f MB/s\n", name, seconds * 1e3,
+         bytes / seconds / 1e6);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 1 && argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " [rows columns [iterations]]"
+              << std::endl;
+    return 1;
+  }
+  const size_t num_rows = argc > 1 ? std::stoul(argv[1]) : 480;
+  const size_t num_columns = argc > 1 ? std::stoul(argv[2]) : 640;
+  const int iterations = argc > 3 ? std::stoi(argv[3]) : 20;
+
+  Image source;
+  source.AllocateSpaceAndSetSize(num_rows, num_columns);
+  source.SetNumberGrayLevels(255);
+  for (size_t i = 0; i < num_rows; ++i) {
+    uint8_t *row = source.Row(i);
+    for (size_t j = 0; j < num_columns; ++j) row[j] = (i * 7 + j * 3) & 255;
+  }
+
+  const std::string filename =
+      "/tmp/bench_io_" + std::to_string(getpid()) + ".pgm";
+  if (!WriteImage(filename, source)) return 1;
+  const size_t bytes = num_rows * num_columns;
+  std::cout << "Image: " << num_rows << " x " << num_columns << ", "
+            << iterations << " iterations" << std::endl;
+
+  Image image;
+  Report("LegacyReadImage", iterations, bytes, [&] {
+    return LegacyReadImage(filename, &image);
+  });
+  Report("ReadImage", iterations, bytes, [&] {
+    return ReadImage(filename, &image);
+  });
+  // Touches every pixel, so the page faults are part of the cost.
+  volatile unsigned sink = 0;
+  Report("MapImage", iterations, bytes, [&] {
+    MappedImage mapped_image;
+    if (!MapImage(filename, &mapped_image)) return false;
+    const ImageView<uint8_t> &view = mapped_image.view();
+    unsigned sum = 0;
+    for (size_t i = 0; i < view.num_rows(); ++i) {
+      const uint8_t *row = view.Row(i);
+      for (size_t j = 0; j < view.num_columns(); ++j) sum += row[j];
+    }
+    sink = sink + sum;
+    return true;
+  });
+  Report("LegacyWriteImage", iterations, bytes, [&] {
+    return LegacyWriteImage(filename, source);
+  });
+  Report("WriteImage", iterations, bytes, [&] {
+    return WriteImage(filename, source);
+  });
+
+  unlink(filename.c_str());
+  return 0;
+}
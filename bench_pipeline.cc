@@ -0,0 +1,556 @@
+// Benchmark of the whole pipeline on synthetic scenes with known ground
+// truth (see synthetic.h), from VGA to 8K and with 3 to 16 lights. Times
+// ReadImage()/WriteImage(), the s1 sphere location, Gaussian smoothing
+// and gradients, the s2 brightest
+// pixel search, the s3 solve and the s4 integration, and measures how far the results are
+// from the truth. Prints one JSON object per line:
+//   {"benchmark":"s3_solve","size":"4k","rows":2160,"columns":3840,
+//    "lights":8,"iterations":5,"p50_ms":...,"megapixels_per_s":...}
+// Timings report latency percentiles over the iterations and the
+// throughput at the median; *_accuracy lines report errors in pixels or
+// degrees.
+// Usage: bench_pipeline [--sizes vga,720p,1080p,4k,8k] [--lights 3,8,16]
+//                       [--iterations N] [--threads N] [--keep DIR]
+// With --keep, the rendered images are left in DIR/<size>/ (and
+// DIR/<size>/<lights>/) for running s1, s2 and s3 on.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "depth.h"
+#include "filter.h"
+#include "image.h"
+#include "photometric.h"
+#include "sphere.h"
+#include "synthetic.h"
+#include "thread_pool.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+struct SceneSize {
+  const char *name;
+  size_t num_rows;
+  size_t num_columns;
+};
+
+const SceneSize kSceneSizes[] = {
+  {"vga", 480, 640},
+  {"720p", 720, 1280},
+  {"1080p", 1080, 1920},
+  {"4k", 2160, 3840},
+  {"8k", 4320, 7680},
+};
+
+const double kPi = 3.14159265358979323846;
+
+// Half-angle of the cone the lights sit on.
+const double kLightElevationDegrees = 30.0;
+
+// Threshold for s1: between the background and the sphere's rim.
+const int kSphereThreshold = 100;
+
+// Standard deviation of the smoothing benchmarked, as for s1/s3 --smooth.
+const double kSmoothSigma = 1.5;
+
+// Splits a comma-separated list.
+std::vector<std::string> SplitList(const std::string &list) {
+  std::vector<std::string> items;
+  std::istringstream input(list);
+  std::string item;
+  while (std::getline(input, item, ',')) items.push_back(item);
+  return items;
+}
+
+// Calls operation iterations times; returns the duration of each call in
+// seconds. Exits if a call fails.
+template <typename Operation>
+std::vector<double> Time(const char *name, int iterations,
+                         Operation operation) {
+  std::vector<double> seconds;
+  for (int k = 0; k < iterations; ++k) {
+    const auto start = std::chrono::steady_clock::now();
+    if (!operation()) {
+      std::cerr << name << ": failed" << std::endl;
+      exit(1);
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    seconds.push_back(elapsed.count());
+  }
+  return seconds;
+}
+
+// Nearest-rank percentile of sorted values.
+double Percentile(const std::vector<double> &sorted, double percent) {
+  if (sorted.empty()) return 0.0;
+  const size_t rank = static_cast<size_t>(ceil(percent / 100.0 * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+// Angle between two vectors, in degrees.
+double AngleDegrees(const double a[3], const double b[3]) {
+  const double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  const double norms = sqrt((a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) *
+                            (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+  return acos(std::min(1.0, std::max(-1.0, dot / norms))) * 180.0 / kPi;
+}
+
+// Angular errors of many pixels, binned to 0.01 degree for percentiles.
+class AngularErrors {
+ public:
+  AngularErrors(): bins_(18001, 0), count_{0}, sum_{0.0}, max_{0.0} { }
+
+  void Add(double degrees) {
+    ++bins_[std::min<size_t>(degrees * 100.0 + 0.5, bins_.size() - 1)];
+    ++count_;
+    sum_ += degrees;
+    max_ = std::max(max_, degrees);
+  }
+
+  uint64_t count() const { return count_; }
+  double mean() const { return count_ == 0 ? 0.0 : sum_ / count_; }
+  double max() const { return max_; }
+  double Percentile(double percent) const {
+    const uint64_t rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(ceil(percent / 100.0 * count_)));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < bins_.size(); ++b) {
+      seen += bins_[b];
+      if (seen >= rank) return b / 100.0;
+    }
+    return max_;
+  }
+
+ private:
+  std::vector<uint64_t> bins_;
+  uint64_t count_;
+  double sum_;
+  double max_;
+};
+
+// One line of output: a JSON object with the fields in the order added.
+class Record {
+ public:
+  Record(const std::string &benchmark, const SceneSize &size,
+         size_t num_lights) {
+    Add("benchmark", benchmark);
+    Add("size", size.name);
+    Add("rows", size.num_rows);
+    Add("columns", size.num_columns);
+    if (num_lights > 0) Add("lights", num_lights);
+  }
+
+  Record &Add(const char *key, const std::string &value) {
+    Key(key);
+    fields_ << '"' << value << '"';
+    return *this;
+  }
+  Record &Add(const char *key, uint64_t value) {
+    Key(key);
+    fields_ << value;
+    return *this;
+  }
+  Record &Add(const char *key, double value) {
+    char number[32];
+    snprintf(number, sizeof number, "%.6g", value);
+    Key(key);
+    fields_ << number;
+    return *this;
+  }
+
+  // Latency percentiles of seconds, and throughput at the median given
+  // that each call handles pixels pixels and bytes bytes (if not 0).
+  Record &AddTimings(std::vector<double> seconds, size_t pixels,
+                     size_t bytes) {
+    std::sort(seconds.begin(), seconds.end());
+    const double median = Percentile(seconds, 50);
+    Add("iterations", seconds.size());
+    Add("p50_ms", median * 1e3);
+    Add("p90_ms", Percentile(seconds, 90) * 1e3);
+    Add("p99_ms", Percentile(seconds, 99) * 1e3);
+    Add("max_ms", seconds.back() * 1e3);
+    Add("megapixels_per_s", pixels / median / 1e6);
+    if (bytes > 0) Add("mb_per_s", bytes / median / 1e6);
+    return *this;
+  }
+
+  Record &AddErrors(const char *prefix, const AngularErrors &errors) {
+    const std::string name(prefix);
+    Add((name + "_mean_deg").c_str(), errors.mean());
+    Add((name + "_p50_deg").c_str(), errors.Percentile(50));
+    Add((name + "_p99_deg").c_str(), errors.Percentile(99));
+    Add((name + "_max_deg").c_str(), errors.max());
+    return *this;
+  }
+
+  void Print() const { std::cout << "{" << fields_.str() << "}" << std::endl; }
+
+ private:
+  void Key(const char *key) {
+    if (fields_.tellp() > 0) fields_ << ',';
+    fields_ << '"' << key << "\":";
+  }
+
+  std::ostringstream fields_;
+};
+
+// Files and directories created for a run, removed afterwards unless the
+// user asked to keep them.
+class Scratch {
+ public:
+  explicit Scratch(bool keep): keep_{keep} { }
+  ~Scratch() {
+    if (keep_) return;
+    for (size_t k = paths_.size(); k-- > 0; )
+      if (unlink(paths_[k].c_str()) != 0) rmdir(paths_[k].c_str());
+  }
+
+  std::string Directory(const std::string &path) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+      std::cerr << "Error: Could not create " << path << std::endl;
+      exit(1);
+    }
+    return Track(path);
+  }
+  std::string Track(const std::string &path) {
+    if (std::find(paths_.begin(), paths_.end(), path) == paths_.end())
+      paths_.push_back(path);
+    return path;
+  }
+
+ private:
+  bool keep_;
+  std::vector<std::string> paths_;
+};
+
+// Solves the object images band by band against the ground truth, with
+// both the true lights and the lights s2 found. Single-threaded: it
+// measures accuracy, not speed.
+void MeasureObjectAccuracy(const SceneSize &size,
+                           const std::vector<ImageReader> &readers,
+                           const LightMatrix &true_lights,
+                           const LightMatrix &found_lights) {
+  const size_t num_columns = size.num_columns;
+  const size_t num_lights = readers.size();
+  const size_t band_rows = 64;
+  std::vector<float> intensities(num_lights * band_rows * num_columns);
+  std::vector<const float *> planes(num_lights);
+  std::vector<float> normal_x(num_columns), normal_y(num_columns),
+      normal_z(num_columns), albedo(num_columns);
+
+  AngularErrors solver_errors, pipeline_errors;
+  double albedo_error = 0.0;
+  for (size_t first_row = 0; first_row < size.num_rows;
+       first_row += band_rows) {
+    const size_t rows = std::min(band_rows, size.num_rows - first_row);
+    for (size_t d = 0; d < num_lights; ++d)
+      readers[d].ReadRows(first_row, rows,
+                          &intensities[d * rows * num_columns], num_columns);
+    for (size_t r = 0; r < rows; ++r) {
+      for (size_t d = 0; d < num_lights; ++d)
+        planes[d] = &intensities[(d * rows + r) * num_columns];
+      for (int pass = 0; pass < 2; ++pass) {
+        SolveNormals(pass == 0 ? true_lights : found_lights, planes.data(),
+                     num_columns, normal_x.data(), normal_y.data(),
+                     normal_z.data(), albedo.data());
+        for (size_t j = 0; j < num_columns; ++j) {
+          double truth[3], true_albedo;
+          ObjectNormalAndAlbedo(size.num_rows, num_columns, first_row + r,
+                                j, truth, &true_albedo);
+          const double found[3] = {normal_x[j], normal_y[j], normal_z[j]};
+          if (pass == 0) {
+            solver_errors.Add(AngleDegrees(found, truth));
+            albedo_error += fabs(albedo[j] - true_albedo);
+          } else {
+            pipeline_errors.Add(AngleDegrees(found, truth));
+          }
+        }
+      }
+    }
+  }
+
+  // With the true lights only quantization separates the result from the
+  // truth; with the lights from s2, calibration errors add up too.
+  Record("s3_accuracy", size, num_lights)
+      .Add("pixels", solver_errors.count())
+      .AddErrors("normal", solver_errors)
+      .Add("albedo_mean_abs_error", albedo_error / solver_errors.count())
+      .Print();
+  Record("pipeline_accuracy", size, num_lights)
+      .Add("pixels", pipeline_errors.count())
+      .AddErrors("normal", pipeline_errors)
+      .Print();
+}
+
+// Integrates the normals solved with the true lights (so quantization is
+// the only error in them) into heights, and compares them with the
+// object's true surface up to the constant the integration leaves free.
+void RunDepth(const SceneSize &size, const std::vector<ImageReader> &readers,
+              const LightMatrix &true_lights, int iterations,
+              ThreadPool *pool) {
+  ImageFloat normals[3], albedo;
+  ComputeFloatNormalsAndAlbedo(readers, true_lights, nullptr, pool, normals,
+                               &albedo);
+  const ImageView<float> planes[3] = {normals[0].View(), normals[1].View(),
+                                      normals[2].View()};
+  const DepthOptions options;
+  ImageFloat height;
+  Image mask;
+  DepthStatistics statistics;
+  Record("s4_integrate", size, readers.size())
+      .Add("threads", pool->num_threads())
+      .AddTimings(Time("s4_integrate", iterations, [&] {
+        ComputeDepth(planes, options, pool, &height, &mask, &statistics);
+        return true;
+      }), size.num_rows * size.num_columns, 0)
+      .Print();
+
+  double offset = 0.0;
+  for (size_t i = 0; i < size.num_rows; ++i)
+    for (size_t j = 0; j < size.num_columns; ++j)
+      if (mask.GetPixel(i, j) != 0)
+        offset += height.GetPixel(i, j) -
+            ObjectHeight(size.num_rows, size.num_columns, i, j);
+  offset /= std::max<size_t>(1, statistics.foreground_pixels);
+  double error_sum = 0.0, error_max = 0.0;
+  for (size_t i = 0; i < size.num_rows; ++i)
+    for (size_t j = 0; j < size.num_columns; ++j) {
+      if (mask.GetPixel(i, j) == 0) continue;
+      const double error = fabs(height.GetPixel(i, j) - offset -
+          ObjectHeight(size.num_rows, size.num_columns, i, j));
+      error_sum += error;
+      error_max = std::max(error_max, error);
+    }
+  Record("s4_accuracy", size, readers.size())
+      .Add("pixels", statistics.foreground_pixels)
+      .Add("cg_iterations", statistics.iterations)
+      .Add("relative_residual", statistics.relative_residual)
+      .Add("height_mean_error_px",
+           error_sum / std::max<size_t>(1, statistics.foreground_pixels))
+      .Add("height_max_error_px", error_max)
+      .Print();
+}
+
+// Runs the light-dependent benchmarks (s2, s3 and s4) of one scene size.
+void RunLights(const SceneSize &size, const SphereParameters &sphere,
+               size_t num_lights, int iterations, ThreadPool *pool,
+               const std::string &directory, Scratch *scratch) {
+  const std::vector<std::vector<double>> lights =
+      MakeLightDirections(num_lights, kLightElevationDegrees);
+  const size_t pixels = size.num_rows * size.num_columns;
+
+  // s2: the brightest pixel of every sphere image.
+  std::vector<std::vector<double>> found(num_lights, std::vector<double>(3));
+  std::vector<double> s2_seconds;
+  AngularErrors light_errors;
+  Image image;
+  for (size_t k = 0; k < num_lights; ++k) {
+    RenderSphere(size.num_rows, size.num_columns, sphere, lights[k].data(),
+                 &image);
+    const std::string name =
+        directory + "/sphere" + std::to_string(k + 1) + ".pgm";
+    if (!WriteImage(scratch->Track(name), image)) exit(1);
+    const std::vector<double> seconds =
+        Time("s2_brightest", iterations, [&] {
+          ComputeLightDirection(image.View(), sphere, found[k].data());
+          return true;
+        });
+    s2_seconds.insert(s2_seconds.end(), seconds.begin(), seconds.end());
+    light_errors.Add(AngleDegrees(found[k].data(), lights[k].data()));
+  }
+  Record("s2_brightest", size, num_lights)
+      .AddTimings(s2_seconds, pixels, pixels).Print();
+  Record("s2_accuracy", size, num_lights)
+      .Add("light_mean_deg", light_errors.mean())
+      .Add("light_max_deg", light_errors.max())
+      .Print();
+
+  // s3: the object images go through files, as they do in s3.
+  std::vector<std::string> object_names;
+  for (size_t k = 0; k < num_lights; ++k) {
+    RenderObject(size.num_rows, size.num_columns, lights[k].data(), &image);
+    object_names.push_back(scratch->Track(
+        directory + "/object" + std::to_string(k + 1) + ".pgm"));
+    if (!WriteImage(object_names.back(), image)) exit(1);
+  }
+  image = Image();  // Frees the pixels before the solve.
+
+  // The true directions file, scaled as s2 would write it.
+  std::ofstream directions_file(
+      scratch->Track(directory + "/directions.txt"));
+  for (size_t k = 0; k < num_lights; ++k)
+    directions_file << 255 * lights[k][0] << " " << 255 * lights[k][1] << " "
+                    << 255 * lights[k][2] << std::endl;
+
+  std::vector<ImageReader> readers;
+  LightMatrix true_lights, found_lights;
+  std::vector<std::vector<double>> scaled = lights;
+  for (size_t k = 0; k < num_lights; ++k)
+    for (int c = 0; c < 3; ++c) scaled[k][c] *= 255.0;
+  if (!OpenObjectImages(object_names, &readers) ||
+      !ComputeLightMatrix(scaled, &true_lights) ||
+      !ComputeLightMatrix(found, &found_lights)) {
+    std::cerr << "Error: Could not set up the s3 benchmark." << std::endl;
+    exit(1);
+  }
+
+  Image normals_image, albedo_image;
+  Record("s3_solve", size, num_lights)
+      .Add("threads", pool->num_threads())
+      .AddTimings(Time("s3_solve", iterations, [&] {
+        ComputeNormalsAndAlbedo(readers, found_lights, nullptr, pool,
+                                &normals_image, &albedo_image);
+        return true;
+      }), pixels, pixels * num_lights)
+      .Print();
+
+  MeasureObjectAccuracy(size, readers, true_lights, found_lights);
+  RunDepth(size, readers, true_lights, iterations, pool);
+}
+
+// Runs every benchmark of one scene size.
+void RunSize(const SceneSize &size, const std::vector<size_t> &light_counts,
+             int iterations, ThreadPool *pool, const std::string &root,
+             Scratch *scratch) {
+  const std::string directory = scratch->Directory(root + "/" + size.name);
+  const size_t pixels = size.num_rows * size.num_columns;
+  const SphereParameters sphere = MakeSphere(size.num_rows, size.num_columns);
+
+  // Reading and writing pgm files.
+  Image mask;
+  RenderSphereMask(size.num_rows, size.num_columns, sphere, &mask);
+  const std::string mask_name = scratch->Track(directory + "/sphere0.pgm");
+  Record("write_image", size, 0)
+      .AddTimings(Time("write_image", iterations, [&] {
+        return WriteImage(mask_name, mask);
+      }), pixels, pixels)
+      .Print();
+  Image image;
+  Record("read_image", size, 0)
+      .AddTimings(Time("read_image", iterations, [&] {
+        return ReadImage(mask_name, &image);
+      }), pixels, pixels)
+      .Print();
+
+  // s1: threshold, centroid and extents are a single fused pass.
+  SphereParameters found;
+  Record("s1_locate", size, 0)
+      .AddTimings(Time("s1_locate", iterations, [&] {
+        return LocateSphere(image.View(), kSphereThreshold, &found);
+      }), pixels, pixels)
+      .Print();
+  Record("s1_accuracy", size, 0)
+      .Add("center_error_px", hypot(found.center_x - sphere.center_x,
+                                    found.center_y - sphere.center_y))
+      .Add("radius_error_px", fabs(found.radius - sphere.radius))
+      .Print();
+
+  // Separable filtering: the s1/s3 --smooth blur, and the Sobel gradients
+  // with the same smoothing folded in.
+  Image smoothed;
+  Record("gaussian_blur", size, 0)
+      .Add("threads", pool->num_threads())
+      .Add("taps", GaussianTaps(kSmoothSigma).size())
+      .AddTimings(Time("gaussian_blur", iterations, [&] {
+        GaussianBlur(image.View(), kSmoothSigma, BorderPolicy::kReflect, pool,
+                     &smoothed);
+        return true;
+      }), pixels, pixels)
+      .Print();
+  smoothed = Image();
+  ImageFloat x_gradient, y_gradient;
+  Record("gaussian_sobel", size, 0)
+      .Add("threads", pool->num_threads())
+      .AddTimings(Time("gaussian_sobel", iterations, [&] {
+        GaussianSobel(image.View(), kSmoothSigma, BorderPolicy::kReflect,
+                      pool, &x_gradient, &y_gradient);
+        return true;
+      }), pixels, pixels)
+      .Print();
+  x_gradient = ImageFloat();
+  y_gradient = ImageFloat();
+
+  for (size_t k = 0; k < light_counts.size(); ++k) {
+    const std::string lights_directory = scratch->Directory(
+        directory + "/" + std::to_string(light_counts[k]));
+    // The calibration uses the sphere s1 found, as the pipeline would.
+    RunLights(size, found, light_counts[k], iterations, pool,
+              lights_directory, scratch);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::vector<std::string> size_names =
+      SplitList("vga,720p,1080p,4k,8k");
+  std::vector<size_t> light_counts = {3, 8, 16};
+  int iterations = 5;
+  size_t threads = 0;  // One per hardware thread
+  std::string keep_directory;
+  for (int i = 1; i < argc; ++i) {
+    const std::string option = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "Usage: " << argv[0] << " [--sizes vga,720p,1080p,4k,8k]"
+                << " [--lights 3,8,16] [--iterations N] [--threads N]"
+                << " [--keep DIR]" << std::endl;
+      return 1;
+    }
+    const std::string value = argv[++i];
+    if (option == "--sizes") {
+      size_names = SplitList(value);
+    } else if (option == "--lights") {
+      light_counts.clear();
+      const std::vector<std::string> counts = SplitList(value);
+      for (size_t k = 0; k < counts.size(); ++k) {
+        light_counts.push_back(std::stoul(counts[k]));
+        if (light_counts.back() < 3) {
+          std::cerr << "Error: At least three lights are needed." << std::endl;
+          return 1;
+        }
+      }
+    } else if (option == "--iterations") {
+      iterations = std::max(1, std::stoi(value));
+    } else if (option == "--threads") {
+      threads = std::stoul(value);
+    } else if (option == "--keep") {
+      keep_directory = value;
+    } else {
+      std::cerr << "Error: Unknown option " << option << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<SceneSize> sizes;
+  for (size_t k = 0; k < size_names.size(); ++k) {
+    const SceneSize *size = nullptr;
+    for (size_t s = 0; s < sizeof kSceneSizes / sizeof kSceneSizes[0]; ++s)
+      if (size_names[k] == kSceneSizes[s].name) size = &kSceneSizes[s];
+    if (size == nullptr) {
+      std::cerr << "Error: Unknown size " << size_names[k] << std::endl;
+      return 1;
+    }
+    sizes.push_back(*size);
+  }
+
+  Scratch scratch(!keep_directory.empty());
+  const std::string root = keep_directory.empty() ?
+      scratch.Directory("/tmp/bench_pipeline_" + std::to_string(getpid())) :
+      scratch.Directory(keep_directory);
+  ThreadPool pool(threads);
+  for (size_t k = 0; k < sizes.size(); ++k)
+    RunSize(sizes[k], light_counts, iterations, &pool, root, &scratch);
+  return 0;
+}
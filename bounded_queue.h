@@ -0,0 +1,115 @@
+// A bounded single-producer, single-consumer queue for handing work from
+// one pipeline stage to the next without locks.
+// To be used in Computer Vision class.
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace ComputerVisionProjects {
+
+// A ring of capacity items shared by exactly one producer thread and one
+// consumer thread. Each side owns one index and only reads the other's,
+// so neither ever takes a lock or waits on the other but to find the
+// ring full or empty. Then Push() and Pop() spin briefly, yield, and
+// finally sleep with a growing backoff (up to a millisecond), which keeps
+// an idle stage off the CPU that the busy ones need.
+// Sample usage:
+//   BoundedQueue<Frame *> frames(4);
+//   // Producer thread:        // Consumer thread:
+//   frames.Push(frame);        Frame *frame = frames.Pop();
+template <typename Item>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : slots_(capacity + 1), head_{0}, tail_{0}, full_waits_{0},
+	empty_waits_{0} { }
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue& operator=(const BoundedQueue &) = delete;
+
+  size_t capacity() const { return slots_.size() - 1; }
+
+  // Producer only. Returns false if the queue is full.
+  bool TryPush(const Item &item) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t next = tail + 1 == slots_.size() ? 0 : tail + 1;
+    if (next == head_.load(std::memory_order_acquire)) return false;
+    slots_[tail] = item;
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool TryPop(Item *item) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    *item = slots_[head];
+    head_.store(head + 1 == slots_.size() ? 0 : head + 1,
+		std::memory_order_release);
+    return true;
+  }
+
+  // Producer only: waits for room.
+  void Push(const Item &item) {
+    if (TryPush(item)) return;
+    ++full_waits_;
+    for (Backoff backoff; !TryPush(item); ) backoff.Wait();
+  }
+
+  // Consumer only: waits for an item.
+  Item Pop() {
+    Item item;
+    if (TryPop(&item)) return item;
+    ++empty_waits_;
+    for (Backoff backoff; !TryPop(&item); ) backoff.Wait();
+    return item;
+  }
+
+  // How many Push() calls found the queue full, and Pop() calls empty:
+  // which side of the queue is the bottleneck. Each is written by its
+  // own side only; read them once both are done.
+  uint64_t full_waits() const { return full_waits_; }
+  uint64_t empty_waits() const { return empty_waits_; }
+
+ private:
+  class Backoff {
+   public:
+    Backoff(): rounds_{0} { }
+    void Wait() {
+      if (rounds_ < kSpins) {
+	++rounds_;
+      } else if (rounds_ < kSpins + kYields) {
+	++rounds_;
+	std::this_thread::yield();
+      } else {
+	const int shift = std::min(rounds_++ - kSpins - kYields, 5);
+	std::this_thread::sleep_for(std::chrono::microseconds(32 << shift));
+      }
+    }
+
+   private:
+    static const int kSpins = 64;
+    static const int kYields = 16;
+    int rounds_;
+  };
+
+  std::vector<Item> slots_;  // One more than the capacity: never all used.
+  // Next slot to pop, written by the consumer; and next slot to push,
+  // written by the producer. On separate cache lines, so that each side
+  // does not keep stealing the other's line.
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  alignas(64) uint64_t full_waits_;
+  uint64_t empty_waits_;
+};
+
+}  // namespace ComputerVisionProjects
+
+#endif  // BOUNDED_QUEUE_H
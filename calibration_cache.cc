@@ -0,0 +1,251 @@
+// On-disk cache of rig calibrations (sphere parameters and light
+// directions), addressed by a hash of the input images and parameters.
+// To be used in Computer Vision class.
+
+#include "calibration_cache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+const uint64_t kPrime1 = 11400714785074694791ULL;
+const uint64_t kPrime2 = 14029467366897019727ULL;
+const uint64_t kPrime3 = 1609587929392839161ULL;
+const uint64_t kPrime4 = 9650029242287828579ULL;
+const uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t Read64(const uint8_t *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof value);
+  return value;
+}
+
+inline uint32_t Read32(const uint8_t *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof value);
+  return value;
+}
+
+inline uint64_t Round(uint64_t lane, uint64_t input) {
+  return RotateLeft(lane + input * kPrime2, 31) * kPrime1;
+}
+
+inline uint64_t Merge(uint64_t hash, uint64_t lane) {
+  return (hash ^ Round(0, lane)) * kPrime1 + kPrime4;
+}
+
+// Name of the cache entry for key.
+string EntryName(const string &cache_directory, uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof name, "%016llx.cal",
+	   static_cast<unsigned long long>(key));
+  return cache_directory + "/" + name;
+}
+
+// Creates directory and its missing parents.
+bool MakeDirectories(const string &directory) {
+  for (size_t slash = directory.find('/', 1); ;
+       slash = directory.find('/', slash + 1)) {
+    const string prefix = directory.substr(0, slash);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    if (slash == string::npos) return true;
+  }
+}
+
+// First line of every entry; bump it when the format changes.
+const char kEntryTag[] = "calibration 1";
+
+}  // namespace
+
+ContentHash::ContentHash() : buffered_{0}, total_size_{0} {
+  lanes_[0] = kPrime1 + kPrime2;
+  lanes_[1] = kPrime2;
+  lanes_[2] = 0;
+  lanes_[3] = -kPrime1;
+}
+
+void ContentHash::Update(const void *data, size_t size) {
+  const uint8_t *input = static_cast<const uint8_t *>(data);
+  total_size_ += size;
+
+  // Top up a partial stripe first.
+  if (buffered_ > 0) {
+    const size_t take = min(size, sizeof buffer_ - buffered_);
+    memcpy(buffer_ + buffered_, input, take);
+    buffered_ += take;
+    input += take;
+    size -= take;
+    if (buffered_ < sizeof buffer_) return;
+    for (int k = 0; k < 4; ++k)
+      lanes_[k] = Round(lanes_[k], Read64(buffer_ + 8 * k));
+    buffered_ = 0;
+  }
+
+  // Whole 32-byte stripes straight from the input.
+  for (; size >= 32; input += 32, size -= 32) {
+    lanes_[0] = Round(lanes_[0], Read64(input));
+    lanes_[1] = Round(lanes_[1], Read64(input + 8));
+    lanes_[2] = Round(lanes_[2], Read64(input + 16));
+    lanes_[3] = Round(lanes_[3], Read64(input + 24));
+  }
+  memcpy(buffer_, input, size);
+  buffered_ = size;
+}
+
+void ContentHash::UpdateString(const string &value) {
+  UpdateValue(value.size());
+  Update(value.data(), value.size());
+}
+
+uint64_t ContentHash::Digest() const {
+  uint64_t hash;
+  if (total_size_ >= 32) {
+    hash = RotateLeft(lanes_[0], 1) + RotateLeft(lanes_[1], 7) +
+      RotateLeft(lanes_[2], 12) + RotateLeft(lanes_[3], 18);
+    for (int k = 0; k < 4; ++k) hash = Merge(hash, lanes_[k]);
+  } else {
+    hash = kPrime5;
+  }
+  hash += total_size_;
+
+  const uint8_t *input = buffer_;
+  size_t size = buffered_;
+  for (; size >= 8; input += 8, size -= 8)
+    hash = RotateLeft(hash ^ Round(0, Read64(input)), 27) * kPrime1 +
+      kPrime4;
+  if (size >= 4) {
+    hash = RotateLeft(hash ^ (Read32(input) * kPrime1), 23) * kPrime2 +
+      kPrime3;
+    input += 4;
+    size -= 4;
+  }
+  for (; size > 0; ++input, --size)
+    hash = RotateLeft(hash ^ (*input * kPrime5), 11) * kPrime1;
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+bool HashFile(const string &filename, ContentHash *hash) {
+  if (hash == nullptr) abort();
+  const int input = open(filename.c_str(), O_RDONLY);
+  if (input < 0) {
+    cout << "HashFile: Cannot open file" << endl;
+    return false;
+  }
+  // Large reads, so the hash runs at memory bandwidth.
+  vector<uint8_t> chunk(1 << 20);
+  for (;;) {
+    const ssize_t size = read(input, chunk.data(), chunk.size());
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      close(input);
+      cout << "HashFile: could not read" << endl;
+      return false;
+    }
+    if (size == 0) break;
+    hash->Update(chunk.data(), size);
+  }
+  close(input);
+  return true;
+}
+
+bool LoadCalibration(const string &cache_directory, uint64_t key,
+		     Calibration *calibration) {
+  if (calibration == nullptr) abort();
+  ifstream entry(EntryName(cache_directory, key));
+  if (!entry) return false;
+
+  string line;
+  if (!getline(entry, line) || line != kEntryTag) return false;
+  Calibration loaded;
+  while (getline(entry, line)) {
+    istringstream fields(line);
+    string kind;
+    fields >> kind;
+    if (kind == "sphere") {
+      SphereParameters sphere;
+      if (!(fields >> sphere.center_x >> sphere.center_y >> sphere.radius))
+	return false;
+      if (loaded.has_sphere) loaded.other_spheres.push_back(sphere);
+      else loaded.sphere = sphere;
+      loaded.has_sphere = true;
+    } else if (kind == "residual") {
+      if (!(fields >> loaded.fit_residual)) return false;
+    } else if (kind == "light") {
+      vector<double> direction(3);
+      if (!(fields >> direction[0] >> direction[1] >> direction[2]))
+	return false;
+      loaded.directions.push_back(direction);
+    } else if (kind == "end") {
+      *calibration = loaded;
+      return true;
+    }
+  }
+  // Truncated entry.
+  return false;
+}
+
+bool StoreCalibration(const string &cache_directory, uint64_t key,
+		      const Calibration &calibration) {
+  if (!MakeDirectories(cache_directory)) {
+    cout << "StoreCalibration: cannot create " << cache_directory << endl;
+    return false;
+  }
+  const string name = EntryName(cache_directory, key);
+  const string temporary = name + "." + to_string(getpid());
+  {
+    ofstream entry(temporary);
+    entry << kEntryTag << "\n" << setprecision(17);
+    if (calibration.has_sphere)
+      entry << "sphere " << calibration.sphere.center_x << " "
+	    << calibration.sphere.center_y << " " << calibration.sphere.radius
+	    << "\n";
+    if (calibration.fit_residual >= 0)
+      entry << "residual " << calibration.fit_residual << "\n";
+    for (size_t k = 0; k < calibration.other_spheres.size(); ++k)
+      entry << "sphere " << calibration.other_spheres[k].center_x << " "
+	    << calibration.other_spheres[k].center_y << " "
+	    << calibration.other_spheres[k].radius << "\n";
+    for (size_t k = 0; k < calibration.directions.size(); ++k)
+      entry << "light " << calibration.directions[k][0] << " "
+	    << calibration.directions[k][1] << " "
+	    << calibration.directions[k][2] << "\n";
+    entry << "end\n";
+    if (!entry.flush()) {
+      unlink(temporary.c_str());
+      cout << "StoreCalibration: could not write" << endl;
+      return false;
+    }
+  }
+  if (rename(temporary.c_str(), name.c_str()) != 0) {
+    unlink(temporary.c_str());
+    cout << "StoreCalibration: could not write" << endl;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace ComputerVisionProjects
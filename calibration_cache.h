@@ -0,0 +1,76 @@
+// On-disk cache of rig calibrations (sphere parameters and light
+// directions), addressed by a hash of the input images and parameters.
+// To be used in Computer Vision class.
+
+#ifndef CALIBRATION_CACHE_H
+#define CALIBRATION_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "sphere.h"
+
+namespace ComputerVisionProjects {
+
+// Incremental 64-bit content hash (the XXH64 algorithm).
+// Sample usage:
+//   ContentHash hash;
+//   hash.Update("s1", 2);
+//   if (!HashFile("sphere0.pgm", &hash)) ...;
+//   const uint64_t key = hash.Digest();
+class ContentHash {
+ public:
+  ContentHash();
+
+  void Update(const void *data, size_t size);
+  // Hashes the bytes of a value, e.g. an int or a double.
+  template <typename Value>
+  void UpdateValue(const Value &value) { Update(&value, sizeof value); }
+  void UpdateString(const std::string &value);
+
+  uint64_t Digest() const;
+
+ private:
+  uint64_t lanes_[4];
+  uint8_t buffer_[32];  // Bytes not yet folded into the lanes.
+  size_t buffered_;
+  uint64_t total_size_;
+};
+
+// Adds the contents of file filename to hash.
+// Returns true if  everyhing is OK, false otherwise.
+bool HashFile(const std::string &filename, ContentHash *hash);
+
+// A cached calibration. Stages that find only part of it (s1 the sphere,
+// s2 the directions) leave the rest empty.
+struct Calibration {
+  Calibration(): has_sphere{false}, fit_residual{-1} { }
+
+  bool has_sphere;
+  SphereParameters sphere;
+  // The RMS distance, in pixels, of the sphere's outline from the circle
+  // fit to it (see FitSphereContour()), so that a limit on it can be
+  // checked on a hit; negative when the sphere was not fit that way.
+  double fit_residual;
+  // The spheres after the first, on rigs with several (see
+  // LocateSpheres()); stored in the same entry.
+  std::vector<SphereParameters> other_spheres;
+  std::vector<std::vector<double>> directions;
+};
+
+// Loads the calibration stored under key in directory cache_directory.
+// Returns true on a hit, false otherwise.
+bool LoadCalibration(const std::string &cache_directory, uint64_t key,
+		     Calibration *calibration);
+
+// Stores calibration under key in directory cache_directory, which is
+// created if needed. Entries are written to a temporary file and renamed
+// into place, so concurrent runs never see half an entry.
+// Returns true if  everyhing is OK, false otherwise.
+bool StoreCalibration(const std::string &cache_directory, uint64_t key,
+		      const Calibration &calibration);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // CALIBRATION_CACHE_H
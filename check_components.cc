@@ -0,0 +1,246 @@
+// Check of LabelComponents() against a reference labeling: a flood fill
+// of the 8-connected foreground, pixel by pixel, whose components'
+// statistics are summed directly. Covers shapes that the run-based union-
+// find has to merge late or across diagonals, blobs on the image border,
+// and random images of several densities, 8- and 16-bit. Prints the
+// first difference and exits with 1 if any image disagrees; run by make.
+// Usage: check_components
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "components.h"
+#include "image.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+const int kThreshold = 128;
+
+// The components of the pixels of an_image at or above threshold, found
+// by flood fill from each unlabeled foreground pixel.
+template <typename PixelType>
+std::vector<Component> ReferenceComponents(const BasicImage<PixelType> &an_image,
+                                           int threshold) {
+  const int num_rows = an_image.num_rows();
+  const int num_columns = an_image.num_columns();
+  std::vector<bool> visited(size_t(num_rows) * num_columns, false);
+  std::vector<Component> components;
+  std::vector<std::pair<int, int>> stack;
+  for (int i = 0; i < num_rows; ++i) {
+    for (int j = 0; j < num_columns; ++j) {
+      if (an_image.GetPixel(i, j) < threshold ||
+          visited[size_t(i) * num_columns + j]) continue;
+      Component component = Component();
+      component.min_x = component.max_x = j;
+      component.min_y = component.max_y = i;
+      visited[size_t(i) * num_columns + j] = true;
+      stack.assign(1, std::make_pair(i, j));
+      while (!stack.empty()) {
+        const int y = stack.back().first, x = stack.back().second;
+        stack.pop_back();
+        ++component.area;
+        component.sum_x += x;
+        component.sum_y += y;
+        component.sum_xx += uint64_t(x) * x;
+        component.sum_xy += uint64_t(x) * y;
+        component.sum_yy += uint64_t(y) * y;
+        component.min_x = std::min(component.min_x, x);
+        component.max_x = std::max(component.max_x, x);
+        component.min_y = std::min(component.min_y, y);
+        component.max_y = std::max(component.max_y, y);
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dx = -1; dx <= 1; ++dx) {
+            const int ny = y + dy, nx = x + dx;
+            if (ny < 0 || ny >= num_rows || nx < 0 || nx >= num_columns) continue;
+            if (an_image.GetPixel(ny, nx) < threshold ||
+                visited[size_t(ny) * num_columns + nx]) continue;
+            visited[size_t(ny) * num_columns + nx] = true;
+            stack.push_back(std::make_pair(ny, nx));
+          }
+        }
+      }
+      components.push_back(component);
+    }
+  }
+  return components;
+}
+
+// All the fields of a component, for ordering and comparing.
+std::tuple<uint64_t, int, int, int, int, uint64_t, uint64_t, uint64_t,
+           uint64_t, uint64_t>
+Fields(const Component &c) {
+  return std::make_tuple(c.area, c.min_y, c.min_x, c.max_y, c.max_x, c.sum_x,
+                         c.sum_y, c.sum_xx, c.sum_xy, c.sum_yy);
+}
+
+bool Before(const Component &a, const Component &b) {
+  return Fields(a) > Fields(b);
+}
+
+std::string Describe(const Component &c) {
+  return "area " + std::to_string(c.area) + ", box x " +
+         std::to_string(c.min_x) + ".." + std::to_string(c.max_x) + " y " +
+         std::to_string(c.min_y) + ".." + std::to_string(c.max_y) +
+         ", sums " + std::to_string(c.sum_x) + " " + std::to_string(c.sum_y) +
+         " " + std::to_string(c.sum_xx) + " " + std::to_string(c.sum_xy) +
+         " " + std::to_string(c.sum_yy);
+}
+
+// Compares LabelComponents() on an_image with the reference; prints the
+// first difference under name.
+template <typename PixelType>
+bool Check(const std::string &name, const BasicImage<PixelType> &an_image) {
+  std::vector<Component> labeled;
+  LabelComponents(an_image.View(), kThreshold, &labeled);
+  std::vector<Component> reference = ReferenceComponents(an_image, kThreshold);
+  for (size_t k = 1; k < labeled.size(); ++k) {
+    if (labeled[k].area > labeled[k - 1].area) {
+      std::cerr << name << ": component " << k << " is larger than the one before it" << std::endl;
+      return false;
+    }
+  }
+  if (labeled.size() != reference.size()) {
+    std::cerr << name << ": " << labeled.size() << " components, expected " << reference.size() << std::endl;
+    return false;
+  }
+  // Components of equal area may come in any order.
+  std::sort(labeled.begin(), labeled.end(), Before);
+  std::sort(reference.begin(), reference.end(), Before);
+  for (size_t k = 0; k < labeled.size(); ++k) {
+    if (Fields(labeled[k]) != Fields(reference[k])) {
+      std::cerr << name << ": got " << Describe(labeled[k]) << std::endl
+                << "  expected " << Describe(reference[k]) << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// An 8-bit image of the rows of picture, '#' in the foreground.
+Image Picture(const std::vector<std::string> &picture) {
+  Image an_image;
+  an_image.AllocateSpaceAndSetSize(picture.size(), picture[0].size());
+  for (size_t i = 0; i < picture.size(); ++i)
+    for (size_t j = 0; j < picture[i].size(); ++j)
+      an_image.SetPixel(i, j, picture[i][j] == '#' ? 255 : 0);
+  return an_image;
+}
+
+// An image whose pixels are in the foreground with probability density;
+// in the 16-bit range, but around the threshold, when PixelType is wide.
+template <typename PixelType>
+BasicImage<PixelType> Random(size_t num_rows, size_t num_columns,
+                             double density, std::mt19937 *random) {
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::uniform_int_distribution<int> above(kThreshold, sizeof(PixelType) > 1 ? 65535 : 255);
+  std::uniform_int_distribution<int> below(0, kThreshold - 1);
+  BasicImage<PixelType> an_image;
+  an_image.AllocateSpaceAndSetSize(num_rows, num_columns);
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j)
+      an_image.SetPixel(i, j, uniform(*random) < density ? above(*random) : below(*random));
+  return an_image;
+}
+
+}  // namespace
+
+int main() {
+  // Shapes the runs meet in awkwardly: diagonal contacts only, U shapes
+  // whose arms join rows below their first runs (also nested and upside
+  // down), a spiral, and blobs on every edge and corner.
+  const std::vector<std::pair<std::string, std::vector<std::string>>> pictures = {
+    {"diagonals", {"#...#...",
+                   ".#.#....",
+                   "..#...#.",
+                   ".#.#.#..",
+                   "#...#..#"}},
+    {"diagonal steps", {"##......",
+                        "..##....",
+                        "....##..",
+                        "......##"}},
+    {"anti-diagonal", {".......#",
+                       "......#.",
+                       ".....#..",
+                       "#...#...",
+                       ".#.#....",
+                       "..#....."}},
+    {"U", {"#.....#",
+           "#.....#",
+           "#.....#",
+           "#######"}},
+    {"W", {"#...#...#",
+           "#...#...#",
+           ".#.#.#.#.",
+           "..#...#.."}},
+    {"nested U", {"#.#...#.#",
+                  "#.#...#.#",
+                  "#.#####.#",
+                  "#.......#",
+                  "#########"}},
+    {"upside-down U", {"#######",
+                       "#.....#",
+                       "#.....#",
+                       "#..#..#"}},
+    {"comb", {"#.#.#.#.#",
+              "#.#.#.#.#",
+              "#.#.#.#.#",
+              "........#",
+              "#########"}},
+    {"spiral", {"#########",
+                "#.......#",
+                "#.#####.#",
+                "#.#...#.#",
+                "#.#.#.#.#",
+                "#.#.###.#",
+                "#.#.....#",
+                "#.#######"}},
+    {"border", {"##..#..##",
+                "#.......#",
+                ".........",
+                "#...#...#",
+                ".........",
+                "#.......#",
+                "##..#..##"}},
+    {"full", {"####",
+              "####"}},
+    {"empty", {"....",
+               "...."}},
+    {"one pixel", {"#"}},
+    {"one row", {"##.#.###..#"}},
+    {"one column", {"#", "#", ".", "#", ".", "."}},
+  };
+  int failures = 0, checked = 0;
+  for (const auto &picture : pictures) {
+    ++checked;
+    if (!Check(picture.first, Picture(picture.second))) ++failures;
+  }
+
+  // Random images, sparse to dense around the density at which the
+  // foreground starts to percolate, in odd sizes.
+  std::mt19937 random(1);
+  const double densities[] = {0.05, 0.3, 0.45, 0.6, 0.9};
+  for (double density : densities) {
+    for (int trial = 0; trial < 20; ++trial) {
+      const size_t num_rows = 1 + random() % 70, num_columns = 1 + random() % 90;
+      const std::string name = "random " + std::to_string(num_rows) + "x" + std::to_string(num_columns) +
+          " at " + std::to_string(density) + " #" + std::to_string(trial);
+      checked += 2;
+      if (!Check(name + " (8-bit)", Random<uint8_t>(num_rows, num_columns, density, &random))) ++failures;
+      if (!Check(name + " (16-bit)", Random<uint16_t>(num_rows, num_columns, density, &random))) ++failures;
+    }
+  }
+
+  if (failures > 0) {
+    std::cerr << "check_components: " << failures << " of " << checked << " images labeled wrong" << std::endl;
+    return 1;
+  }
+  std::cout << "check_components: " << checked << " images OK" << std::endl;
+  return 0;
+}
@@ -0,0 +1,172 @@
+// Check of FitSphereContour() on spheres of known center and radius: the
+// calibration spheres of synthetic.h at several scene sizes, discs with
+// fractional centers and radii rendered with their edge pixels shaded by
+// coverage, spheres cut off by the image border and spheres next to
+// stray foreground. Each must be recovered to a fraction of a pixel, and
+// images with no closed outline to follow (no foreground, or nothing
+// but foreground) must be rejected. Prints the first failure and exits
+// with 1; run by make.
+// Usage: check_contour
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "image.h"
+#include "sphere.h"
+#include "synthetic.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+// Gray levels of RenderSphereMask(): the background, and the sphere's
+// darkest (rim) level.
+const int kBackground = 10;
+const int kRim = 150;
+
+// Halfway between them, where interpolated edge points fall on the
+// outline.
+const int kThreshold = (kBackground + kRim) / 2;
+
+// How far the fit may be from the truth, in pixels: the outline of a
+// sphere whose pixels are either in or out is only known to within the
+// pixel grid, which the fit averages out to a few hundredths of a pixel;
+// one whose edge pixels are shaded by coverage pins each edge point, and
+// then the fit is expected within a hundredth or two, and the residual
+// within a tenth rather than a quarter.
+const double kAliasedTolerance = 0.05;
+const double kAliasedResidual = 0.3;
+const double kShadedTolerance = 0.025;
+const double kShadedResidual = 0.1;
+
+// A disc of center (center_x, center_y) and radius on a background of
+// kBackground, kRim inside; each edge pixel is shaded by the fraction of
+// it the disc covers (on a 16 x 16 grid of samples), as a camera would.
+Image RenderDisc(size_t num_rows, size_t num_columns, double center_x,
+                 double center_y, double radius) {
+  const int kSamples = 16;
+  Image an_image;
+  an_image.AllocateSpaceAndSetSize(num_rows, num_columns);
+  an_image.SetNumberGrayLevels(255);
+  for (size_t i = 0; i < num_rows; ++i) {
+    for (size_t j = 0; j < num_columns; ++j) {
+      int inside = 0;
+      for (int k = 0; k < kSamples; ++k) {
+        for (int l = 0; l < kSamples; ++l) {
+          const double dy = i - 0.5 + (k + 0.5) / kSamples - center_y;
+          const double dx = j - 0.5 + (l + 0.5) / kSamples - center_x;
+          if (dx * dx + dy * dy <= radius * radius) ++inside;
+        }
+      }
+      const double coverage = static_cast<double>(inside) / (kSamples * kSamples);
+      an_image.SetPixel(i, j, std::lround(kBackground + (kRim - kBackground) * coverage));
+    }
+  }
+  return an_image;
+}
+
+// Fits the circle in an_image and compares it with the truth: center and
+// radius to within tolerance, and the residual at most max_residual.
+bool CheckFit(const std::string &name, const Image &an_image, double center_x,
+              double center_y, double radius, double tolerance,
+              double max_residual) {
+  CircleFit fit;
+  if (!FitSphereContour(an_image.View(), kThreshold, &fit)) {
+    std::cerr << name << ": no circle found" << std::endl;
+    return false;
+  }
+  const double center_error =
+      std::hypot(fit.center_x - center_x, fit.center_y - center_y);
+  const double radius_error = std::fabs(fit.radius - radius);
+  if (center_error > tolerance || radius_error > tolerance ||
+      fit.residual > max_residual) {
+    std::cerr << name << ": fit center (" << fit.center_x << ", " << fit.center_y
+              << "), radius " << fit.radius << ", residual " << fit.residual
+              << "; expected (" << center_x << ", " << center_y << "), " << radius
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Checks that no circle is fit in an_image.
+bool CheckRejected(const std::string &name, const Image &an_image) {
+  CircleFit fit;
+  if (FitSphereContour(an_image.View(), kThreshold, &fit)) {
+    std::cerr << name << ": fit a circle of center (" << fit.center_x << ", "
+              << fit.center_y << ") and radius " << fit.radius
+              << " where there is none" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// An image of uniform gray level.
+Image Uniform(size_t num_rows, size_t num_columns, int gray_level) {
+  Image an_image;
+  an_image.AllocateSpaceAndSetSize(num_rows, num_columns);
+  an_image.SetNumberGrayLevels(255);
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j) an_image.SetPixel(i, j, gray_level);
+  return an_image;
+}
+
+}  // namespace
+
+int main() {
+  int failures = 0, checked = 0;
+  auto count = [&](bool ok) {
+    ++checked;
+    if (!ok) ++failures;
+  };
+
+  // The benchmarks' calibration spheres, whose pixels are in or out.
+  const size_t sizes[][2] = {{120, 160}, {480, 640}, {720, 1280}, {1080, 1920}};
+  for (const auto &size : sizes) {
+    const SphereParameters sphere = MakeSphere(size[0], size[1]);
+    Image an_image;
+    RenderSphereMask(size[0], size[1], sphere, &an_image);
+    count(CheckFit("synthetic sphere " + std::to_string(size[0]) + "x" + std::to_string(size[1]),
+                   an_image, sphere.center_x, sphere.center_y, sphere.radius, kAliasedTolerance, kAliasedResidual));
+  }
+
+  // Centers and radii between pixels.
+  const double discs[][3] = {
+    {80.25, 60.5, 30.0}, {79.7, 61.1, 30.4}, {100.5, 90.5, 45.75},
+    {64.33, 48.9, 12.2}, {90.0, 70.0, 55.5},
+  };
+  for (const auto &disc : discs) {
+    const std::string name = "disc (" + std::to_string(disc[0]) + ", " +
+        std::to_string(disc[1]) + ") r " + std::to_string(disc[2]);
+    count(CheckFit(name, RenderDisc(160, 200, disc[0], disc[1], disc[2]),
+                   disc[0], disc[1], disc[2], kShadedTolerance, kShadedResidual));
+  }
+
+  // Cut off by the left and top borders: fit to the arc that remains.
+  count(CheckFit("disc cut by the border", RenderDisc(160, 200, 20.4, 25.6, 40.0),
+                 20.4, 25.6, 40.0, kShadedTolerance, kShadedResidual));
+
+  // Stray foreground apart from the sphere is not followed.
+  {
+    Image an_image = RenderDisc(160, 200, 120.5, 80.25, 35.0);
+    for (size_t i = 5; i < 40; ++i)
+      for (size_t j = 5; j < 30; ++j) an_image.SetPixel(i, j, 255);
+    for (size_t i = 140; i < 143; ++i)
+      for (size_t j = 20; j < 190; ++j) an_image.SetPixel(i, j, 200);
+    count(CheckFit("disc with stray foreground", an_image, 120.5, 80.25, 35.0,
+                   kShadedTolerance, kShadedResidual));
+  }
+
+  // No outline: no foreground at all, or no background to bound it.
+  count(CheckRejected("background only", Uniform(120, 160, kBackground)));
+  count(CheckRejected("foreground only", Uniform(120, 160, 200)));
+
+  if (failures > 0) {
+    std::cerr << "check_contour: " << failures << " of " << checked << " images fit wrong" << std::endl;
+    return 1;
+  }
+  std::cout << "check_contour: " << checked << " images OK" << std::endl;
+  return 0;
+}
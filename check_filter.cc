@@ -0,0 +1,284 @@
+// Check of the separable filters against a direct 2D convolution: each
+// output pixel summed in double over the whole n x n kernel, reading past
+// the image through the border policy one pixel at a time. Covers every
+// border policy on random images and on step edges, images from 1 pixel
+// to wider than a band, Gaussians wider than the image itself (whose
+// reflections bounce off both sides), the Sobel gradients, and the
+// rounding and saturation of 8- and 16-bit outputs. Prints the first
+// difference and exits with 1 if any case disagrees; run by make.
+// Usage: check_filter
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "filter.h"
+#include "image.h"
+#include "thread_pool.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+const BorderPolicy kBorders[] = {BorderPolicy::kReplicate,
+                                 BorderPolicy::kReflect, BorderPolicy::kZero};
+
+const char *BorderName(BorderPolicy border) {
+  switch (border) {
+    case BorderPolicy::kReplicate: return "replicate";
+    case BorderPolicy::kReflect: return "reflect";
+    default: return "zero";
+  }
+}
+
+// The index in [0, size) that index past the edge reads under border, or
+// -1 for a zero.
+long SourceIndex(long index, long size, BorderPolicy border) {
+  if (index >= 0 && index < size) return index;
+  if (border == BorderPolicy::kZero) return -1;
+  if (border == BorderPolicy::kReplicate || size == 1)
+    return index < 0 ? 0 : size - 1;
+  while (index < 0 || index >= size) {
+    if (index < 0) index = -index;
+    if (index >= size) index = 2 * (size - 1) - index;
+  }
+  return index;
+}
+
+// The correlation of an_image with column_taps[k] * row_taps[l] at every
+// pixel, in double.
+template <typename PixelType>
+std::vector<double> Reference(const BasicImage<PixelType> &an_image,
+                              const std::vector<float> &row_taps,
+                              const std::vector<float> &column_taps,
+                              BorderPolicy border) {
+  const long num_rows = an_image.num_rows();
+  const long num_columns = an_image.num_columns();
+  const long row_radius = row_taps.size() / 2;
+  const long column_radius = column_taps.size() / 2;
+  std::vector<double> result(num_rows * num_columns);
+  for (long i = 0; i < num_rows; ++i) {
+    for (long j = 0; j < num_columns; ++j) {
+      double sum = 0;
+      for (long k = -column_radius; k <= column_radius; ++k) {
+        const long y = SourceIndex(i + k, num_rows, border);
+        if (y < 0) continue;
+        for (long l = -row_radius; l <= row_radius; ++l) {
+          const long x = SourceIndex(j + l, num_columns, border);
+          if (x < 0) continue;
+          sum += static_cast<double>(column_taps[k + column_radius]) *
+                 row_taps[l + row_radius] * an_image.GetPixel(y, x);
+        }
+      }
+      result[i * num_columns + j] = sum;
+    }
+  }
+  return result;
+}
+
+// Compares output with reference: float outputs to within tolerance,
+// integer ones to the reference rounded and saturated, give or take one
+// level where it is within tolerance of a half.
+template <typename OutputType>
+bool Compare(const std::string &name, const BasicImage<OutputType> &output,
+             const std::vector<double> &reference, double tolerance) {
+  const bool integer = std::numeric_limits<OutputType>::is_integer;
+  const double maximum = std::numeric_limits<OutputType>::max();
+  for (size_t i = 0; i < output.num_rows(); ++i) {
+    for (size_t j = 0; j < output.num_columns(); ++j) {
+      const double expected = reference[i * output.num_columns() + j];
+      const double got = output.GetPixel(i, j);
+      bool ok;
+      if (integer) {
+        const double clamped = std::min(std::max(expected, 0.0), maximum);
+        ok = got == std::round(clamped) ||
+             (std::fabs(got - clamped) <= 0.5 + tolerance && got >= 0 && got <= maximum);
+      } else {
+        ok = std::fabs(got - expected) <= tolerance;
+      }
+      if (!ok) {
+        std::cerr << name << ": pixel (" << i << ", " << j << ") is " << got
+                  << ", expected " << expected << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The absolute error float arithmetic may leave on taps applied to pixels
+// up to maximum.
+double Tolerance(const std::vector<float> &row_taps,
+                 const std::vector<float> &column_taps, double maximum) {
+  double row_sum = 0, column_sum = 0;
+  for (float tap : row_taps) row_sum += std::fabs(tap);
+  for (float tap : column_taps) column_sum += std::fabs(tap);
+  return 1e-5 * maximum * row_sum * column_sum + 1e-4;
+}
+
+// Convolves an_image with the taps into an OutputType image, with and
+// without a pool, and compares both with the direct convolution.
+template <typename OutputType, typename PixelType>
+bool CheckConvolution(const std::string &name,
+                      const BasicImage<PixelType> &an_image,
+                      const std::vector<float> &row_taps,
+                      const std::vector<float> &column_taps,
+                      BorderPolicy border, ThreadPool *pool) {
+  const std::vector<double> reference =
+      Reference(an_image, row_taps, column_taps, border);
+  const double tolerance = Tolerance(row_taps, column_taps,
+                                     std::numeric_limits<PixelType>::max());
+  BasicImage<OutputType> output, pooled;
+  ConvolveSeparable(an_image.View(), row_taps, column_taps, border, nullptr, &output);
+  ConvolveSeparable(an_image.View(), row_taps, column_taps, border, pool, &pooled);
+  if (output.num_rows() != an_image.num_rows() ||
+      output.num_columns() != an_image.num_columns()) {
+    std::cerr << name << ": output is " << output.num_rows() << " x " << output.num_columns() << std::endl;
+    return false;
+  }
+  return Compare(name, output, reference, tolerance) &&
+         Compare(name + " (threaded)", pooled, reference, tolerance);
+}
+
+// Checks GaussianBlur() and GaussianSobel() on an_image, the latter
+// against the Gaussian combined with the Sobel derivative and smoothing
+// taps by hand.
+template <typename PixelType>
+bool CheckGaussian(const std::string &name,
+                   const BasicImage<PixelType> &an_image, double sigma,
+                   BorderPolicy border, ThreadPool *pool) {
+  const std::vector<float> taps = GaussianTaps(sigma);
+  BasicImage<PixelType> blurred;
+  GaussianBlur(an_image.View(), sigma, border, pool, &blurred);
+  const double maximum = std::numeric_limits<PixelType>::max();
+  if (!Compare(name + " blur", blurred, Reference(an_image, taps, taps, border),
+               Tolerance(taps, taps, maximum)))
+    return false;
+
+  std::vector<float> derivative(taps.size() + 2, 0), smoothing(taps.size() + 2, 0);
+  for (size_t k = 0; k < taps.size(); ++k) {
+    derivative[k] -= taps[k];
+    derivative[k + 2] += taps[k];
+    smoothing[k] += taps[k];
+    smoothing[k + 1] += 2 * taps[k];
+    smoothing[k + 2] += taps[k];
+  }
+  ImageFloat x_gradient, y_gradient;
+  GaussianSobel(an_image.View(), sigma, border, pool, &x_gradient, &y_gradient);
+  const double tolerance = Tolerance(derivative, smoothing, maximum);
+  return Compare(name + " x gradient", x_gradient,
+                 Reference(an_image, derivative, smoothing, border), tolerance) &&
+         Compare(name + " y gradient", y_gradient,
+                 Reference(an_image, smoothing, derivative, border), tolerance);
+}
+
+// An image of uniform noise over the PixelType range.
+template <typename PixelType>
+BasicImage<PixelType> Noise(size_t num_rows, size_t num_columns,
+                            std::mt19937 *random) {
+  std::uniform_int_distribution<int> level(0, std::numeric_limits<PixelType>::max());
+  BasicImage<PixelType> an_image;
+  an_image.AllocateSpaceAndSetSize(num_rows, num_columns);
+  an_image.SetNumberGrayLevels(std::numeric_limits<PixelType>::max());
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j) an_image.SetPixel(i, j, level(*random));
+  return an_image;
+}
+
+// An image black left of a diagonal step edge and white right of it, so
+// the edge crosses the image borders at different places.
+Image Step(size_t num_rows, size_t num_columns) {
+  Image an_image;
+  an_image.AllocateSpaceAndSetSize(num_rows, num_columns);
+  an_image.SetNumberGrayLevels(255);
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j)
+      an_image.SetPixel(i, j, 2 * j + i >= num_columns ? 255 : 0);
+  return an_image;
+}
+
+}  // namespace
+
+int main() {
+  ThreadPool pool(3);
+  std::mt19937 random(1);
+  int failures = 0, checked = 0;
+  auto count = [&](bool ok) {
+    ++checked;
+    if (!ok) ++failures;
+  };
+
+  // The taps themselves: normalized, 2 * ceil(3 sigma) + 1 of them.
+  for (double sigma : {0.0, 0.3, 1.0, 2.5, 12.0}) {
+    const std::vector<float> taps = GaussianTaps(sigma);
+    double sum = 0;
+    for (float tap : taps) sum += tap;
+    const size_t expected = 2 * static_cast<size_t>(std::ceil(3 * sigma)) + 1;
+    const bool ok = taps.size() == expected && std::fabs(sum - 1) < 1e-5;
+    if (!ok) std::cerr << "GaussianTaps(" << sigma << "): " << taps.size() << " taps summing to " << sum << std::endl;
+    count(ok);
+  }
+
+  // Sizes from a single pixel to more rows than a band (64); sigma 6 and
+  // 12 give kernels (37 and 73 taps) wider than most or all of them.
+  const size_t row_counts[] = {1, 2, 5, 37, 70};
+  const size_t column_counts[] = {1, 3, 9, 17, 61};
+  const double sigmas[] = {0, 0.8, 2.5, 6, 12};
+  for (size_t num_rows : row_counts) {
+    for (size_t num_columns : column_counts) {
+      const Image noise = Noise<uint8_t>(num_rows, num_columns, &random);
+      const Image step = Step(num_rows, num_columns);
+      for (BorderPolicy border : kBorders) {
+        for (double sigma : sigmas) {
+          const std::string name = std::to_string(num_rows) + "x" + std::to_string(num_columns) + " " +
+              BorderName(border) + " sigma " + std::to_string(sigma);
+          count(CheckGaussian("noise " + name, noise, sigma, border, &pool));
+          count(CheckGaussian("step " + name, step, sigma, border, &pool));
+        }
+      }
+    }
+  }
+
+  // Kernels that are not Gaussians, of different widths along the rows
+  // and the columns, into every output type: sharpening overshoots
+  // [0, maximum] at edges, so integer outputs saturate.
+  const std::vector<float> sharpen = {-0.5f, 2.0f, -0.5f};
+  const std::vector<float> box = {0.2f, 0.2f, 0.2f, 0.2f, 0.2f};
+  const std::vector<float> asymmetric = {0.1f, -0.7f, 1.9f, 0.3f, -0.4f, 0.6f, -0.8f};
+  const std::vector<std::pair<std::vector<float>, std::vector<float>>> kernels = {
+    {sharpen, sharpen}, {box, sharpen}, {asymmetric, box}, {sharpen, asymmetric},
+  };
+  for (size_t num_rows : {1, 7, 70}) {
+    for (size_t num_columns : {1, 4, 33}) {
+      const Image noise = Noise<uint8_t>(num_rows, num_columns, &random);
+      const Image step = Step(num_rows, num_columns);
+      const Image16 deep = Noise<uint16_t>(num_rows, num_columns, &random);
+      for (BorderPolicy border : kBorders) {
+        count(CheckGaussian("16-bit noise " + std::to_string(num_rows) + "x" + std::to_string(num_columns) + " " +
+                            BorderName(border) + " sigma 2.5", deep, 2.5, border, &pool));
+        for (size_t k = 0; k < kernels.size(); ++k) {
+          const std::vector<float> &rows = kernels[k].first, &columns = kernels[k].second;
+          const std::string name = std::to_string(num_rows) + "x" + std::to_string(num_columns) + " " +
+              BorderName(border) + " kernel " + std::to_string(k);
+          count(CheckConvolution<uint8_t>("8-bit noise " + name, noise, rows, columns, border, &pool));
+          count(CheckConvolution<uint8_t>("8-bit step " + name, step, rows, columns, border, &pool));
+          count(CheckConvolution<float>("8-bit to float noise " + name, noise, rows, columns, border, &pool));
+          count(CheckConvolution<uint16_t>("16-bit noise " + name, deep, rows, columns, border, &pool));
+          count(CheckConvolution<float>("16-bit to float noise " + name, deep, rows, columns, border, &pool));
+        }
+      }
+    }
+  }
+
+  if (failures > 0) {
+    std::cerr << "check_filter: " << failures << " of " << checked << " cases wrong" << std::endl;
+    return 1;
+  }
+  std::cout << "check_filter: " << checked << " cases OK" << std::endl;
+  return 0;
+}
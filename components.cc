@@ -0,0 +1,133 @@
+// Connected-component labeling of thresholded gray-scale images.
+// To be used in Computer Vision class.
+
+#include "components.h"
+#include "trace.h"
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+// Pixels [begin, end) of row row, all in the foreground.
+struct Run {
+  int row;
+  int begin;
+  int end;
+};
+
+// The root of run's set, halving the path there on the way.
+uint32_t FindRoot(vector<uint32_t> &parent, uint32_t run) {
+  while (parent[run] != run) {
+    parent[run] = parent[parent[run]];
+    run = parent[run];
+  }
+  return run;
+}
+
+// Joins the sets of runs a and b, under the earlier root.
+void Join(vector<uint32_t> &parent, uint32_t a, uint32_t b) {
+  a = FindRoot(parent, a);
+  b = FindRoot(parent, b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+// Sum of the squares of 0, 1, ..., n - 1.
+uint64_t SumOfSquares(uint64_t n) {
+  return n == 0 ? 0 : (n - 1) * n * (2 * n - 1) / 6;
+}
+
+}  // namespace
+
+template <typename PixelType>
+void LabelComponents(const ImageView<PixelType> &an_image, int threshold,
+		     vector<Component> *components) {
+  if (components == nullptr) abort();
+  TRACE_SCOPE("label");
+  TRACE_COUNT("pixels_thresholded",
+	      an_image.num_rows() * an_image.num_columns());
+  const int num_rows = an_image.num_rows();
+  const int num_columns = an_image.num_columns();
+
+  // The runs, in row-major order, and their union-find forest.
+  vector<Run> runs;
+  vector<uint32_t> parent;
+  size_t above_begin = 0, above_end = 0;  // The runs of the row above.
+  for (int i = 0; i < num_rows; ++i) {
+    const PixelType *row = an_image.Row(i);
+    const size_t row_begin = runs.size();
+    size_t above = above_begin;  // First run above that may still touch.
+    for (int j = 0; j < num_columns; ) {
+      if (row[j] < threshold) {
+	++j;
+	continue;
+      }
+      Run run;
+      run.row = i;
+      run.begin = j;
+      while (j < num_columns && row[j] >= threshold) ++j;
+      run.end = j;
+      const uint32_t index = runs.size();
+      runs.push_back(run);
+      parent.push_back(index);
+
+      // Runs above touch this one, diagonally included, if they reach
+      // past its begin - 1 and start before its end + 1. They are sorted,
+      // so those entirely to the left are done with for the next runs too.
+      while (above < above_end && runs[above].end < run.begin) ++above;
+      for (size_t k = above; k < above_end && runs[k].begin <= run.end; ++k)
+	Join(parent, index, k);
+    }
+    above_begin = row_begin;
+    above_end = runs.size();
+  }
+  TRACE_COUNT("runs_labeled", runs.size());
+
+  // The statistics of each set, summed from its runs in closed form.
+  components->clear();
+  vector<uint32_t> component_of(runs.size());
+  for (size_t k = 0; k < runs.size(); ++k) {
+    const uint32_t root = FindRoot(parent, k);
+    if (root == k) {
+      component_of[k] = components->size();
+      Component component = {0, 0, 0, 0, 0, 0, INT_MAX, -1, INT_MAX, -1};
+      components->push_back(component);
+    } else {
+      // Roots come first in their sets, so they are numbered already.
+      component_of[k] = component_of[root];
+    }
+    const Run &run = runs[k];
+    Component &component = (*components)[component_of[k]];
+    const uint64_t length = run.end - run.begin;
+    const uint64_t y = run.row;
+    const uint64_t sum_x =
+      (static_cast<uint64_t>(run.begin) + run.end - 1) * length / 2;
+    component.area += length;
+    component.sum_x += sum_x;
+    component.sum_y += length * y;
+    component.sum_xx += SumOfSquares(run.end) - SumOfSquares(run.begin);
+    component.sum_xy += sum_x * y;
+    component.sum_yy += length * y * y;
+    component.min_x = min(component.min_x, run.begin);
+    component.max_x = max(component.max_x, run.end - 1);
+    component.min_y = min(component.min_y, run.row);
+    component.max_y = max(component.max_y, run.row);
+  }
+
+  // Largest first; equal areas in the order they start in the image.
+  stable_sort(components->begin(), components->end(),
+	      [](const Component &a, const Component &b) {
+		return a.area > b.area;
+	      });
+}
+
+template void LabelComponents(const ImageView<uint8_t> &, int,
+			      vector<Component> *);
+template void LabelComponents(const ImageView<uint16_t> &, int,
+			      vector<Component> *);
+
+}  // namespace ComputerVisionProjects
@@ -0,0 +1,56 @@
+// Connected-component labeling of thresholded gray-scale images.
+// To be used in Computer Vision class.
+
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+
+#include <cstdint>
+#include <vector>
+#include "image.h"
+
+namespace ComputerVisionProjects {
+
+// One 8-connected component of the pixels at or above a threshold: its
+// area, bounding box and raw moments up to the second order, in image
+// coordinates (x the column, y the row). The sums are 64-bit, which is
+// enough for the second moments of images under 65536 pixels a side.
+struct Component {
+  uint64_t area;
+  uint64_t sum_x;   // First moments: the sums of the coordinates.
+  uint64_t sum_y;
+  uint64_t sum_xx;  // Second moments: the sums of their products.
+  uint64_t sum_xy;
+  uint64_t sum_yy;
+  int min_x, max_x; // Bounding box.
+  int min_y, max_y;
+
+  double centroid_x() const { return static_cast<double>(sum_x) / area; }
+  double centroid_y() const { return static_cast<double>(sum_y) / area; }
+  // Central second moments, normalized by the area: the covariance of
+  // the coordinates. A disc of radius r has r^2 / 4, 0 and r^2 / 4.
+  double mu20() const {
+    return static_cast<double>(sum_xx) / area - centroid_x() * centroid_x();
+  }
+  double mu11() const {
+    return static_cast<double>(sum_xy) / area - centroid_x() * centroid_y();
+  }
+  double mu02() const {
+    return static_cast<double>(sum_yy) / area - centroid_y() * centroid_y();
+  }
+};
+
+// Labels the 8-connected components of the pixels of an_image at or above
+// threshold. The foreground is taken a row at a time as runs of pixels;
+// each run is joined (union-find) to the runs it touches on the row
+// above, and the components' statistics are then summed from the runs in
+// one pass over them, in closed form, without a label image or a second
+// pass over the pixels. Memory grows with the number of runs, not with
+// the image size.
+// components gets one entry per component, largest first.
+template <typename PixelType>
+void LabelComponents(const ImageView<PixelType> &an_image, int threshold,
+		     std::vector<Component> *components);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // COMPONENTS_H
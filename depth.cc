@@ -0,0 +1,732 @@
+// Integration of a normal field into a height map, by conjugate gradients
+// with a multigrid preconditioner or by Frankot-Chellappa.
+// To be used in Computer Vision class.
+
+#include "depth.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <vector>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+// Cells per task of the passes over a grid; smaller grids are done by
+// the calling thread alone.
+const size_t kTileCells = 32 * 1024;
+
+// Red-black Gauss-Seidel sweeps before and after each coarse correction.
+const int kSmoothingSweeps = 2;
+
+// Grids are coarsened down to this many cells, then solved by sweeps
+// only.
+const size_t kCoarsestCells = 64;
+const int kCoarsestSweeps = 32;
+
+// Piecewise constant interpolation undershoots smooth errors by about
+// half; doubling the coarse correction (Braess' over-correction) brings
+// the iterations for a 1000 x 1000 foreground from ~70 down to ~7.
+const float kCoarseCorrection = 2.0f;
+
+// Each round of iterative refinement reduces the residual this much.
+const double kRefinement = 1e-3;
+
+// Calls pass(first_row, last_row) over row tiles of a grid of num_rows
+// rows of num_columns cells, on pool when the grid is big enough.
+void ForRowTiles(ThreadPool *pool, size_t num_rows, size_t num_columns,
+		 const function<void(size_t, size_t)> &pass) {
+  const size_t tile_rows = max<size_t>(1, kTileCells / max<size_t>(1, num_columns));
+  const size_t num_tiles = (num_rows + tile_rows - 1) / tile_rows;
+  if (num_tiles <= 1) {
+    pass(0, num_rows);
+    return;
+  }
+  pool->ParallelFor(num_tiles, [&](size_t tile) {
+    const size_t first_row = tile * tile_rows;
+    pass(first_row, min(num_rows, first_row + tile_rows));
+  });
+}
+
+// Adds up sum(first_row, last_row) over the row tiles of ForRowTiles(),
+// in tile order, so that the result does not depend on the scheduling.
+double SumRowTiles(ThreadPool *pool, size_t num_rows, size_t num_columns,
+		   const function<double(size_t, size_t)> &sum) {
+  const size_t tile_rows = max<size_t>(1, kTileCells / max<size_t>(1, num_columns));
+  const size_t num_tiles = (num_rows + tile_rows - 1) / tile_rows;
+  vector<double> partial(num_tiles, 0.0);
+  ForRowTiles(pool, num_rows, num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    partial[first_row / tile_rows] = sum(first_row, last_row);
+  });
+  double total = 0.0;
+  for (size_t tile = 0; tile < num_tiles; ++tile) total += partial[tile];
+  return total;
+}
+
+// One grid of the multigrid hierarchy: the Laplacian of the foreground,
+// (A x)_c = diagonal_c x_c - sum over the neighbours d of w_cd x_d.
+// Cells are stored with a border of one cell all around, whose weights
+// and values stay 0, so that the stencils need no bounds checks; cell
+// (i, j) is at Index(i, j). Cells with a zero diagonal are not part of
+// the system and stay 0.
+struct Grid {
+  size_t num_rows;
+  size_t num_columns;
+  size_t stride;           // num_columns + 2.
+  vector<float> right;     // Weight of the edge to the cell on the right.
+  vector<float> down;      // Weight of the edge to the cell below.
+  vector<float> diagonal;
+  vector<float> inverse_diagonal;  // 0 outside the system.
+  // Work space of the V-cycle; solution and rhs only on coarser grids.
+  vector<float> solution, rhs, residual;
+
+  size_t Index(size_t i, size_t j) const { return (i + 1) * stride + j + 1; }
+  size_t size() const { return (num_rows + 2) * stride; }
+};
+
+// Sizes grid for num_rows x num_columns cells, every array cleared.
+void AllocateGrid(size_t num_rows, size_t num_columns, Grid *grid) {
+  grid->num_rows = num_rows;
+  grid->num_columns = num_columns;
+  grid->stride = num_columns + 2;
+  vector<float> *arrays[] = {&grid->right, &grid->down, &grid->diagonal,
+			     &grid->inverse_diagonal, &grid->residual};
+  for (size_t a = 0; a < sizeof arrays / sizeof arrays[0]; ++a)
+    arrays[a]->assign(grid->size(), 0.0f);
+}
+
+void ComputeInverseDiagonal(ThreadPool *pool, Grid *grid) {
+  ForRowTiles(pool, grid->num_rows, grid->num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      for (size_t c = grid->Index(i, 0); c < grid->Index(i, grid->num_columns);
+	   ++c)
+	grid->inverse_diagonal[c] =
+	  grid->diagonal[c] > 0.0f ? 1.0f / grid->diagonal[c] : 0.0f;
+    }
+  });
+}
+
+// Labels the 4-connected parts of the foreground of mask, and returns the
+// first pixel of each in raster order, as row * num_columns + column.
+vector<size_t> FindComponentSeeds(const Image &mask) {
+  const size_t num_rows = mask.num_rows(), num_columns = mask.num_columns();
+  vector<uint8_t> visited(num_rows * num_columns, 0);
+  vector<size_t> seeds, stack;
+  for (size_t i = 0; i < num_rows; ++i) {
+    for (size_t j = 0; j < num_columns; ++j) {
+      const size_t seed = i * num_columns + j;
+      if (!mask.Row(i)[j] || visited[seed]) continue;
+      seeds.push_back(seed);
+      visited[seed] = 1;
+      stack.push_back(seed);
+      while (!stack.empty()) {
+	const size_t pixel = stack.back();
+	stack.pop_back();
+	const size_t y = pixel / num_columns, x = pixel % num_columns;
+	const size_t neighbours[4][2] = {{y, x + 1}, {y, x - 1}, {y + 1, x},
+					 {y - 1, x}};
+	for (int n = 0; n < 4; ++n) {
+	  // Going below 0 wraps around to a huge index.
+	  const size_t ny = neighbours[n][0], nx = neighbours[n][1];
+	  if (ny >= num_rows || nx >= num_columns || !mask.Row(ny)[nx] ||
+	      visited[ny * num_columns + nx])
+	    continue;
+	  visited[ny * num_columns + nx] = 1;
+	  stack.push_back(ny * num_columns + nx);
+	}
+      }
+    }
+  }
+  return seeds;
+}
+
+// The grid of the pixels of mask: an edge of weight 1 between every two
+// 4-neighbours in the foreground. Each connected part would only be
+// known up to a constant, so its first pixel in seeds is held at 0: it
+// leaves the system, and its edges stay on its neighbours' diagonals.
+// The singular system becomes positive definite, with the same solution
+// up to those constants.
+void BuildFinestGrid(const Image &mask, const vector<size_t> &seeds,
+		     ThreadPool *pool, Grid *grid) {
+  const size_t num_rows = mask.num_rows(), num_columns = mask.num_columns();
+  AllocateGrid(num_rows, num_columns, grid);
+  ForRowTiles(pool, num_rows, num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      const uint8_t *row = mask.Row(i);
+      const uint8_t *previous_row = i > 0 ? mask.Row(i - 1) : nullptr;
+      const uint8_t *next_row = i + 1 < num_rows ? mask.Row(i + 1) : nullptr;
+      for (size_t j = 0; j < num_columns; ++j) {
+	const size_t c = grid->Index(i, j);
+	if (!row[j]) continue;
+	grid->right[c] = j + 1 < num_columns && row[j + 1];
+	grid->down[c] = next_row != nullptr && next_row[j];
+	grid->diagonal[c] = grid->right[c] + grid->down[c] +
+	  (j > 0 && row[j - 1]) + (previous_row != nullptr && previous_row[j]);
+      }
+    }
+  });
+  for (size_t s = 0; s < seeds.size(); ++s) {
+    const size_t c = grid->Index(seeds[s] / num_columns,
+				 seeds[s] % num_columns);
+    grid->right[c] = grid->down[c] = grid->diagonal[c] = 0.0f;
+    grid->right[c - 1] = grid->down[c - grid->stride] = 0.0f;
+  }
+  ComputeInverseDiagonal(pool, grid);
+}
+
+// Builds coarse from fine by aggregating 2 x 2 blocks of cells: the
+// Galerkin operator P^T A P for piecewise constant interpolation P (0 for
+// the cells outside the system). Its edges sum the fine edges between two
+// blocks; its diagonal sums the fine diagonals, less the edges inside the
+// block.
+void Coarsen(const Grid &fine, ThreadPool *pool, Grid *coarse) {
+  AllocateGrid((fine.num_rows + 1) / 2, (fine.num_columns + 1) / 2, coarse);
+  ForRowTiles(pool, coarse->num_rows, coarse->num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      for (size_t j = 0; j < coarse->num_columns; ++j) {
+	// Children past the last row or column fall in the border, whose
+	// weights are 0.
+	const size_t f = fine.Index(2 * i, 2 * j);
+	const size_t c = coarse->Index(i, j);
+	const size_t below = fine.stride;
+	coarse->right[c] = fine.right[f + 1] + fine.right[f + below + 1];
+	coarse->down[c] = fine.down[f + below] + fine.down[f + below + 1];
+	coarse->diagonal[c] = fine.diagonal[f] + fine.diagonal[f + 1] +
+	  fine.diagonal[f + below] + fine.diagonal[f + below + 1] -
+	  2.0f * (fine.right[f] + fine.right[f + below] + fine.down[f] +
+		  fine.down[f + 1]);
+      }
+    }
+  });
+  ComputeInverseDiagonal(pool, coarse);
+  coarse->solution.assign(coarse->size(), 0.0f);
+  coarse->rhs.assign(coarse->size(), 0.0f);
+}
+
+// The sum of w_cd x_d over the neighbours d of cell c.
+inline float NeighbourSum(const Grid &grid, const float *x, size_t c) {
+  return grid.right[c] * x[c + 1] + grid.right[c - 1] * x[c - 1] +
+    grid.down[c] * x[c + grid.stride] +
+    grid.down[c - grid.stride] * x[c - grid.stride];
+}
+
+// One Gauss-Seidel sweep over the cells of one color of the checkerboard
+// (color 0 where i + j is even). Cells of a color only depend on those of
+// the other, so the rows can be swept in parallel.
+void Smooth(const Grid &grid, const float *rhs, int color, ThreadPool *pool,
+	    float *x) {
+  ForRowTiles(pool, grid.num_rows, grid.num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      const size_t end = grid.Index(i, grid.num_columns);
+      for (size_t c = grid.Index(i, (i + color) & 1); c < end; c += 2)
+	x[c] = (rhs[c] + NeighbourSum(grid, x, c)) * grid.inverse_diagonal[c];
+    }
+  });
+}
+
+// residual = rhs - A x.
+void ComputeResidual(const Grid &grid, const float *x, const float *rhs,
+		     ThreadPool *pool, float *residual) {
+  ForRowTiles(pool, grid.num_rows, grid.num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      const size_t end = grid.Index(i, grid.num_columns);
+      for (size_t c = grid.Index(i, 0); c < end; ++c)
+	residual[c] = rhs[c] - grid.diagonal[c] * x[c] +
+	  NeighbourSum(grid, x, c);
+    }
+  });
+}
+
+// Approximately solves A x = rhs on grids[level] with a V-cycle from
+// x = 0. Smoothing is red then black on the way down and black then red
+// on the way up, so that the cycle is a symmetric preconditioner.
+void VCycle(vector<Grid> &grids, size_t level, const float *rhs,
+	    ThreadPool *pool, float *x) {
+  const Grid &grid = grids[level];
+  ForRowTiles(pool, grid.num_rows, grid.num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    fill(x + grid.Index(first_row, 0), x + grid.Index(last_row, 0), 0.0f);
+  });
+  const bool coarsest = level + 1 == grids.size();
+  const int sweeps = coarsest ? kCoarsestSweeps : kSmoothingSweeps;
+  for (int s = 0; s < sweeps; ++s) {
+    Smooth(grid, rhs, 0, pool, x);
+    Smooth(grid, rhs, 1, pool, x);
+  }
+  if (!coarsest) {
+    ComputeResidual(grid, x, rhs, pool, grids[level].residual.data());
+    Grid &coarse = grids[level + 1];
+    const float *residual = grid.residual.data();
+    ForRowTiles(pool, coarse.num_rows, coarse.num_columns,
+		[&](size_t first_row, size_t last_row) {
+      for (size_t i = first_row; i < last_row; ++i) {
+	for (size_t j = 0; j < coarse.num_columns; ++j) {
+	  const size_t f = grid.Index(2 * i, 2 * j);
+	  coarse.rhs[coarse.Index(i, j)] =
+	    residual[f] + residual[f + 1] + residual[f + grid.stride] +
+	    residual[f + grid.stride + 1];
+	}
+      }
+    });
+    VCycle(grids, level + 1, coarse.rhs.data(), pool,
+	   coarse.solution.data());
+    ForRowTiles(pool, grid.num_rows, grid.num_columns,
+		[&](size_t first_row, size_t last_row) {
+      for (size_t i = first_row; i < last_row; ++i) {
+	const float *coarse_row = &coarse.solution[coarse.Index(i / 2, 0)];
+	float *row = x + grid.Index(i, 0);
+	const float *inverse_diagonal = &grid.inverse_diagonal[grid.Index(i, 0)];
+	for (size_t j = 0; j < grid.num_columns; ++j)
+	  row[j] += inverse_diagonal[j] > 0.0f ?
+	  kCoarseCorrection * coarse_row[j / 2] : 0.0f;
+      }
+    });
+  }
+  for (int s = 0; s < sweeps; ++s) {
+    Smooth(grid, rhs, 1, pool, x);
+    Smooth(grid, rhs, 0, pool, x);
+  }
+}
+
+// The right-hand side of the least-squares equations A z = rhs: every
+// edge between pixels a and b (b right of or below a) wants
+// z_b - z_a = g, the mean of their gradients along the edge, and adds
+// -g to rhs_a and g to rhs_b. Pixels outside the system get 0.
+void ComputeRightHandSide(const Grid &grid, const Image &mask,
+			  const ImageFloat &p, const ImageFloat &q,
+			  ThreadPool *pool, float *rhs) {
+  const size_t num_rows = grid.num_rows, num_columns = grid.num_columns;
+  ForRowTiles(pool, num_rows, num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      const uint8_t *row = mask.Row(i);
+      const uint8_t *next_row = i + 1 < num_rows ? mask.Row(i + 1) : nullptr;
+      const uint8_t *previous_row = i > 0 ? mask.Row(i - 1) : nullptr;
+      const float *p_row = p.Row(i);
+      const float *q_row = q.Row(i);
+      for (size_t j = 0; j < num_columns; ++j) {
+	const size_t c = grid.Index(i, j);
+	float sum = 0.0f;
+	if (grid.diagonal[c] > 0.0f) {
+	  if (j + 1 < num_columns && row[j + 1])
+	    sum -= 0.5f * (p_row[j] + p_row[j + 1]);
+	  if (j > 0 && row[j - 1]) sum += 0.5f * (p_row[j - 1] + p_row[j]);
+	  if (next_row != nullptr && next_row[j])
+	    sum -= 0.5f * (q_row[j] + q.Row(i + 1)[j]);
+	  if (previous_row != nullptr && previous_row[j])
+	    sum += 0.5f * (q.Row(i - 1)[j] + q_row[j]);
+	}
+	rhs[c] = sum;
+      }
+    }
+  });
+}
+
+// residual = rhs - A z with z in double precision, where the heights are
+// large next to their differences; returns |residual|^2.
+double ComputeExactResidual(const Grid &grid, const vector<double> &z,
+			    const vector<float> &rhs, ThreadPool *pool,
+			    vector<float> *residual) {
+  return SumRowTiles(pool, grid.num_rows, grid.num_columns,
+		     [&](size_t first_row, size_t last_row) {
+    double sum = 0.0;
+    for (size_t i = first_row; i < last_row; ++i) {
+      const size_t end = grid.Index(i, grid.num_columns);
+      for (size_t c = grid.Index(i, 0); c < end; ++c) {
+	const double neighbours =
+	  grid.right[c] * z[c + 1] + grid.right[c - 1] * z[c - 1] +
+	  grid.down[c] * z[c + grid.stride] +
+	  grid.down[c - grid.stride] * z[c - grid.stride];
+	const double value = rhs[c] - grid.diagonal[c] * z[c] + neighbours;
+	(*residual)[c] = value;
+	sum += value * value;
+      }
+    }
+    return sum;
+  });
+}
+
+// Solves A e = rhs on grids[0], from e = 0, by conjugate gradients
+// preconditioned with VCycle(), until |rhs - A e| <= target or after
+// max_iterations. residual holds rhs on entry and rhs - A e on return.
+// Returns the iterations run.
+size_t RunConjugateGradients(vector<Grid> &grids, double target,
+			     size_t max_iterations, ThreadPool *pool,
+			     vector<float> *residual_vector, vector<float> *e) {
+  const Grid &grid = grids[0];
+  const size_t num_rows = grid.num_rows, num_columns = grid.num_columns;
+  vector<float> &residual = *residual_vector;
+  vector<float> preconditioned(grid.size(), 0.0f),
+    direction(grid.size(), 0.0f), product(grid.size(), 0.0f);
+  e->assign(grid.size(), 0.0f);
+
+  // Sums of row_sum(begin, end) over the cells of each row.
+  auto sum_rows = [&](const function<double(size_t, size_t)> &row_sum) {
+    return SumRowTiles(pool, num_rows, num_columns,
+		       [&](size_t first_row, size_t last_row) {
+      double sum = 0.0;
+      for (size_t i = first_row; i < last_row; ++i)
+	sum += row_sum(grid.Index(i, 0), grid.Index(i, num_columns));
+      return sum;
+    });
+  };
+
+  VCycle(grids, 0, residual.data(), pool, preconditioned.data());
+  direction = preconditioned;
+  double rho = sum_rows([&](size_t begin, size_t end) {
+    double sum = 0.0;
+    for (size_t c = begin; c < end; ++c)
+      sum += static_cast<double>(residual[c]) * preconditioned[c];
+    return sum;
+  });
+  size_t iterations = 0;
+  while (iterations < max_iterations) {
+    TRACE_SCOPE("cg_iteration");
+    ++iterations;
+    // product = A direction, with its dot product with direction.
+    const double curvature = sum_rows([&](size_t begin, size_t end) {
+      double sum = 0.0;
+      for (size_t c = begin; c < end; ++c) {
+	product[c] = grid.diagonal[c] * direction[c] -
+	  NeighbourSum(grid, direction.data(), c);
+	sum += static_cast<double>(direction[c]) * product[c];
+      }
+      return sum;
+    });
+    if (!(curvature > 0.0)) break;
+    const float alpha = rho / curvature;
+    const double residual_norm = sqrt(sum_rows([&](size_t begin,
+						   size_t end) {
+      double sum = 0.0;
+      for (size_t c = begin; c < end; ++c) {
+	(*e)[c] += alpha * direction[c];
+	residual[c] -= alpha * product[c];
+	sum += static_cast<double>(residual[c]) * residual[c];
+      }
+      return sum;
+    }));
+    if (residual_norm <= target) break;
+
+    VCycle(grids, 0, residual.data(), pool, preconditioned.data());
+    const double next_rho = sum_rows([&](size_t begin, size_t end) {
+      double sum = 0.0;
+      for (size_t c = begin; c < end; ++c)
+	sum += static_cast<double>(residual[c]) * preconditioned[c];
+      return sum;
+    });
+    const float beta = next_rho / rho;
+    rho = next_rho;
+    sum_rows([&](size_t begin, size_t end) {
+      for (size_t c = begin; c < end; ++c)
+	direction[c] = preconditioned[c] + beta * direction[c];
+      return 0.0;
+    });
+  }
+  return iterations;
+}
+
+// Solves A z = rhs on grids[0] by iterative refinement: single precision
+// conjugate gradients find corrections to z, kept in double precision,
+// from the exact residual, until that is within options.tolerance of rhs.
+// In single precision alone the residual would stall once the heights
+// dwarf their differences, at a few hundred pixels.
+void SolveMultigrid(vector<Grid> &grids, const vector<float> &rhs,
+		    const DepthOptions &options, ThreadPool *pool,
+		    vector<double> *z, DepthStatistics *statistics) {
+  const Grid &grid = grids[0];
+  z->assign(grid.size(), 0.0);
+  vector<float> residual(grid.size(), 0.0f), correction;
+  const double rhs_norm = sqrt(ComputeExactResidual(grid, *z, rhs, pool,
+						    &residual));
+  statistics->iterations = 0;
+  statistics->relative_residual = 0.0;
+  if (rhs_norm == 0.0) return;
+
+  double residual_norm = rhs_norm;
+  while (residual_norm > options.tolerance * rhs_norm &&
+	 statistics->iterations < options.max_iterations) {
+    statistics->iterations += RunConjugateGradients(
+	grids, max(options.tolerance * rhs_norm, kRefinement * residual_norm),
+	options.max_iterations - statistics->iterations, pool, &residual,
+	&correction);
+    ForRowTiles(pool, grid.num_rows, grid.num_columns,
+		[&](size_t first_row, size_t last_row) {
+      for (size_t c = grid.Index(first_row, 0);
+	   c < grid.Index(last_row, 0); ++c)
+	(*z)[c] += correction[c];
+    });
+    residual_norm = sqrt(ComputeExactResidual(grid, *z, rhs, pool,
+					      &residual));
+  }
+  statistics->relative_residual = residual_norm / rhs_norm;
+}
+
+// Radix-2 fast Fourier transforms of one power-of-2 size.
+class Fourier {
+ public:
+  explicit Fourier(size_t size): size_{size}, twiddles_(size / 2),
+				 reversed_(size) {
+    const double kPi = 3.14159265358979323846;
+    for (size_t k = 0; k < size / 2; ++k)
+      twiddles_[k] = complex<float>(cos(2.0 * kPi * k / size),
+				    -sin(2.0 * kPi * k / size));
+    int bits = 0;
+    while ((size_t{1} << bits) < size) ++bits;
+    for (size_t k = 0; k < size; ++k) {
+      size_t reversed = 0;
+      for (int b = 0; b < bits; ++b)
+	if (k & (size_t{1} << b)) reversed |= size_t{1} << (bits - 1 - b);
+      reversed_[k] = reversed;
+    }
+  }
+
+  // Transforms the size values of data in place, unscaled.
+  void Transform(complex<float> *data, bool inverse) const {
+    for (size_t k = 0; k < size_; ++k)
+      if (k < reversed_[k]) swap(data[k], data[reversed_[k]]);
+    const float sign = inverse ? -1.0f : 1.0f;
+    for (size_t half = 1; half < size_; half *= 2) {
+      const size_t step = size_ / (2 * half);
+      for (size_t start = 0; start < size_; start += 2 * half) {
+	for (size_t k = 0; k < half; ++k) {
+	  const complex<float> w = twiddles_[k * step];
+	  const float w_re = w.real(), w_im = sign * w.imag();
+	  complex<float> &a = data[start + k];
+	  complex<float> &b = data[start + k + half];
+	  // Multiplied by hand: operator* checks for infinities.
+	  const float t_re = b.real() * w_re - b.imag() * w_im;
+	  const float t_im = b.real() * w_im + b.imag() * w_re;
+	  b = complex<float>(a.real() - t_re, a.imag() - t_im);
+	  a = complex<float>(a.real() + t_re, a.imag() + t_im);
+	}
+      }
+    }
+  }
+
+ private:
+  size_t size_;
+  vector<complex<float>> twiddles_;
+  vector<size_t> reversed_;
+};
+
+// Columns transformed together, so that gathering them reads whole
+// cache lines.
+const size_t kColumnBatch = 16;
+
+// Transforms the num_rows x num_columns array data (both powers of 2)
+// along the rows, then along the columns.
+void Transform2D(size_t num_rows, size_t num_columns, bool inverse,
+		 ThreadPool *pool, vector<complex<float>> *data) {
+  const Fourier row_fourier(num_columns), column_fourier(num_rows);
+  pool->ParallelFor(num_rows, [&](size_t i) {
+    row_fourier.Transform(&(*data)[i * num_columns], inverse);
+  });
+  const size_t batch = min(kColumnBatch, num_columns);
+  pool->ParallelFor(num_columns / batch, [&](size_t b) {
+    thread_local vector<complex<float>> columns;
+    columns.resize(batch * num_rows);
+    const size_t first_column = b * batch;
+    for (size_t i = 0; i < num_rows; ++i)
+      for (size_t k = 0; k < batch; ++k)
+	columns[k * num_rows + i] = (*data)[i * num_columns + first_column + k];
+    for (size_t k = 0; k < batch; ++k)
+      column_fourier.Transform(&columns[k * num_rows], inverse);
+    for (size_t i = 0; i < num_rows; ++i)
+      for (size_t k = 0; k < batch; ++k)
+	(*data)[i * num_columns + first_column + k] = columns[k * num_rows + i];
+  });
+}
+
+size_t PowerOf2AtLeast(size_t n) {
+  size_t power = 1;
+  while (power < n) power *= 2;
+  return power;
+}
+
+// Frankot-Chellappa, into z in the layout of grid. p and q go in as one complex field p + i q, whose
+// transform F gives P(k) = (F(k) + F*(-k)) / 2 and
+// Q(k) = (F(k) - F*(-k)) / 2i; then Z = -i (wx P + wy Q) / (wx^2 + wy^2).
+void SolveFourier(const ImageFloat &p, const ImageFloat &q,
+		  const Image &mask, ThreadPool *pool, const Grid &grid,
+		  vector<double> *z) {
+  const double kPi = 3.14159265358979323846;
+  const size_t num_rows = mask.num_rows(), num_columns = mask.num_columns();
+  const size_t rows = PowerOf2AtLeast(num_rows);
+  const size_t columns = PowerOf2AtLeast(num_columns);
+  vector<complex<float>> field(rows * columns);
+  pool->ParallelFor(num_rows, [&](size_t i) {
+    for (size_t j = 0; j < num_columns; ++j)
+      if (mask.Row(i)[j])
+	field[i * columns + j] = complex<float>(p.Row(i)[j], q.Row(i)[j]);
+  });
+  Transform2D(rows, columns, false, pool, &field);
+
+  // Each frequency is solved with its mirror -k, and Z(-k) = Z*(k) since
+  // z is real. Frequencies that are their own mirror (0 and the Nyquist
+  // ones) have no well-defined derivative and get 0.
+  pool->ParallelFor(rows / 2 + 1, [&](size_t ky) {
+    const size_t my = (rows - ky) % rows;
+    const double wy = 2.0 * kPi *
+      (ky < rows / 2 ? static_cast<double>(ky) :
+       static_cast<double>(ky) - rows) / rows;
+    for (size_t kx = 0; kx < columns; ++kx) {
+      const size_t mx = (columns - kx) % columns;
+      if (my == ky && mx < kx) continue;  // Done as its mirror.
+      complex<float> &f = field[ky * columns + kx];
+      complex<float> &mirror = field[my * columns + mx];
+      if (my == ky && mx == kx) {
+	f = 0.0f;
+	continue;
+      }
+      const double wx = 2.0 * kPi *
+	(kx < columns / 2 ? static_cast<double>(kx) :
+	 static_cast<double>(kx) - columns) / columns;
+      const complex<double> a(f), b(conj(mirror));
+      const complex<double> p_k = 0.5 * (a + b);
+      const complex<double> q_k = complex<double>(0.0, -0.5) * (a - b);
+      const complex<double> z_k = complex<double>(0.0, -1.0) *
+	(wx * p_k + wy * q_k) / (wx * wx + wy * wy);
+      f = complex<float>(z_k);
+      mirror = conj(f);
+    }
+  });
+
+  Transform2D(rows, columns, true, pool, &field);
+  const float scale = 1.0f / (rows * columns);
+  z->assign(grid.size(), 0.0);
+  pool->ParallelFor(num_rows, [&](size_t i) {
+    for (size_t j = 0; j < num_columns; ++j)
+      (*z)[grid.Index(i, j)] = field[i * columns + j].real() * scale;
+  });
+}
+
+}  // namespace
+
+void ComputeGradients(const ImageView<float> normals[3], float min_normal_z,
+		      ThreadPool *pool, ImageFloat *p, ImageFloat *q,
+		      Image *mask) {
+  if (p == nullptr || q == nullptr || mask == nullptr) abort();
+  TRACE_SCOPE("gradients");
+  const size_t num_rows = normals[0].num_rows();
+  const size_t num_columns = normals[0].num_columns();
+  p->AllocateSpaceAndSetSize(num_rows, num_columns);
+  q->AllocateSpaceAndSetSize(num_rows, num_columns);
+  mask->AllocateSpaceAndSetSize(num_rows, num_columns);
+  mask->SetNumberGrayLevels(1);
+  ForRowTiles(pool, num_rows, num_columns,
+	      [&](size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      const float *x = normals[0].Row(i);
+      const float *y = normals[1].Row(i);
+      const float *z = normals[2].Row(i);
+      float *p_row = p->Row(i);
+      float *q_row = q->Row(i);
+      uint8_t *mask_row = mask->Row(i);
+      for (size_t j = 0; j < num_columns; ++j) {
+	const bool usable = z[j] >= min_normal_z;
+	mask_row[j] = usable;
+	p_row[j] = usable ? -x[j] / z[j] : 0.0f;
+	q_row[j] = usable ? -y[j] / z[j] : 0.0f;
+      }
+    }
+  });
+}
+
+void IntegrateGradients(const ImageFloat &p, const ImageFloat &q,
+			const Image &mask, const DepthOptions &options,
+			ThreadPool *pool, ImageFloat *height,
+			DepthStatistics *statistics) {
+  if (height == nullptr) abort();
+  TRACE_SCOPE("integrate");
+  DepthStatistics ignored;
+  if (statistics == nullptr) statistics = &ignored;
+  const size_t num_rows = mask.num_rows(), num_columns = mask.num_columns();
+  statistics->foreground_pixels = 0;
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j)
+      statistics->foreground_pixels += mask.Row(i)[j] != 0;
+  TRACE_COUNT("pixels_integrated", statistics->foreground_pixels);
+
+  // z is in the layout of the finest grid. The Fourier solve leaves every
+  // part where it lands, so none of its pixels is held at 0.
+  vector<Grid> grids(1);
+  BuildFinestGrid(mask,
+		  options.method == DepthMethod::kFourier ? vector<size_t>() :
+		  FindComponentSeeds(mask), pool, &grids[0]);
+  vector<float> rhs(grids[0].size(), 0.0f);
+  ComputeRightHandSide(grids[0], mask, p, q, pool, rhs.data());
+  vector<double> z;
+  if (options.method == DepthMethod::kFourier) {
+    SolveFourier(p, q, mask, pool, grids[0], &z);
+    // The residual of the least-squares equations, as for kMultigrid.
+    const double norm = sqrt(ComputeExactResidual(
+	grids[0], vector<double>(z.size(), 0.0), rhs, pool,
+	&grids[0].residual));
+    const double residual = sqrt(ComputeExactResidual(
+	grids[0], z, rhs, pool, &grids[0].residual));
+    statistics->iterations = 0;
+    statistics->relative_residual = norm > 0.0 ? residual / norm : 0.0;
+  } else {
+    while (grids.back().num_rows * grids.back().num_columns > kCoarsestCells) {
+      grids.emplace_back();
+      Coarsen(grids[grids.size() - 2], pool, &grids.back());
+    }
+    SolveMultigrid(grids, rhs, options, pool, &z, statistics);
+  }
+
+  // The lowest foreground pixel goes to 0.
+  double lowest = numeric_limits<double>::max();
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j)
+      if (mask.Row(i)[j]) lowest = min(lowest, z[grids[0].Index(i, j)]);
+  height->AllocateSpaceAndSetSize(num_rows, num_columns);
+  for (size_t i = 0; i < num_rows; ++i) {
+    float *row = height->Row(i);
+    for (size_t j = 0; j < num_columns; ++j)
+      row[j] = mask.Row(i)[j] ? z[grids[0].Index(i, j)] - lowest : 0.0f;
+  }
+}
+
+void ComputeDepth(const ImageView<float> normals[3],
+		  const DepthOptions &options, ThreadPool *pool,
+		  ImageFloat *height, Image *mask,
+		  DepthStatistics *statistics) {
+  ImageFloat p, q;
+  ComputeGradients(normals, options.min_normal_z, pool, &p, &q, mask);
+  IntegrateGradients(p, q, *mask, options, pool, height, statistics);
+}
+
+void QuantizeHeight(const ImageFloat &height, const Image &mask,
+		    Image *height_image) {
+  if (height_image == nullptr) abort();
+  const size_t num_rows = height.num_rows();
+  const size_t num_columns = height.num_columns();
+  float highest = 0.0f;
+  for (size_t i = 0; i < num_rows; ++i)
+    for (size_t j = 0; j < num_columns; ++j)
+      if (mask.Row(i)[j]) highest = max(highest, height.Row(i)[j]);
+  const float scale = highest > 0.0f ? 254.0f / highest : 0.0f;
+  height_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+  height_image->SetNumberGrayLevels(255);
+  for (size_t i = 0; i < num_rows; ++i) {
+    uint8_t *row = height_image->Row(i);
+    for (size_t j = 0; j < num_columns; ++j)
+      row[j] = mask.Row(i)[j] ?
+	static_cast<uint8_t>(1.0f + height.Row(i)[j] * scale + 0.5f) : 0;
+  }
+}
+
+}  // namespace ComputerVisionProjects
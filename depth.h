@@ -0,0 +1,82 @@
+// Integration of a normal field into a height map. The normals become
+// gradients p = -nx / nz, q = -ny / nz, and the height z whose gradient
+// is closest to them in the least-squares sense solves the Poisson
+// equation lap z = dp/dx + dq/dy over the foreground, with natural
+// (Neumann) boundaries where the foreground ends.
+// To be used in Computer Vision class.
+
+#ifndef DEPTH_H
+#define DEPTH_H
+
+#include <cstddef>
+#include "image.h"
+#include "thread_pool.h"
+
+namespace ComputerVisionProjects {
+
+enum class DepthMethod {
+  // Conjugate gradients on the foreground pixels only, preconditioned
+  // with a multigrid V-cycle: O(N) per iteration and an iteration count
+  // that barely grows with the image size.
+  kMultigrid,
+  // Frankot-Chellappa: projection of the gradients onto the integrable
+  // fields in the Fourier domain, O(N log N). Gradients are taken as 0
+  // outside the foreground, and the boundaries are periodic (the image
+  // is padded to powers of 2), so heights bend near the borders.
+  kFourier,
+};
+
+struct DepthOptions {
+  DepthOptions(): method{DepthMethod::kMultigrid}, tolerance{1e-4},
+		  max_iterations{100}, min_normal_z{0.05f} { }
+
+  DepthMethod method;
+  // kMultigrid stops once the residual is this small relative to the
+  // right-hand side, or after max_iterations.
+  double tolerance;
+  size_t max_iterations;
+  // Normals closer to the image plane give unbounded gradients; their
+  // pixels are left out of the foreground.
+  float min_normal_z;
+};
+
+// How an integration went.
+struct DepthStatistics {
+  size_t foreground_pixels;
+  size_t iterations;          // 0 for kFourier.
+  double relative_residual;   // Of the Poisson equation, at the end.
+};
+
+// Converts normals (the x, y and z planes, of the same size) to
+// gradients p and q, in height units per pixel along the columns and
+// the rows. mask gets 1 where the normal is usable (its z component is
+// at least min_normal_z) and 0 elsewhere, where p and q are 0.
+void ComputeGradients(const ImageView<float> normals[3], float min_normal_z,
+		      ThreadPool *pool, ImageFloat *p, ImageFloat *q,
+		      Image *mask);
+
+// Integrates gradients p and q over the nonzero pixels of mask into
+// height, with options.method; pool runs the passes over row tiles.
+// Each connected part of the foreground is only known up to a constant:
+// the heights are shifted so that the lowest foreground pixel is at 0.
+// Pixels outside the mask get 0. statistics may be nullptr.
+void IntegrateGradients(const ImageFloat &p, const ImageFloat &q,
+			const Image &mask, const DepthOptions &options,
+			ThreadPool *pool, ImageFloat *height,
+			DepthStatistics *statistics);
+
+// ComputeGradients() then IntegrateGradients(); mask gets the
+// foreground that was integrated.
+void ComputeDepth(const ImageView<float> normals[3],
+		  const DepthOptions &options, ThreadPool *pool,
+		  ImageFloat *height, Image *mask,
+		  DepthStatistics *statistics);
+
+// Maps the heights of the nonzero pixels of mask to gray levels 1 to
+// 255, from lowest to highest; the other pixels get 0.
+void QuantizeHeight(const ImageFloat &height, const Image &mask,
+		    Image *height_image);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // DEPTH_H
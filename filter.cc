@@ -0,0 +1,419 @@
+// Separable convolution of gray-scale images.
+// To be used in Computer Vision class.
+
+#include "filter.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+// Rows per band of ConvolveSeparable(); each band also filters the
+// column kernel's reach above and below it along the rows.
+const size_t kBandRows = 64;
+
+// The index in [0, size) that index reads under border, or -1 for a
+// zero.
+ptrdiff_t SourceIndex(ptrdiff_t index, ptrdiff_t size, BorderPolicy border) {
+  if (index >= 0 && index < size) return index;
+  switch (border) {
+    case BorderPolicy::kReplicate:
+      return index < 0 ? 0 : size - 1;
+    case BorderPolicy::kReflect: {
+      if (size == 1) return 0;
+      // Mirrored about both edges, the image repeats every period.
+      const ptrdiff_t period = 2 * (size - 1);
+      index %= period;
+      if (index < 0) index += period;
+      return index < size ? index : period - index;
+    }
+    case BorderPolicy::kZero:
+      break;
+  }
+  return -1;
+}
+
+// Converts count pixels to floats.
+template <typename PixelType>
+void ConvertRow(const PixelType *row, size_t count, float *output) {
+  for (size_t j = 0; j < count; ++j) output[j] = row[j];
+}
+
+#if defined(__SSE2__)
+template <>
+void ConvertRow(const uint8_t *row, size_t count, float *output) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t j = 0;
+  for (; j + 16 <= count; j += 16) {
+    const __m128i bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j));
+    const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_ps(output + j,
+		  _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)));
+    _mm_storeu_ps(output + j + 4,
+		  _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)));
+    _mm_storeu_ps(output + j + 8,
+		  _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)));
+    _mm_storeu_ps(output + j + 12,
+		  _mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)));
+  }
+  for (; j < count; ++j) output[j] = row[j];
+}
+#endif
+
+// Copies row, num_columns pixels, into line as floats, with radius
+// pixels of border on either side.
+template <typename PixelType>
+void LoadLine(const PixelType *row, size_t num_columns, size_t radius,
+	      BorderPolicy border, float *line) {
+  ConvertRow(row, num_columns, line + radius);
+  for (size_t k = 0; k < radius; ++k) {
+    const ptrdiff_t left = SourceIndex(static_cast<ptrdiff_t>(k) - radius,
+				       num_columns, border);
+    const ptrdiff_t right = SourceIndex(num_columns + k, num_columns, border);
+    line[k] = left < 0 ? 0.0f : row[left];
+    line[radius + num_columns + k] = right < 0 ? 0.0f : row[right];
+  }
+}
+
+// output[j] = sum over k of taps[k] * line[j + k], for j in
+// [0, num_columns): the row pass.
+void FilterLine(const float *line, size_t num_columns, const float *taps,
+		size_t num_taps, float *output) {
+  size_t j = 0;
+#if defined(__AVX__)
+  // Four independent sums at a time, so the adds of one do not wait on
+  // those of the previous tap.
+  for (; j + 32 <= num_columns; j += 32) {
+    const __m256 tap = _mm256_set1_ps(taps[0]);
+    __m256 sum0 = _mm256_mul_ps(tap, _mm256_loadu_ps(line + j));
+    __m256 sum1 = _mm256_mul_ps(tap, _mm256_loadu_ps(line + j + 8));
+    __m256 sum2 = _mm256_mul_ps(tap, _mm256_loadu_ps(line + j + 16));
+    __m256 sum3 = _mm256_mul_ps(tap, _mm256_loadu_ps(line + j + 24));
+    for (size_t k = 1; k < num_taps; ++k) {
+      const __m256 tap = _mm256_set1_ps(taps[k]);
+      const float *in = line + j + k;
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(tap, _mm256_loadu_ps(in)));
+      sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(tap, _mm256_loadu_ps(in + 8)));
+      sum2 = _mm256_add_ps(sum2,
+			   _mm256_mul_ps(tap, _mm256_loadu_ps(in + 16)));
+      sum3 = _mm256_add_ps(sum3,
+			   _mm256_mul_ps(tap, _mm256_loadu_ps(in + 24)));
+    }
+    _mm256_storeu_ps(output + j, sum0);
+    _mm256_storeu_ps(output + j + 8, sum1);
+    _mm256_storeu_ps(output + j + 16, sum2);
+    _mm256_storeu_ps(output + j + 24, sum3);
+  }
+  for (; j + 8 <= num_columns; j += 8) {
+    __m256 sum = _mm256_mul_ps(_mm256_set1_ps(taps[0]),
+			       _mm256_loadu_ps(line + j));
+    for (size_t k = 1; k < num_taps; ++k)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(taps[k]),
+					     _mm256_loadu_ps(line + j + k)));
+    _mm256_storeu_ps(output + j, sum);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; j + 16 <= num_columns; j += 16) {
+    const __m128 tap = _mm_set1_ps(taps[0]);
+    __m128 sum0 = _mm_mul_ps(tap, _mm_loadu_ps(line + j));
+    __m128 sum1 = _mm_mul_ps(tap, _mm_loadu_ps(line + j + 4));
+    __m128 sum2 = _mm_mul_ps(tap, _mm_loadu_ps(line + j + 8));
+    __m128 sum3 = _mm_mul_ps(tap, _mm_loadu_ps(line + j + 12));
+    for (size_t k = 1; k < num_taps; ++k) {
+      const __m128 tap = _mm_set1_ps(taps[k]);
+      const float *in = line + j + k;
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(tap, _mm_loadu_ps(in)));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(tap, _mm_loadu_ps(in + 4)));
+      sum2 = _mm_add_ps(sum2, _mm_mul_ps(tap, _mm_loadu_ps(in + 8)));
+      sum3 = _mm_add_ps(sum3, _mm_mul_ps(tap, _mm_loadu_ps(in + 12)));
+    }
+    _mm_storeu_ps(output + j, sum0);
+    _mm_storeu_ps(output + j + 4, sum1);
+    _mm_storeu_ps(output + j + 8, sum2);
+    _mm_storeu_ps(output + j + 12, sum3);
+  }
+  for (; j + 4 <= num_columns; j += 4) {
+    __m128 sum = _mm_mul_ps(_mm_set1_ps(taps[0]), _mm_loadu_ps(line + j));
+    for (size_t k = 1; k < num_taps; ++k)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(taps[k]),
+				       _mm_loadu_ps(line + j + k)));
+    _mm_storeu_ps(output + j, sum);
+  }
+#endif
+  for (; j < num_columns; ++j) {
+    float sum = 0.0f;
+    for (size_t k = 0; k < num_taps; ++k) sum += taps[k] * line[j + k];
+    output[j] = sum;
+  }
+}
+
+// output[j] = sum over k of taps[k] * rows[k][j], for j in
+// [0, num_columns): the column pass.
+void CombineRows(const float *const *rows, const float *taps,
+		 size_t num_taps, size_t num_columns, float *output) {
+  size_t j = 0;
+#if defined(__AVX__)
+  // Four independent sums at a time, as in FilterLine().
+  for (; j + 32 <= num_columns; j += 32) {
+    const __m256 tap = _mm256_set1_ps(taps[0]);
+    __m256 sum0 = _mm256_mul_ps(tap, _mm256_loadu_ps(rows[0] + j));
+    __m256 sum1 = _mm256_mul_ps(tap, _mm256_loadu_ps(rows[0] + j + 8));
+    __m256 sum2 = _mm256_mul_ps(tap, _mm256_loadu_ps(rows[0] + j + 16));
+    __m256 sum3 = _mm256_mul_ps(tap, _mm256_loadu_ps(rows[0] + j + 24));
+    for (size_t k = 1; k < num_taps; ++k) {
+      const __m256 tap = _mm256_set1_ps(taps[k]);
+      const float *in = rows[k] + j;
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(tap, _mm256_loadu_ps(in)));
+      sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(tap, _mm256_loadu_ps(in + 8)));
+      sum2 = _mm256_add_ps(sum2,
+			   _mm256_mul_ps(tap, _mm256_loadu_ps(in + 16)));
+      sum3 = _mm256_add_ps(sum3,
+			   _mm256_mul_ps(tap, _mm256_loadu_ps(in + 24)));
+    }
+    _mm256_storeu_ps(output + j, sum0);
+    _mm256_storeu_ps(output + j + 8, sum1);
+    _mm256_storeu_ps(output + j + 16, sum2);
+    _mm256_storeu_ps(output + j + 24, sum3);
+  }
+  for (; j + 8 <= num_columns; j += 8) {
+    __m256 sum = _mm256_mul_ps(_mm256_set1_ps(taps[0]),
+			       _mm256_loadu_ps(rows[0] + j));
+    for (size_t k = 1; k < num_taps; ++k)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(taps[k]),
+					     _mm256_loadu_ps(rows[k] + j)));
+    _mm256_storeu_ps(output + j, sum);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; j + 16 <= num_columns; j += 16) {
+    const __m128 tap = _mm_set1_ps(taps[0]);
+    __m128 sum0 = _mm_mul_ps(tap, _mm_loadu_ps(rows[0] + j));
+    __m128 sum1 = _mm_mul_ps(tap, _mm_loadu_ps(rows[0] + j + 4));
+    __m128 sum2 = _mm_mul_ps(tap, _mm_loadu_ps(rows[0] + j + 8));
+    __m128 sum3 = _mm_mul_ps(tap, _mm_loadu_ps(rows[0] + j + 12));
+    for (size_t k = 1; k < num_taps; ++k) {
+      const __m128 tap = _mm_set1_ps(taps[k]);
+      const float *in = rows[k] + j;
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(tap, _mm_loadu_ps(in)));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(tap, _mm_loadu_ps(in + 4)));
+      sum2 = _mm_add_ps(sum2, _mm_mul_ps(tap, _mm_loadu_ps(in + 8)));
+      sum3 = _mm_add_ps(sum3, _mm_mul_ps(tap, _mm_loadu_ps(in + 12)));
+    }
+    _mm_storeu_ps(output + j, sum0);
+    _mm_storeu_ps(output + j + 4, sum1);
+    _mm_storeu_ps(output + j + 8, sum2);
+    _mm_storeu_ps(output + j + 12, sum3);
+  }
+  for (; j + 4 <= num_columns; j += 4) {
+    __m128 sum = _mm_mul_ps(_mm_set1_ps(taps[0]), _mm_loadu_ps(rows[0] + j));
+    for (size_t k = 1; k < num_taps; ++k)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(taps[k]),
+				       _mm_loadu_ps(rows[k] + j)));
+    _mm_storeu_ps(output + j, sum);
+  }
+#endif
+  for (; j < num_columns; ++j) {
+    float sum = 0.0f;
+    for (size_t k = 0; k < num_taps; ++k) sum += taps[k] * rows[k][j];
+    output[j] = sum;
+  }
+}
+
+// Rounds (to nearest even, as the vector conversions do) and saturates
+// the count values to output.
+template <typename OutputType>
+void StoreRow(const float *values, size_t count, OutputType *output) {
+  const float high = numeric_limits<OutputType>::max();
+  for (size_t j = 0; j < count; ++j)
+    output[j] = static_cast<OutputType>(
+	lrintf(min(high, max(0.0f, values[j]))));
+}
+
+template <>
+void StoreRow(const float *values, size_t count, float *output) {
+  if (values != output) memcpy(output, values, count * sizeof(float));
+}
+
+#if defined(__SSE2__)
+template <>
+void StoreRow(const float *values, size_t count, uint8_t *output) {
+  size_t j = 0;
+  for (; j + 16 <= count; j += 16) {
+    // Packing saturates to [-32768, 32767], then to [0, 255].
+    const __m128i low = _mm_packs_epi32(
+	_mm_cvtps_epi32(_mm_loadu_ps(values + j)),
+	_mm_cvtps_epi32(_mm_loadu_ps(values + j + 4)));
+    const __m128i high = _mm_packs_epi32(
+	_mm_cvtps_epi32(_mm_loadu_ps(values + j + 8)),
+	_mm_cvtps_epi32(_mm_loadu_ps(values + j + 12)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + j),
+		     _mm_packus_epi16(low, high));
+  }
+  for (; j < count; ++j)
+    output[j] = static_cast<uint8_t>(
+	lrintf(min(255.0f, max(0.0f, values[j]))));
+}
+#endif
+
+// The full convolution of the kernels a and b: one kernel doing what a
+// then b do.
+vector<float> CombineTaps(const vector<float> &a, const vector<float> &b) {
+  vector<float> combined(a.size() + b.size() - 1, 0.0f);
+  for (size_t i = 0; i < a.size(); ++i)
+    for (size_t k = 0; k < b.size(); ++k) combined[i + k] += a[i] * b[k];
+  return combined;
+}
+
+}  // namespace
+
+vector<float> GaussianTaps(double sigma) {
+  if (!(sigma > 0)) return vector<float>(1, 1.0f);
+  const int radius = static_cast<int>(ceil(3.0 * sigma));
+  vector<double> weights(2 * radius + 1);
+  double total = 0;
+  for (int k = -radius; k <= radius; ++k) {
+    weights[k + radius] = exp(-k * k / (2.0 * sigma * sigma));
+    total += weights[k + radius];
+  }
+  vector<float> taps(weights.size());
+  for (size_t k = 0; k < taps.size(); ++k) taps[k] = weights[k] / total;
+  return taps;
+}
+
+template <typename InputType, typename OutputType>
+void ConvolveSeparable(const ImageView<InputType> &an_image,
+		       const vector<float> &row_taps,
+		       const vector<float> &column_taps,
+		       BorderPolicy border, ThreadPool *pool,
+		       BasicImage<OutputType> *output) {
+  if (output == nullptr || row_taps.size() % 2 == 0 ||
+      column_taps.size() % 2 == 0) abort();
+  const size_t num_rows = an_image.num_rows();
+  const size_t num_columns = an_image.num_columns();
+  output->AllocateSpaceAndSetSize(num_rows, num_columns);
+  output->SetNumberGrayLevels(an_image.num_gray_levels());
+  if (num_rows == 0 || num_columns == 0) return;
+  TRACE_SCOPE("convolve");
+  TRACE_COUNT("pixels_filtered", num_rows * num_columns);
+
+  const size_t row_radius = row_taps.size() / 2;
+  const size_t num_taps = column_taps.size();
+  const ptrdiff_t column_radius = num_taps / 2;
+  const size_t num_bands = (num_rows + kBandRows - 1) / kBandRows;
+  auto filter_band = [&](size_t band) {
+    const ptrdiff_t first = band * kBandRows;
+    const ptrdiff_t last = min(num_rows, (band + 1) * kBandRows);
+    // The row-filtered rows the column kernel spans, in a ring: row t
+    // of the image (or past its edges) is in slot (t - top) % num_taps.
+    const ptrdiff_t top = first - column_radius;
+    vector<float> line(num_columns + 2 * row_radius);
+    vector<float> ring(num_taps * num_columns);
+    vector<float> values(num_columns);
+    vector<const float *> rows(num_taps);
+    for (ptrdiff_t t = top; t < last + column_radius; ++t) {
+      float *slot = &ring[((t - top) % num_taps) * num_columns];
+      const ptrdiff_t source = SourceIndex(t, num_rows, border);
+      if (source < 0) {
+	fill(slot, slot + num_columns, 0.0f);
+      } else {
+	LoadLine(an_image.Row(source), num_columns, row_radius, border,
+		 line.data());
+	FilterLine(line.data(), num_columns, row_taps.data(),
+		   row_taps.size(), slot);
+      }
+
+      // Once the ring reaches column_radius rows below row y, y is done.
+      const ptrdiff_t y = t - column_radius;
+      if (y < first) continue;
+      for (size_t k = 0; k < num_taps; ++k)
+	rows[k] = &ring[((y - first + k) % num_taps) * num_columns];
+      OutputType *target = output->Row(y);
+      // Float outputs are combined in place.
+      float *sums = is_same<OutputType, float>::value ?
+	reinterpret_cast<float *>(target) : values.data();
+      CombineRows(rows.data(), column_taps.data(), num_taps, num_columns,
+		  sums);
+      StoreRow(sums, num_columns, target);
+    }
+  };
+  if (pool == nullptr) {
+    for (size_t band = 0; band < num_bands; ++band) filter_band(band);
+  } else {
+    pool->ParallelFor(num_bands, filter_band);
+  }
+}
+
+template void ConvolveSeparable(const ImageView<uint8_t> &,
+				const vector<float> &, const vector<float> &,
+				BorderPolicy, ThreadPool *, Image *);
+template void ConvolveSeparable(const ImageView<uint16_t> &,
+				const vector<float> &, const vector<float> &,
+				BorderPolicy, ThreadPool *, Image16 *);
+template void ConvolveSeparable(const ImageView<float> &,
+				const vector<float> &, const vector<float> &,
+				BorderPolicy, ThreadPool *, ImageFloat *);
+template void ConvolveSeparable(const ImageView<uint8_t> &,
+				const vector<float> &, const vector<float> &,
+				BorderPolicy, ThreadPool *, ImageFloat *);
+template void ConvolveSeparable(const ImageView<uint16_t> &,
+				const vector<float> &, const vector<float> &,
+				BorderPolicy, ThreadPool *, ImageFloat *);
+
+template <typename PixelType>
+void GaussianBlur(const ImageView<PixelType> &an_image, double sigma,
+		  BorderPolicy border, ThreadPool *pool,
+		  BasicImage<PixelType> *output) {
+  const vector<float> taps = GaussianTaps(sigma);
+  ConvolveSeparable(an_image, taps, taps, border, pool, output);
+}
+
+template void GaussianBlur(const ImageView<uint8_t> &, double, BorderPolicy,
+			   ThreadPool *, Image *);
+template void GaussianBlur(const ImageView<uint16_t> &, double,
+			   BorderPolicy, ThreadPool *, Image16 *);
+template void GaussianBlur(const ImageView<float> &, double, BorderPolicy,
+			   ThreadPool *, ImageFloat *);
+
+template <typename PixelType>
+void GaussianSobel(const ImageView<PixelType> &an_image, double sigma,
+		   BorderPolicy border, ThreadPool *pool,
+		   ImageFloat *x_gradient, ImageFloat *y_gradient) {
+  if (x_gradient == nullptr || y_gradient == nullptr) abort();
+  // Sobel is a central difference along one axis and [1 2 1] smoothing
+  // along the other; the Gaussian goes into both.
+  const vector<float> gaussian = GaussianTaps(sigma);
+  const vector<float> derivative =
+    CombineTaps(gaussian, vector<float>{-1.0f, 0.0f, 1.0f});
+  const vector<float> smoothing =
+    CombineTaps(gaussian, vector<float>{1.0f, 2.0f, 1.0f});
+  ConvolveSeparable(an_image, derivative, smoothing, border, pool,
+		    x_gradient);
+  ConvolveSeparable(an_image, smoothing, derivative, border, pool,
+		    y_gradient);
+}
+
+template void GaussianSobel(const ImageView<uint8_t> &, double,
+			    BorderPolicy, ThreadPool *, ImageFloat *,
+			    ImageFloat *);
+template void GaussianSobel(const ImageView<uint16_t> &, double,
+			    BorderPolicy, ThreadPool *, ImageFloat *,
+			    ImageFloat *);
+template void GaussianSobel(const ImageView<float> &, double,
+			    BorderPolicy, ThreadPool *, ImageFloat *,
+			    ImageFloat *);
+
+}  // namespace ComputerVisionProjects
@@ -0,0 +1,66 @@
+// Separable convolution of gray-scale images: Gaussian smoothing, Sobel
+// gradients, and any other kernel that is a product of a row and a column
+// kernel.
+// To be used in Computer Vision class.
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <cstddef>
+#include <vector>
+#include "image.h"
+#include "thread_pool.h"
+
+namespace ComputerVisionProjects {
+
+// What a kernel reading past the edge of the image sees there.
+enum class BorderPolicy {
+  kReplicate,  // The nearest edge pixel: aaa|abcd|ddd.
+  kReflect,    // The image mirrored about its edge pixels: dcb|abcd|cba.
+  kZero,       // Zeros.
+};
+
+// The taps of a normalized Gaussian of standard deviation sigma, in
+// pixels, cut off at 3 sigma: 2 * ceil(3 sigma) + 1 of them. A sigma of
+// 0 gives the identity, {1}.
+std::vector<float> GaussianTaps(double sigma);
+
+// Correlates an_image with the kernel whose entry (k, l) is
+// column_taps[k] * row_taps[l], centered on the middle taps (both kernels
+// must have an odd number of taps), as a pass along the rows and then one
+// along the columns: for an n x n kernel, 2n multiply-adds per pixel
+// rather than n^2. Rows are taken in bands, which pool filters
+// independently (pool may be nullptr to filter on the calling thread);
+// each band keeps only the row-filtered rows the column kernel spans, so
+// they stay in cache. Both passes run in float, 8 (AVX) or 4 (SSE)
+// pixels at a time when available. Integer outputs are rounded and
+// saturated to [0, the output type's maximum]; output gets an_image's
+// size and gray levels.
+template <typename InputType, typename OutputType>
+void ConvolveSeparable(const ImageView<InputType> &an_image,
+		       const std::vector<float> &row_taps,
+		       const std::vector<float> &column_taps,
+		       BorderPolicy border, ThreadPool *pool,
+		       BasicImage<OutputType> *output);
+
+// Smooths an_image with a Gaussian of standard deviation sigma (see
+// GaussianTaps()) into output, which may not be an_image's own buffer.
+template <typename PixelType>
+void GaussianBlur(const ImageView<PixelType> &an_image, double sigma,
+		  BorderPolicy border, ThreadPool *pool,
+		  BasicImage<PixelType> *output);
+
+// The Sobel gradients of an_image smoothed with a Gaussian of standard
+// deviation sigma (none for 0): x_gradient gets d/dx (along the rows),
+// y_gradient d/dy (down the columns), in gray levels per pixel times 8 as
+// with the classic 3x3 Sobel operator. The smoothing is folded into the
+// Sobel kernels, which stay separable, so each gradient takes a single
+// separable pass over an_image, with no smoothed image in between.
+template <typename PixelType>
+void GaussianSobel(const ImageView<PixelType> &an_image, double sigma,
+		   BorderPolicy border, ThreadPool *pool,
+		   ImageFloat *x_gradient, ImageFloat *y_gradient);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // FILTER_H
@@ -0,0 +1,224 @@
+// Gray-level histograms and threshold selection from them.
+// To be used in Computer Vision class.
+
+#include "histogram.h"
+#include "trace.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+// Rows decoded at a time by ComputeMaximumHistogram().
+const size_t kBandRows = 64;
+
+// Number of interleaved copies of the bins a thread counts PixelType
+// pixels into. The 65536 bins of 16-bit pixels already spill out of the
+// L1 cache, so they get a single copy.
+template <typename PixelType>
+struct Lanes {
+  static const size_t kCount = 1;
+};
+
+template <>
+struct Lanes<uint8_t> {
+  static const size_t kCount = 4;
+};
+
+// Counts the num_columns pixels of row into counts, Lanes<PixelType>
+// copies of the bins back to back.
+template <typename PixelType>
+void CountRow(const PixelType *row, size_t num_columns, uint32_t *counts) {
+  for (size_t j = 0; j < num_columns; ++j) ++counts[row[j]];
+}
+
+template <>
+void CountRow(const uint8_t *row, size_t num_columns, uint32_t *counts) {
+  size_t j = 0;
+  // One 8-byte load feeds eight increments, spread over the four copies
+  // so that consecutive equal pixels hit different counters.
+  for (; j + 8 <= num_columns; j += 8) {
+    uint64_t pixels;
+    memcpy(&pixels, row + j, sizeof pixels);
+    ++counts[pixels & 0xff];
+    ++counts[256 + ((pixels >> 8) & 0xff)];
+    ++counts[512 + ((pixels >> 16) & 0xff)];
+    ++counts[768 + ((pixels >> 24) & 0xff)];
+    ++counts[(pixels >> 32) & 0xff];
+    ++counts[256 + ((pixels >> 40) & 0xff)];
+    ++counts[512 + ((pixels >> 48) & 0xff)];
+    ++counts[768 + (pixels >> 56)];
+  }
+  for (; j < num_columns; ++j) ++counts[row[j]];
+}
+
+// The histogram one thread counts: 32-bit counters, which keep more of
+// the bins in cache, added to 64-bit totals before they can overflow.
+template <typename PixelType>
+class Counter {
+ public:
+  Counter()
+      : counts_(Lanes<PixelType>::kCount * HistogramBins<PixelType>(), 0),
+	totals_(HistogramBins<PixelType>(), 0), pending_{0} { }
+
+  void AddRow(const PixelType *row, size_t num_columns) {
+    if (pending_ + num_columns > UINT32_MAX) Flush();
+    CountRow(row, num_columns, counts_.data());
+    pending_ += num_columns;
+  }
+
+  // Moves the totals of all the rows added into totals.
+  void TakeTotals(vector<uint64_t> *totals) {
+    Flush();
+    totals->swap(totals_);
+  }
+
+ private:
+  void Flush() {
+    const size_t bins = totals_.size();
+    for (size_t k = 0; k < counts_.size(); ++k) totals_[k % bins] += counts_[k];
+    fill(counts_.begin(), counts_.end(), 0);
+    pending_ = 0;
+  }
+
+  vector<uint32_t> counts_;
+  vector<uint64_t> totals_;
+  uint64_t pending_;  // Pixels in counts_.
+};
+
+// Splits rows [0, num_rows) into one chunk per thread of pool, calls
+// count_rows(first_row, last_row, &counter) for each on its own Counter,
+// and adds the chunks' totals to histogram.
+template <typename PixelType, typename CountRows>
+void CountInChunks(size_t num_rows, ThreadPool *pool,
+		   const CountRows &count_rows,
+		   vector<uint64_t> *histogram) {
+  const size_t num_chunks =
+    max<size_t>(1, min(num_rows, pool == nullptr ? 1 : pool->num_threads()));
+  vector<vector<uint64_t>> totals(num_chunks);
+  auto count_chunk = [&](size_t chunk) {
+    Counter<PixelType> counter;
+    count_rows(chunk * num_rows / num_chunks,
+	       (chunk + 1) * num_rows / num_chunks, &counter);
+    counter.TakeTotals(&totals[chunk]);
+  };
+  if (num_chunks == 1) {
+    count_chunk(0);
+  } else {
+    pool->ParallelFor(num_chunks, count_chunk);
+  }
+
+  const size_t bins = HistogramBins<PixelType>();
+  if (histogram->size() < bins) histogram->resize(bins, 0);
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+    for (size_t k = 0; k < bins; ++k) (*histogram)[k] += totals[chunk][k];
+}
+
+// ComputeMaximumHistogram() with the images decoded to PixelType pixels.
+template <typename PixelType>
+void AddMaximumHistogram(const vector<ImageReader> &readers, ThreadPool *pool,
+			 vector<uint64_t> *histogram) {
+  const size_t num_columns = readers[0].num_columns();
+  CountInChunks<PixelType>(
+      readers[0].num_rows(), pool,
+      [&](size_t first_row, size_t last_row, Counter<PixelType> *counter) {
+	vector<PixelType> band(kBandRows * num_columns), other;
+	if (readers.size() > 1) other.resize(band.size());
+	for (size_t row = first_row; row < last_row; row += kBandRows) {
+	  const size_t rows = min(kBandRows, last_row - row);
+	  const size_t count = rows * num_columns;
+	  readers[0].ReadRows(row, rows, band.data(), num_columns);
+	  readers[0].ReleaseRows(row, rows);
+	  for (size_t k = 1; k < readers.size(); ++k) {
+	    readers[k].ReadRows(row, rows, other.data(), num_columns);
+	    readers[k].ReleaseRows(row, rows);
+	    for (size_t j = 0; j < count; ++j) band[j] = max(band[j], other[j]);
+	  }
+	  for (size_t i = 0; i < rows; ++i)
+	    counter->AddRow(&band[i * num_columns], num_columns);
+	}
+      },
+      histogram);
+}
+
+}  // namespace
+
+template <typename PixelType>
+void ComputeHistogram(const ImageView<PixelType> &an_image, ThreadPool *pool,
+		      vector<uint64_t> *histogram) {
+  if (histogram == nullptr) abort();
+  TRACE_SCOPE("histogram");
+  TRACE_COUNT("pixels_counted", an_image.num_rows() * an_image.num_columns());
+  histogram->assign(HistogramBins<PixelType>(), 0);
+  CountInChunks<PixelType>(
+      an_image.num_rows(), pool,
+      [&](size_t first_row, size_t last_row, Counter<PixelType> *counter) {
+	for (size_t i = first_row; i < last_row; ++i)
+	  counter->AddRow(an_image.Row(i), an_image.num_columns());
+      },
+      histogram);
+}
+
+template void ComputeHistogram(const ImageView<uint8_t> &, ThreadPool *,
+			       vector<uint64_t> *);
+template void ComputeHistogram(const ImageView<uint16_t> &, ThreadPool *,
+			       vector<uint64_t> *);
+
+void ComputeMaximumHistogram(const vector<ImageReader> &readers,
+			     ThreadPool *pool, vector<uint64_t> *histogram) {
+  if (histogram == nullptr) abort();
+  histogram->clear();
+  if (readers.empty()) return;
+  TRACE_SCOPE("histogram");
+  TRACE_COUNT("pixels_counted", readers.size() * readers[0].num_rows() *
+	      readers[0].num_columns());
+  bool deep = false;
+  for (const ImageReader &reader : readers)
+    deep = deep || reader.num_gray_levels() > 255;
+  if (deep) {
+    AddMaximumHistogram<uint16_t>(readers, pool, histogram);
+  } else {
+    AddMaximumHistogram<uint8_t>(readers, pool, histogram);
+  }
+}
+
+int OtsuThreshold(const vector<uint64_t> &histogram) {
+  double total = 0, total_sum = 0;
+  int highest = 0;  // The highest occupied level.
+  for (size_t k = 0; k < histogram.size(); ++k) {
+    total += histogram[k];
+    total_sum += static_cast<double>(k) * histogram[k];
+    if (histogram[k] > 0) highest = k;
+  }
+
+  // Sweeps t up, keeping the count and sum of the levels [0, t].
+  double below = 0, below_sum = 0;
+  double best = -1;
+  size_t first_best = 0, last_best = 0;
+  for (size_t t = 0; t + 1 < histogram.size(); ++t) {
+    below += histogram[t];
+    below_sum += static_cast<double>(t) * histogram[t];
+    if (below == 0) continue;
+    const double above = total - below;
+    if (above == 0) break;
+    const double difference =
+      below_sum / below - (total_sum - below_sum) / above;
+    // Levels with empty bins leave it exactly unchanged, so ties are
+    // exact.
+    const double between = below * above * difference * difference;
+    if (between > best) {
+      best = between;
+      first_best = last_best = t;
+    } else if (between == best) {
+      last_best = t;
+    }
+  }
+  if (best < 0) return highest;
+  return (first_best + last_best) / 2;
+}
+
+}  // namespace ComputerVisionProjects
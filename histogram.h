@@ -0,0 +1,53 @@
+// Gray-level histograms and threshold selection from them.
+// To be used in Computer Vision class.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+#include "thread_pool.h"
+
+namespace ComputerVisionProjects {
+
+// Number of bins of the histogram of PixelType pixels: one per value,
+// 256 for 8-bit and 65536 for 16-bit pixels.
+template <typename PixelType>
+size_t HistogramBins() { return size_t(1) << (8 * sizeof(PixelType)); }
+
+// The histogram of an_image: (*histogram)[v] gets the number of pixels of
+// value v, with HistogramBins<PixelType>() bins. Each thread of pool (which
+// may be nullptr to count on the calling thread) counts its share of the
+// rows into a histogram of its own, and those are summed at the end, so
+// the threads never contend for a bin. 8-bit pixels are counted into
+// four interleaved copies of the bins, so that runs of equal pixels do not
+// wait on the increment of the same counter.
+template <typename PixelType>
+void ComputeHistogram(const ImageView<PixelType> &an_image, ThreadPool *pool,
+		      std::vector<uint64_t> *histogram);
+
+// The histogram of the brightest of the images open in readers at each
+// pixel (the images must be the same size), decoded a band of rows at a
+// time whose pages are released once counted, so that no image is ever
+// whole in memory. With a single reader, that of its image. It has
+// 65536 bins if any image is 16-bit, 256 otherwise. A threshold on it
+// splits the pixels as s3's foreground does: some image is brighter than
+// the threshold where the brightest is.
+void ComputeMaximumHistogram(const std::vector<ImageReader> &readers,
+			     ThreadPool *pool,
+			     std::vector<uint64_t> *histogram);
+
+// Otsu's threshold for histogram: the gray level t that splits it into
+// [0, t] and [t + 1, max] with the most variance between the two classes
+// (equivalently, the least within them). When several levels tie, as
+// with empty bins between the classes, the middle one is taken. Pixels
+// above t are the bright class: s3's threshold is t itself, s1's (which
+// keeps the pixels at or above it) t + 1. A histogram with fewer than two
+// occupied levels has no split; that level is returned.
+int OtsuThreshold(const std::vector<uint64_t> &histogram);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // HISTOGRAM_H
@@ -3,139 +3,779 @@
 // To be used in Computer Vision class.
 
 #include "image.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 using namespace std;
 
 namespace ComputerVisionProjects {
 
-Image::Image(const Image &an_image){
-  pixels_ = nullptr;
-  num_rows_ = 0;
-  num_columns_ = 0;
-  AllocateSpaceAndSetSize(an_image.num_rows(), an_image.num_columns());
-  SetNumberGrayLevels(an_image.num_gray_levels());
+namespace {
 
-  for (size_t i = 0; i < num_rows(); ++i)
-    for (size_t j = 0; j < num_columns(); ++j){
-      SetPixel(i,j, an_image.GetPixel(i,j));
+// Maps the whole of file filename read-only. On success *mapping and
+// *mapping_size describe the mapping, to be released with munmap().
+bool MapFile(const string &filename, void **mapping, size_t *mapping_size,
+	     const char *caller) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cout << caller << ": Cannot open file" << endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    cout << caller << ": Expected .pgm file" << endl;
+    return false;
+  }
+  const size_t size = file_stat.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cout << caller << ": Cannot map file" << endl;
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  *mapping = data;
+  *mapping_size = size;
+  return true;
+}
+
+bool IsPgmSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+    c == '\f';
+}
+
+// Skips whitespace and comments starting at *pos.
+void SkipPgmSpace(const char *data, size_t size, size_t *pos) {
+  while (*pos < size) {
+    if (data[*pos] == '#') {
+      while (*pos < size && data[*pos] != '\n') ++*pos;
+    } else if (IsPgmSpace(data[*pos])) {
+      ++*pos;
+    } else {
+      return;
     }
+  }
 }
 
-Image::~Image(){
-  DeallocateSpace();
+// Reads the unsigned decimal number at *pos.
+bool ParsePgmNumber(const char *data, size_t size, size_t *pos,
+		    size_t *value) {
+  SkipPgmSpace(data, size, pos);
+  if (*pos >= size || data[*pos] < '0' || data[*pos] > '9') return false;
+  size_t number = 0;
+  while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+    number = number * 10 + (data[*pos] - '0');
+    if (number > (1u << 30)) return false;
+    ++*pos;
+  }
+  *value = number;
+  return true;
 }
 
-void Image::AllocateSpaceAndSetSize(size_t num_rows, size_t num_columns) {
-  if (pixels_ != nullptr) DeallocateSpace();
-  pixels_ = new int*[num_rows];
-  for (size_t i = 0; i < num_rows; ++i)
-    pixels_[i] = new int[num_columns];
+// Writes every buffer in iov, in as few writev() calls as the
+// kernel allows.
+bool WriteFully(int fd, struct iovec *iov, size_t count) {
+  while (count > 0) {
+    const int batch = count < IOV_MAX ? count : IOV_MAX;
+    ssize_t written = writev(fd, iov, batch);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    // Skip over what went out, which may end mid-buffer.
+    while (count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
 
-  num_rows_ = num_rows;
-  num_columns_ = num_columns;
+// Like WriteFully(), but at byte offset of the file, with pwritev().
+bool WriteFullyAt(int fd, struct iovec *iov, size_t count, off_t offset) {
+  while (count > 0) {
+    const int batch = count < IOV_MAX ? count : IOV_MAX;
+    ssize_t written = pwritev(fd, iov, batch, offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    offset += written;
+    while (count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
 }
 
-void Image::DeallocateSpace() {
-  for (size_t i = 0; i < num_rows_; i++)
-    delete pixels_[i];
-  delete pixels_;
-  pixels_ = nullptr;
-  num_rows_ = 0;
-  num_columns_ = 0;
+}  // namespace
+
+bool ParsePgmHeader(const char *data, size_t size, PgmHeader *header) {
+  if (header == nullptr) abort();
+  if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '2'))
+    return false;
+  header->binary = data[1] == '5';
+
+  size_t pos = 2;
+  if (pos < size && !IsPgmSpace(data[pos]) && data[pos] != '#') return false;
+  if (!ParsePgmNumber(data, size, &pos, &header->num_columns) ||
+      !ParsePgmNumber(data, size, &pos, &header->num_rows) ||
+      !ParsePgmNumber(data, size, &pos, &header->num_gray_levels))
+    return false;
+  if (header->num_columns == 0 || header->num_rows == 0 ||
+      header->num_gray_levels == 0 || header->num_gray_levels > 65535)
+    return false;
+
+  // A single whitespace character separates maxval from the samples;
+  // files written on Windows use "\r\n" there.
+  if (pos >= size || !IsPgmSpace(data[pos])) return false;
+  if (data[pos] == '\r' && pos + 1 < size && data[pos + 1] == '\n') ++pos;
+  header->data_offset = pos + 1;
+  return true;
 }
 
-bool ReadImage(const string &filename, Image *an_image) {  
-  if (an_image == nullptr) abort();
-  FILE *input = fopen(filename.c_str(),"rb");
-  if (input == 0) {
-    cout << "ReadImage: Cannot open file" << endl;
+MappedImage::MappedImage(MappedImage &&a_mapping) noexcept
+    : mapping_{a_mapping.mapping_}, mapping_size_{a_mapping.mapping_size_},
+      view_{a_mapping.view_} {
+  a_mapping.mapping_ = nullptr;
+  a_mapping.mapping_size_ = 0;
+  a_mapping.view_ = ImageView<uint8_t>();
+}
+
+MappedImage& MappedImage::operator=(MappedImage &&a_mapping) noexcept {
+  if (this == &a_mapping) return *this;
+  Close();
+  mapping_ = a_mapping.mapping_;
+  mapping_size_ = a_mapping.mapping_size_;
+  view_ = a_mapping.view_;
+  a_mapping.mapping_ = nullptr;
+  a_mapping.mapping_size_ = 0;
+  a_mapping.view_ = ImageView<uint8_t>();
+  return *this;
+}
+
+void MappedImage::Close() {
+  if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  view_ = ImageView<uint8_t>();
+}
+
+bool MapImage(const string &filename, MappedImage *mapped_image) {
+  if (mapped_image == nullptr) abort();
+  mapped_image->Close();
+  void *mapping;
+  size_t mapping_size;
+  if (!MapFile(filename, &mapping, &mapping_size, "MapImage")) return false;
+
+  const char *data = static_cast<const char *>(mapping);
+  PgmHeader header;
+  if (!ParsePgmHeader(data, mapping_size, &header) || !header.binary ||
+      header.num_gray_levels > 255) {
+    munmap(mapping, mapping_size);
+    cout << "MapImage: Expected 8-bit .pgm file" << endl;
     return false;
   }
-  
-  // Check for the right "magic number".
-  char line[1024];
-  if (fread(line, 1, 3, input) != 3 || strncmp(line,"P5\n",3)) {
-    fclose(input);
-    cout << "ReadImage: Expected .pgm file" << endl;
+  if (mapping_size - header.data_offset <
+      header.num_rows * header.num_columns) {
+    munmap(mapping, mapping_size);
+    cout << "MapImage: short file" << endl;
     return false;
   }
-  
-  // Skip comments.
-  do
-    fgets(line, sizeof line, input);
-  while(*line == '#');
-  
-  // Read the width and height.
-  int num_columns,num_rows;
-  sscanf(line,"%d %d\n", &num_columns, &num_rows);
-  an_image->AllocateSpaceAndSetSize(num_rows, num_columns);
-  
 
-  // Read # of gray levels.
-  fgets(line, sizeof line, input);
-  int levels;
-  sscanf(line,"%d\n", &levels);
-  an_image->SetNumberGrayLevels(levels);
-
-  // read pixel row by row.
-  for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0;j < num_columns; ++j) {
-      const int byte=fgetc(input);
-      if (byte == EOF) {
-        fclose(input);
-        cout << "ReadImage: short file" << endl;
-        return false;
+  mapped_image->mapping_ = mapping;
+  mapped_image->mapping_size_ = mapping_size;
+  mapped_image->view_ = ImageView<uint8_t>(
+      reinterpret_cast<const uint8_t *>(data + header.data_offset),
+      header.num_rows, header.num_columns, header.num_columns,
+      header.num_gray_levels);
+  return true;
+}
+
+bool ReadImageHeader(const string &filename, PgmHeader *header) {
+  if (header == nullptr) abort();
+  void *mapping;
+  size_t mapping_size;
+  if (!MapFile(filename, &mapping, &mapping_size, "ReadImageHeader"))
+    return false;
+  const bool ok = ParsePgmHeader(static_cast<const char *>(mapping),
+				 mapping_size, header);
+  munmap(mapping, mapping_size);
+  if (!ok) cout << "ReadImageHeader: Expected .pgm file" << endl;
+  return ok;
+}
+
+ImageReader::ImageReader(ImageReader &&a_reader) noexcept
+    : mapping_{a_reader.mapping_}, mapping_size_{a_reader.mapping_size_},
+      owns_mapping_{a_reader.owns_mapping_}, header_(a_reader.header_),
+      plain_samples_(std::move(a_reader.plain_samples_)) {
+  a_reader.mapping_ = nullptr;
+  a_reader.mapping_size_ = 0;
+  a_reader.owns_mapping_ = false;
+  a_reader.header_ = PgmHeader();
+}
+
+ImageReader& ImageReader::operator=(ImageReader &&a_reader) noexcept {
+  if (this == &a_reader) return *this;
+  Close();
+  mapping_ = a_reader.mapping_;
+  mapping_size_ = a_reader.mapping_size_;
+  owns_mapping_ = a_reader.owns_mapping_;
+  header_ = a_reader.header_;
+  plain_samples_ = std::move(a_reader.plain_samples_);
+  a_reader.mapping_ = nullptr;
+  a_reader.mapping_size_ = 0;
+  a_reader.owns_mapping_ = false;
+  a_reader.header_ = PgmHeader();
+  return *this;
+}
+
+void ImageReader::Close() {
+  if (mapping_ != nullptr && owns_mapping_) munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  owns_mapping_ = false;
+  header_ = PgmHeader();
+  plain_samples_.clear();
+}
+
+bool ImageReader::Open(char *data, size_t size, bool owned,
+		       const char *caller) {
+  PgmHeader header;
+  if (!ParsePgmHeader(data, size, &header)) {
+    if (owned) munmap(data, size);
+    cout << caller << ": Expected .pgm file" << endl;
+    return false;
+  }
+  const size_t num_samples = header.num_rows * header.num_columns;
+  if (header.binary) {
+    const size_t sample_size = header.num_gray_levels > 255 ? 2 : 1;
+    if ((size - header.data_offset) / sample_size < num_samples) {
+      if (owned) munmap(data, size);
+      cout << caller << ": short file" << endl;
+      return false;
+    }
+  } else {
+    // Decodes the samples of a P2 file, written as decimal text. Each takes
+    // at least a digit and a separator (but the last), so a header claiming
+    // more than fit is rejected before they are allocated.
+    if ((size - header.data_offset + 1) / 2 < num_samples) {
+      if (owned) munmap(data, size);
+      cout << caller << ": short file" << endl;
+      return false;
+    }
+    plain_samples_.resize(num_samples);
+    size_t pos = header.data_offset;
+    for (size_t k = 0; k < num_samples; ++k) {
+      size_t value;
+      if (!ParsePgmNumber(data, size, &pos, &value) ||
+	  value > header.num_gray_levels) {
+	if (owned) munmap(data, size);
+	plain_samples_.clear();
+	cout << caller << ": bad or missing sample" << endl;
+	return false;
       }
-      an_image->SetPixel(i, j, byte);
+      plain_samples_[k] = value;
     }
+    if (owned) munmap(data, size);
+    data = nullptr;
+    size = 0;
   }
-  
-  fclose(input);
+
+  mapping_ = data;
+  mapping_size_ = size;
+  owns_mapping_ = owned;
+  header_ = header;
+  return true;
+}
+
+bool OpenImage(const string &filename, ImageReader *reader) {
+  if (reader == nullptr) abort();
+  reader->Close();
+  void *mapping;
+  size_t mapping_size;
+  TRACE_SCOPE("open");
+  if (!MapFile(filename, &mapping, &mapping_size, "OpenImage")) return false;
+  return reader->Open(static_cast<char *>(mapping), mapping_size, true,
+		      "OpenImage");
+}
+
+bool OpenImageInMemory(const void *data, size_t size, ImageReader *reader) {
+  if (reader == nullptr) abort();
+  reader->Close();
+  TRACE_SCOPE("open");
+  // Never written through: the reader only decodes from it.
+  return reader->Open(static_cast<char *>(const_cast<void *>(data)), size,
+		      false, "OpenImageInMemory");
+}
+
+template <typename PixelType>
+void ImageReader::DecodeSamples(size_t first_sample, size_t count,
+				PixelType *output) const {
+  const bool wide = header_.num_gray_levels > 255;
+  if (wide && sizeof(PixelType) == 1) abort();
+  if (!header_.binary) {
+    const uint16_t *input = plain_samples_.data() + first_sample;
+    for (size_t j = 0; j < count; ++j) output[j] = input[j];
+    return;
+  }
+  const uint8_t *samples =
+    static_cast<const uint8_t *>(mapping_) + header_.data_offset;
+  if (wide) {
+    // Two bytes per sample, most significant first.
+    const uint8_t *input = samples + 2 * first_sample;
+    for (size_t j = 0; j < count; ++j)
+      output[j] = (input[2 * j] << 8) | input[2 * j + 1];
+  } else if (sizeof(PixelType) == 1) {
+    memcpy(output, samples + first_sample, count);
+  } else {
+    const uint8_t *input = samples + first_sample;
+    for (size_t j = 0; j < count; ++j) output[j] = input[j];
+  }
+}
+
+template <typename PixelType>
+void ImageReader::ReadRows(size_t first_row, size_t num_rows,
+			   PixelType *output, size_t stride) const {
+  if (first_row + num_rows > header_.num_rows) abort();
+  const size_t num_columns = header_.num_columns;
+  TRACE_SCOPE("decode");
+  TRACE_COUNT("pixels_decoded", num_rows * num_columns);
+  TRACE_COUNT("bytes_decoded", num_rows * num_columns *
+	      (header_.num_gray_levels > 255 ? 2 : 1));
+  for (size_t i = 0; i < num_rows; ++i)
+    DecodeSamples((first_row + i) * num_columns, num_columns,
+		  output + i * stride);
+}
+
+template <typename PixelType>
+void ImageReader::ReadRowSpan(size_t row, size_t first_column,
+			      size_t num_columns, PixelType *output) const {
+  if (row >= header_.num_rows ||
+      first_column + num_columns > header_.num_columns) abort();
+  DecodeSamples(row * header_.num_columns + first_column, num_columns,
+		output);
+}
+
+void ImageReader::ReleaseRows(size_t first_row, size_t num_rows) const {
+  // Memory that is not a mapping of ours would be zeroed, not released.
+  if (mapping_ == nullptr || !owns_mapping_) return;
+  const size_t sample_size = header_.num_gray_levels > 255 ? 2 : 1;
+  const size_t row_size = header_.num_columns * sample_size;
+  size_t begin = header_.data_offset + first_row * row_size;
+  size_t end = begin + num_rows * row_size;
+  // Only whole pages can go; the ones shared with other rows stay.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  begin = (begin + page_size - 1) / page_size * page_size;
+  end = end / page_size * page_size;
+  if (begin < end)
+    madvise(static_cast<char *>(mapping_) + begin, end - begin,
+	    MADV_DONTNEED);
+}
+
+template void ImageReader::ReadRows(size_t, size_t, uint8_t *, size_t) const;
+template void ImageReader::ReadRows(size_t, size_t, uint16_t *, size_t) const;
+template void ImageReader::ReadRows(size_t, size_t, float *, size_t) const;
+template void ImageReader::ReadRowSpan(size_t, size_t, size_t,
+				       uint8_t *) const;
+template void ImageReader::ReadRowSpan(size_t, size_t, size_t,
+				       uint16_t *) const;
+template void ImageReader::ReadRowSpan(size_t, size_t, size_t,
+				       float *) const;
+
+template <typename PixelType>
+bool ReadImage(const string &filename, BasicImage<PixelType> *an_image) {
+  if (an_image == nullptr) abort();
+  ImageReader reader;
+  if (!OpenImage(filename, &reader)) return false;
+  if (reader.num_gray_levels() > 255 && sizeof(PixelType) == 1) {
+    cout << "ReadImage: 16-bit .pgm file needs a 16-bit image" << endl;
+    return false;
+  }
+
+  an_image->AllocateSpaceAndSetSize(reader.num_rows(), reader.num_columns());
+  an_image->SetNumberGrayLevels(reader.num_gray_levels());
+  reader.ReadRows(0, reader.num_rows(), an_image->data(),
+		  an_image->stride());
   return true; 
 }
 
-bool WriteImage(const string &filename, const Image &an_image) {  
-  FILE *output = fopen(filename.c_str(), "w");
-  if (output == 0) {
+template bool ReadImage(const string &, Image *);
+template bool ReadImage(const string &, Image16 *);
+template bool ReadImage(const string &, ImageFloat *);
+
+bool WriteImage(const string &filename, const Image &an_image) {
+  return WriteImage(filename, an_image.View());
+}
+
+bool WriteImage(const string &filename, const ImageView<uint8_t> &an_image) {
+  const int output = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+			  0644);
+  if (output < 0) {
     cout << "WriteImage: cannot open file" << endl;
     return false;
   }
+  const bool ok = WriteImage(output, an_image);
+  close(output);
+  return ok;
+}
+
+bool WriteImage(int output, const ImageView<uint8_t> &an_image) {
+  TRACE_SCOPE("encode");
+  TRACE_COUNT("bytes_encoded", an_image.num_rows() * an_image.num_columns());
   const int num_rows = an_image.num_rows();
   const int num_columns = an_image.num_columns();
   const int colors = an_image.num_gray_levels();
 
-  // Write the header.
-  fprintf(output, "P5\n"); // Magic number.
-  fprintf(output, "#\n");  // Empty comment.
-  fprintf(output, "%d %d\n%03d\n", num_columns, num_rows, colors);
-
-  for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0; j < num_columns; ++j) {
-      const int byte = an_image.GetPixel(i , j);
-      if (fputc(byte,output) == EOF) {
-	    fclose(output);
-            cout << "WriteImage: could not write" << endl;
-	    return false;
+  // The header: magic number, empty comment, size and gray levels.
+  char header[64];
+  const int header_size = snprintf(header, sizeof header,
+				   "P5\n#\n%d %d\n%03d\n",
+				   num_columns, num_rows, colors);
+
+  // Contiguous rows go out as one buffer, padded ones as one per row.
+  vector<struct iovec> iov;
+  iov.push_back({header, static_cast<size_t>(header_size)});
+  const char *pixels = reinterpret_cast<const char *>(an_image.data());
+  if (an_image.stride() == an_image.num_columns()) {
+    iov.push_back({const_cast<char *>(pixels),
+		   an_image.num_rows() * an_image.num_columns()});
+  } else {
+    for (int i = 0; i < num_rows; ++i)
+      iov.push_back({const_cast<char *>(pixels + i * an_image.stride()),
+		     an_image.num_columns()});
+  }
+
+  if (!WriteFully(output, iov.data(), iov.size())) {
+    cout << "WriteImage: could not write" << endl;
+    return false;
+  }
+  return true; 
+}
+
+template <typename PixelType>
+void EncodeImage(const ImageView<PixelType> &an_image, vector<char> *bytes) {
+  if (bytes == nullptr) abort();
+  TRACE_SCOPE("encode");
+  const size_t num_rows = an_image.num_rows();
+  const size_t num_columns = an_image.num_columns();
+  const int colors = an_image.num_gray_levels();
+  const size_t sample_size = colors > 255 ? 2 : 1;
+  TRACE_COUNT("bytes_encoded", num_rows * num_columns * sample_size);
+
+  char header[64];
+  const int header_size = snprintf(header, sizeof header,
+				   "P5\n#\n%d %d\n%03d\n",
+				   static_cast<int>(num_columns),
+				   static_cast<int>(num_rows), colors);
+  bytes->resize(header_size + num_rows * num_columns * sample_size);
+  memcpy(bytes->data(), header, header_size);
+  unsigned char *out =
+    reinterpret_cast<unsigned char *>(bytes->data()) + header_size;
+  for (size_t i = 0; i < num_rows; ++i) {
+    const PixelType *row = an_image.Row(i);
+    for (size_t j = 0; j < num_columns; ++j) {
+      const unsigned value = row[j];
+      if (sample_size == 2) *out++ = value >> 8;
+      *out++ = value & 0xff;
+    }
+  }
+}
+
+template void EncodeImage(const ImageView<uint8_t> &, vector<char> *);
+template void EncodeImage(const ImageView<uint16_t> &, vector<char> *);
+
+bool CreateImage(const string &filename, size_t num_rows, size_t num_columns,
+		 size_t num_gray_levels, ImageWriter *writer) {
+  if (writer == nullptr) abort();
+  writer->Close();
+  const int output = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+			  0644);
+  if (output < 0) {
+    cout << "CreateImage: cannot open file" << endl;
+    return false;
+  }
+  char header[64];
+  const int header_size = snprintf(header, sizeof header,
+				   "P5\n#\n%d %d\n%03d\n",
+				   static_cast<int>(num_columns),
+				   static_cast<int>(num_rows),
+				   static_cast<int>(num_gray_levels));
+  struct iovec iov = {header, static_cast<size_t>(header_size)};
+  if (!WriteFully(output, &iov, 1)) {
+    close(output);
+    cout << "CreateImage: could not write" << endl;
+    return false;
+  }
+  writer->file_ = output;
+  writer->num_columns_ = num_columns;
+  writer->rows_left_ = num_rows;
+  return true;
+}
+
+bool ImageWriter::WriteRows(const uint8_t *rows, size_t num_rows,
+			    size_t stride) {
+  if (file_ < 0 || num_rows > rows_left_) abort();
+  TRACE_SCOPE("encode");
+  TRACE_COUNT("bytes_encoded", num_rows * num_columns_);
+  vector<struct iovec> iov;
+  if (stride == num_columns_) {
+    iov.push_back({const_cast<uint8_t *>(rows), num_rows * num_columns_});
+  } else {
+    for (size_t i = 0; i < num_rows; ++i)
+      iov.push_back({const_cast<uint8_t *>(rows + i * stride),
+		     num_columns_});
+  }
+  if (!WriteFully(file_, iov.data(), iov.size())) {
+    cout << "ImageWriter: could not write" << endl;
+    return false;
+  }
+  rows_left_ -= num_rows;
+  return true;
+}
+
+bool ImageWriter::Close() {
+  if (file_ < 0) return true;
+  const bool complete = rows_left_ == 0;
+  close(file_);
+  file_ = -1;
+  num_columns_ = 0;
+  rows_left_ = 0;
+  return complete;
+}
+
+bool CreateFloatImage(const string &filename, FloatFormat format,
+		      size_t num_planes, size_t num_rows, size_t num_columns,
+		      FloatImageWriter *writer) {
+  if (writer == nullptr) abort();
+  writer->Close();
+  if (num_planes == 0 ||
+      (format == FloatFormat::kPfm && num_planes != 1 && num_planes != 3)) {
+    cout << "CreateFloatImage: unsupported number of planes" << endl;
+    return false;
+  }
+  const int output = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+			  0644);
+  if (output < 0) {
+    cout << "CreateFloatImage: cannot open file" << endl;
+    return false;
+  }
+
+  // A negative scale marks little-endian samples.
+  const uint32_t byte_order = kFloatPlanesByteOrder;
+  const bool little_endian =
+    *reinterpret_cast<const uint8_t *>(&byte_order) == 0x04;
+  const size_t alignment = BasicImage<float>::kRowAlignment;
+  const size_t plane_size =
+    (num_rows * num_columns * sizeof(float) + alignment - 1) / alignment *
+    alignment;
+  char pfm_header[64];
+  FloatPlanesHeader planes_header;
+  struct iovec iov;
+  if (format == FloatFormat::kPfm) {
+    const int header_size = snprintf(pfm_header, sizeof pfm_header,
+				     "%s\n%d %d\n%s\n",
+				     num_planes == 3 ? "PF" : "Pf",
+				     static_cast<int>(num_columns),
+				     static_cast<int>(num_rows),
+				     little_endian ? "-1.0" : "1.0");
+    iov = {pfm_header, static_cast<size_t>(header_size)};
+  } else {
+    memset(&planes_header, 0, sizeof planes_header);
+    memcpy(planes_header.magic, kFloatPlanesMagic, sizeof kFloatPlanesMagic);
+    planes_header.byte_order = kFloatPlanesByteOrder;
+    planes_header.num_planes = num_planes;
+    planes_header.num_rows = num_rows;
+    planes_header.num_columns = num_columns;
+    planes_header.plane_size = plane_size;
+    iov = {&planes_header, sizeof planes_header};
+  }
+  const size_t data_offset = iov.iov_len;
+  // The padding after each plane is left to ftruncate(), as zeros.
+  if (!WriteFully(output, &iov, 1) ||
+      (format == FloatFormat::kPlanes &&
+       ftruncate(output, data_offset + num_planes * plane_size) != 0)) {
+    close(output);
+    cout << "CreateFloatImage: could not write" << endl;
+    return false;
+  }
+  writer->file_ = output;
+  writer->format_ = format;
+  writer->num_planes_ = num_planes;
+  writer->num_rows_ = num_rows;
+  writer->num_columns_ = num_columns;
+  writer->data_offset_ = data_offset;
+  writer->plane_size_ = plane_size;
+  writer->rows_written_ = 0;
+  return true;
+}
+
+bool FloatImageWriter::WriteRows(const float *const *planes, size_t num_rows,
+				 size_t stride) {
+  if (file_ < 0 || num_rows > num_rows_ - rows_written_) abort();
+  TRACE_SCOPE("encode");
+  TRACE_COUNT("bytes_encoded",
+	      num_planes_ * num_rows * num_columns_ * sizeof(float));
+  const size_t row_size = num_columns_ * sizeof(float);
+  vector<struct iovec> iov;
+  bool written = true;
+  if (format_ == FloatFormat::kPlanes) {
+    for (size_t p = 0; p < num_planes_ && written; ++p) {
+      iov.clear();
+      if (stride == num_columns_) {
+	iov.push_back({const_cast<float *>(planes[p]), num_rows * row_size});
+      } else {
+	for (size_t i = 0; i < num_rows; ++i)
+	  iov.push_back({const_cast<float *>(planes[p] + i * stride),
+			 row_size});
+      }
+      written = WriteFullyAt(file_, iov.data(), iov.size(),
+			     data_offset_ + p * plane_size_ +
+			     rows_written_ * row_size);
+    }
+  } else {
+    // The band's rows go in reverse order, right below those of the bands
+    // written before, which are higher up in the file.
+    interleaved_.resize(num_planes_ * num_rows * num_columns_);
+    for (size_t i = 0; i < num_rows; ++i) {
+      float *output_row =
+	&interleaved_[(num_rows - 1 - i) * num_planes_ * num_columns_];
+      for (size_t p = 0; p < num_planes_; ++p) {
+	const float *row = planes[p] + i * stride;
+	for (size_t j = 0; j < num_columns_; ++j)
+	  output_row[j * num_planes_ + p] = row[j];
       }
     }
+    iov.push_back({interleaved_.data(),
+		   interleaved_.size() * sizeof(float)});
+    written = WriteFullyAt(file_, iov.data(), 1,
+			   data_offset_ + (num_rows_ - rows_written_ -
+					   num_rows) * num_planes_ *
+			   row_size);
   }
+  if (!written) {
+    cout << "FloatImageWriter: could not write" << endl;
+    return false;
+  }
+  rows_written_ += num_rows;
+  return true;
+}
 
-  fclose(output);
-  return true; 
+bool FloatImageWriter::Close() {
+  if (file_ < 0) return true;
+  const bool complete = rows_written_ == num_rows_;
+  close(file_);
+  file_ = -1;
+  num_planes_ = 0;
+  num_rows_ = 0;
+  num_columns_ = 0;
+  rows_written_ = 0;
+  interleaved_ = vector<float>();
+  return complete;
 }
 
+bool WriteFloatImage(const string &filename, FloatFormat format,
+		     const ImageView<float> *planes, size_t num_planes) {
+  if (planes == nullptr || num_planes == 0) abort();
+  vector<const float *> rows(num_planes);
+  for (size_t p = 0; p < num_planes; ++p) {
+    if (planes[p].num_rows() != planes[0].num_rows() ||
+	planes[p].num_columns() != planes[0].num_columns() ||
+	planes[p].stride() != planes[0].stride()) {
+      cout << "WriteFloatImage: planes differ in size" << endl;
+      return false;
+    }
+    rows[p] = planes[p].data();
+  }
+  FloatImageWriter writer;
+  return CreateFloatImage(filename, format, num_planes, planes[0].num_rows(),
+			  planes[0].num_columns(), &writer) &&
+    writer.WriteRows(rows.data(), planes[0].num_rows(), planes[0].stride()) &&
+    writer.Close();
+}
+
+void MappedFloatPlanes::Close() {
+  if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  planes_.clear();
+}
+
+bool MapFloatPlanes(const string &filename,
+		    MappedFloatPlanes *mapped_planes) {
+  if (mapped_planes == nullptr) abort();
+  mapped_planes->Close();
+  void *mapping;
+  size_t mapping_size;
+  if (!MapFile(filename, &mapping, &mapping_size, "MapFloatPlanes"))
+    return false;
+
+  const char *data = static_cast<const char *>(mapping);
+  const FloatPlanesHeader *header =
+    reinterpret_cast<const FloatPlanesHeader *>(data);
+  if (mapping_size < sizeof *header ||
+      memcmp(header->magic, kFloatPlanesMagic, sizeof kFloatPlanesMagic) != 0 ||
+      header->byte_order != kFloatPlanesByteOrder ||
+      header->num_planes == 0 ||
+      header->plane_size <
+      uint64_t{header->num_rows} * header->num_columns * sizeof(float)) {
+    munmap(mapping, mapping_size);
+    cout << "MapFloatPlanes: Expected float planes file" << endl;
+    return false;
+  }
+  if ((mapping_size - sizeof *header) / header->num_planes <
+      header->plane_size) {
+    munmap(mapping, mapping_size);
+    cout << "MapFloatPlanes: short file" << endl;
+    return false;
+  }
+
+  mapped_planes->mapping_ = mapping;
+  mapped_planes->mapping_size_ = mapping_size;
+  for (size_t p = 0; p < header->num_planes; ++p)
+    mapped_planes->planes_.push_back(ImageView<float>(
+	reinterpret_cast<const float *>(data + sizeof *header +
+					p * header->plane_size),
+	header->num_rows, header->num_columns, header->num_columns, 0));
+  return true;
+}
+
+namespace {
+
 // Implements the Bresenham's incremental midpoint algorithm;
 // (adapted from J.D.Foley, A. van Dam, S.K.Feiner, J.F.Hughes
 // "Computer Graphics. Principles and practice", 
 // 2nd ed., 1990, section 3.2.2);  
-void DrawLine(int x0, int y0, int x1, int y1, int color,
-	      Image *an_image) {  
-  if (an_image == nullptr) abort();
+// The line must lie inside the image: pixels are written through the
+// row pointers, with no checks.
+void DrawClippedLine(int x0, int y0, int x1, int y1, uint8_t color,
+		     uint8_t *pixels, size_t stride) {
 
 #ifdef SWAP
 #undef SWAP
@@ -145,12 +785,10 @@ void DrawLine(int x0, int y0, int x1, int y1, int color,
   const int DIR_X = 0;
   const int DIR_Y = 1;
   
-  // Increments: East, North-East, South, South-East, North.
+  // Increments: East, North-East, South-East.
   int incrE,
     incrNE,
-    incrS,
-    incrSE,
-    incrN;     
+    incrSE;
   int d;         /* the D */
   int x,y;       /* running coordinates */
   int mpCase;    /* midpoint algorithm's case */
@@ -213,7 +851,7 @@ void DrawLine(int x0, int y0, int x1, int y1, int color,
   done = 0;
 
   while (!done) {
-    an_image->SetPixel(x,y,color);
+    pixels[x * stride + y] = color;
   
     // Move to the next point.
     switch(dir) {
@@ -281,6 +919,63 @@ void DrawLine(int x0, int y0, int x1, int y1, int color,
   }
 }
 
+}  // namespace
+
+bool ClipLine(size_t num_rows, size_t num_columns, LineSegment *segment) {
+  if (segment == nullptr) abort();
+  if (num_rows == 0 || num_columns == 0) return false;
+  // Points x0 + t dx, y0 + t dy for t in [t0, t1] are inside.
+  const double dx = segment->x1 - segment->x0;
+  const double dy = segment->y1 - segment->y0;
+  const double p[4] = {-dx, dx, -dy, dy};
+  const double q[4] = {static_cast<double>(segment->x0),
+		       num_rows - 1.0 - segment->x0,
+		       static_cast<double>(segment->y0),
+		       num_columns - 1.0 - segment->y0};
+  double t0 = 0.0, t1 = 1.0;
+  for (int k = 0; k < 4; ++k) {
+    if (p[k] == 0.0) {
+      if (q[k] < 0.0) return false;  // Parallel to the edge and outside.
+      continue;
+    }
+    const double t = q[k] / p[k];
+    if (p[k] < 0.0) t0 = max(t0, t);  // Entering.
+    else t1 = min(t1, t);             // Leaving.
+  }
+  if (t0 > t1) return false;
+
+  const int x0 = segment->x0, y0 = segment->y0;
+  if (t0 > 0.0) {
+    segment->x0 = lround(x0 + t0 * dx);
+    segment->y0 = lround(y0 + t0 * dy);
+  }
+  if (t1 < 1.0) {
+    segment->x1 = lround(x0 + t1 * dx);
+    segment->y1 = lround(y0 + t1 * dy);
+  }
+  return true;
+}
+
+void DrawLine(int x0, int y0, int x1, int y1, int color,
+	      Image *an_image) {
+  const LineSegment segment = {x0, y0, x1, y1};
+  DrawLines(&segment, 1, color, an_image);
+}
+
+void DrawLines(const LineSegment *segments, size_t count, int color,
+	       Image *an_image) {
+  if (an_image == nullptr) abort();
+  uint8_t *pixels = an_image->data();
+  const size_t stride = an_image->stride();
+  for (size_t k = 0; k < count; ++k) {
+    LineSegment segment = segments[k];
+    if (!ClipLine(an_image->num_rows(), an_image->num_columns(), &segment))
+      continue;
+    DrawClippedLine(segment.x0, segment.y0, segment.x1, segment.y1, color,
+		    pixels, stride);
+  }
+}
+
 }  // namespace ComputerVisionProjects
 
 
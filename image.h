@@ -7,11 +7,51 @@
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <new>
 #include <string>
 
 namespace ComputerVisionProjects {
-// Class for representing a gray-scale image.
+// Read-only window onto pixels owned by someone else: a BasicImage
+// (see BasicImage::View()) or a memory-mapped file (see MappedImage).
+// Views are cheap to copy and never free the pixels.
+template <typename PixelType>
+class ImageView {
+ public:
+  ImageView(): data_{nullptr}, num_rows_{0}, num_columns_{0}, stride_{0},
+	       num_gray_levels_{0} { }
+  ImageView(const PixelType *data, size_t num_rows, size_t num_columns,
+	    size_t stride, size_t num_gray_levels)
+      : data_{data}, num_rows_{num_rows}, num_columns_{num_columns},
+	stride_{stride}, num_gray_levels_{num_gray_levels} { }
+
+  size_t num_rows() const { return num_rows_; }
+  size_t num_columns() const { return num_columns_; }
+  size_t stride() const { return stride_; }
+  size_t num_gray_levels() const { return num_gray_levels_; }
+
+  PixelType GetPixel(size_t i, size_t j) const {
+    if (i >= num_rows_ || j >= num_columns_) abort();
+    return data_[i * stride_ + j];
+  }
+
+  const PixelType *Row(size_t i) const { return data_ + i * stride_; }
+  const PixelType *data() const { return data_; }
+
+ private:
+  const PixelType *data_;
+  size_t num_rows_;
+  size_t num_columns_;
+  size_t stride_;
+  size_t num_gray_levels_;
+};
+
+// Class for representing a gray-scale image whose pixels are of type
+// PixelType (uint8_t, uint16_t or float).
+// Pixels live in a single buffer; each row starts on a kRowAlignment-byte
+// boundary, so consecutive rows are stride() pixels apart.
 // Sample usage:
 //   Image one_image;
 //   one_image.AllocateSpaceAndSetSize(100, 200);
@@ -21,26 +61,41 @@ namespace ComputerVisionProjects {
 //     for (int j = 0; j < 200; ++j)
 //       one_image.SetPixel(i, j, 150);
 //   WriteImage("output_file.pgm", an_image);
-//   // See image_demo.cc for read/write image.
-class Image {
+//   // Kernels should walk the rows directly instead:
+//   for (size_t i = 0; i < one_image.num_rows(); ++i) {
+//     uint8_t *row = one_image.Row(i);
+//     for (size_t j = 0; j < one_image.num_columns(); ++j) row[j] = 150;
+//   }
+template <typename PixelType>
+class BasicImage {
  public:  
-  // void h1(Image* image);   // Accepts an Image pointer
-  // void sobels(Image* image); // Accepts an Image pointer
+  // Smoothing and Sobel gradients are in filter.h (GaussianSobel()).
 
-  Image(): num_rows_{0}, num_columns_{0}, 
-	   num_gray_levels_{0}, pixels_{nullptr} { }
+  typedef PixelType pixel_type;
+
+  // Alignment in bytes of the buffer and of the start of every row.
+  static const size_t kRowAlignment = 64;
+
+  BasicImage(): num_rows_{0}, num_columns_{0}, stride_{0},
+		num_gray_levels_{0}, pixels_{nullptr} { }
   
-  Image(const Image &an_image);
-  Image& operator=(const Image &an_image) = delete;
+  BasicImage(const BasicImage &an_image);
+  BasicImage(BasicImage &&an_image) noexcept;
+  BasicImage& operator=(const BasicImage &an_image);
+  BasicImage& operator=(BasicImage &&an_image) noexcept;
 
-  ~Image();
+  ~BasicImage() { DeallocateSpace(); }
 
   // Sets the size of the image to the given
   // height (num_rows) and columns (num_columns).
+  // The buffer is reused when the shape does not change; pixel values
+  // are left uninitialized either way.
   void AllocateSpaceAndSetSize(size_t num_rows, size_t num_columns);
 
   size_t num_rows() const { return num_rows_; }
   size_t num_columns() const { return num_columns_; }
+  // Distance, in pixels, between the starts of two consecutive rows.
+  size_t stride() const { return stride_; }
   size_t num_gray_levels() const { return num_gray_levels_; }
   void SetNumberGrayLevels(size_t gray_levels) {
     num_gray_levels_ = gray_levels;
@@ -48,41 +103,436 @@ class Image {
  
   // Sets the pixel in the image at row i and column j
   // to a particular gray_level.
-  void SetPixel(size_t i, size_t j, int gray_level) {
+  void SetPixel(size_t i, size_t j, PixelType gray_level) {
     if (i >= num_rows_ || j >= num_columns_) abort();
-    pixels_[i][j] = gray_level;
+    pixels_[i * stride_ + j] = gray_level;
   }
 
-  int GetPixel(size_t i, size_t j) const {
+  PixelType GetPixel(size_t i, size_t j) const {
     if (i >= num_rows_ || j >= num_columns_) abort();
-    return pixels_[i][j];
+    return pixels_[i * stride_ + j];
+  }
+
+  // Unchecked access to the first pixel of row i.
+  PixelType *Row(size_t i) { return pixels_ + i * stride_; }
+  const PixelType *Row(size_t i) const { return pixels_ + i * stride_; }
+
+  // The whole buffer: num_rows() * stride() pixels.
+  PixelType *data() { return pixels_; }
+  const PixelType *data() const { return pixels_; }
+
+  ImageView<PixelType> View() const {
+    return ImageView<PixelType>(pixels_, num_rows_, num_columns_, stride_,
+				num_gray_levels_);
   }
 
  private:
   void DeallocateSpace();
 
+  // Number of pixels that make up kRowAlignment bytes' worth of rows.
+  static size_t AlignedStride(size_t num_columns);
+
   size_t num_rows_; 
   size_t num_columns_; 
+  size_t stride_;
   size_t num_gray_levels_;  
-  int **pixels_;
+  PixelType *pixels_;
+};
+
+// 8-bit images: what every pgm in this project currently holds.
+typedef BasicImage<uint8_t> Image;
+// 16-bit images, for pgm files with more than 255 gray levels.
+typedef BasicImage<uint16_t> Image16;
+// Floating point images, for intermediate results.
+typedef BasicImage<float> ImageFloat;
+
+template <typename PixelType>
+BasicImage<PixelType>::BasicImage(const BasicImage &an_image)
+    : BasicImage() {
+  *this = an_image;
+}
+
+template <typename PixelType>
+BasicImage<PixelType>::BasicImage(BasicImage &&an_image) noexcept
+    : num_rows_{an_image.num_rows_}, num_columns_{an_image.num_columns_},
+      stride_{an_image.stride_}, num_gray_levels_{an_image.num_gray_levels_},
+      pixels_{an_image.pixels_} {
+  an_image.pixels_ = nullptr;
+  an_image.num_rows_ = 0;
+  an_image.num_columns_ = 0;
+  an_image.stride_ = 0;
+}
+
+template <typename PixelType>
+BasicImage<PixelType>&
+BasicImage<PixelType>::operator=(const BasicImage &an_image) {
+  if (this == &an_image) return *this;
+  AllocateSpaceAndSetSize(an_image.num_rows(), an_image.num_columns());
+  SetNumberGrayLevels(an_image.num_gray_levels());
+  // Both buffers share the same stride, so the copy is a single memcpy.
+  if (pixels_ != nullptr)
+    memcpy(pixels_, an_image.pixels_,
+	   num_rows_ * stride_ * sizeof(PixelType));
+  return *this;
+}
+
+template <typename PixelType>
+BasicImage<PixelType>&
+BasicImage<PixelType>::operator=(BasicImage &&an_image) noexcept {
+  if (this == &an_image) return *this;
+  DeallocateSpace();
+  num_rows_ = an_image.num_rows_;
+  num_columns_ = an_image.num_columns_;
+  stride_ = an_image.stride_;
+  num_gray_levels_ = an_image.num_gray_levels_;
+  pixels_ = an_image.pixels_;
+  an_image.pixels_ = nullptr;
+  an_image.num_rows_ = 0;
+  an_image.num_columns_ = 0;
+  an_image.stride_ = 0;
+  return *this;
+}
+
+template <typename PixelType>
+size_t BasicImage<PixelType>::AlignedStride(size_t num_columns) {
+  const size_t per_line = kRowAlignment / sizeof(PixelType);
+  return (num_columns + per_line - 1) / per_line * per_line;
+}
+
+template <typename PixelType>
+void BasicImage<PixelType>::AllocateSpaceAndSetSize(size_t num_rows,
+						    size_t num_columns) {
+  const size_t stride = AlignedStride(num_columns);
+  if (pixels_ != nullptr && num_rows == num_rows_ && stride == stride_) {
+    num_columns_ = num_columns;
+    return;
+  }
+  DeallocateSpace();
+  if (num_rows == 0 || num_columns == 0) return;
+
+  void *buffer = nullptr;
+  if (posix_memalign(&buffer, kRowAlignment,
+		     num_rows * stride * sizeof(PixelType)) != 0)
+    throw std::bad_alloc();
+  pixels_ = static_cast<PixelType *>(buffer);
+
+  num_rows_ = num_rows;
+  num_columns_ = num_columns;
+  stride_ = stride;
+}
+
+template <typename PixelType>
+void BasicImage<PixelType>::DeallocateSpace() {
+  free(pixels_);
+  pixels_ = nullptr;
+  num_rows_ = 0;
+  num_columns_ = 0;
+  stride_ = 0;
+}
+
+// Layout of a pgm file, as found by ParsePgmHeader().
+struct PgmHeader {
+  bool binary;              // P5 (raw) rather than P2 (plain text).
+  size_t num_rows;
+  size_t num_columns;
+  size_t num_gray_levels;   // Maxval; above 255 samples take two bytes.
+  size_t data_offset;       // Offset of the first sample.
+};
+
+// Parses the header at the start of the size bytes in data. Comments may
+// appear wherever the format allows whitespace.
+// Returns true if  everyhing is OK, false otherwise.
+bool ParsePgmHeader(const char *data, size_t size, PgmHeader *header);
+
+// An 8-bit P5 pgm file mapped read-only into memory. view() exposes the
+// pixels in place, without copying them; it stays valid until the
+// MappedImage is closed or destroyed.
+class MappedImage {
+ public:
+  MappedImage(): mapping_{nullptr}, mapping_size_{0} { }
+  MappedImage(const MappedImage &) = delete;
+  MappedImage& operator=(const MappedImage &) = delete;
+  MappedImage(MappedImage &&a_mapping) noexcept;
+  MappedImage& operator=(MappedImage &&a_mapping) noexcept;
+  ~MappedImage() { Close(); }
+
+  const ImageView<uint8_t> &view() const { return view_; }
+  void Close();
+
+ private:
+  friend bool MapImage(const std::string &, MappedImage *);
+
+  void *mapping_;
+  size_t mapping_size_;
+  ImageView<uint8_t> view_;
+};
+
+// Maps pgm file input_filename into mapped_image.
+// Returns true if  everyhing is OK, false otherwise (including for files
+// that are not 8-bit P5, whose samples cannot be used in place).
+bool MapImage(const std::string &input_filename, MappedImage *mapped_image);
+
+// A pgm file, P5 or P2, kept open (memory-mapped) so that bands of rows
+// can be decoded on demand, by several threads at once if need be.
+class ImageReader {
+ public:
+  ImageReader(): mapping_{nullptr}, mapping_size_{0}, owns_mapping_{false},
+		 header_() { }
+  ImageReader(const ImageReader &) = delete;
+  ImageReader& operator=(const ImageReader &) = delete;
+  ImageReader(ImageReader &&a_reader) noexcept;
+  ImageReader& operator=(ImageReader &&a_reader) noexcept;
+  ~ImageReader() { Close(); }
+
+  const PgmHeader &header() const { return header_; }
+  size_t num_rows() const { return header_.num_rows; }
+  size_t num_columns() const { return header_.num_columns; }
+  size_t num_gray_levels() const { return header_.num_gray_levels; }
+
+  // Decodes rows [first_row, first_row + num_rows) into output, whose
+  // rows are stride pixels apart. 16-bit files need a 16-bit or float
+  // PixelType.
+  template <typename PixelType>
+  void ReadRows(size_t first_row, size_t num_rows, PixelType *output,
+		size_t stride) const;
+
+  // Decodes the num_columns pixels of row row from column first_column
+  // on into output.
+  template <typename PixelType>
+  void ReadRowSpan(size_t row, size_t first_column, size_t num_columns,
+		   PixelType *output) const;
+
+  // Tells the kernel that rows [first_row, first_row + num_rows) will
+  // not be read again, so their pages need not stay resident. Does
+  // nothing for images opened in memory.
+  void ReleaseRows(size_t first_row, size_t num_rows) const;
+
+  void Close();
+
+ private:
+  friend bool OpenImage(const std::string &, ImageReader *);
+  friend bool OpenImageInMemory(const void *, size_t, ImageReader *);
+
+  // Opens the size bytes of pgm file at data, a mapping to be unmapped
+  // on Close() if owned; caller names the opener in error messages.
+  bool Open(char *data, size_t size, bool owned, const char *caller);
+
+  // Decodes count samples, from sample first_sample in row-major order.
+  template <typename PixelType>
+  void DecodeSamples(size_t first_sample, size_t count,
+		     PixelType *output) const;
+
+  void *mapping_;
+  size_t mapping_size_;
+  bool owns_mapping_;  // False for images opened in memory.
+  PgmHeader header_;
+  // P2 samples have no fixed offsets, so they are decoded up front.
+  std::vector<uint16_t> plain_samples_;
 };
 
+// Opens pgm file input_filename for reading with reader.
+// Returns true if  everyhing is OK, false otherwise.
+bool OpenImage(const std::string &input_filename, ImageReader *reader);
+
+// Opens the pgm file held in the size bytes at data, e.g. a frame read
+// from a pipe, for reading with reader. The samples are decoded from
+// data in place: it must stay valid and unchanged while reader is open.
+// Returns true if  everyhing is OK, false otherwise.
+bool OpenImageInMemory(const void *data, size_t size, ImageReader *reader);
+
+// Reads just the header of pgm file input_filename, e.g. to choose the
+// pixel type before calling ReadImage().
+// Returns true if  everyhing is OK, false otherwise.
+bool ReadImageHeader(const std::string &input_filename, PgmHeader *header);
+
 // Reads a pgm image from file input_filename.
 // an_image is the resulting image.
+// Both P5 and P2 files are accepted, with up to 65535 gray levels;
+// 16-bit files need an Image16 or ImageFloat.
 // Returns true if  everyhing is OK, false otherwise.
-bool ReadImage(const std::string &input_filename, Image *an_image);
+template <typename PixelType>
+bool ReadImage(const std::string &input_filename,
+	       BasicImage<PixelType> *an_image);
 
-// Writes image an_iamge into the pgm file output_filename.
+// Writes image an_iamge into the pgm file output_filename,
+// header and pixels with a single writev().
 // Returns true if  everyhing is OK, false otherwise.
 bool WriteImage(const std::string &output_filename, const Image &an_image);
+bool WriteImage(const std::string &output_filename,
+		const ImageView<uint8_t> &an_image);
+// Writes an_image to the open file descriptor output, e.g. a pipe, as
+// one pgm file.
+// Returns true if  everyhing is OK, false otherwise.
+bool WriteImage(int output, const ImageView<uint8_t> &an_image);
+// Encodes an_image as a P5 pgm file into bytes, e.g. to open a processed
+// image with OpenImageInMemory(): one byte per sample up to 255 gray
+// levels, two (most significant first) above.
+template <typename PixelType>
+void EncodeImage(const ImageView<PixelType> &an_image,
+		 std::vector<char> *bytes);
+
+// An 8-bit P5 pgm file being written a band of rows at a time, so that
+// the whole image never has to be in memory.
+class ImageWriter {
+ public:
+  ImageWriter(): file_{-1}, num_columns_{0}, rows_left_{0} { }
+  ImageWriter(const ImageWriter &) = delete;
+  ImageWriter& operator=(const ImageWriter &) = delete;
+  ~ImageWriter() { Close(); }
+
+  // Appends num_rows rows, stride pixels apart, with a single writev().
+  // Returns true if  everyhing is OK, false otherwise.
+  bool WriteRows(const uint8_t *rows, size_t num_rows, size_t stride);
+
+  // Returns false if the file is missing rows.
+  bool Close();
+
+ private:
+  friend bool CreateImage(const std::string &, size_t, size_t, size_t,
+			  ImageWriter *);
+
+  int file_;
+  size_t num_columns_;
+  size_t rows_left_;
+};
+
+// Creates pgm file output_filename and writes its header; the rows are
+// to follow through writer.
+// Returns true if  everyhing is OK, false otherwise.
+bool CreateImage(const std::string &output_filename, size_t num_rows,
+		 size_t num_columns, size_t num_gray_levels,
+		 ImageWriter *writer);
+
+// File formats for floating point images of one or more planes.
+enum class FloatFormat {
+  // Portable float map: 1 (Pf) or 3 (PF) interleaved planes, rows from
+  // the bottom of the image up, readable by most image tools.
+  kPfm,
+  // A FloatPlanesHeader, then every plane whole, rows from the top down:
+  // meant to be mapped and used in place (see MapFloatPlanes()).
+  kPlanes,
+};
+
+// The 64 bytes at the start of a FloatFormat::kPlanes file. Plane p
+// starts at byte sizeof(FloatPlanesHeader) + p * plane_size, and holds
+// num_rows rows of num_columns floats in host byte order; plane_size is
+// rounded up to 64 bytes so that every plane is as aligned as an Image
+// row once the file is mapped.
+struct FloatPlanesHeader {
+  char magic[8];          // kFloatPlanesMagic.
+  uint32_t byte_order;    // kFloatPlanesByteOrder, as written by the host.
+  uint32_t num_planes;
+  uint32_t num_rows;
+  uint32_t num_columns;
+  uint64_t plane_size;    // In bytes, padding included.
+  char reserved[32];      // Zero.
+};
+static_assert(sizeof(FloatPlanesHeader) == 64,
+	      "FloatPlanesHeader must keep the planes aligned");
+
+const char kFloatPlanesMagic[8] = {'C', 'V', 'P', 'L', 'A', 'N', 'E', 'S'};
+const uint32_t kFloatPlanesByteOrder = 0x01020304;
+
+// A floating point image file being written a band of rows at a time.
+class FloatImageWriter {
+ public:
+  FloatImageWriter(): file_{-1}, format_{FloatFormat::kPlanes},
+		      num_planes_{0}, num_rows_{0}, num_columns_{0},
+		      data_offset_{0}, plane_size_{0}, rows_written_{0} { }
+  FloatImageWriter(const FloatImageWriter &) = delete;
+  FloatImageWriter& operator=(const FloatImageWriter &) = delete;
+  ~FloatImageWriter() { Close(); }
+
+  // Appends num_rows rows of every plane; rows of plane p start at
+  // planes[p] and are stride floats apart. Each plane of a kPlanes file
+  // goes out with a single pwritev(); the planes of a kPfm file are
+  // interleaved, then written with a single pwrite().
+  // Returns true if  everyhing is OK, false otherwise.
+  bool WriteRows(const float *const *planes, size_t num_rows,
+		 size_t stride);
+
+  // Returns false if the file is missing rows.
+  bool Close();
+
+ private:
+  friend bool CreateFloatImage(const std::string &, FloatFormat, size_t,
+			       size_t, size_t, FloatImageWriter *);
+
+  int file_;
+  FloatFormat format_;
+  size_t num_planes_;
+  size_t num_rows_;
+  size_t num_columns_;
+  size_t data_offset_;  // Bytes before the first sample.
+  size_t plane_size_;   // kPlanes only.
+  size_t rows_written_;
+  std::vector<float> interleaved_;  // kPfm only: the band being written.
+};
+
+// Creates floating point image file output_filename, of num_planes
+// planes (1 or 3 for kPfm) of num_rows x num_columns, and writes its
+// header; the rows are to follow through writer.
+// Returns true if  everyhing is OK, false otherwise.
+bool CreateFloatImage(const std::string &output_filename, FloatFormat format,
+		      size_t num_planes, size_t num_rows, size_t num_columns,
+		      FloatImageWriter *writer);
+
+// Writes the num_planes planes (all of the same size) into the floating
+// point image file output_filename.
+// Returns true if  everyhing is OK, false otherwise.
+bool WriteFloatImage(const std::string &output_filename, FloatFormat format,
+		     const ImageView<float> *planes, size_t num_planes);
+
+// A FloatFormat::kPlanes file mapped read-only into memory. plane(p)
+// exposes plane p in place, without copying or parsing it; it stays
+// valid until the MappedFloatPlanes is closed or destroyed.
+class MappedFloatPlanes {
+ public:
+  MappedFloatPlanes(): mapping_{nullptr}, mapping_size_{0} { }
+  MappedFloatPlanes(const MappedFloatPlanes &) = delete;
+  MappedFloatPlanes& operator=(const MappedFloatPlanes &) = delete;
+  ~MappedFloatPlanes() { Close(); }
+
+  size_t num_planes() const { return planes_.size(); }
+  const ImageView<float> &plane(size_t p) const { return planes_[p]; }
+  void Close();
+
+ private:
+  friend bool MapFloatPlanes(const std::string &, MappedFloatPlanes *);
+
+  void *mapping_;
+  size_t mapping_size_;
+  std::vector<ImageView<float>> planes_;
+};
+
+// Maps kPlanes file input_filename into mapped_planes.
+// Returns true if  everyhing is OK, false otherwise (including for files
+// written on a host of the other byte order).
+bool MapFloatPlanes(const std::string &input_filename,
+		    MappedFloatPlanes *mapped_planes);
 
 //  Draws a line of given gray-level color from (x0,y0) to (x1,y1);
-//  an_image is the input/output image. 
-// IMPORTANT: (x0,y0) and (x1,y1) can lie outside the image 
-//   boundaries, so SetPixel() should check the coordinates passed to it.
+//  an_image is the input/output image. x is the row, y the column.
+// (x0,y0) and (x1,y1) can lie outside the image boundaries: the line is
+// clipped once, then drawn without checking every pixel.
 void DrawLine(int x0, int y0, int x1, int y1, int color,
 	      Image *an_image);
 
+// A line from (x0,y0) to (x1,y1), in the coordinates of DrawLine().
+struct LineSegment {
+  int x0, y0;
+  int x1, y1;
+};
+
+// Clips segment to the num_rows x num_columns image (Liang-Barsky),
+// rounding the new end points to the nearest pixels.
+// Returns false if no part of the segment is inside the image.
+bool ClipLine(size_t num_rows, size_t num_columns, LineSegment *segment);
+
+// Draws count segments, as DrawLine() would, in one pass over the list.
+void DrawLines(const LineSegment *segments, size_t count, int color,
+	       Image *an_image);
+
 }  // namespace ComputerVisionProjects
 
 #endif  // COMPUTER_VISION_IMAGE_H_
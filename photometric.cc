@@ -0,0 +1,1123 @@
+// Photometric stereo: recovers surface normals and albedo from images of
+// an object lit from known directions.
+// To be used in Computer Vision class.
+
+#include "photometric.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+bool ComputeLightMatrix(const vector<vector<double>> &directions,
+			LightMatrix *light_matrix) {
+  if (light_matrix == nullptr) abort();
+  const size_t num_lights = directions.size();
+  if (num_lights < 3) return false;
+  for (size_t k = 0; k < num_lights; ++k)
+    if (directions[k].size() != 3) return false;
+
+  // m = S^T S, symmetric 3 x 3.
+  double m[3][3] = {{0}};
+  for (size_t k = 0; k < num_lights; ++k)
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+	m[r][c] += directions[k][r] * directions[k][c];
+
+  // Inverse through the adjugate.
+  double inverse[3][3];
+  inverse[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  inverse[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+  inverse[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+  inverse[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  inverse[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+  inverse[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+  inverse[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  inverse[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+  inverse[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+  const double determinant = m[0][0] * inverse[0][0] +
+    m[0][1] * inverse[1][0] + m[0][2] * inverse[2][0];
+  // Relative to the scale of the lights, so bright lights are not
+  // mistaken for a well-conditioned set.
+  const double scale = m[0][0] + m[1][1] + m[2][2];
+  if (!(fabs(determinant) > 1e-12 * scale * scale * scale)) return false;
+
+  light_matrix->num_lights = num_lights;
+  light_matrix->robust = false;
+  light_matrix->subsets.reset();
+  light_matrix->pseudo_inverse.assign(3 * num_lights, 0.0f);
+  for (int r = 0; r < 3; ++r) {
+    for (size_t k = 0; k < num_lights; ++k) {
+      double value = 0.0;
+      for (int c = 0; c < 3; ++c) value += inverse[r][c] * directions[k][c];
+      light_matrix->pseudo_inverse[r * num_lights + k] = value / determinant;
+    }
+  }
+  return true;
+}
+
+SubsetInverses::SubsetInverses(const vector<vector<double>> &directions)
+  : directions_{directions},
+    entries_{new atomic<const float *>[size_t{1} << directions.size()]} {
+  if (directions.size() > kMaxLights) abort();
+  for (size_t subset = 0; subset < (size_t{1} << directions.size()); ++subset)
+    entries_[subset].store(nullptr, memory_order_relaxed);
+}
+
+const float *SubsetInverses::Compute(uint32_t subset) {
+  lock_guard<mutex> hold(lock_);
+  return ComputeLocked(subset);
+}
+
+const float *SubsetInverses::ComputeLocked(uint32_t subset) {
+  const float *inverse = entries_[subset].load(memory_order_acquire);
+  if (inverse != nullptr) return inverse;  // Another thread was first.
+
+  const size_t num_lights = directions_.size();
+  const uint32_t every_light = (uint32_t{1} << num_lights) - 1;
+  vector<vector<double>> chosen;
+  for (size_t k = 0; k < num_lights; ++k)
+    if (subset & (uint32_t{1} << k)) chosen.push_back(directions_[k]);
+  LightMatrix light_matrix;
+  if (!ComputeLightMatrix(chosen, &light_matrix)) {
+    // The full set was checked before robust mode was enabled.
+    if (subset == every_light) abort();
+    // Too few lights left: fall back on all of them.
+    inverse = ComputeLocked(every_light);
+  } else {
+    // Spread the chosen columns back over all the lights.
+    storage_.emplace_back(3 * num_lights, 0.0f);
+    vector<float> &spread = storage_.back();
+    size_t column = 0;
+    for (size_t k = 0; k < num_lights; ++k) {
+      if (!(subset & (uint32_t{1} << k))) continue;
+      for (int r = 0; r < 3; ++r)
+	spread[r * num_lights + k] =
+	  light_matrix.pseudo_inverse[r * chosen.size() + column];
+      ++column;
+    }
+    inverse = spread.data();
+  }
+  entries_[subset].store(inverse, memory_order_release);
+  return inverse;
+}
+
+bool EnableRobustSolve(const vector<vector<double>> &directions,
+		       float band_low, float band_high,
+		       LightMatrix *light_matrix) {
+  if (light_matrix == nullptr) abort();
+  if (directions.size() > SubsetInverses::kMaxLights ||
+      directions.size() != light_matrix->num_lights)
+    return false;
+  LightMatrix every_light;
+  if (!ComputeLightMatrix(directions, &every_light)) return false;
+  light_matrix->robust = true;
+  light_matrix->band_low = band_low;
+  light_matrix->band_high = band_high;
+  light_matrix->subsets = make_shared<SubsetInverses>(directions);
+  return true;
+}
+
+namespace {
+
+// Solves pixels [first, last) with the 3 x num_lights pseudo_inverse.
+// With NumLights > 0 the loops over the lights are unrolled at compile
+// time and any_num_lights is ignored; 0 stands for any number of lights.
+template <int NumLights>
+void SolveWithInverse(const float *pseudo_inverse, size_t any_num_lights,
+		      const float *const *intensities, size_t first,
+		      size_t last, float *normal_x, float *normal_y,
+		      float *normal_z, float *albedo) {
+  const size_t num_lights = NumLights > 0 ? NumLights : any_num_lights;
+  const float *row_x = pseudo_inverse;
+  const float *row_y = row_x + num_lights;
+  const float *row_z = row_y + num_lights;
+
+  size_t p = first;
+#if defined(__AVX__)
+  for (; p + 8 <= last; p += 8) {
+    __m256 gx = _mm256_setzero_ps();
+    __m256 gy = _mm256_setzero_ps();
+    __m256 gz = _mm256_setzero_ps();
+    for (size_t k = 0; k < num_lights; ++k) {
+      const __m256 value = _mm256_loadu_ps(intensities[k] + p);
+      gx = _mm256_add_ps(gx, _mm256_mul_ps(_mm256_set1_ps(row_x[k]), value));
+      gy = _mm256_add_ps(gy, _mm256_mul_ps(_mm256_set1_ps(row_y[k]), value));
+      gz = _mm256_add_ps(gz, _mm256_mul_ps(_mm256_set1_ps(row_z[k]), value));
+    }
+    const __m256 length = _mm256_sqrt_ps(_mm256_add_ps(
+	_mm256_add_ps(_mm256_mul_ps(gx, gx), _mm256_mul_ps(gy, gy)),
+	_mm256_mul_ps(gz, gz)));
+    // 1 / length, or 0 where length is 0.
+    const __m256 inverse = _mm256_and_ps(
+	_mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ),
+	_mm256_div_ps(_mm256_set1_ps(1.0f), length));
+    _mm256_storeu_ps(normal_x + p, _mm256_mul_ps(gx, inverse));
+    _mm256_storeu_ps(normal_y + p, _mm256_mul_ps(gy, inverse));
+    _mm256_storeu_ps(normal_z + p, _mm256_mul_ps(gz, inverse));
+    _mm256_storeu_ps(albedo + p, length);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; p + 4 <= last; p += 4) {
+    __m128 gx = _mm_setzero_ps();
+    __m128 gy = _mm_setzero_ps();
+    __m128 gz = _mm_setzero_ps();
+    for (size_t k = 0; k < num_lights; ++k) {
+      const __m128 value = _mm_loadu_ps(intensities[k] + p);
+      gx = _mm_add_ps(gx, _mm_mul_ps(_mm_set1_ps(row_x[k]), value));
+      gy = _mm_add_ps(gy, _mm_mul_ps(_mm_set1_ps(row_y[k]), value));
+      gz = _mm_add_ps(gz, _mm_mul_ps(_mm_set1_ps(row_z[k]), value));
+    }
+    const __m128 length = _mm_sqrt_ps(_mm_add_ps(
+	_mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gy, gy)),
+	_mm_mul_ps(gz, gz)));
+    // 1 / length, or 0 where length is 0.
+    const __m128 inverse = _mm_and_ps(
+	_mm_cmpgt_ps(length, _mm_setzero_ps()),
+	_mm_div_ps(_mm_set1_ps(1.0f), length));
+    _mm_storeu_ps(normal_x + p, _mm_mul_ps(gx, inverse));
+    _mm_storeu_ps(normal_y + p, _mm_mul_ps(gy, inverse));
+    _mm_storeu_ps(normal_z + p, _mm_mul_ps(gz, inverse));
+    _mm_storeu_ps(albedo + p, length);
+  }
+#endif
+  for (; p < last; ++p) {
+    float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+    for (size_t k = 0; k < num_lights; ++k) {
+      const float value = intensities[k][p];
+      gx += row_x[k] * value;
+      gy += row_y[k] * value;
+      gz += row_z[k] * value;
+    }
+    const float length = sqrt(gx * gx + gy * gy + gz * gz);
+    const float inverse = length > 0.0f ? 1.0f / length : 0.0f;
+    normal_x[p] = gx * inverse;
+    normal_y[p] = gy * inverse;
+    normal_z[p] = gz * inverse;
+    albedo[p] = length;
+  }
+}
+
+// Solves count pixels of a robust light matrix. Runs of pixels with every
+// sample inside the band go to SolveWithInverse() whole; the others are
+// solved one at a time with their subset's inverse. NumLights is as for
+// SolveWithInverse().
+template <int NumLights>
+void SolveNormalsRobust(const LightMatrix &light_matrix,
+			const float *const *intensities, size_t count,
+			float *normal_x, float *normal_y, float *normal_z,
+			float *albedo) {
+  const size_t num_lights = NumLights > 0 ? NumLights :
+    light_matrix.num_lights;
+  const uint32_t every_light = (uint32_t{1} << num_lights) - 1;
+  const float low = light_matrix.band_low;
+  const float high = light_matrix.band_high;
+  SubsetInverses &subsets = *light_matrix.subsets;
+  float values[SubsetInverses::kMaxLights];
+  size_t run_start = 0;  // First pixel of the current run in the band.
+  for (size_t p = 0; p < count; ++p) {
+    uint32_t subset = 0;
+    for (size_t k = 0; k < num_lights; ++k) {
+      values[k] = intensities[k][p];
+      subset |= static_cast<uint32_t>(values[k] >= low && values[k] <= high)
+	<< k;
+    }
+    if (subset == every_light) continue;
+    SolveWithInverse<NumLights>(light_matrix.pseudo_inverse.data(),
+				num_lights,
+		     intensities, run_start, p, normal_x, normal_y, normal_z,
+		     albedo);
+    run_start = p + 1;
+
+    const float *row_x = subsets.Get(subset);
+    const float *row_y = row_x + num_lights;
+    const float *row_z = row_y + num_lights;
+    float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+    for (size_t k = 0; k < num_lights; ++k) {
+      gx += row_x[k] * values[k];
+      gy += row_y[k] * values[k];
+      gz += row_z[k] * values[k];
+    }
+    const float length = sqrt(gx * gx + gy * gy + gz * gz);
+    const float inverse = length > 0.0f ? 1.0f / length : 0.0f;
+    normal_x[p] = gx * inverse;
+    normal_y[p] = gy * inverse;
+    normal_z[p] = gz * inverse;
+    albedo[p] = length;
+  }
+  SolveWithInverse<NumLights>(light_matrix.pseudo_inverse.data(),
+			      num_lights, intensities, run_start, count,
+			      normal_x, normal_y, normal_z, albedo);
+}
+
+// Solves count pixels with light_matrix, robustly or not, for NumLights
+// as in SolveWithInverse().
+template <int NumLights>
+void SolveNormalsFor(const LightMatrix &light_matrix,
+		     const float *const *intensities, size_t count,
+		     float *normal_x, float *normal_y, float *normal_z,
+		     float *albedo) {
+  if (light_matrix.robust) {
+    SolveNormalsRobust<NumLights>(light_matrix, intensities, count,
+				  normal_x, normal_y, normal_z, albedo);
+  } else {
+    SolveWithInverse<NumLights>(light_matrix.pseudo_inverse.data(),
+				light_matrix.num_lights, intensities, 0,
+				count, normal_x, normal_y, normal_z, albedo);
+  }
+}
+
+}  // namespace
+
+void SolveNormals(const LightMatrix &light_matrix,
+		  const float *const *intensities, size_t count,
+		  float *normal_x, float *normal_y, float *normal_z,
+		  float *albedo) {
+  // The common light counts get their own, unrolled, kernels.
+  switch (light_matrix.num_lights) {
+  case 3:
+    SolveNormalsFor<3>(light_matrix, intensities, count, normal_x, normal_y,
+		       normal_z, albedo);
+    return;
+  case 4:
+    SolveNormalsFor<4>(light_matrix, intensities, count, normal_x, normal_y,
+		       normal_z, albedo);
+    return;
+  case 6:
+    SolveNormalsFor<6>(light_matrix, intensities, count, normal_x, normal_y,
+		       normal_z, albedo);
+    return;
+  case 8:
+    SolveNormalsFor<8>(light_matrix, intensities, count, normal_x, normal_y,
+		       normal_z, albedo);
+    return;
+  default:
+    SolveNormalsFor<0>(light_matrix, intensities, count, normal_x, normal_y,
+		       normal_z, albedo);
+    return;
+  }
+}
+
+bool OpenObjectImages(const vector<string> &filenames,
+		      vector<ImageReader> *readers) {
+  if (readers == nullptr) abort();
+  readers->resize(filenames.size());
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    if (!OpenImage(filenames[i], &(*readers)[i])) return false;
+    if ((*readers)[i].num_rows() != (*readers)[0].num_rows() ||
+	(*readers)[i].num_columns() != (*readers)[0].num_columns()) {
+      cout << "OpenObjectImages: " << filenames[i]
+	   << " differs in size from " << filenames[0] << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+
+// Bytes of intensities and results to aim for per tile.
+const size_t kTileBytes = 256 * 1024;
+
+// Gathers rows [first_row, first_row + num_rows) of every image as
+// floating point intensity planes, one plane of num_rows rows per light.
+void GatherIntensities(const vector<ImageReader> &readers, size_t first_row,
+		       size_t num_rows, vector<float> *intensities) {
+  TRACE_SCOPE("gather");
+  const size_t num_columns = readers[0].num_columns();
+  TRACE_COUNT("pixels_gathered", readers.size() * num_rows * num_columns);
+  intensities->resize(readers.size() * num_rows * num_columns);
+  for (size_t d = 0; d < readers.size(); ++d)
+    readers[d].ReadRows(first_row, num_rows,
+			&(*intensities)[d * num_rows * num_columns],
+			num_columns);
+}
+
+// Gathers the foreground pixels of rows [first_row, first_row + num_rows)
+// of every image, in row-major order, as floating point intensity
+// planes, one plane per light. Returns the number of pixels per plane.
+size_t GatherSpans(const vector<ImageReader> &readers,
+		   const ForegroundMask &mask, size_t first_row,
+		   size_t num_rows, vector<float> *intensities) {
+  TRACE_SCOPE("gather");
+  const Span *first_span = mask.spans.data() + mask.row_starts[first_row];
+  const Span *last_span =
+    mask.spans.data() + mask.row_starts[first_row + num_rows];
+  size_t count = 0;
+  for (const Span *span = first_span; span != last_span; ++span)
+    count += span->end - span->begin;
+  TRACE_COUNT("pixels_gathered", readers.size() * count);
+  intensities->resize(readers.size() * count);
+
+  for (size_t d = 0; d < readers.size(); ++d) {
+    float *plane = &(*intensities)[d * count];
+    for (size_t i = first_row; i < first_row + num_rows; ++i) {
+      for (size_t s = mask.row_starts[i]; s < mask.row_starts[i + 1]; ++s) {
+	const Span &span = mask.spans[s];
+	readers[d].ReadRowSpan(i, span.begin, span.end - span.begin, plane);
+	plane += span.end - span.begin;
+      }
+    }
+  }
+  return count;
+}
+
+// Maps a normal component in [-1, 1] to a gray level.
+inline uint8_t QuantizeNormal(float component) {
+  return static_cast<uint8_t>((component + 1.0f) * 127.5f + 0.5f);
+}
+
+// The gray level of a zero normal component: that of background pixels.
+const uint8_t kZeroNormal = 128;
+
+// Where SolveRows() puts row r of its band: at r * stride from the start
+// of each output. Outputs that are nullptr are skipped, except albedo.
+struct SolvedRows {
+  uint8_t *normals;  // Quantized x component.
+  size_t normals_stride;
+  float *normal[3];  // Full precision x, y and z components.
+  size_t normal_stride;
+  float *albedo;
+  size_t albedo_stride;
+};
+
+// Points the outputs of solved to the rows of normals_image and albedo.
+SolvedRows QuantizedOutputs(Image *normals_image, ImageFloat *albedo) {
+  return {normals_image->data(), normals_image->stride(),
+	  {nullptr, nullptr, nullptr}, 0, albedo->data(), albedo->stride()};
+}
+
+// Points the outputs to the planes of normals and to albedo.
+SolvedRows FloatOutputs(ImageFloat normals[3], ImageFloat *albedo) {
+  return {nullptr, 0,
+	  {normals[0].data(), normals[1].data(), normals[2].data()},
+	  normals[0].stride(), albedo->data(), albedo->stride()};
+}
+
+// Clears columns [first_column, first_column + num_columns) of row y of
+// output to the background, then writes the solved pixels of spans
+// [first_span, last_span), whose columns are relative to first_column,
+// from pixel *next of solved and albedo on; *next ends past them.
+// Returns the largest albedo written.
+float ScatterSpans(const Span *first_span, const Span *last_span,
+		   size_t first_column, size_t num_columns,
+		   const float *const solved[3], const float *albedo,
+		   size_t *next, size_t y, const SolvedRows &output) {
+  uint8_t *normals_row = output.normals == nullptr ? nullptr :
+    output.normals + y * output.normals_stride + first_column;
+  float *normal_rows[3];
+  for (int c = 0; c < 3; ++c) {
+    normal_rows[c] = output.normal[c] == nullptr ? nullptr :
+      output.normal[c] + y * output.normal_stride + first_column;
+    if (normal_rows[c] != nullptr)
+      fill(normal_rows[c], normal_rows[c] + num_columns, 0.0f);
+  }
+  float *albedo_row = output.albedo + y * output.albedo_stride +
+    first_column;
+  if (normals_row != nullptr)
+    memset(normals_row, kZeroNormal, num_columns);
+  fill(albedo_row, albedo_row + num_columns, 0.0f);
+
+  float max_albedo = 0.0f;
+  size_t p = *next;
+  for (const Span *span = first_span; span != last_span; ++span) {
+    if (normals_row != nullptr)
+      for (size_t x = span->begin, q = p; x < span->end; ++x, ++q)
+	normals_row[x] = QuantizeNormal(solved[0][q]);
+    for (int c = 0; c < 3; ++c)
+      if (normal_rows[c] != nullptr)
+	copy(solved[c] + p, solved[c] + p + (span->end - span->begin),
+	     normal_rows[c] + span->begin);
+    for (size_t x = span->begin; x < span->end; ++x, ++p) {
+      albedo_row[x] = albedo[p];
+      max_albedo = max(max_albedo, albedo[p]);
+    }
+  }
+  *next = p;
+  return max_albedo;
+}
+
+// Solves rows [first_row, first_row + num_rows) tile by tile on pool,
+// only the foreground of mask if it is not nullptr, into output.
+// Background pixels get kZeroNormal, or a zero normal at full precision,
+// and a zero albedo. Returns the largest albedo.
+float SolveRows(const vector<ImageReader> &readers,
+		const LightMatrix &light_matrix, const ForegroundMask *mask,
+		ThreadPool *pool, size_t first_row, size_t num_rows,
+		const SolvedRows &output) {
+  const size_t num_columns = readers[0].num_columns();
+  const size_t tile_rows = max<size_t>(
+      1, kTileBytes / (num_columns * sizeof(float) * (readers.size() + 4)));
+  const size_t num_tiles = (num_rows + tile_rows - 1) / tile_rows;
+  vector<float> tile_max_albedo(num_tiles, 0.0f);
+
+  pool->ParallelFor(num_tiles, [&](size_t tile) {
+    const size_t tile_first_row = tile * tile_rows;
+    const size_t tile_num_rows = min(tile_rows, num_rows - tile_first_row);
+
+    // Scratch buffers are reused by every tile a thread runs.
+    thread_local vector<float> intensities, normal_x, normal_y, normal_z;
+    thread_local vector<float> span_albedo;
+    thread_local vector<const float *> planes;
+    planes.resize(readers.size());
+    float max_albedo = 0.0f;
+
+    if (mask != nullptr) {
+      // The foreground of the whole tile is solved as one batch, then
+      // scattered over rows cleared to the background.
+      const size_t count = GatherSpans(readers, *mask,
+				       first_row + tile_first_row,
+				       tile_num_rows, &intensities);
+      normal_x.resize(count);
+      normal_y.resize(count);
+      normal_z.resize(count);
+      span_albedo.resize(count);
+      for (size_t d = 0; d < readers.size(); ++d)
+	planes[d] = intensities.data() + d * count;
+
+      TRACE_SCOPE("solve");
+      TRACE_COUNT("pixels_solved", count);
+      SolveNormals(light_matrix, planes.data(), count, normal_x.data(),
+		   normal_y.data(), normal_z.data(), span_albedo.data());
+      const float *solved[3] = {normal_x.data(), normal_y.data(),
+				normal_z.data()};
+      size_t p = 0;
+      for (size_t r = 0; r < tile_num_rows; ++r) {
+	const size_t i = first_row + tile_first_row + r;
+	max_albedo = max(max_albedo,
+			 ScatterSpans(mask->spans.data() + mask->row_starts[i],
+				      mask->spans.data() +
+				      mask->row_starts[i + 1],
+				      0, num_columns, solved,
+				      span_albedo.data(), &p,
+				      tile_first_row + r, output));
+      }
+      tile_max_albedo[tile] = max_albedo;
+      return;
+    }
+
+    GatherIntensities(readers, first_row + tile_first_row, tile_num_rows,
+		      &intensities);
+    normal_x.resize(num_columns);
+    normal_y.resize(num_columns);
+    normal_z.resize(num_columns);
+
+    TRACE_SCOPE("solve");
+    TRACE_COUNT("pixels_solved", tile_num_rows * num_columns);
+    for (size_t r = 0; r < tile_num_rows; ++r) {
+      const size_t y = tile_first_row + r;
+      for (size_t d = 0; d < readers.size(); ++d)
+	planes[d] = &intensities[(d * tile_num_rows + r) * num_columns];
+      // Full precision components are solved in place.
+      float *normal_rows[3] = {normal_x.data(), normal_y.data(),
+			       normal_z.data()};
+      for (int c = 0; c < 3; ++c)
+	if (output.normal[c] != nullptr)
+	  normal_rows[c] = output.normal[c] + y * output.normal_stride;
+      float *albedo_row = output.albedo + y * output.albedo_stride;
+      SolveNormals(light_matrix, planes.data(), num_columns, normal_rows[0],
+		   normal_rows[1], normal_rows[2], albedo_row);
+
+      if (output.normals != nullptr) {
+	uint8_t *normals_row = output.normals + y * output.normals_stride;
+	for (size_t x = 0; x < num_columns; ++x)
+	  normals_row[x] = QuantizeNormal(normal_rows[0][x]);
+      }
+      for (size_t x = 0; x < num_columns; ++x)
+	max_albedo = max(max_albedo, albedo_row[x]);
+    }
+    tile_max_albedo[tile] = max_albedo;
+  });
+  return num_tiles == 0 ? 0.0f :
+    *max_element(tile_max_albedo.begin(), tile_max_albedo.end());
+}
+
+// Maps the first num_rows rows of albedo, times scale, to gray levels:
+// only the foreground of rows [first_row, first_row + num_rows) of mask
+// if it is not nullptr, the rest being 0.
+void QuantizeAlbedo(const ImageFloat &albedo, const ForegroundMask *mask,
+		    size_t first_row, size_t num_rows, float scale,
+		    Image *albedo_image) {
+  TRACE_SCOPE("quantize");
+  for (size_t y = 0; y < num_rows; ++y) {
+    const float *albedo_row = albedo.Row(y);
+    uint8_t *output_row = albedo_image->Row(y);
+    if (mask == nullptr) {
+      for (size_t x = 0; x < albedo.num_columns(); ++x)
+	output_row[x] = static_cast<uint8_t>(albedo_row[x] * scale + 0.5f);
+      continue;
+    }
+    memset(output_row, 0, albedo.num_columns());
+    const size_t i = first_row + y;
+    for (size_t s = mask->row_starts[i]; s < mask->row_starts[i + 1]; ++s)
+      for (size_t x = mask->spans[s].begin; x < mask->spans[s].end; ++x)
+	output_row[x] = static_cast<uint8_t>(albedo_row[x] * scale + 0.5f);
+  }
+}
+
+// Appends the spans of rows [first_row, first_row + num_rows) to mask,
+// whose earlier rows are complete; pool scans row tiles independently.
+void AppendMaskRows(const vector<ImageReader> &readers, int threshold,
+		    ThreadPool *pool, size_t first_row, size_t num_rows,
+		    ForegroundMask *mask) {
+  TRACE_SCOPE("mask");
+  const size_t num_columns = readers[0].num_columns();
+  const size_t tile_rows = max<size_t>(1, kTileBytes / (4 * num_columns));
+  const size_t num_tiles = (num_rows + tile_rows - 1) / tile_rows;
+  vector<vector<Span>> tile_spans(num_tiles);
+  vector<size_t> row_counts(num_rows, 0);
+
+  pool->ParallelFor(num_tiles, [&](size_t tile) {
+    const size_t tile_first_row = tile * tile_rows;
+    const size_t tile_num_rows = min(tile_rows, num_rows - tile_first_row);
+    thread_local vector<uint16_t> row;
+    thread_local vector<uint8_t> lit;
+    row.resize(num_columns);
+    lit.resize(num_columns);
+    for (size_t r = tile_first_row; r < tile_first_row + tile_num_rows;
+	 ++r) {
+      fill(lit.begin(), lit.end(), 0);
+      for (size_t d = 0; d < readers.size(); ++d) {
+	readers[d].ReadRows(first_row + r, 1, row.data(), num_columns);
+	for (size_t x = 0; x < num_columns; ++x)
+	  lit[x] |= row[x] > threshold;
+      }
+      const size_t before = tile_spans[tile].size();
+      for (size_t x = 0; x < num_columns; ) {
+	if (!lit[x]) {
+	  ++x;
+	  continue;
+	}
+	const size_t begin = x;
+	while (x < num_columns && lit[x]) ++x;
+	tile_spans[tile].push_back({static_cast<uint32_t>(begin),
+				    static_cast<uint32_t>(x)});
+      }
+      row_counts[r] = tile_spans[tile].size() - before;
+    }
+  });
+
+  for (size_t tile = 0; tile < num_tiles; ++tile) {
+    for (size_t s = 0; s < tile_spans[tile].size(); ++s)
+      mask->num_pixels += tile_spans[tile][s].end - tile_spans[tile][s].begin;
+    mask->spans.insert(mask->spans.end(), tile_spans[tile].begin(),
+		       tile_spans[tile].end());
+  }
+  for (size_t r = 0; r < num_rows; ++r)
+    mask->row_starts.push_back(mask->row_starts.back() + row_counts[r]);
+}
+
+// Starts an empty mask for the size of readers.
+void ClearMask(const vector<ImageReader> &readers, ForegroundMask *mask) {
+  mask->num_rows = readers[0].num_rows();
+  mask->num_columns = readers[0].num_columns();
+  mask->num_pixels = 0;
+  mask->spans.clear();
+  mask->row_starts.assign(1, 0);
+}
+
+// The scale that maps max_albedo to 255.
+float AlbedoScale(float max_albedo) {
+  return max_albedo > 0.0f ? 255.0f / max_albedo : 0.0f;
+}
+
+// Converts the first num_rows rows of albedo from gray levels to units
+// of the images' maximum gray level, num_gray_levels.
+void NormalizeAlbedo(size_t num_gray_levels, size_t num_rows,
+		     ImageFloat *albedo) {
+  const float scale = 1.0f / num_gray_levels;
+  for (size_t y = 0; y < num_rows; ++y) {
+    float *albedo_row = albedo->Row(y);
+    for (size_t x = 0; x < albedo->num_columns(); ++x)
+      albedo_row[x] *= scale;
+  }
+}
+
+// Solves the tiles of row tile_row of images on pool, each from its own
+// foreground (the pixels above threshold under some light), into
+// output, whose row 0 is the first row of the tiles' cores. Background
+// pixels get kZeroNormal, or a zero normal at full precision, and a zero
+// albedo. Returns the largest albedo.
+float SolveTileRow(const vector<TiledImage<uint16_t>> &images,
+		   const LightMatrix &light_matrix, int threshold,
+		   ThreadPool *pool, size_t tile_row,
+		   const SolvedRows &output) {
+  const size_t num_tiles = images[0].num_tile_columns();
+  const size_t tile_size = images[0].options().tile_size;
+  vector<float> tile_max_albedo(num_tiles, 0.0f);
+
+  pool->ParallelFor(num_tiles, [&](size_t tile_column) {
+    // Scratch buffers are reused by every tile a thread runs.
+    thread_local vector<Span> spans;
+    thread_local vector<size_t> row_starts;
+    thread_local vector<uint8_t> lit;
+    thread_local vector<float> intensities, normal_x, normal_y, normal_z;
+    thread_local vector<float> span_albedo;
+    thread_local vector<const float *> planes;
+
+    // The tiles are held only until their pixels are gathered.
+    vector<ImageTile<uint16_t>> tiles(images.size());
+    vector<ImageView<uint16_t>> cores(images.size());
+    for (size_t d = 0; d < images.size(); ++d) {
+      tiles[d] = images[d].GetTile(tile_row, tile_column);
+      cores[d] = tiles[d].CoreView();
+    }
+    const size_t num_rows = cores[0].num_rows();
+    const size_t num_columns = cores[0].num_columns();
+
+    // The foreground spans of the core, row by row.
+    {
+      TRACE_SCOPE("mask");
+      spans.clear();
+      row_starts.assign(1, 0);
+      lit.resize(num_columns);
+      for (size_t r = 0; r < num_rows; ++r) {
+	fill(lit.begin(), lit.end(), 0);
+	for (size_t d = 0; d < images.size(); ++d) {
+	  const uint16_t *row = cores[d].Row(r);
+	  for (size_t x = 0; x < num_columns; ++x)
+	    lit[x] |= row[x] > threshold;
+	}
+	for (size_t x = 0; x < num_columns; ) {
+	  if (!lit[x]) {
+	    ++x;
+	    continue;
+	  }
+	  const size_t begin = x;
+	  while (x < num_columns && lit[x]) ++x;
+	  spans.push_back({static_cast<uint32_t>(begin),
+			   static_cast<uint32_t>(x)});
+	}
+	row_starts.push_back(spans.size());
+      }
+    }
+
+    size_t count = 0;
+    for (size_t s = 0; s < spans.size(); ++s)
+      count += spans[s].end - spans[s].begin;
+    {
+      TRACE_SCOPE("gather");
+      TRACE_COUNT("pixels_gathered", images.size() * count);
+      intensities.resize(images.size() * count);
+      for (size_t d = 0; d < images.size(); ++d) {
+	float *plane = &intensities[d * count];
+	for (size_t r = 0; r < num_rows; ++r) {
+	  const uint16_t *row = cores[d].Row(r);
+	  for (size_t s = row_starts[r]; s < row_starts[r + 1]; ++s)
+	    for (size_t x = spans[s].begin; x < spans[s].end; ++x)
+	      *plane++ = row[x];
+	}
+      }
+    }
+    tiles.clear();
+
+    normal_x.resize(count);
+    normal_y.resize(count);
+    normal_z.resize(count);
+    span_albedo.resize(count);
+    planes.resize(images.size());
+    for (size_t d = 0; d < images.size(); ++d)
+      planes[d] = intensities.data() + d * count;
+    TRACE_SCOPE("solve");
+    TRACE_COUNT("pixels_solved", count);
+    SolveNormals(light_matrix, planes.data(), count, normal_x.data(),
+		 normal_y.data(), normal_z.data(), span_albedo.data());
+
+    const float *solved[3] = {normal_x.data(), normal_y.data(),
+			      normal_z.data()};
+    size_t p = 0;
+    float max_albedo = 0.0f;
+    for (size_t r = 0; r < num_rows; ++r)
+      max_albedo = max(max_albedo,
+		       ScatterSpans(spans.data() + row_starts[r],
+				    spans.data() + row_starts[r + 1],
+				    tile_column * tile_size, num_columns,
+				    solved, span_albedo.data(), &p, r,
+				    output));
+    tile_max_albedo[tile_column] = max_albedo;
+  });
+  return num_tiles == 0 ? 0.0f :
+    *max_element(tile_max_albedo.begin(), tile_max_albedo.end());
+}
+
+}  // namespace
+
+void ComputeForegroundMask(const vector<ImageReader> &readers,
+			   int threshold, ThreadPool *pool,
+			   ForegroundMask *mask) {
+  if (mask == nullptr) abort();
+  ClearMask(readers, mask);
+  AppendMaskRows(readers, threshold, pool, 0, mask->num_rows, mask);
+}
+
+void ComputeNormalsAndAlbedo(const vector<ImageReader> &readers,
+			     const LightMatrix &light_matrix,
+			     const ForegroundMask *mask, ThreadPool *pool,
+			     Image *normals_image, Image *albedo_image) {
+  if (normals_image == nullptr || albedo_image == nullptr) abort();
+  const size_t num_rows = readers[0].num_rows();
+  const size_t num_columns = readers[0].num_columns();
+  normals_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+  normals_image->SetNumberGrayLevels(255);
+  albedo_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+  albedo_image->SetNumberGrayLevels(255);
+
+  // The albedo is kept until its maximum is known.
+  ImageFloat albedo;
+  albedo.AllocateSpaceAndSetSize(num_rows, num_columns);
+  const float max_albedo =
+    SolveRows(readers, light_matrix, mask, pool, 0, num_rows,
+	      QuantizedOutputs(normals_image, &albedo));
+  QuantizeAlbedo(albedo, mask, 0, num_rows, AlbedoScale(max_albedo),
+		 albedo_image);
+}
+
+void ComputeFloatNormalsAndAlbedo(const vector<ImageReader> &readers,
+				  const LightMatrix &light_matrix,
+				  const ForegroundMask *mask,
+				  ThreadPool *pool, ImageFloat normals[3],
+				  ImageFloat *albedo) {
+  if (normals == nullptr || albedo == nullptr) abort();
+  const size_t num_rows = readers[0].num_rows();
+  const size_t num_columns = readers[0].num_columns();
+  for (int c = 0; c < 3; ++c)
+    normals[c].AllocateSpaceAndSetSize(num_rows, num_columns);
+  albedo->AllocateSpaceAndSetSize(num_rows, num_columns);
+  SolveRows(readers, light_matrix, mask, pool, 0, num_rows,
+	    FloatOutputs(normals, albedo));
+  NormalizeAlbedo(readers[0].num_gray_levels(), num_rows, albedo);
+}
+
+bool StreamNormalsAndAlbedo(const vector<ImageReader> &readers,
+			    const LightMatrix &light_matrix, int threshold,
+			    ThreadPool *pool, size_t band_rows,
+			    const string &normals_filename,
+			    const string &albedo_filename) {
+  const size_t num_rows = readers[0].num_rows();
+  const size_t num_columns = readers[0].num_columns();
+  band_rows = max<size_t>(1, min(band_rows, num_rows));
+
+  Image normals_band, albedo_band;
+  normals_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  albedo_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  ImageFloat albedo;
+  albedo.AllocateSpaceAndSetSize(band_rows, num_columns);
+
+  // First pass: the mask and the albedo's maximum.
+  ForegroundMask foreground;
+  const ForegroundMask *mask = threshold < 0 ? nullptr : &foreground;
+  ClearMask(readers, &foreground);
+  float max_albedo = 0.0f;
+  for (size_t first_row = 0; first_row < num_rows; first_row += band_rows) {
+    const size_t rows = min(band_rows, num_rows - first_row);
+    if (mask != nullptr)
+      AppendMaskRows(readers, threshold, pool, first_row, rows, &foreground);
+    max_albedo = max(max_albedo,
+		     SolveRows(readers, light_matrix, mask, pool, first_row,
+			       rows, QuantizedOutputs(&normals_band,
+						      &albedo)));
+    for (size_t d = 0; d < readers.size(); ++d)
+      readers[d].ReleaseRows(first_row, rows);
+  }
+  const float scale = AlbedoScale(max_albedo);
+
+  // Second pass: solve again and write each band out.
+  ImageWriter normals_writer, albedo_writer;
+  if (!CreateImage(normals_filename, num_rows, num_columns, 255,
+		   &normals_writer) ||
+      !CreateImage(albedo_filename, num_rows, num_columns, 255,
+		   &albedo_writer))
+    return false;
+  for (size_t first_row = 0; first_row < num_rows; first_row += band_rows) {
+    const size_t rows = min(band_rows, num_rows - first_row);
+    SolveRows(readers, light_matrix, mask, pool, first_row, rows,
+	      QuantizedOutputs(&normals_band, &albedo));
+    QuantizeAlbedo(albedo, mask, first_row, rows, scale, &albedo_band);
+    if (!normals_writer.WriteRows(normals_band.data(), rows,
+				  normals_band.stride()) ||
+	!albedo_writer.WriteRows(albedo_band.data(), rows,
+				 albedo_band.stride()))
+      return false;
+    for (size_t d = 0; d < readers.size(); ++d)
+      readers[d].ReleaseRows(first_row, rows);
+  }
+  return normals_writer.Close() && albedo_writer.Close();
+}
+
+bool StreamFloatNormalsAndAlbedo(const vector<ImageReader> &readers,
+				 const LightMatrix &light_matrix,
+				 int threshold, ThreadPool *pool,
+				 size_t band_rows, FloatFormat format,
+				 const string &normals_filename,
+				 const string &albedo_filename) {
+  const size_t num_rows = readers[0].num_rows();
+  const size_t num_columns = readers[0].num_columns();
+  band_rows = max<size_t>(1, min(band_rows, num_rows));
+
+  ImageFloat normals_band[3], albedo_band;
+  for (int c = 0; c < 3; ++c)
+    normals_band[c].AllocateSpaceAndSetSize(band_rows, num_columns);
+  albedo_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  const float *normal_rows[3] = {normals_band[0].data(),
+				 normals_band[1].data(),
+				 normals_band[2].data()};
+  const float *albedo_rows = albedo_band.data();
+
+  FloatImageWriter normals_writer, albedo_writer;
+  if (!CreateFloatImage(normals_filename, format, 3, num_rows, num_columns,
+			&normals_writer) ||
+      !CreateFloatImage(albedo_filename, format, 1, num_rows, num_columns,
+			&albedo_writer))
+    return false;
+
+  // Nothing is rescaled, so each band is written as soon as it is solved.
+  ForegroundMask foreground;
+  const ForegroundMask *mask = threshold < 0 ? nullptr : &foreground;
+  ClearMask(readers, &foreground);
+  for (size_t first_row = 0; first_row < num_rows; first_row += band_rows) {
+    const size_t rows = min(band_rows, num_rows - first_row);
+    if (mask != nullptr)
+      AppendMaskRows(readers, threshold, pool, first_row, rows, &foreground);
+    SolveRows(readers, light_matrix, mask, pool, first_row, rows,
+	      FloatOutputs(normals_band, &albedo_band));
+    NormalizeAlbedo(readers[0].num_gray_levels(), rows, &albedo_band);
+    if (!normals_writer.WriteRows(normal_rows, rows,
+				  normals_band[0].stride()) ||
+	!albedo_writer.WriteRows(&albedo_rows, rows, albedo_band.stride()))
+      return false;
+    for (size_t d = 0; d < readers.size(); ++d)
+      readers[d].ReleaseRows(first_row, rows);
+  }
+  return normals_writer.Close() && albedo_writer.Close();
+}
+
+bool OpenTiledObjectImages(const vector<string> &filenames,
+			   const TileOptions &options,
+			   vector<TiledImage<uint16_t>> *images) {
+  if (images == nullptr) abort();
+  images->clear();
+  images->resize(filenames.size());
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    if (!OpenTiledImage(filenames[i], options, &(*images)[i])) return false;
+    if ((*images)[i].num_rows() != (*images)[0].num_rows() ||
+	(*images)[i].num_columns() != (*images)[0].num_columns()) {
+      cout << "OpenTiledObjectImages: " << filenames[i]
+	   << " differs in size from " << filenames[0] << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t TileCacheBudget(size_t memory_budget, size_t num_lights,
+		       size_t num_columns, size_t tile_size,
+		       bool full_precision, size_t num_threads) {
+  // A row of tiles of the outputs: the quantized normals, the albedo and
+  // its quantized copy, or the three normal planes and the albedo.
+  const size_t band = tile_size * num_columns * (full_precision ? 16 : 6);
+  // Per thread, the intensities and results of a whole tile.
+  const size_t scratch = tile_size * tile_size * sizeof(float) *
+    (num_lights + 4);
+  const size_t reserved = band + num_threads * scratch;
+  if (num_lights == 0 || memory_budget <= reserved) return 0;
+  const size_t budget = (memory_budget - reserved) / num_lights;
+  const size_t per_line = Image::kRowAlignment / sizeof(uint16_t);
+  const size_t tile_bytes = tile_size * sizeof(uint16_t) *
+    ((tile_size + per_line - 1) / per_line * per_line);
+  return budget < num_threads * tile_bytes ? 0 : budget;
+}
+
+bool StreamTiledNormalsAndAlbedo(const vector<TiledImage<uint16_t>> &images,
+				 const LightMatrix &light_matrix,
+				 int threshold, ThreadPool *pool,
+				 const string &normals_filename,
+				 const string &albedo_filename) {
+  const size_t num_rows = images[0].num_rows();
+  const size_t num_columns = images[0].num_columns();
+  const size_t tile_size = images[0].options().tile_size;
+  const size_t band_rows = min(tile_size, num_rows);
+
+  Image normals_band, albedo_band;
+  normals_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  albedo_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  ImageFloat albedo;
+  albedo.AllocateSpaceAndSetSize(band_rows, num_columns);
+
+  // First pass: the albedo's maximum.
+  float max_albedo = 0.0f;
+  for (size_t tile_row = 0; tile_row < images[0].num_tile_rows(); ++tile_row)
+    max_albedo = max(max_albedo,
+		     SolveTileRow(images, light_matrix, threshold, pool,
+				  tile_row, QuantizedOutputs(&normals_band,
+							     &albedo)));
+  const float scale = AlbedoScale(max_albedo);
+
+  // Second pass: solve again and write each row of tiles out.
+  ImageWriter normals_writer, albedo_writer;
+  if (!CreateImage(normals_filename, num_rows, num_columns, 255,
+		   &normals_writer) ||
+      !CreateImage(albedo_filename, num_rows, num_columns, 255,
+		   &albedo_writer))
+    return false;
+  for (size_t tile_row = 0; tile_row < images[0].num_tile_rows();
+       ++tile_row) {
+    const size_t rows = min(tile_size, num_rows - tile_row * tile_size);
+    SolveTileRow(images, light_matrix, threshold, pool, tile_row,
+		 QuantizedOutputs(&normals_band, &albedo));
+    QuantizeAlbedo(albedo, nullptr, 0, rows, scale, &albedo_band);
+    if (!normals_writer.WriteRows(normals_band.data(), rows,
+				  normals_band.stride()) ||
+	!albedo_writer.WriteRows(albedo_band.data(), rows,
+				 albedo_band.stride()))
+      return false;
+  }
+  return normals_writer.Close() && albedo_writer.Close();
+}
+
+bool StreamTiledFloatNormalsAndAlbedo(
+    const vector<TiledImage<uint16_t>> &images,
+    const LightMatrix &light_matrix, int threshold, ThreadPool *pool,
+    FloatFormat format, const string &normals_filename,
+    const string &albedo_filename) {
+  const size_t num_rows = images[0].num_rows();
+  const size_t num_columns = images[0].num_columns();
+  const size_t tile_size = images[0].options().tile_size;
+  const size_t band_rows = min(tile_size, num_rows);
+
+  ImageFloat normals_band[3], albedo_band;
+  for (int c = 0; c < 3; ++c)
+    normals_band[c].AllocateSpaceAndSetSize(band_rows, num_columns);
+  albedo_band.AllocateSpaceAndSetSize(band_rows, num_columns);
+  const float *normal_rows[3] = {normals_band[0].data(),
+				 normals_band[1].data(),
+				 normals_band[2].data()};
+  const float *albedo_rows = albedo_band.data();
+
+  FloatImageWriter normals_writer, albedo_writer;
+  if (!CreateFloatImage(normals_filename, format, 3, num_rows, num_columns,
+			&normals_writer) ||
+      !CreateFloatImage(albedo_filename, format, 1, num_rows, num_columns,
+			&albedo_writer))
+    return false;
+  for (size_t tile_row = 0; tile_row < images[0].num_tile_rows();
+       ++tile_row) {
+    const size_t rows = min(tile_size, num_rows - tile_row * tile_size);
+    SolveTileRow(images, light_matrix, threshold, pool, tile_row,
+		 FloatOutputs(normals_band, &albedo_band));
+    NormalizeAlbedo(images[0].num_gray_levels(), rows, &albedo_band);
+    if (!normals_writer.WriteRows(normal_rows, rows,
+				  normals_band[0].stride()) ||
+	!albedo_writer.WriteRows(&albedo_rows, rows, albedo_band.stride()))
+      return false;
+  }
+  return normals_writer.Close() && albedo_writer.Close();
+}
+
+void ComputeNeedles(const vector<ImageReader> &readers,
+		    const LightMatrix &light_matrix, int step, int threshold,
+		    vector<Needle> *needles) {
+  if (needles == nullptr || step < 1) abort();
+  TRACE_SCOPE("needles");
+  needles->clear();
+  const size_t num_rows = readers[0].num_rows();
+  const size_t num_columns = readers[0].num_columns();
+  const size_t num_lights = readers.size();
+
+  // The grid pixels of one row, one plane per light, then compacted to
+  // those of the foreground.
+  const size_t num_grid_columns = (num_columns + step - 1) / step;
+  vector<float> row(num_columns);
+  vector<float> intensities(num_lights * num_grid_columns);
+  vector<const float *> planes(num_lights);
+  vector<int> columns;
+  vector<uint8_t> lit(num_grid_columns);
+  vector<float> normal_x(num_grid_columns), normal_y(num_grid_columns),
+    normal_z(num_grid_columns), albedo(num_grid_columns);
+  for (size_t i = 0; i < num_rows; i += step) {
+    fill(lit.begin(), lit.end(), 0);
+    for (size_t d = 0; d < num_lights; ++d) {
+      readers[d].ReadRows(i, 1, row.data(), num_columns);
+      float *plane = &intensities[d * num_grid_columns];
+      for (size_t c = 0; c < num_grid_columns; ++c) {
+	plane[c] = row[c * step];
+	lit[c] |= plane[c] > threshold;
+      }
+    }
+    columns.clear();
+    for (size_t c = 0; c < num_grid_columns; ++c) {
+      if (!lit[c]) continue;
+      for (size_t d = 0; d < num_lights; ++d)
+	intensities[d * num_grid_columns + columns.size()] =
+	  intensities[d * num_grid_columns + c];
+      columns.push_back(c * step);
+    }
+    if (columns.empty()) continue;
+
+    for (size_t d = 0; d < num_lights; ++d)
+      planes[d] = &intensities[d * num_grid_columns];
+    SolveNormals(light_matrix, planes.data(), columns.size(),
+		 normal_x.data(), normal_y.data(), normal_z.data(),
+		 albedo.data());
+    for (size_t c = 0; c < columns.size(); ++c)
+      needles->push_back({static_cast<int>(i), columns[c], normal_x[c],
+			  normal_y[c]});
+  }
+}
+
+void RenderNeedleMap(const ImageReader &background,
+		     const vector<Needle> &needles, int length,
+		     Image *needle_map) {
+  if (needle_map == nullptr) abort();
+  TRACE_SCOPE("needle_map");
+  const size_t num_rows = background.num_rows();
+  const size_t num_columns = background.num_columns();
+  needle_map->AllocateSpaceAndSetSize(num_rows, num_columns);
+  needle_map->SetNumberGrayLevels(255);
+  if (background.num_gray_levels() == 255) {
+    background.ReadRows(0, num_rows, needle_map->data(),
+			needle_map->stride());
+  } else {
+    vector<float> row(num_columns);
+    const float scale = 255.0f / background.num_gray_levels();
+    for (size_t i = 0; i < num_rows; ++i) {
+      background.ReadRows(i, 1, row.data(), num_columns);
+      uint8_t *output = needle_map->Row(i);
+      for (size_t j = 0; j < num_columns; ++j)
+	output[j] = static_cast<uint8_t>(row[j] * scale + 0.5f);
+    }
+  }
+
+  // Lines are in DrawLine() coordinates: x is the row.
+  vector<LineSegment> lines(needles.size());
+  for (size_t k = 0; k < needles.size(); ++k) {
+    const Needle &needle = needles[k];
+    lines[k].x0 = needle.row;
+    lines[k].y0 = needle.column;
+    lines[k].x1 = needle.row + lround(length * needle.normal_y);
+    lines[k].y1 = needle.column + lround(length * needle.normal_x);
+  }
+  DrawLines(lines.data(), lines.size(), 255, needle_map);
+
+  // The dots go on top of the lines.
+  const int last_row = num_rows - 1, last_column = num_columns - 1;
+  for (size_t k = 0; k < needles.size(); ++k) {
+    const int i = needles[k].row, j = needles[k].column;
+    needle_map->Row(i)[j] = 0;
+    if (i > 0) needle_map->Row(i - 1)[j] = 255;
+    if (i < last_row) needle_map->Row(i + 1)[j] = 255;
+    if (j > 0) needle_map->Row(i)[j - 1] = 255;
+    if (j < last_column) needle_map->Row(i)[j + 1] = 255;
+  }
+}
+
+}  // namespace ComputerVisionProjects
@@ -0,0 +1,249 @@
+// Photometric stereo: recovers surface normals and albedo from images of
+// an object lit from known directions.
+// To be used in Computer Vision class.
+
+#ifndef PHOTOMETRIC_H
+#define PHOTOMETRIC_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "thread_pool.h"
+#include "tiled_image.h"
+
+namespace ComputerVisionProjects {
+
+class SubsetInverses;
+
+// The light directions S (one row per light, scaled by the light's
+// brightness) and its pseudo-inverse, computed once per set of lights.
+// For a pixel with intensities I (one per light), g = S+ I, where the
+// albedo is |g| and the normal is g / |g|.
+struct LightMatrix {
+  size_t num_lights;
+  // 3 rows of num_lights entries: (S^T S)^-1 S^T.
+  std::vector<float> pseudo_inverse;
+
+  // Robust mode (see EnableRobustSolve()): each pixel is solved with only
+  // the lights whose intensity lies in [band_low, band_high].
+  bool robust;
+  float band_low;
+  float band_high;
+  std::shared_ptr<SubsetInverses> subsets;
+};
+
+// Computes the pseudo-inverse of the num_lights x 3 matrix directions.
+// Returns true if  everyhing is OK, false if there are fewer than three
+// lights or they do not span 3D space.
+bool ComputeLightMatrix(const std::vector<std::vector<double>> &directions,
+			LightMatrix *light_matrix);
+
+// The pseudo-inverses of the subsets of a set of lights, computed the
+// first time each subset is asked for and kept for every later pixel:
+// at most 2^N of them for N lights. Safe to share between threads.
+class SubsetInverses {
+ public:
+  // Up to kMaxLights directions.
+  explicit SubsetInverses(
+      const std::vector<std::vector<double>> &directions);
+  SubsetInverses(const SubsetInverses &) = delete;
+  SubsetInverses& operator=(const SubsetInverses &) = delete;
+
+  static const size_t kMaxLights = 16;
+
+  // The pseudo-inverse for the lights whose bits are set in subset, as 3
+  // rows of N entries that are 0 for the lights left out. Subsets of
+  // fewer than three lights, or that do not span 3D space, get that of
+  // every light.
+  const float *Get(uint32_t subset) {
+    const float *inverse = entries_[subset].load(std::memory_order_acquire);
+    return inverse != nullptr ? inverse : Compute(subset);
+  }
+
+ private:
+  const float *Compute(uint32_t subset);
+  // Compute() once lock_ is held.
+  const float *ComputeLocked(uint32_t subset);
+
+  std::vector<std::vector<double>> directions_;
+  std::unique_ptr<std::atomic<const float *>[]> entries_;
+  std::mutex lock_;  // Guards storage_ and the computing of entries.
+  std::deque<std::vector<float>> storage_;
+};
+
+// Switches light_matrix (already computed for directions) to robust
+// mode: samples darker than band_low (shadows) or brighter than
+// band_high (highlights, saturation) are left out of each pixel's solve.
+// Returns true if  everyhing is OK, false if there are more than
+// SubsetInverses::kMaxLights lights.
+bool EnableRobustSolve(const std::vector<std::vector<double>> &directions,
+		       float band_low, float band_high,
+		       LightMatrix *light_matrix);
+
+// Solves count pixels. intensities holds one array of count values per
+// light (structure of arrays); the results go to the four output arrays.
+// Pixels that are black under every light get a zero normal and albedo.
+// Processes 8 (AVX) or 4 (SSE) pixels at a time when available; robust
+// light matrices do so too on runs of pixels with no sample out of the
+// band, and solve the rest one at a time. Both have kernels specialized
+// for 3, 4, 6 and 8 lights.
+void SolveNormals(const LightMatrix &light_matrix,
+		  const float *const *intensities, size_t count,
+		  float *normal_x, float *normal_y, float *normal_z,
+		  float *albedo);
+
+// Opens the object images, one per light, for reading a band of rows at
+// a time. All of them must have the same size.
+// Returns true if  everyhing is OK, false otherwise.
+bool OpenObjectImages(const std::vector<std::string> &input_filenames,
+		      std::vector<ImageReader> *readers);
+
+// Pixels [begin, end) of one row.
+struct Span {
+  uint32_t begin;
+  uint32_t end;
+};
+
+// The foreground of the object images: the pixels above a threshold under
+// at least one light, as run-length spans. The spans of row i are
+// spans[row_starts[i]] up to (not including) spans[row_starts[i + 1]].
+struct ForegroundMask {
+  size_t num_rows;
+  size_t num_columns;
+  size_t num_pixels;  // In all the spans.
+  std::vector<Span> spans;
+  std::vector<size_t> row_starts;  // num_rows + 1 entries.
+};
+
+// Builds the ForegroundMask of the object images in readers for
+// threshold, with pool scanning row tiles independently.
+void ComputeForegroundMask(const std::vector<ImageReader> &readers,
+			   int threshold, ThreadPool *pool,
+			   ForegroundMask *mask);
+
+// Solves the pixels of the object images in readers (one per light, in
+// the order of light_matrix): those of mask, or every pixel if mask is
+// nullptr. The image is split into row tiles sized to stay in cache,
+// which pool decodes, solves and quantizes independently; with a mask,
+// only the foreground spans are decoded and solved.
+// normals_image gets the x component of the normals, mapped from [-1, 1]
+// to [0, 255]; albedo_image gets the albedo, scaled so that its maximum
+// is 255. Pixels outside the mask get a zero normal and albedo, as black
+// pixels do.
+void ComputeNormalsAndAlbedo(const std::vector<ImageReader> &readers,
+			     const LightMatrix &light_matrix,
+			     const ForegroundMask *mask, ThreadPool *pool,
+			     Image *normals_image, Image *albedo_image);
+
+// Like ComputeNormalsAndAlbedo(), but band_rows rows at a time, each band
+// written to the pgm files normals_filename and albedo_filename as soon
+// as it is solved: memory use depends on the band and the number of
+// lights, not on the image size. The albedo scale must be known before
+// the first row is written, so the images are solved twice. The mask for
+// threshold is built band by band during the first pass; a negative
+// threshold solves every pixel.
+// Returns true if  everyhing is OK, false otherwise.
+bool StreamNormalsAndAlbedo(const std::vector<ImageReader> &readers,
+			    const LightMatrix &light_matrix, int threshold,
+			    ThreadPool *pool, size_t band_rows,
+			    const std::string &normals_filename,
+			    const std::string &albedo_filename);
+
+// Like ComputeNormalsAndAlbedo(), but at full precision: normals[0],
+// normals[1] and normals[2] get the x, y and z components of the unit
+// normals, and albedo the albedo in units of the images' maximum gray
+// level (1 for a white surface facing a light of unit length). Pixels
+// outside the mask get a zero normal and albedo.
+void ComputeFloatNormalsAndAlbedo(const std::vector<ImageReader> &readers,
+				  const LightMatrix &light_matrix,
+				  const ForegroundMask *mask,
+				  ThreadPool *pool, ImageFloat normals[3],
+				  ImageFloat *albedo);
+
+// Like StreamNormalsAndAlbedo(), but at full precision, as in
+// ComputeFloatNormalsAndAlbedo(): normals_filename gets the x, y and z
+// planes and albedo_filename the albedo, both files in format. Nothing
+// depends on the albedo's maximum, so the images are solved only once.
+// Returns true if  everyhing is OK, false otherwise.
+bool StreamFloatNormalsAndAlbedo(const std::vector<ImageReader> &readers,
+				 const LightMatrix &light_matrix,
+				 int threshold, ThreadPool *pool,
+				 size_t band_rows, FloatFormat format,
+				 const std::string &normals_filename,
+				 const std::string &albedo_filename);
+
+// Opens the object images, one per light, for reading through tile
+// caches, each with options. All of them must have the same size.
+// Returns true if  everyhing is OK, false otherwise.
+bool OpenTiledObjectImages(const std::vector<std::string> &input_filenames,
+			   const TileOptions &options,
+			   std::vector<TiledImage<uint16_t>> *images);
+
+// The budget of each tile cache when num_lights object images of
+// num_columns columns, in tiles of tile_size, are solved by
+// StreamTiledNormalsAndAlbedo() (or StreamTiledFloatNormalsAndAlbedo()
+// if full_precision) on num_threads threads, in memory_budget bytes in
+// all: what is left once a row of tiles of the outputs is set aside,
+// shared equally. Returns 0 if that is less than a tile of every image
+// per thread, which the solve holds at once.
+size_t TileCacheBudget(size_t memory_budget, size_t num_lights,
+		       size_t num_columns, size_t tile_size,
+		       bool full_precision, size_t num_threads);
+
+// Like StreamNormalsAndAlbedo(), but reading the object images through
+// their tile caches (see OpenTiledObjectImages()): pool solves the tiles
+// of a row of tiles independently, each from its own foreground, and the
+// row is written out once done. Nothing is kept from one row of tiles to
+// the next but the cached tiles, not even the mask, so memory use is the
+// caches' budget and a row of tiles of the outputs. The albedo scale
+// needs a first pass over the images, which the second pass reads again
+// from the caches when they hold the whole images.
+// Returns true if  everyhing is OK, false otherwise.
+bool StreamTiledNormalsAndAlbedo(
+    const std::vector<TiledImage<uint16_t>> &images,
+    const LightMatrix &light_matrix, int threshold, ThreadPool *pool,
+    const std::string &normals_filename, const std::string &albedo_filename);
+
+// Like StreamTiledNormalsAndAlbedo(), but at full precision, as in
+// StreamFloatNormalsAndAlbedo(), in a single pass.
+// Returns true if  everyhing is OK, false otherwise.
+bool StreamTiledFloatNormalsAndAlbedo(
+    const std::vector<TiledImage<uint16_t>> &images,
+    const LightMatrix &light_matrix, int threshold, ThreadPool *pool,
+    FloatFormat format, const std::string &normals_filename,
+    const std::string &albedo_filename);
+
+// The normal at one pixel of a needle map.
+struct Needle {
+  int row;
+  int column;
+  float normal_x;
+  float normal_y;
+};
+
+// Solves the pixels of every step-th row and column (starting from 0)
+// that are in the foreground for threshold, as ComputeForegroundMask()
+// and the solves take it (above threshold under at least one light;
+// every pixel for a negative threshold), and nothing else: only one row
+// in step is decoded.
+void ComputeNeedles(const std::vector<ImageReader> &readers,
+		    const LightMatrix &light_matrix, int step, int threshold,
+		    std::vector<Needle> *needles);
+
+// Renders needles over background (a pgm file, scaled to 8 bits if
+// needed): a white line from each needle's pixel along its normal,
+// length pixels long for a normal in the image plane, and a black dot
+// with a white outline at the pixel itself.
+void RenderNeedleMap(const ImageReader &background,
+		     const std::vector<Needle> &needles, int length,
+		     Image *needle_map);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // PHOTOMETRIC_H
@@ -1,176 +1,349 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
-#include <vector>
 #include <cmath>
 #include <string>
+#include <vector>
+#include "calibration_cache.h"
+#include "filter.h"
+#include "histogram.h"
+#include "image.h"
+#include "sphere.h"
+#include "trace.h"
 
 namespace ComputerVision {
 
-// Function to read PGM file (P5 format)
-bool readPGM(const std::string &filename, std::vector<std::vector<int>> &image) {
-    std::ifstream file(filename, std::ios::binary);
+using ComputerVisionProjects::BasicImage;
+using ComputerVisionProjects::SphereParameters;
+
+// Function to write the sphere parameters to a file, one line per sphere
+void writeParameters(const std::string &filename, const std::vector<SphereParameters> &spheres) {
+    std::ofstream file(filename);
     if (!file) {
-        std::cerr << "Error: Could not open file " << filename << std::endl;
-        return false;
+        std::cerr << "Error: Could not open output file " << filename << std::endl;
+        return;
     }
-
-    std::string line;
-    std::getline(file, line);  // Read the "P5"
-    if (line != "P5") {
-        std::cerr << "Error: Not a valid PGM file (expected P5)." << std::endl;
-        return false;
+    for (size_t k = 0; k < spheres.size(); ++k) {
+        file << spheres[k].center_x << " " << spheres[k].center_y << " " << spheres[k].radius << std::endl;
     }
+}
 
-    // Skip over any comments (lines starting with '#')
-    while (std::getline(file, line)) {
-        if (line[0] != '#') break;
-    }
+// Smooths image with a Gaussian of standard deviation sigma, on every hardware thread; a sigma of 0 leaves it as is
+template <typename PixelType>
+void smooth(BasicImage<PixelType> &image, double sigma) {
+    if (sigma <= 0) return;
+    ComputerVisionProjects::ThreadPool pool(0);
+    BasicImage<PixelType> smoothed;
+    ComputerVisionProjects::GaussianBlur(image.View(), sigma, ComputerVisionProjects::BorderPolicy::kReflect, &pool, &smoothed);
+    image = std::move(smoothed);
+}
 
-    // Read the image dimensions
-    int width, height;
-    std::istringstream(line) >> width >> height;
-    if (width <= 0 || height <= 0) {
-        std::cerr << "Error: Invalid image dimensions." << std::endl;
-        return false;
-    }
+// Chooses threshold by Otsu's method from the histogram of image, as it is thresholded (i.e. after any smoothing)
+template <typename PixelType>
+void otsuThreshold(const BasicImage<PixelType> &image, int &threshold) {
+    ComputerVisionProjects::ThreadPool pool(0);
+    std::vector<uint64_t> histogram;
+    ComputerVisionProjects::ComputeHistogram(image.View(), &pool, &histogram);
+    // The sphere is the pixels at or above the threshold, Otsu's bright class those above its level
+    threshold = ComputerVisionProjects::OtsuThreshold(histogram) + 1;
+    std::cout << "Otsu threshold: " << threshold << std::endl;
+}
 
-    // Skip the "255" line (max pixel value)
-    std::getline(file, line);
-    if (line != "255") {
-        std::cerr << "Error: Expected max pixel value to be 255." << std::endl;
+// Runs the calibration on an image whose pixels are of type PixelType; a contour fit also gives its residual
+template <typename PixelType>
+bool calibrate(const std::string &inputImage, int threshold, bool autoThreshold, double smoothSigma, bool contour, SphereParameters &sphere, double &residual) {
+    // Read the PGM file
+    BasicImage<PixelType> image;
+    if (!ComputerVisionProjects::ReadImage(inputImage, &image)) {
+        std::cerr << "Error: Unable to read the PGM file." << std::endl;
         return false;
     }
 
-    // Now read the pixel data
-    image.resize(height, std::vector<int>(width));
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            image[i][j] = file.get();  // Read one byte (pixel value)
+    // Debug: Print image dimensions
+    std::cout << "Image Loaded. Size: " << image.num_rows() << " x " << image.num_columns() << std::endl;
+
+    // Denoise before thresholding, so that isolated noisy pixels do not pull the fit
+    smooth(image, smoothSigma);
+    if (autoThreshold) otsuThreshold(image, threshold);
+
+    // Or fit a circle to the sphere's outline, following it from one boundary pixel
+    if (contour) {
+        ComputerVisionProjects::CircleFit fit;
+        if (!ComputerVisionProjects::FitSphereContour(image.View(), threshold, &fit)) {
+            std::cerr << "Error: No circle detected in the binary image." << std::endl;
+            return false;
         }
+        std::cout << "Circle fit to " << fit.num_points << " edge points: center (" << fit.center_x << ", " << fit.center_y
+                  << "), radius " << fit.radius << ", residual " << fit.residual << " px" << std::endl;
+        residual = fit.residual;
+        sphere.center_x = std::lround(fit.center_x);
+        sphere.center_y = std::lround(fit.center_y);
+        sphere.radius = fit.radius;
+        return true;
     }
 
+    // Threshold the image and compute the centroid and radius of the detected circle in one pass
+    if (!ComputerVisionProjects::LocateSphere(image.View(), threshold, &sphere)) {
+        std::cerr << "Error: No circle detected in the binary image." << std::endl;
+        return false;
+    }
     return true;
 }
 
-// Function to threshold the image and create a binary image
-void thresholdImage(const std::vector<std::vector<int>> &image, std::vector<std::vector<int>> &binaryImage, int threshold) {
-    int height = image.size();
-    int width = image[0].size();
-    binaryImage.resize(height, std::vector<int>(width));
-
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            binaryImage[i][j] = (image[i][j] >= threshold) ? 255 : 0;
-        }
+// Runs the calibration for several spheres, each found as its own connected component
+template <typename PixelType>
+bool calibrateSpheres(const std::string &inputImage, int threshold, bool autoThreshold, double smoothSigma, size_t count, std::vector<SphereParameters> &spheres) {
+    BasicImage<PixelType> image;
+    if (!ComputerVisionProjects::ReadImage(inputImage, &image)) {
+        std::cerr << "Error: Unable to read the PGM file." << std::endl;
+        return false;
     }
-}
 
-// Function to compute the centroid of a binary image (assumes a circular shape)
-void computeCentroid(const std::vector<std::vector<int>> &binaryImage, int &centerX, int &centerY) {
-    int height = binaryImage.size();
-    int width = binaryImage[0].size();
+    std::cout << "Image Loaded. Size: " << image.num_rows() << " x " << image.num_columns() << std::endl;
 
-    int totalX = 0, totalY = 0, count = 0;
+    // Smoothing also keeps speckle from labeling as blobs of its own
+    smooth(image, smoothSigma);
+    if (autoThreshold) otsuThreshold(image, threshold);
 
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            if (binaryImage[i][j] == 255) {
-                totalX += j;
-                totalY += i;
-                count++;
-            }
-        }
+    size_t others = 0;
+    if (!ComputerVisionProjects::LocateSpheres(image.View(), threshold, count, &spheres, &others)) {
+        std::cerr << "Error: Fewer than " << count << " blobs in the binary image." << std::endl;
+        return false;
     }
+    if (others > 0) std::cout << others << " smaller blobs left out" << std::endl;
+    return true;
+}
 
-    if (count == 0) {
-        centerX = centerY = -1;  // No pixels found
-    } else {
-        centerX = totalX / count;
-        centerY = totalY / count;
+// Runs the calibration a tile at a time, holding at most the tile cache's budget of decoded pixels
+template <typename PixelType>
+bool calibrateTiled(const std::string &inputImage, int threshold, const ComputerVisionProjects::TileOptions &options, SphereParameters &sphere) {
+    ComputerVisionProjects::TiledImage<PixelType> image;
+    if (!ComputerVisionProjects::OpenTiledImage(inputImage, options, &image)) {
+        std::cerr << "Error: Unable to read the PGM file." << std::endl;
+        return false;
     }
+
+    std::cout << "Image Opened. Size: " << image.num_rows() << " x " << image.num_columns() << ", " << image.num_tile_rows() * image.num_tile_columns() << " tiles" << std::endl;
+
+    if (!ComputerVisionProjects::LocateSphere(image, threshold, &sphere)) {
+        std::cerr << "Error: No circle detected in the binary image." << std::endl;
+        return false;
+    }
+    return true;
 }
 
-// Function to compute the radius of a binary circle
-double computeRadius(const std::vector<std::vector<int>> &binaryImage, int centerX, int centerY) {
-    int height = binaryImage.size();
-    int width = binaryImage[0].size();
-
-    int left = width, right = 0, top = height, bottom = 0;
-
-    // Loop to find boundary points
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            if (binaryImage[i][j] == 255) {
-                if (j < left) left = j;           // Leftmost point
-                if (j > right) right = j;         // Rightmost point
-                if (i < top) top = i;             // Topmost point
-                if (i > bottom) bottom = i;       // Bottommost point
-            }
-        }
+// Runs the calibration coarse to fine, decoding only every factor-th row and a window around the sphere
+template <typename PixelType>
+bool calibrateCoarseToFine(const std::string &inputImage, int threshold, size_t factor, SphereParameters &sphere) {
+    ComputerVisionProjects::ImageReader reader;
+    if (!ComputerVisionProjects::OpenImage(inputImage, &reader)) {
+        std::cerr << "Error: Unable to read the PGM file." << std::endl;
+        return false;
     }
 
-    // Compute horizontal and vertical diameters
-    double horizontalDiameter = right - left;
-    double verticalDiameter = bottom - top;
+    std::cout << "Image Opened. Size: " << reader.num_rows() << " x " << reader.num_columns() << ", searched at 1/" << factor << " first" << std::endl;
 
-    // Average the diameters and divide by 2 to get the radius
-    double radius = (horizontalDiameter + verticalDiameter) / 4.0;
+    if (!ComputerVisionProjects::LocateSphereCoarseToFine<PixelType>(reader, threshold, factor, &sphere)) {
+        std::cerr << "Error: No circle detected in the binary image." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    return radius;
+// Function to choose the threshold by Otsu's method before a tiled or coarse-to-fine calibration, from the
+// histogram of the whole image streamed a band at a time (those modes do not smooth)
+bool otsuThreshold(const std::string &inputImage, int &threshold) {
+    std::vector<ComputerVisionProjects::ImageReader> readers(1);
+    if (!ComputerVisionProjects::OpenImage(inputImage, &readers[0])) {
+        std::cerr << "Error: Unable to read the PGM file." << std::endl;
+        return false;
+    }
+    ComputerVisionProjects::ThreadPool pool(0);
+    std::vector<uint64_t> histogram;
+    ComputerVisionProjects::ComputeMaximumHistogram(readers, &pool, &histogram);
+    // The sphere is the pixels at or above the threshold, Otsu's bright class those above its level
+    threshold = ComputerVisionProjects::OtsuThreshold(histogram) + 1;
+    std::cout << "Otsu threshold: " << threshold << std::endl;
+    return true;
 }
 
-// Function to write the sphere parameters to a file
-void writeParameters(const std::string &filename, int centerX, int centerY, double radius) {
-    std::ofstream file(filename);
-    if (!file) {
-        std::cerr << "Error: Could not open output file " << filename << std::endl;
-        return;
+// Function to compute the cache key of a calibration: the image contents, the threshold and the search
+bool cacheKey(const std::string &inputImage, int threshold, bool autoThreshold, double smoothSigma, size_t pyramidFactor, bool contour, size_t numSpheres, uint64_t &key) {
+    ComputerVisionProjects::ContentHash hash;
+    hash.UpdateString("s1 sphere");
+    if (autoThreshold) {
+        // Otsu's threshold is chosen on the image as thresholded, after the smoothing hashed below
+        hash.UpdateString(smoothSigma > 0 ? "otsu of smoothed" : "otsu");
+    } else {
+        hash.UpdateValue(threshold);
     }
-    file << centerX << " " << centerY << " " << radius << std::endl;
+    if (smoothSigma > 0) hash.UpdateValue(smoothSigma);
+    // The coarse search may leave out specks of foreground that a full scan counts
+    if (pyramidFactor > 0) hash.UpdateValue(pyramidFactor);
+    if (contour) hash.UpdateString("contour");
+    if (numSpheres > 0) hash.UpdateValue(numSpheres);
+    if (!ComputerVisionProjects::HashFile(inputImage, &hash)) return false;
+    key = hash.Digest();
+    return true;
 }
 
 }  // namespace ComputerVision
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <input gray-level sphere image> <threshold value> <output parameters file>" << std::endl;
-        return 1;
+    // Pull out the options, leaving the positional arguments
+    std::string cacheDirectory;  // No caching unless given
+    bool tiled = false;  // The whole image is read unless a memory budget is given
+    ComputerVisionProjects::TileOptions tileOptions;
+    size_t pyramidFactor = 0;  // Every pixel is searched unless given
+    std::string fit = "box";
+    double maxResidual = 0;  // Any fit is accepted unless given
+    double smoothSigma = 0;  // No smoothing unless given
+    bool autoThreshold = false;  // The threshold is given unless asked for
+    size_t numSpheres = 0;  // One blob, the whole foreground, unless given
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char *> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--cache" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (std::string(argv[i]) == "--memory-budget" && i + 1 < argc) {
+            tiled = true;
+            tileOptions.memory_budget = std::stoul(argv[++i]) << 20;
+        } else if (std::string(argv[i]) == "--spheres" && i + 1 < argc) {
+            numSpheres = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--fit" && i + 1 < argc) {
+            fit = argv[++i];
+        } else if (std::string(argv[i]) == "--max-residual" && i + 1 < argc) {
+            maxResidual = std::stod(argv[++i]);
+        } else if (std::string(argv[i]) == "--auto-threshold") {
+            autoThreshold = true;
+        } else if (std::string(argv[i]) == "--smooth" && i + 1 < argc) {
+            smoothSigma = std::stod(argv[++i]);
+        } else if (std::string(argv[i]) == "--pyramid" && i + 1 < argc) {
+            pyramidFactor = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--tile-size" && i + 1 < argc) {
+            tileOptions.tile_size = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
     }
+    argc = args.size();
+    argv = args.data();
 
-    std::string inputImage = argv[1];
-    int threshold = std::stoi(argv[2]);
-    std::string outputFile = argv[3];
+    // With --auto-threshold the threshold is chosen from the image instead of given
+    if (argc != (autoThreshold ? 3 : 4)) {
+        std::cerr << "Usage: " << argv[0] << " [--cache DIR] [--memory-budget MB [--tile-size N] | --pyramid F | --fit box|contour [--max-residual R] | --spheres N] [--smooth SIGMA] [--auto-threshold] [--trace FILE] [--metrics FILE] <input gray-level sphere image> <threshold value (not with --auto-threshold)> <output parameters file>" << std::endl;
+        return 1;
+    }
 
-    // Read the PGM file
-    std::vector<std::vector<int>> image;
-    if (!ComputerVision::readPGM(inputImage, image)) {
-        std::cerr << "Error: Unable to read the PGM file." << std::endl;
+    if (fit != "box" && fit != "contour") {
+        std::cerr << "Error: Unknown fit " << fit << " (expected box or contour)." << std::endl;
+        return 1;
+    }
+    if (numSpheres > 0 && (tiled || pyramidFactor > 0 || fit == "contour")) {
+        std::cerr << "Error: --spheres labels the whole image; it cannot be combined with --memory-budget, --pyramid or --fit contour." << std::endl;
+        return 1;
+    }
+    if (fit == "contour" && (tiled || pyramidFactor > 0)) {
+        std::cerr << "Error: --fit contour visits only the outline already; it cannot be combined with --memory-budget or --pyramid." << std::endl;
+        return 1;
+    }
+    if (maxResidual < 0) {
+        std::cerr << "Error: The residual limit cannot be negative." << std::endl;
+        return 1;
+    }
+    if (maxResidual > 0 && fit != "contour") {
+        std::cerr << "Error: --max-residual needs --fit contour; the box fit has no residual." << std::endl;
+        return 1;
+    }
+    if (smoothSigma < 0) {
+        std::cerr << "Error: The smoothing sigma cannot be negative." << std::endl;
+        return 1;
+    }
+    if (smoothSigma > 0 && (tiled || pyramidFactor > 0)) {
+        std::cerr << "Error: --smooth filters the whole image; it cannot be combined with --memory-budget or --pyramid." << std::endl;
+        return 1;
+    }
+    if (pyramidFactor > 0 && tiled) {
+        std::cerr << "Error: --pyramid reads only part of the image already; it cannot be combined with --memory-budget." << std::endl;
         return 1;
     }
 
-    // Debug: Print image dimensions
-    std::cout << "Image Loaded. Size: " << image.size() << " x " << image[0].size() << std::endl;
+    // Traces are written on return
+    ComputerVisionProjects::TraceSession trace(traceFile, metricsFile);
 
-    // Threshold the image to create a binary image
-    std::vector<std::vector<int>> binaryImage;
-    ComputerVision::thresholdImage(image, binaryImage, threshold);
+    std::string inputImage = argv[1];
+    int threshold = autoThreshold ? 0 : std::stoi(argv[2]);
+    std::string outputFile = argv[argc - 1];
+
+    // A cached calibration of the same image and threshold is reused
+    ComputerVisionProjects::Calibration calibration;
+    uint64_t key = 0;
+    bool cached = false;
+    if (!cacheDirectory.empty() && ComputerVision::cacheKey(inputImage, threshold, autoThreshold, smoothSigma, pyramidFactor, fit == "contour", numSpheres, key)) {
+        // Contour fits are reused only with their residual, which --max-residual is checked on
+        cached = ComputerVisionProjects::LoadCalibration(cacheDirectory, key, &calibration) && calibration.has_sphere &&
+            (fit != "contour" || calibration.fit_residual >= 0);
+    }
 
-    // Compute the centroid of the binary image
-    int centerX, centerY;
-    ComputerVision::computeCentroid(binaryImage, centerX, centerY);
-    if (centerX == -1 || centerY == -1) {
-        std::cerr << "Error: No circle detected in the binary image." << std::endl;
-        return 1;
+    if (!cached) {
+        // 16-bit images are calibrated at full precision
+        ComputerVisionProjects::PgmHeader header;
+        if (!ComputerVisionProjects::ReadImageHeader(inputImage, &header)) {
+            std::cerr << "Error: Unable to read the PGM file." << std::endl;
+            return 1;
+        }
+        // The modes that load the whole image choose it there, after smoothing
+        if (autoThreshold && (tiled || pyramidFactor > 0)) {
+            if (!ComputerVision::otsuThreshold(inputImage, threshold)) return 1;
+        }
+        bool ok;
+        if (numSpheres > 0) {
+            std::vector<ComputerVisionProjects::SphereParameters> spheres;
+            ok = header.num_gray_levels > 255 ?
+                ComputerVision::calibrateSpheres<uint16_t>(inputImage, threshold, autoThreshold, smoothSigma, numSpheres, spheres) :
+                ComputerVision::calibrateSpheres<uint8_t>(inputImage, threshold, autoThreshold, smoothSigma, numSpheres, spheres);
+            if (ok) {
+                calibration.sphere = spheres[0];
+                calibration.other_spheres.assign(spheres.begin() + 1, spheres.end());
+            }
+        } else if (pyramidFactor > 0) {
+            ok = header.num_gray_levels > 255 ?
+                ComputerVision::calibrateCoarseToFine<uint16_t>(inputImage, threshold, pyramidFactor, calibration.sphere) :
+                ComputerVision::calibrateCoarseToFine<uint8_t>(inputImage, threshold, pyramidFactor, calibration.sphere);
+        } else if (tiled) {
+            ok = header.num_gray_levels > 255 ?
+                ComputerVision::calibrateTiled<uint16_t>(inputImage, threshold, tileOptions, calibration.sphere) :
+                ComputerVision::calibrateTiled<uint8_t>(inputImage, threshold, tileOptions, calibration.sphere);
+        } else {
+            ok = header.num_gray_levels > 255 ?
+                ComputerVision::calibrate<uint16_t>(inputImage, threshold, autoThreshold, smoothSigma, fit == "contour", calibration.sphere, calibration.fit_residual) :
+                ComputerVision::calibrate<uint8_t>(inputImage, threshold, autoThreshold, smoothSigma, fit == "contour", calibration.sphere, calibration.fit_residual);
+        }
+        if (!ok) return 1;
+        calibration.has_sphere = true;
+        if (!cacheDirectory.empty()) {
+            ComputerVisionProjects::StoreCalibration(cacheDirectory, key, calibration);
+        }
     }
 
-    // Compute the radius of the detected circle
-    double radius = ComputerVision::computeRadius(binaryImage, centerX, centerY);
+    // The limit is not part of the cache key, so cached fits are checked against it too
+    if (maxResidual > 0 && calibration.fit_residual > maxResidual) {
+        std::cerr << "Error: The outline is not round enough (residual " << calibration.fit_residual << " px, at most " << maxResidual << " allowed)." << std::endl;
+        return 1;
+    }
+    std::vector<ComputerVisionProjects::SphereParameters> spheres(1, calibration.sphere);
+    spheres.insert(spheres.end(), calibration.other_spheres.begin(), calibration.other_spheres.end());
 
     // Write the parameters to the output file
-    ComputerVision::writeParameters(outputFile, centerX, centerY, radius);
+    ComputerVision::writeParameters(outputFile, spheres);
 
-    std::cout << "Sphere center: (" << centerX << ", " << centerY << "), Radius: " << radius << std::endl;
+    for (size_t k = 0; k < spheres.size(); ++k) {
+        std::cout << "Sphere " << (spheres.size() > 1 ? std::to_string(k + 1) + " " : "") << "center: (" << spheres[k].center_x << ", "
+                  << spheres[k].center_y << "), Radius: " << spheres[k].radius << (cached ? " (cached)" : "") << std::endl;
+    }
 
     return 0;
 }
@@ -1,98 +1,90 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
-#include <vector>
 #include <cmath>
 #include <string>
 #include <limits>
+#include <vector>
+#include "calibration_cache.h"
+#include "image.h"
+#include "sphere.h"
+#include "trace.h"
 
 namespace ComputerVision {
 
-// Function to read PGM file (P5 format)
-bool readPGM(const std::string &filename, std::vector<std::vector<int>> &image) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        std::cerr << "Error: Could not open file " << filename << std::endl;
-        return false;
-    }
-
-    std::string line;
-    std::getline(file, line);  // Read the "P5"
-    if (line != "P5") {
-        std::cerr << "Error: Not a valid PGM file (expected P5)." << std::endl;
-        return false;
-    }
-
-    // Skip over any comments (lines starting with '#')
-    while (std::getline(file, line)) {
-        if (line[0] != '#') break;
-    }
-
-    // Read the image dimensions
-    int width, height;
-    std::istringstream(line) >> width >> height;
-    if (width <= 0 || height <= 0) {
-        std::cerr << "Error: Invalid image dimensions." << std::endl;
-        return false;
-    }
-
-    // Skip the "255" line (max pixel value)
-    std::getline(file, line);
-    if (line != "255") {
-        std::cerr << "Error: Expected max pixel value to be 255." << std::endl;
-        return false;
-    }
+using ComputerVisionProjects::BasicImage;
+using ComputerVisionProjects::SphereParameters;
 
-    // Now read the pixel data
-    image.resize(height, std::vector<int>(width));
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            image[i][j] = file.get();  // Read one byte (pixel value)
+// Computes the light directions from sphere images whose pixels are of type PixelType
+template <typename PixelType>
+bool computeDirections(const SphereParameters &sphere, const std::vector<std::string> &imageFiles, int highlightBand, std::vector<std::vector<double>> &directions) {
+    // Prepare the images
+    std::vector<BasicImage<PixelType>> images(imageFiles.size());
+    std::vector<ComputerVisionProjects::ImageView<PixelType>> views;
+    for (size_t i = 0; i < imageFiles.size(); ++i) {
+        if (!ComputerVisionProjects::ReadImage(imageFiles[i], &images[i])) {
+            std::cerr << "Error: Could not read one of the sphere images." << std::endl;
+            return false;
         }
+        if (images[i].num_rows() != images[0].num_rows() || images[i].num_columns() != images[0].num_columns()) {
+            std::cerr << "Error: The sphere images differ in size." << std::endl;
+            return false;
+        }
+        views.push_back(images[i].View());
     }
 
+    // Compute the direction vectors at the highlights' centroids, scaled by their brightness, all images at once
+    ComputerVisionProjects::ComputeLightDirections(views, sphere, highlightBand, &directions);
     return true;
 }
 
-// Function to compute the direction vector from the normal
-void computeDirectionVector(int centerX, int centerY, double radius, int pixelX, int pixelY, double &dx, double &dy, double &dz) {
-    // Compute the normal vector components in 3D space (using the formula)
-    double dx_norm = (pixelX - centerX) / radius;
-    double dy_norm = (pixelY - centerY) / radius;
-    
-    // Calculate dz based on the sphere equation: r^2 = (x-cx)^2 + (y-cy)^2 + (z-cz)^2
-    double dz_norm = std::sqrt(1.0 - dx_norm * dx_norm - dy_norm * dy_norm);  // This comes from the sphere equation
-
-    dx = dx_norm;
-    dy = dy_norm;
-    dz = dz_norm;
-}
-
-// Function to find the brightest pixel and its coordinates
-void findBrightestPixel(const std::vector<std::vector<int>> &image, int &brightestX, int &brightestY, int &brightness) {
-    int maxBrightness = 0;
-    brightestX = -1;
-    brightestY = -1;
-
-    for (int i = 0; i < image.size(); ++i) {
-        for (int j = 0; j < image[0].size(); ++j) {
-            if (image[i][j] > maxBrightness) {
-                maxBrightness = image[i][j];
-                brightestX = j;
-                brightestY = i;
-            }
-        }
+// Function to compute the cache key of the directions: the sphere parameters, the highlight band and the image contents
+bool cacheKey(const SphereParameters &sphere, const std::vector<std::string> &imageFiles, int highlightBand, uint64_t &key) {
+    ComputerVisionProjects::ContentHash hash;
+    hash.UpdateString("s2 highlights");
+    hash.UpdateValue(sphere.center_x);
+    hash.UpdateValue(sphere.center_y);
+    hash.UpdateValue(sphere.radius);
+    hash.UpdateValue(highlightBand);
+    for (size_t i = 0; i < imageFiles.size(); ++i) {
+        if (!ComputerVisionProjects::HashFile(imageFiles[i], &hash)) return false;
     }
-    brightness = maxBrightness;
+    key = hash.Digest();
+    return true;
 }
 
 }  // namespace ComputerVision
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        std::cerr << "Usage: " << argv[0] << " <input parameters file> <sphere image 1> <sphere image 2> <sphere image 3> <output directions file>" << std::endl;
+    // Pull out the options, leaving the positional arguments
+    std::string cacheDirectory;  // No caching unless given
+    int highlightBand = 0;  // Only the brightest pixels unless given
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char *> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--cache" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (std::string(argv[i]) == "--highlight-band" && i + 1 < argc) {
+            highlightBand = std::stoi(argv[++i]);
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " [--cache DIR] [--highlight-band B] [--trace FILE] [--metrics FILE] <input parameters file> <sphere image 1> ... <sphere image N> <output directions file>" << std::endl;
         return 1;
     }
+    const std::vector<std::string> imageFiles(argv + 2, argv + argc - 1);
+    const std::string outputFile = argv[argc - 1];
+
+    // Traces are written on return
+    ComputerVisionProjects::TraceSession trace(traceFile, metricsFile);
 
     // Read the parameters file
     std::ifstream paramFile(argv[1]);
@@ -101,50 +93,52 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    int centerX, centerY;
-    double radius;
-    paramFile >> centerX >> centerY >> radius;
+    ComputerVisionProjects::SphereParameters sphere;
+    paramFile >> sphere.center_x >> sphere.center_y >> sphere.radius;
     paramFile.close();
 
-    // Prepare the images
-    std::vector<std::vector<int>> image1, image2, image3;
-    if (!ComputerVision::readPGM(argv[2], image1) || !ComputerVision::readPGM(argv[3], image2) || !ComputerVision::readPGM(argv[4], image3)) {
-        std::cerr << "Error: Could not read one of the sphere images." << std::endl;
-        return 1;
+    // Directions cached for the same sphere and images are reused
+    ComputerVisionProjects::Calibration calibration;
+    uint64_t key = 0;
+    bool cached = false;
+    if (!cacheDirectory.empty() && ComputerVision::cacheKey(sphere, imageFiles, highlightBand, key)) {
+        cached = ComputerVisionProjects::LoadCalibration(cacheDirectory, key, &calibration) && calibration.directions.size() == imageFiles.size();
+    }
+
+    if (!cached) {
+        // 16-bit images are searched at full precision
+        bool sixteenBit = false;
+        for (size_t i = 0; i < imageFiles.size(); ++i) {
+            ComputerVisionProjects::PgmHeader header;
+            if (!ComputerVisionProjects::ReadImageHeader(imageFiles[i], &header)) {
+                std::cerr << "Error: Could not read one of the sphere images." << std::endl;
+                return 1;
+            }
+            if (header.num_gray_levels > 255) sixteenBit = true;
+        }
+
+        calibration.has_sphere = false;
+        calibration.directions.clear();
+        bool ok = sixteenBit ?
+            ComputerVision::computeDirections<uint16_t>(sphere, imageFiles, highlightBand, calibration.directions) :
+            ComputerVision::computeDirections<uint8_t>(sphere, imageFiles, highlightBand, calibration.directions);
+        if (!ok) return 1;
+        if (!cacheDirectory.empty()) {
+            ComputerVisionProjects::StoreCalibration(cacheDirectory, key, calibration);
+        }
     }
 
     // Output file for the light directions
-    std::ofstream outFile(argv[5]);
+    std::ofstream outFile(outputFile);
     if (!outFile) {
-        std::cerr << "Error: Could not open output file " << argv[5] << std::endl;
+        std::cerr << "Error: Could not open output file " << outputFile << std::endl;
         return 1;
     }
-
-    // Process each image
-    for (int i = 0; i < 3; ++i) {
-        std::vector<std::vector<int>> *image;
-        if (i == 0) image = &image1;
-        else if (i == 1) image = &image2;
-        else image = &image3;
-
-        // Find the brightest pixel in the image
-        int brightestX, brightestY, brightness;
-        ComputerVision::findBrightestPixel(*image, brightestX, brightestY, brightness);
-
-        // Compute the direction vector at the brightest pixel
-        double dx, dy, dz;
-        ComputerVision::computeDirectionVector(centerX, centerY, radius, brightestX, brightestY, dx, dy, dz);
-
-        // Scale the direction vector by the brightness
-        double scale = static_cast<double>(brightness);
-        dx *= scale;
-        dy *= scale;
-        dz *= scale;
-
-        // Write the direction to the output file
-        outFile << dx << " " << dy << " " << dz << std::endl;
+    for (size_t i = 0; i < calibration.directions.size(); ++i) {
+        const std::vector<double> &direction = calibration.directions[i];
+        outFile << direction[0] << " " << direction[1] << " " << direction[2] << std::endl;
     }
 
-    std::cout << "Light directions written to " << argv[5] << std::endl;
+    std::cout << "Light directions written to " << outputFile << (cached ? " (cached)" : "") << std::endl;
     return 0;
 }
@@ -3,7 +3,12 @@
 #include <cmath>
 #include <vector>
 #include <string>
+#include "filter.h"
+#include "histogram.h"
 #include "image.h"  // Include the header for your Image class
+#include "photometric.h"
+#include "thread_pool.h"
+#include "trace.h"
 
 using namespace ComputerVisionProjects;
 
@@ -21,93 +26,104 @@ bool loadDirections(const std::string& filename, std::vector<std::vector<double>
     return true;
 }
 
-// Function to locate the center of the sphere in the image
-bool locateSphere(const Image& image, int& centerX, int& centerY, int& radius) {
-    centerX = image.num_columns() / 2;
-    centerY = image.num_rows() / 2;
-    radius = std::min(image.num_columns(), image.num_rows()) / 4;
+// Replaces the image of each reader with a copy smoothed by a Gaussian of standard deviation sigma, kept in buffers
+bool smoothImages(std::vector<ImageReader>& readers, double sigma, ThreadPool* pool, std::vector<std::vector<char>>& buffers) {
+    buffers.resize(readers.size());
+    Image16 image, smoothed;
+    for (size_t k = 0; k < readers.size(); ++k) {
+        image.AllocateSpaceAndSetSize(readers[k].num_rows(), readers[k].num_columns());
+        image.SetNumberGrayLevels(readers[k].num_gray_levels());
+        readers[k].ReadRows(0, image.num_rows(), image.data(), image.stride());
+        GaussianBlur(image.View(), sigma, BorderPolicy::kReflect, pool, &smoothed);
+        EncodeImage(smoothed.View(), &buffers[k]);
+        if (!OpenImageInMemory(buffers[k].data(), buffers[k].size(), &readers[k])) return false;
+    }
     return true;
 }
 
-// Function to compute light intensities based on the provided images
-bool computeLightIntensities(const std::vector<std::string>& imageFiles, 
-                             const std::vector<std::vector<double>>& directions, 
-                             const Image& sphereImage, 
-                             std::vector<std::vector<double>>& intensities) {
-    for (size_t i = 0; i < imageFiles.size(); ++i) {
-        Image img;
-        if (!ReadImage(imageFiles[i], &img)) {
-            std::cerr << "Error reading image: " << imageFiles[i] << std::endl;
-            return false;
-        }
-
-        // Locate the sphere in the current image
-        int centerX, centerY, radius;
-        if (!locateSphere(img, centerX, centerY, radius)) {
-            std::cerr << "Error locating sphere in image: " << imageFiles[i] << std::endl;
-            return false;
-        }
-
-        // Compute intensity based on direction and pixel values (simplified)
-        for (size_t y = 0; y < img.num_rows(); ++y) {
-            for (size_t x = 0; x < img.num_columns(); ++x) {
-                int pixelValue = img.GetPixel(y, x);
+// Chooses the threshold by Otsu's method, from the histogram of the brightest image at each pixel: the one the foreground is tested on
+int otsuThreshold(const std::vector<ImageReader>& readers, ThreadPool* pool) {
+    std::vector<uint64_t> histogram;
+    ComputeMaximumHistogram(readers, pool, &histogram);
+    return OtsuThreshold(histogram);
+}
 
-                // Add the pixel intensity contribution to the corresponding light source's direction
-                for (size_t d = 0; d < directions.size(); ++d) {
-                    intensities[d][y * img.num_columns() + x] += pixelValue * directions[d][0];  // Simplified
-                }
-            }
+int main(int argc, char** argv) {
+    // Pull out the options, leaving the positional arguments
+    size_t threads = 0;  // One per hardware thread
+    bool stream = false;
+    size_t bandRows = 64;
+    bool bandRowsGiven = false;
+    size_t memoryBudget = 0;  // Tiled only if given, in MB
+    TileOptions tileOptions;
+    std::string needleMapFile;  // No needle map unless given
+    bool robust = false;
+    double smoothSigma = 0;  // No smoothing unless given
+    bool autoThreshold = false;
+    float robustLow = 0, robustHigh = 0;
+    std::string floatFormat;  // 8-bit pgm outputs unless given
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--stream") {
+            stream = true;
+        } else if (std::string(argv[i]) == "--band-rows" && i + 1 < argc) {
+            bandRows = std::stoul(argv[++i]);
+            bandRowsGiven = true;
+        } else if (std::string(argv[i]) == "--memory-budget" && i + 1 < argc) {
+            memoryBudget = std::stoul(argv[++i]) << 20;
+        } else if (std::string(argv[i]) == "--tile-size" && i + 1 < argc) {
+            tileOptions.tile_size = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--robust" && i + 2 < argc) {
+            robust = true;
+            robustLow = std::stof(argv[++i]);
+            robustHigh = std::stof(argv[++i]);
+        } else if (std::string(argv[i]) == "--auto-threshold") {
+            autoThreshold = true;
+        } else if (std::string(argv[i]) == "--smooth" && i + 1 < argc) {
+            smoothSigma = std::stod(argv[++i]);
+        } else if (std::string(argv[i]) == "--float" && i + 1 < argc) {
+            floatFormat = argv[++i];
+        } else if (std::string(argv[i]) == "--needle-map" && i + 1 < argc) {
+            needleMapFile = argv[++i];
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
         }
     }
-    return true;
-}
+    argc = args.size();
+    argv = args.data();
 
-// Function to compute normals and albedo (simplified example)
-bool computeNormalsAndAlbedo(const std::vector<std::vector<double>>& intensities, 
-                             const std::vector<std::vector<double>>& directions, 
-                             Image& normalsImage, Image& albedoImage) {
-    // Now we compute the normals based on the intensities and directions
-    for (int y = 0; y < normalsImage.num_rows(); ++y) {
-        for (int x = 0; x < normalsImage.num_columns(); ++x) {
-            std::vector<double> normal(3, 0.0);
-            double totalIntensity = 0.0;
-
-            // Summing intensities for each light source to estimate the normal at this pixel
-            for (size_t d = 0; d < directions.size(); ++d) {
-                int idx = y * normalsImage.num_columns() + x;  // Flatten the 2D coordinate to 1D index
-                double intensity = intensities[d][idx];
-                totalIntensity += intensity;
-
-                // Update normal direction based on the light source's direction
-                for (int i = 0; i < 3; ++i) {
-                    normal[i] += intensity * directions[d][i];  // Direction of the light source multiplied by intensity
-                }
-            }
+    // With --auto-threshold the threshold is chosen from the images instead of given
+    const int numTrailing = autoThreshold ? 3 : 4;
 
-            // Normalize the normal vector
-            double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
-            if (length > 0.0) {
-                for (int i = 0; i < 3; ++i) {
-                    normal[i] /= length;
-                }
-            }
+    // Ensure correct usage of the program with required arguments
+    if (argc < 5 + numTrailing) {
+        std::cerr << "Usage: s3 [--threads N] [--stream [--band-rows N]] [--memory-budget MB [--tile-size N]] [--robust LOW HIGH] [--smooth SIGMA] [--auto-threshold] [--float pfm|planes] [--needle-map FILE] [--trace FILE] [--metrics FILE] {directions file} {image 1} {image 2} {image 3}... {step} {threshold (not with --auto-threshold)} {normals image} {albedo image}" << std::endl;
+        return 1;
+    }
 
-            // Set the normal and albedo (simplified as intensity for now)
-            normalsImage.SetPixel(y, x, static_cast<int>(normal[0] * 255));  // Use one component as normal for simplicity
-            albedoImage.SetPixel(y, x, static_cast<int>(totalIntensity * 255));  // Use intensity as albedo for simplicity
-        }
+    if (smoothSigma < 0) {
+        std::cerr << "The smoothing sigma cannot be negative!" << std::endl;
+        return 1;
     }
-    return true;
-}
 
-int main(int argc, char** argv) {
-    // Ensure correct usage of the program with required arguments
-    if (argc < 9) {
-        std::cerr << "Usage: s3 {directions file} {image 1} {image 2} {image 3}... {step} {threshold} {normals image} {albedo image}" << std::endl;
+    FloatFormat format = FloatFormat::kPlanes;
+    if (floatFormat == "pfm") {
+        format = FloatFormat::kPfm;
+    } else if (!floatFormat.empty() && floatFormat != "planes") {
+        std::cerr << "Unknown float format " << floatFormat << " (expected pfm or planes)" << std::endl;
         return 1;
     }
 
+    // Traces are written on return
+    TraceSession trace(traceFile, metricsFile);
+
     // Read light source directions from the file
     std::vector<std::vector<double>> directions;
     if (!loadDirections(argv[1], directions)) {
@@ -117,45 +133,158 @@ int main(int argc, char** argv) {
 
     // Store image file paths
     std::vector<std::string> imageFiles;
-    for (int i = 2; i < argc - 4; ++i) {
+    for (int i = 2; i < argc - numTrailing; ++i) {
         imageFiles.push_back(argv[i]);
     }
-
-    // Read the first image to initialize image size
-    Image firstImage;
-    if (!ReadImage(imageFiles[0], &firstImage)) {
-        std::cerr << "Failed to read first image!" << std::endl;
+    if (imageFiles.size() != directions.size()) {
+        std::cerr << "Expected one image per light direction (" << directions.size() << "), got " << imageFiles.size() << std::endl;
         return 1;
     }
 
-    // Initialize the intensities array (one for each light source, with an intensity per pixel)
-    std::vector<std::vector<double>> intensities(directions.size(), std::vector<double>(firstImage.num_rows() * firstImage.num_columns(), 0.0));
+    // Invert the light matrix once for every pixel
+    LightMatrix lights;
+    if (!ComputeLightMatrix(directions, &lights)) {
+        std::cerr << "Light directions do not determine the normals!" << std::endl;
+        return 1;
+    }
 
-    // Process the images and compute intensities
-    if (!computeLightIntensities(imageFiles, directions, firstImage, intensities)) {
-        std::cerr << "Failed to compute light intensities!" << std::endl;
+    // Robust mode drops the shadowed and saturated samples of every pixel
+    if (robust && !EnableRobustSolve(directions, robustLow, robustHigh, &lights)) {
+        std::cerr << "Cannot solve robustly with these light directions!" << std::endl;
         return 1;
     }
 
-    // Prepare output images for normals and albedo
-    Image normalsImage, albedoImage;
+    ThreadPool pool(threads);
 
-    // Use the size of the first image to determine the dimensions of output images
-    if (!ReadImage(imageFiles[0], &normalsImage)) {
-        std::cerr << "Error reading image for normals!" << std::endl;
-        return 1;
+    // With a memory budget the images are read through tile caches, and the outputs written a row of tiles at a time
+    if (memoryBudget > 0) {
+        if (!needleMapFile.empty()) {
+            std::cerr << "The needle map is drawn over a whole image; it cannot be combined with --memory-budget!" << std::endl;
+            return 1;
+        }
+        if (smoothSigma > 0) {
+            std::cerr << "Smoothing filters whole images; it cannot be combined with --memory-budget!" << std::endl;
+            return 1;
+        }
+        if (stream || bandRowsGiven) {
+            std::cerr << "The outputs are already written a row of tiles at a time; --stream and --band-rows cannot be combined with --memory-budget!" << std::endl;
+            return 1;
+        }
+        PgmHeader header;
+        if (!ReadImageHeader(imageFiles[0], &header)) {
+            std::cerr << "Failed to compute light intensities!" << std::endl;
+            return 1;
+        }
+        tileOptions.memory_budget = TileCacheBudget(memoryBudget, imageFiles.size(), header.num_columns, tileOptions.tile_size, !floatFormat.empty(), pool.num_threads());
+        if (tileOptions.memory_budget == 0 || tileOptions.tile_size == 0) {
+            std::cerr << "The memory budget is too small for " << imageFiles.size() << " images in tiles of " << tileOptions.tile_size << " on " << pool.num_threads() << " threads!" << std::endl;
+            return 1;
+        }
+        std::vector<TiledImage<uint16_t>> images;
+        if (!OpenTiledObjectImages(imageFiles, tileOptions, &images)) {
+            std::cerr << "Failed to compute light intensities!" << std::endl;
+            return 1;
+        }
+        int threshold = autoThreshold ? 0 : std::stoi(argv[argc - 3]);
+        if (autoThreshold) {
+            // The histograms are counted a band of rows at a time, within the budget too
+            std::vector<ImageReader> readers;
+            if (!OpenObjectImages(imageFiles, &readers)) {
+                std::cerr << "Failed to compute light intensities!" << std::endl;
+                return 1;
+            }
+            threshold = otsuThreshold(readers, &pool);
+            std::cout << "Otsu threshold: " << threshold << std::endl;
+        }
+        bool ok = floatFormat.empty() ?
+            StreamTiledNormalsAndAlbedo(images, lights, threshold, &pool, argv[argc - 2], argv[argc - 1]) :
+            StreamTiledFloatNormalsAndAlbedo(images, lights, threshold, &pool, format, argv[argc - 2], argv[argc - 1]);
+        if (!ok) {
+            std::cerr << "Failed to compute normals and albedo!" << std::endl;
+            return 1;
+        }
+        std::cout << "Normals and albedo images successfully written!" << std::endl;
+        return 0;
     }
-    if (!ReadImage(imageFiles[0], &albedoImage)) {
-        std::cerr << "Error reading image for albedo!" << std::endl;
+
+    // Open the images; their pixels are decoded tile by tile
+    std::vector<ImageReader> readers;
+    if (!OpenObjectImages(imageFiles, &readers)) {
+        std::cerr << "Failed to compute light intensities!" << std::endl;
         return 1;
     }
 
-    // Compute normals and albedo
-    if (!computeNormalsAndAlbedo(intensities, directions, normalsImage, albedoImage)) {
-        std::cerr << "Failed to compute normals and albedo!" << std::endl;
+    // Smoothing the images before the solve evens out their noise; the smoothed copies are read from memory
+    std::vector<std::vector<char>> smoothedImages;
+    if (smoothSigma > 0 && !smoothImages(readers, smoothSigma, &pool, smoothedImages)) {
+        std::cerr << "Failed to smooth the images!" << std::endl;
         return 1;
     }
 
+    // Needles every step pixels of the solved foreground, where some image is brighter than threshold
+    int step = std::stoi(argv[argc - numTrailing]);
+    int threshold = autoThreshold ? otsuThreshold(readers, &pool) : std::stoi(argv[argc - 3]);
+    if (autoThreshold) {
+        std::cout << "Otsu threshold: " << threshold << std::endl;
+    }
+    if (!needleMapFile.empty()) {
+        if (step < 1) {
+            std::cerr << "The needle step must be at least 1!" << std::endl;
+            return 1;
+        }
+        std::vector<Needle> needles;
+        ComputeNeedles(readers, lights, step, threshold, &needles);
+        Image needleMap;
+        RenderNeedleMap(readers[0], needles, step, &needleMap);
+        if (!WriteImage(needleMapFile, needleMap)) {
+            std::cerr << "Error writing needle map!" << std::endl;
+            return 1;
+        }
+    }
+
+    // In streaming mode the outputs are written band by band as they are solved
+    if (stream && !floatFormat.empty()) {
+        if (!StreamFloatNormalsAndAlbedo(readers, lights, threshold, &pool, bandRows, format, argv[argc - 2], argv[argc - 1])) {
+            std::cerr << "Failed to compute normals and albedo!" << std::endl;
+            return 1;
+        }
+        std::cout << "Normals and albedo images successfully written!" << std::endl;
+        return 0;
+    }
+    if (stream) {
+        if (!StreamNormalsAndAlbedo(readers, lights, threshold, &pool, bandRows, argv[argc - 2], argv[argc - 1])) {
+            std::cerr << "Failed to compute normals and albedo!" << std::endl;
+            return 1;
+        }
+        std::cout << "Normals and albedo images successfully written!" << std::endl;
+        return 0;
+    }
+
+    // Compute normals and albedo, only where some image is brighter than threshold
+    ForegroundMask mask;
+    ComputeForegroundMask(readers, threshold, &pool, &mask);
+
+    // Full precision outputs: the three normal components and the albedo
+    if (!floatFormat.empty()) {
+        ImageFloat normals[3], albedo;
+        ComputeFloatNormalsAndAlbedo(readers, lights, &mask, &pool, normals, &albedo);
+        const ImageView<float> normalPlanes[3] = {normals[0].View(), normals[1].View(), normals[2].View()};
+        const ImageView<float> albedoPlane = albedo.View();
+        if (!WriteFloatImage(argv[argc - 2], format, normalPlanes, 3)) {
+            std::cerr << "Error writing normals image!" << std::endl;
+            return 1;
+        }
+        if (!WriteFloatImage(argv[argc - 1], format, &albedoPlane, 1)) {
+            std::cerr << "Error writing albedo image!" << std::endl;
+            return 1;
+        }
+        std::cout << "Normals and albedo images successfully written!" << std::endl;
+        return 0;
+    }
+
+    Image normalsImage, albedoImage;
+    ComputeNormalsAndAlbedo(readers, lights, &mask, &pool, &normalsImage, &albedoImage);
+
     // Save the output images
     if (!WriteImage(argv[argc - 2], normalsImage)) {
         std::cerr << "Error writing normals image!" << std::endl;
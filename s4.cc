@@ -0,0 +1,101 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "depth.h"
+#include "image.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace ComputerVisionProjects;
+
+int main(int argc, char** argv) {
+    // Pull out the options, leaving the positional arguments
+    size_t threads = 0;  // One per hardware thread
+    DepthOptions options;
+    std::string method = "multigrid";
+    std::string floatFormat;  // 8-bit pgm output unless given
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--method" && i + 1 < argc) {
+            method = argv[++i];
+        } else if (std::string(argv[i]) == "--tolerance" && i + 1 < argc) {
+            options.tolerance = std::stod(argv[++i]);
+        } else if (std::string(argv[i]) == "--max-iterations" && i + 1 < argc) {
+            options.max_iterations = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--min-normal-z" && i + 1 < argc) {
+            options.min_normal_z = std::stof(argv[++i]);
+        } else if (std::string(argv[i]) == "--float" && i + 1 < argc) {
+            floatFormat = argv[++i];
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
+    // Ensure correct usage of the program with required arguments
+    if (argc != 3) {
+        std::cerr << "Usage: s4 [--threads N] [--method multigrid|fft] [--tolerance T] [--max-iterations N] [--min-normal-z Z] [--float pfm|planes] [--trace FILE] [--metrics FILE] {normals planes file} {depth image}" << std::endl;
+        return 1;
+    }
+    if (method == "fft") {
+        options.method = DepthMethod::kFourier;
+    } else if (method != "multigrid") {
+        std::cerr << "Unknown method " << method << " (expected multigrid or fft)" << std::endl;
+        return 1;
+    }
+    FloatFormat format = FloatFormat::kPlanes;
+    if (floatFormat == "pfm") {
+        format = FloatFormat::kPfm;
+    } else if (!floatFormat.empty() && floatFormat != "planes") {
+        std::cerr << "Unknown float format " << floatFormat << " (expected pfm or planes)" << std::endl;
+        return 1;
+    }
+
+    // Traces are written on return
+    TraceSession trace(traceFile, metricsFile);
+
+    // The normals written by s3 --float planes, used in place
+    MappedFloatPlanes normals;
+    if (!MapFloatPlanes(argv[1], &normals) || normals.num_planes() != 3) {
+        std::cerr << "Expected the x, y and z planes of the normals in " << argv[1] << std::endl;
+        return 1;
+    }
+    const ImageView<float> planes[3] = {normals.plane(0), normals.plane(1), normals.plane(2)};
+
+    // Integrate over the pixels whose normal is usable
+    ThreadPool pool(threads);
+    ImageFloat height;
+    Image mask;
+    DepthStatistics statistics;
+    ComputeDepth(planes, options, &pool, &height, &mask, &statistics);
+    std::cout << "Integrated " << statistics.foreground_pixels << " pixels in " << statistics.iterations
+              << " iterations, relative residual " << statistics.relative_residual << std::endl;
+
+    // Save the height map, in pixels, or scaled to gray levels
+    if (!floatFormat.empty()) {
+        const ImageView<float> heightPlane = height.View();
+        if (!WriteFloatImage(argv[2], format, &heightPlane, 1)) {
+            std::cerr << "Error writing depth image!" << std::endl;
+            return 1;
+        }
+    } else {
+        Image depthImage;
+        QuantizeHeight(height, mask, &depthImage);
+        if (!WriteImage(argv[2], depthImage)) {
+            std::cerr << "Error writing depth image!" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "Depth image successfully written!" << std::endl;
+
+    return 0;
+}
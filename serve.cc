@@ -0,0 +1,365 @@
+// A long-running solver for many small jobs: listens on a Unix domain
+// socket and solves each job as s3 would, without paying for process
+// startup, calibration loading and buffer allocation every time. The
+// thread pool, the light matrices of the calibrations seen so far and
+// the output buffers all stay warm between jobs.
+//
+// Clients send one request per line, words separated by spaces (so paths
+// cannot hold spaces), and get one reply line per request:
+//   solve {directions file} {threshold} {normals image | shm} {albedo image | shm} {image 1} ... {image N}
+//     -> ok {normals} {albedo}
+//   stats
+//     -> ok jobs J failures F calibrations C loads L
+//   shutdown
+//     -> ok
+// Failed requests get "error {reason}" instead. A directions file is
+// read again only when it changes on disk. "shm" in place of an output
+// path writes that output to a new POSIX shared memory object, whose name
+// the reply gives in place of the path: the client maps it (its size is
+// that of the pgm file inside) and must shm_unlink() it once done.
+// Jobs are solved one at a time, each with the whole pool; connections
+// are served in turn as their requests arrive.
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "image.h"
+#include "photometric.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace ComputerVisionProjects;
+
+namespace {
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+}  // namespace
+
+// Function to load light source directions from a file
+bool loadDirections(const std::string& filename, std::vector<std::vector<double>>& directions) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Error loading directions file!" << std::endl;
+        return false;
+    }
+    double x, y, z;
+    while (file >> x >> y >> z) {
+        directions.push_back({x, y, z});
+    }
+    return true;
+}
+
+// The state kept warm between jobs
+class Server {
+public:
+    explicit Server(size_t threads): pool_(threads), jobs_(0), failures_(0), loads_(0), shmObjects_(0) {}
+
+    // Carries out the request on line. Returns the reply, without the newline; sets stop for shutdown
+    std::string handle(const std::string &line, bool &stop) {
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+        if (command == "solve") {
+            ++jobs_;
+            std::vector<std::string> arguments;
+            for (std::string word; words >> word; ) arguments.push_back(word);
+            // A job too big for memory (or otherwise failing to run) fails alone; the server keeps serving
+            std::string reply;
+            try {
+                reply = solve(arguments);
+            } catch (const std::exception &e) {
+                reply = std::string("error job failed: ") + e.what();
+            }
+            if (reply.compare(0, 3, "ok ") != 0) ++failures_;
+            return reply;
+        }
+        if (command == "stats") {
+            std::ostringstream reply;
+            reply << "ok jobs " << jobs_ << " failures " << failures_ << " calibrations " << calibrations_.size()
+                  << " loads " << loads_;
+            return reply.str();
+        }
+        if (command == "shutdown") {
+            stop = true;
+            return "ok";
+        }
+        return "error unknown request " + command + " (expected solve, stats or shutdown)";
+    }
+
+    size_t jobs() const { return jobs_; }
+    size_t failures() const { return failures_; }
+
+private:
+    // A calibration as last loaded, with what identified the file's contents then
+    struct Calibration {
+        struct timespec modified;
+        off_t size;
+        LightMatrix lights;
+    };
+
+    // Most calibrations a rig needs; past this many, the cache starts over
+    static const size_t kMaxCalibrations = 64;
+
+    // The light matrix of directions file filename, loaded unless cached since its last change
+    const LightMatrix *lights(const std::string &filename, std::string &error) {
+        struct stat status;
+        if (stat(filename.c_str(), &status) != 0) {
+            error = "cannot read directions file " + filename;
+            return nullptr;
+        }
+        std::map<std::string, Calibration>::iterator found = calibrations_.find(filename);
+        if (found != calibrations_.end() && found->second.size == status.st_size &&
+            found->second.modified.tv_sec == status.st_mtim.tv_sec &&
+            found->second.modified.tv_nsec == status.st_mtim.tv_nsec) {
+            return &found->second.lights;
+        }
+
+        std::vector<std::vector<double>> directions;
+        Calibration calibration;
+        if (!loadDirections(filename, directions)) {
+            error = "cannot read directions file " + filename;
+            return nullptr;
+        }
+        if (!ComputeLightMatrix(directions, &calibration.lights)) {
+            error = "light directions in " + filename + " do not determine the normals";
+            return nullptr;
+        }
+        ++loads_;
+        calibration.modified = status.st_mtim;
+        calibration.size = status.st_size;
+        if (found == calibrations_.end() && calibrations_.size() == kMaxCalibrations) calibrations_.clear();
+        Calibration &cached = calibrations_[filename];
+        cached = calibration;
+        return &cached.lights;
+    }
+
+    // Writes image to output, a path or "shm" for a new shared memory object.
+    // Returns where it went, or an empty string on failure
+    std::string writeOutput(const std::string &output, const Image &image) {
+        if (output != "shm") return WriteImage(output, image) ? output : std::string();
+        char name[64];
+        snprintf(name, sizeof name, "/photometric-%ld-%zu", static_cast<long>(getpid()), ++shmObjects_);
+        const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) return std::string();
+        const bool ok = WriteImage(fd, image.View());
+        close(fd);
+        if (!ok) {
+            shm_unlink(name);
+            return std::string();
+        }
+        return name;
+    }
+
+    std::string solve(const std::vector<std::string> &arguments) {
+        if (arguments.size() < 4) {
+            return "error usage: solve {directions file} {threshold} {normals image | shm} {albedo image | shm} {image 1} ... {image N}";
+        }
+        TRACE_SCOPE("job");
+        std::string error;
+        const LightMatrix *lightMatrix = lights(arguments[0], error);
+        if (lightMatrix == nullptr) return "error " + error;
+        int threshold;
+        std::istringstream thresholdWord(arguments[1]);
+        if (!(thresholdWord >> threshold) || !thresholdWord.eof()) return "error threshold " + arguments[1] + " is not an integer";
+        const size_t numLights = arguments.size() - 4;
+        if (numLights != lightMatrix->num_lights) {
+            std::ostringstream reply;
+            reply << "error " << numLights << " images for " << lightMatrix->num_lights << " light directions";
+            return reply.str();
+        }
+
+        // Mapped for this job only, so that the pages are not held between jobs
+        readers_.resize(numLights);
+        bool ok = true;
+        for (size_t d = 0; d < numLights && ok; ++d) {
+            if (!OpenImage(arguments[4 + d], &readers_[d])) {
+                error = "cannot read image " + arguments[4 + d];
+                ok = false;
+            } else if (readers_[d].num_rows() != readers_[0].num_rows() ||
+                       readers_[d].num_columns() != readers_[0].num_columns()) {
+                error = "image " + arguments[4 + d] + " differs in size from " + arguments[4];
+                ok = false;
+            }
+        }
+        std::string normalsOutput, albedoOutput;
+        if (ok) {
+            if (threshold >= 0) ComputeForegroundMask(readers_, threshold, &pool_, &mask_);
+            ComputeNormalsAndAlbedo(readers_, *lightMatrix, threshold >= 0 ? &mask_ : nullptr, &pool_, &normals_, &albedo_);
+            normalsOutput = writeOutput(arguments[2], normals_);
+            albedoOutput = writeOutput(arguments[3], albedo_);
+            if (normalsOutput.empty() || albedoOutput.empty()) {
+                error = "cannot write the outputs";
+                ok = false;
+            }
+        }
+        for (size_t d = 0; d < readers_.size(); ++d) readers_[d].Close();
+        if (!ok) {
+            // A shared memory object no one will hear of would never be unlinked
+            if (arguments[2] == "shm" && !normalsOutput.empty()) shm_unlink(normalsOutput.c_str());
+            if (arguments[3] == "shm" && !albedoOutput.empty()) shm_unlink(albedoOutput.c_str());
+            return "error " + error;
+        }
+        return "ok " + normalsOutput + " " + albedoOutput;
+    }
+
+    ThreadPool pool_;
+    std::map<std::string, Calibration> calibrations_;  // By directions file
+    // Reused by every job: the output buffers keep their space while the image size does not change
+    std::vector<ImageReader> readers_;
+    ForegroundMask mask_;
+    Image normals_, albedo_;
+    size_t jobs_, failures_, loads_, shmObjects_;
+};
+
+// Sends all of reply and a newline to a client. Returns false if the client is gone
+bool sendReply(int fd, std::string reply) {
+    reply += '\n';
+    for (size_t sent = 0; sent < reply.size(); ) {
+        const ssize_t count = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        sent += count;
+    }
+    return true;
+}
+
+// Creates the listening socket at path. A socket file left there by a server no longer running is replaced
+int listenAt(const std::string &path) {
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof address.sun_path) {
+        std::cerr << "Error: Socket path " << path << " is too long." << std::endl;
+        return -1;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot create a socket." << std::endl;
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof address) == 0) {
+        std::cerr << "Error: A server is already listening on " << path << std::endl;
+        close(fd);
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof address) != 0 || listen(fd, 64) != 0) {
+        std::cerr << "Error: Cannot listen on " << path << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    // Pull out the options, leaving the positional arguments
+    size_t threads = 0;  // One per hardware thread
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() != 2) {
+        std::cerr << "Usage: serve [--threads N] [--trace FILE] [--metrics FILE] {socket path}" << std::endl;
+        return 1;
+    }
+    const std::string socketPath = args[1];
+
+    // SIGINT and SIGTERM interrupt poll() and end the loop, so that the socket file is removed
+    struct sigaction action;
+    std::memset(&action, 0, sizeof action);
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    const int listener = listenAt(socketPath);
+    if (listener < 0) return 1;
+
+    // Traces are written on return
+    TraceSession trace(traceFile, metricsFile);
+    Server server(threads);
+    std::cout << "Serving on " << socketPath << std::endl;
+
+    // The listener first, then one entry per client, with what each has sent past its last full line
+    std::vector<struct pollfd> watched(1);
+    watched[0].fd = listener;
+    watched[0].events = POLLIN;
+    std::vector<std::string> pending(1);
+    const size_t kMaxRequestSize = 1 << 16;
+    char buffer[4096];
+    bool stop = false;
+    while (!stop && !stopRequested) {
+        if (poll(watched.data(), watched.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: poll failed." << std::endl;
+            break;
+        }
+        for (size_t k = watched.size() - 1; k > 0 && !stop; --k) {
+            if (watched[k].revents == 0) continue;
+            const ssize_t count = recv(watched[k].fd, buffer, sizeof buffer, 0);
+            if (count < 0 && errno == EINTR) continue;
+            bool open = count > 0;
+            if (open) pending[k].append(buffer, count);
+            for (size_t end; open && !stop && (end = pending[k].find('\n')) != std::string::npos; ) {
+                std::string line = pending[k].substr(0, end);
+                pending[k].erase(0, end + 1);
+                if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+                if (!line.empty()) open = sendReply(watched[k].fd, server.handle(line, stop));
+            }
+            if (pending[k].size() > kMaxRequestSize) {
+                sendReply(watched[k].fd, "error request too long");
+                open = false;
+            }
+            if (!open) {
+                close(watched[k].fd);
+                watched.erase(watched.begin() + k);
+                pending.erase(pending.begin() + k);
+            }
+        }
+        if (watched[0].revents & POLLIN) {
+            const int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                struct pollfd entry;
+                entry.fd = client;
+                entry.events = POLLIN;
+                entry.revents = 0;
+                watched.push_back(entry);
+                pending.push_back(std::string());
+            }
+        }
+    }
+
+    for (size_t k = 0; k < watched.size(); ++k) close(watched[k].fd);
+    unlink(socketPath.c_str());
+    std::cout << server.jobs() - server.failures() << " jobs solved, " << server.failures() << " failures." << std::endl;
+    return 0;
+}
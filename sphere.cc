@@ -0,0 +1,749 @@
+// Kernels for locating the calibration sphere in a gray-scale image and
+// for finding the light directions from its highlights.
+// To be used in Computer Vision class.
+
+#include "sphere.h"
+#include "components.h"
+#include "trace.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+// Per-row accumulators, merged into the BlobStats once the row is done.
+struct RowStats {
+  uint64_t count;
+  uint64_t sum_x;
+  int first;  // First and last foreground columns; -1 if none.
+  int last;
+};
+
+// Scans columns [begin, end) of row.
+template <typename PixelType>
+void ScanRowScalar(const PixelType *row, size_t begin, size_t end,
+		   int threshold, RowStats *stats) {
+  for (size_t j = begin; j < end; ++j) {
+    if (row[j] >= threshold) {
+      ++stats->count;
+      stats->sum_x += j;
+      if (stats->first < 0) stats->first = j;
+      stats->last = j;
+    }
+  }
+}
+
+#if defined(__AVX2__)
+
+// Scans the leading multiple of 32 columns of row, with threshold in
+// [1, 255]; returns the number of columns scanned.
+size_t ScanRowSimd(const uint8_t *row, size_t num_columns, int threshold,
+		   RowStats *stats) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(1);
+  const __m256i limit = _mm256_set1_epi8(static_cast<char>(threshold));
+  const __m256i index = _mm256_setr_epi8(
+      0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+  // Four 64-bit lanes each.
+  __m256i counts = zero;
+  __m256i sums = zero;
+
+  size_t j = 0;
+  for (; j + 32 <= num_columns; j += 32) {
+    const __m256i pixels =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + j));
+    // Unsigned pixels >= limit  <=>  max(pixels, limit) == pixels.
+    const __m256i hit =
+      _mm256_cmpeq_epi8(_mm256_max_epu8(pixels, limit), pixels);
+    const uint32_t mask = _mm256_movemask_epi8(hit);
+    if (mask == 0) continue;
+
+    const __m256i chunk_count =
+      _mm256_sad_epu8(_mm256_and_si256(hit, ones), zero);
+    const __m256i chunk_sum =
+      _mm256_sad_epu8(_mm256_and_si256(hit, index), zero);
+    counts = _mm256_add_epi64(counts, chunk_count);
+    sums = _mm256_add_epi64(sums, chunk_sum);
+    sums = _mm256_add_epi64(
+	sums, _mm256_mul_epu32(chunk_count, _mm256_set1_epi64x(j)));
+
+    if (stats->first < 0) stats->first = j + __builtin_ctz(mask);
+    stats->last = j + 31 - __builtin_clz(mask);
+  }
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), counts);
+  stats->count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), sums);
+  stats->sum_x += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return j;
+}
+
+#elif defined(__SSE2__)
+
+// Scans the leading multiple of 16 columns of row, with threshold in
+// [1, 255]; returns the number of columns scanned.
+size_t ScanRowSimd(const uint8_t *row, size_t num_columns, int threshold,
+		   RowStats *stats) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+  const __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				      8, 9, 10, 11, 12, 13, 14, 15);
+  // Two 64-bit lanes each.
+  __m128i counts = zero;
+  __m128i sums = zero;
+
+  size_t j = 0;
+  for (; j + 16 <= num_columns; j += 16) {
+    const __m128i pixels =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j));
+    // Unsigned pixels >= limit  <=>  max(pixels, limit) == pixels.
+    const __m128i hit = _mm_cmpeq_epi8(_mm_max_epu8(pixels, limit), pixels);
+    const uint32_t mask = _mm_movemask_epi8(hit);
+    if (mask == 0) continue;
+
+    const __m128i chunk_count = _mm_sad_epu8(_mm_and_si128(hit, ones), zero);
+    const __m128i chunk_sum = _mm_sad_epu8(_mm_and_si128(hit, index), zero);
+    counts = _mm_add_epi64(counts, chunk_count);
+    sums = _mm_add_epi64(sums, chunk_sum);
+    sums = _mm_add_epi64(sums,
+			 _mm_mul_epu32(chunk_count, _mm_set1_epi64x(j)));
+
+    if (stats->first < 0) stats->first = j + __builtin_ctz(mask);
+    stats->last = j + 31 - __builtin_clz(mask);
+  }
+
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), counts);
+  stats->count += lanes[0] + lanes[1];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), sums);
+  stats->sum_x += lanes[0] + lanes[1];
+  return j;
+}
+
+#endif
+
+template <typename PixelType>
+void ScanRow(const PixelType *row, size_t num_columns, int threshold,
+	     RowStats *stats) {
+  ScanRowScalar(row, 0, num_columns, threshold, stats);
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+template <>
+void ScanRow(const uint8_t *row, size_t num_columns, int threshold,
+	     RowStats *stats) {
+  size_t j = 0;
+  if (threshold >= 1 && threshold <= 255)
+    j = ScanRowSimd(row, num_columns, threshold, stats);
+  // The vector loop finds the first hit in the row, the tail the last.
+  RowStats tail = {0, 0, -1, -1};
+  ScanRowScalar(row, j, num_columns, threshold, &tail);
+  stats->count += tail.count;
+  stats->sum_x += tail.sum_x;
+  if (stats->first < 0) stats->first = tail.first;
+  if (tail.last >= 0) stats->last = tail.last;
+}
+#endif
+
+// The brightest of the count pixels from pixels on.
+template <typename PixelType>
+PixelType RowMaximum(const PixelType *pixels, size_t count) {
+  PixelType brightest = 0;
+  for (size_t j = 0; j < count; ++j) brightest = max(brightest, pixels[j]);
+  return brightest;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+template <>
+uint8_t RowMaximum(const uint8_t *pixels, size_t count) {
+  size_t j = 0;
+#if defined(__AVX2__)
+  __m256i wide = _mm256_setzero_si256();
+  for (; j + 32 <= count; j += 32)
+    wide = _mm256_max_epu8(wide, _mm256_loadu_si256(
+	reinterpret_cast<const __m256i *>(pixels + j)));
+  __m128i brightest = _mm_max_epu8(_mm256_castsi256_si128(wide),
+				   _mm256_extracti128_si256(wide, 1));
+#else
+  __m128i brightest = _mm_setzero_si128();
+#endif
+  for (; j + 16 <= count; j += 16)
+    brightest = _mm_max_epu8(brightest, _mm_loadu_si128(
+	reinterpret_cast<const __m128i *>(pixels + j)));
+  // Folds the 16 lanes into the first.
+  brightest = _mm_max_epu8(brightest, _mm_srli_si128(brightest, 8));
+  brightest = _mm_max_epu8(brightest, _mm_srli_si128(brightest, 4));
+  brightest = _mm_max_epu8(brightest, _mm_srli_si128(brightest, 2));
+  brightest = _mm_max_epu8(brightest, _mm_srli_si128(brightest, 1));
+  uint8_t result = _mm_cvtsi128_si32(brightest) & 0xff;
+  for (; j < count; ++j) result = max(result, pixels[j]);
+  return result;
+}
+#endif
+
+// Adds the stats of a block of pixels whose first pixel is at row
+// first_row and column first_column of the image to total.
+void MergeBlobStats(const BlobStats &block, size_t first_row,
+		    size_t first_column, BlobStats *total) {
+  if (block.count == 0) return;
+  total->count += block.count;
+  total->sum_x += block.sum_x + block.count * first_column;
+  total->sum_y += block.sum_y + block.count * first_row;
+  total->min_x = min<int>(total->min_x, block.min_x + first_column);
+  total->max_x = max<int>(total->max_x, block.max_x + first_column);
+  total->min_y = min<int>(total->min_y, block.min_y + first_row);
+  total->max_y = max<int>(total->max_y, block.max_y + first_row);
+}
+
+// Fits a circle to the points (xs[k], ys[k]) by Pratt's algebraic fit,
+// solved by Newton's method from Kasa's fit (as in Chernov, "Circular
+// and Linear Regression", 2010), on coordinates centered on the points'
+// mean for conditioning.
+bool FitCircle(const vector<double> &xs, const vector<double> &ys,
+	       CircleFit *fit) {
+  const size_t n = xs.size();
+  if (n < 3) return false;
+  double mean_x = 0, mean_y = 0;
+  for (size_t k = 0; k < n; ++k) {
+    mean_x += xs[k];
+    mean_y += ys[k];
+  }
+  mean_x /= n;
+  mean_y /= n;
+
+  // The moments of the centered points, with z = x^2 + y^2.
+  double mxx = 0, myy = 0, mxy = 0, mxz = 0, myz = 0, mzz = 0;
+  for (size_t k = 0; k < n; ++k) {
+    const double x = xs[k] - mean_x;
+    const double y = ys[k] - mean_y;
+    const double z = x * x + y * y;
+    mxx += x * x;
+    myy += y * y;
+    mxy += x * y;
+    mxz += x * z;
+    myz += y * z;
+    mzz += z * z;
+  }
+  mxx /= n;
+  myy /= n;
+  mxy /= n;
+  mxz /= n;
+  myz /= n;
+  mzz /= n;
+
+  // Pratt's fit is the smallest non-negative root of a quartic in eta;
+  // eta = 0 gives Kasa's fit.
+  const double mz = mxx + myy;
+  const double cov_xy = mxx * myy - mxy * mxy;
+  const double a2 = 4 * cov_xy - 3 * mz * mz - mzz;
+  const double a1 = mzz * mz + 4 * cov_xy * mz - mxz * mxz - myz * myz -
+    mz * mz * mz;
+  const double a0 = mxz * mxz * myy + myz * myz * mxx - mzz * cov_xy -
+    2 * mxz * myz * mxy + mz * mz * cov_xy;
+  double eta = 0;
+  double value = numeric_limits<double>::max();
+  for (int iteration = 0; iteration < 20; ++iteration) {
+    const double previous_value = value;
+    value = a0 + eta * (a1 + eta * (a2 + 4 * eta * eta));
+    if (fabs(value) > fabs(previous_value)) {
+      eta = 0;  // Diverging: keep Kasa's fit.
+      break;
+    }
+    const double slope = a1 + eta * (2 * a2 + 16 * eta * eta);
+    const double previous = eta;
+    eta = previous - value / slope;
+    if (!(eta >= 0)) {
+      eta = 0;
+      break;
+    }
+    if (fabs(eta - previous) <= 1e-12 * fabs(eta)) break;
+  }
+
+  const double determinant = eta * eta - eta * mz + cov_xy;
+  if (determinant == 0) return false;  // Collinear points.
+  const double x = (mxz * (myy - eta) - myz * mxy) / (2 * determinant);
+  const double y = (myz * (mxx - eta) - mxz * mxy) / (2 * determinant);
+  fit->center_x = x + mean_x;
+  fit->center_y = y + mean_y;
+  fit->radius = sqrt(x * x + y * y + mz + 2 * eta);
+  fit->num_points = n;
+
+  double squares = 0;
+  for (size_t k = 0; k < n; ++k) {
+    const double distance =
+      hypot(xs[k] - fit->center_x, ys[k] - fit->center_y) - fit->radius;
+    squares += distance * distance;
+  }
+  fit->residual = sqrt(squares / n);
+  return true;
+}
+
+// The sphere that the foreground of stats outlines.
+bool SphereFromBlobStats(const BlobStats &stats, SphereParameters *sphere) {
+  if (stats.count == 0) return false;
+  sphere->center_x = stats.sum_x / stats.count;
+  sphere->center_y = stats.sum_y / stats.count;
+  // Average the diameters and divide by 2 to get the radius.
+  sphere->radius =
+    ((stats.max_x - stats.min_x) + (stats.max_y - stats.min_y)) / 4.0;
+  return true;
+}
+
+}  // namespace
+
+template <typename PixelType>
+BlobStats ComputeBlobStats(const ImageView<PixelType> &an_image,
+			   int threshold) {
+  TRACE_SCOPE("threshold_centroid");
+  TRACE_COUNT("pixels_thresholded",
+	      an_image.num_rows() * an_image.num_columns());
+  BlobStats stats = {0, 0, 0, INT_MAX, -1, INT_MAX, -1};
+  for (size_t i = 0; i < an_image.num_rows(); ++i) {
+    RowStats row = {0, 0, -1, -1};
+    ScanRow(an_image.Row(i), an_image.num_columns(), threshold, &row);
+    if (row.count == 0) continue;
+
+    stats.count += row.count;
+    stats.sum_x += row.sum_x;
+    stats.sum_y += row.count * i;
+    stats.min_x = min(stats.min_x, row.first);
+    stats.max_x = max(stats.max_x, row.last);
+    if (stats.max_y < 0) stats.min_y = i;
+    stats.max_y = i;
+  }
+  return stats;
+}
+
+template BlobStats ComputeBlobStats(const ImageView<uint8_t> &, int);
+template BlobStats ComputeBlobStats(const ImageView<uint16_t> &, int);
+template BlobStats ComputeBlobStats(const ImageView<float> &, int);
+
+template <typename PixelType>
+BlobStats ComputeBlobStats(const TiledImage<PixelType> &an_image,
+			   int threshold) {
+  BlobStats stats = {0, 0, 0, INT_MAX, -1, INT_MAX, -1};
+  for (size_t r = 0; r < an_image.num_tile_rows(); ++r) {
+    for (size_t c = 0; c < an_image.num_tile_columns(); ++c) {
+      const ImageTile<PixelType> tile = an_image.GetTile(r, c);
+      MergeBlobStats(ComputeBlobStats(tile.CoreView(), threshold),
+		     tile.first_row + tile.core_row,
+		     tile.first_column + tile.core_column, &stats);
+    }
+  }
+  return stats;
+}
+
+template BlobStats ComputeBlobStats(const TiledImage<uint8_t> &, int);
+template BlobStats ComputeBlobStats(const TiledImage<uint16_t> &, int);
+
+template <typename PixelType>
+bool LocateSphere(const ImageView<PixelType> &an_image, int threshold,
+		  SphereParameters *sphere) {
+  if (sphere == nullptr) abort();
+  return SphereFromBlobStats(ComputeBlobStats(an_image, threshold), sphere);
+}
+
+template bool LocateSphere(const ImageView<uint8_t> &, int,
+			   SphereParameters *);
+template bool LocateSphere(const ImageView<uint16_t> &, int,
+			   SphereParameters *);
+
+template <typename PixelType>
+bool LocateSphere(const TiledImage<PixelType> &an_image, int threshold,
+		  SphereParameters *sphere) {
+  if (sphere == nullptr) abort();
+  return SphereFromBlobStats(ComputeBlobStats(an_image, threshold), sphere);
+}
+
+template bool LocateSphere(const TiledImage<uint8_t> &, int,
+			   SphereParameters *);
+template bool LocateSphere(const TiledImage<uint16_t> &, int,
+			   SphereParameters *);
+
+template <typename PixelType>
+bool LocateSpheres(const ImageView<PixelType> &an_image, int threshold,
+		   size_t count, vector<SphereParameters> *spheres,
+		   size_t *other_components) {
+  if (spheres == nullptr) abort();
+  vector<Component> components;
+  LabelComponents(an_image, threshold, &components);
+  if (components.size() < count) return false;
+  if (other_components != nullptr)
+    *other_components = components.size() - count;
+
+  spheres->clear();
+  for (size_t k = 0; k < count; ++k) {
+    const Component &component = components[k];
+    const BlobStats stats = {component.area, component.sum_x,
+			     component.sum_y, component.min_x,
+			     component.max_x, component.min_y,
+			     component.max_y};
+    SphereParameters sphere;
+    SphereFromBlobStats(stats, &sphere);
+    spheres->push_back(sphere);
+  }
+  sort(spheres->begin(), spheres->end(),
+       [](const SphereParameters &a, const SphereParameters &b) {
+	 return a.center_x != b.center_x ? a.center_x < b.center_x :
+	   a.center_y < b.center_y;
+       });
+  return true;
+}
+
+template bool LocateSpheres(const ImageView<uint8_t> &, int, size_t,
+			    vector<SphereParameters> *, size_t *);
+template bool LocateSpheres(const ImageView<uint16_t> &, int, size_t,
+			    vector<SphereParameters> *, size_t *);
+
+template <typename PixelType>
+bool LocateSphereCoarseToFine(const ImageReader &reader, int threshold,
+			      size_t factor, SphereParameters *sphere) {
+  if (sphere == nullptr) abort();
+  const size_t num_rows = reader.num_rows();
+  const size_t num_columns = reader.num_columns();
+  factor = max<size_t>(factor, 1);
+
+  // The downsample: one row in factor is decoded, and one of its pixels
+  // in factor kept.
+  BasicImage<PixelType> coarse;
+  coarse.AllocateSpaceAndSetSize((num_rows + factor - 1) / factor,
+				 (num_columns + factor - 1) / factor);
+  coarse.SetNumberGrayLevels(reader.num_gray_levels());
+  {
+    TRACE_SCOPE("downsample");
+    TRACE_COUNT("pixels_decoded", coarse.num_rows() * num_columns);
+    vector<PixelType> row(num_columns);
+    for (size_t i = 0; i < coarse.num_rows(); ++i) {
+      reader.ReadRowSpan(i * factor, 0, num_columns, row.data());
+      PixelType *sampled = coarse.Row(i);
+      for (size_t j = 0; j < coarse.num_columns(); ++j)
+	sampled[j] = row[j * factor];
+    }
+  }
+  const BlobStats estimate = ComputeBlobStats(coarse.View(), threshold);
+  if (estimate.count == 0) {
+    // Too small for the downsample to see, if there at all.
+    BasicImage<PixelType> image;
+    image.AllocateSpaceAndSetSize(num_rows, num_columns);
+    image.SetNumberGrayLevels(reader.num_gray_levels());
+    reader.ReadRows(0, num_rows, image.data(), image.stride());
+    return LocateSphere(image.View(), threshold, sphere);
+  }
+
+  // The window, rows [top, bottom) and columns [left, right): the
+  // samples' box grown by a step of the downsample, as the foreground
+  // may reach up to the next samples.
+  size_t top = estimate.min_y * factor;
+  size_t left = estimate.min_x * factor;
+  size_t bottom = min(num_rows, (estimate.max_y + 1) * factor);
+  size_t right = min(num_columns, (estimate.max_x + 1) * factor);
+  top -= min(top, factor);
+  left -= min(left, factor);
+  bottom = min(num_rows, bottom + factor);
+  right = min(num_columns, right + factor);
+
+  BasicImage<PixelType> window;
+  window.SetNumberGrayLevels(reader.num_gray_levels());
+  BlobStats stats;
+  while (true) {
+    window.AllocateSpaceAndSetSize(bottom - top, right - left);
+    {
+      TRACE_SCOPE("decode");
+      TRACE_COUNT("pixels_decoded", window.num_rows() * window.num_columns());
+      for (size_t i = 0; i < window.num_rows(); ++i)
+	reader.ReadRowSpan(top + i, left, window.num_columns(), window.Row(i));
+    }
+    stats = ComputeBlobStats(window.View(), threshold);
+
+    // Foreground on an edge of the window (but not of the image) may go
+    // on past it: the window grows on that side, by half its size so
+    // that few rounds are needed, and is scanned again.
+    const size_t grow_rows = max(factor, window.num_rows() / 2);
+    const size_t grow_columns = max(factor, window.num_columns() / 2);
+    bool grown = false;
+    if (stats.min_y == 0 && top > 0) {
+      top -= min(top, grow_rows);
+      grown = true;
+    }
+    if (stats.max_y + 1 == static_cast<int>(window.num_rows()) &&
+	bottom < num_rows) {
+      bottom = min(num_rows, bottom + grow_rows);
+      grown = true;
+    }
+    if (stats.min_x == 0 && left > 0) {
+      left -= min(left, grow_columns);
+      grown = true;
+    }
+    if (stats.max_x + 1 == static_cast<int>(window.num_columns()) &&
+	right < num_columns) {
+      right = min(num_columns, right + grow_columns);
+      grown = true;
+    }
+    if (!grown) break;
+    TRACE_COUNT("window_regrowths", 1);
+  }
+
+  BlobStats total = {0, 0, 0, INT_MAX, -1, INT_MAX, -1};
+  MergeBlobStats(stats, top, left, &total);
+  return SphereFromBlobStats(total, sphere);
+}
+
+template bool LocateSphereCoarseToFine<uint8_t>(const ImageReader &, int,
+						size_t, SphereParameters *);
+template bool LocateSphereCoarseToFine<uint16_t>(const ImageReader &, int,
+						 size_t, SphereParameters *);
+
+template <typename PixelType>
+bool FitSphereContour(const ImageView<PixelType> &an_image, int threshold,
+		      CircleFit *fit) {
+  if (fit == nullptr) abort();
+  TRACE_SCOPE("contour_fit");
+  const int num_rows = an_image.num_rows();
+  const int num_columns = an_image.num_columns();
+  // Pixels outside the image are background.
+  auto foreground = [&](int x, int y) {
+    return x >= 0 && y >= 0 && x < num_columns && y < num_rows &&
+      an_image.Row(y)[x] >= threshold;
+  };
+
+  // A sparse grid of samples, some 64 across the shorter side, finds the
+  // foreground's centroid; a sphere too small for the grid is looked for
+  // again on grids twice as fine.
+  int step = max(1, min(num_rows, num_columns) / 64);
+  uint64_t count = 0, sum_y = 0;
+  int sampled_y = -1;
+  while (true) {
+    for (int y = step / 2; y < num_rows; y += step) {
+      const PixelType *row = an_image.Row(y);
+      for (int x = step / 2; x < num_columns; x += step) {
+	if (row[x] >= threshold) {
+	  ++count;
+	  sum_y += y;
+	  if (sampled_y < 0) sampled_y = y;
+	}
+      }
+    }
+    TRACE_COUNT("pixels_sampled",
+		static_cast<uint64_t>(num_rows / step) * (num_columns / step));
+    if (count > 0 || step == 1) break;
+    step /= 2;
+  }
+  if (count == 0) return false;
+
+  // The longest run of foreground on the centroid's row crosses the
+  // sphere; its first pixel is on the sphere's outline, with background
+  // to its left. A row missing the foreground (a ring, say) gives way to
+  // the first sampled one.
+  int start_y = sum_y / count;
+  int start_x = -1;
+  for (int attempt = 0; attempt < 2 && start_x < 0; ++attempt) {
+    if (attempt == 1) start_y = sampled_y;
+    const PixelType *row = an_image.Row(start_y);
+    int longest = 0;
+    for (int x = 0; x < num_columns; ) {
+      if (row[x] < threshold) {
+	++x;
+	continue;
+      }
+      const int begin = x;
+      while (x < num_columns && row[x] >= threshold) ++x;
+      if (x - begin > longest) {
+	longest = x - begin;
+	start_x = begin;
+      }
+    }
+  }
+
+  // Moore-neighbor tracing. The neighbors of a pixel, clockwise from
+  // the left (rows grow downwards).
+  static const int kNeighborX[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+  static const int kNeighborY[8] = {0, -1, -1, -1, 0, 1, 1, 1};
+  // The direction of neighbor (dx, dy), as kDirection[dy + 1][dx + 1].
+  static const int kDirection[3][3] = {{1, 2, 3}, {0, -1, 4}, {7, 6, 5}};
+  vector<double> xs, ys;
+  const double level = threshold - 0.5;  // Between the last background
+					 // and the first foreground level.
+  // Adds the edge points between contour pixel (x, y) and its
+  // background 4-neighbors. Where the image ends is not the sphere's
+  // edge, so it gives none.
+  auto add_edge_points = [&](int x, int y) {
+    const double inside = an_image.Row(y)[x];
+    for (int d = 0; d < 8; d += 2) {
+      const int nx = x + kNeighborX[d];
+      const int ny = y + kNeighborY[d];
+      if (nx < 0 || ny < 0 || nx >= num_columns || ny >= num_rows ||
+	  foreground(nx, ny)) continue;
+      const double outside = an_image.Row(ny)[nx];
+      const double t =
+	min(1.0, max(0.0, (inside - level) / (inside - outside)));
+      xs.push_back(x + t * kNeighborX[d]);
+      ys.push_back(y + t * kNeighborY[d]);
+    }
+  };
+
+  // Tracing stops on leaving the start pixel the way it first did, so
+  // that a contour through the start more than once is still followed
+  // whole; the bound only guards against a broken criterion.
+  int x = start_x, y = start_y;
+  int backtrack = 0;  // The direction of the background pixel last seen.
+  int second_x = -1, second_y = -1;  // Where the start was first left for.
+  const size_t max_steps = 4 * static_cast<size_t>(num_rows) * num_columns;
+  for (size_t steps = 0; steps < max_steps; ++steps) {
+    int next = -1;
+    for (int k = 1; k <= 8; ++k) {
+      const int d = (backtrack + k) % 8;
+      if (foreground(x + kNeighborX[d], y + kNeighborY[d])) {
+	next = d;
+	break;
+      }
+    }
+    if (next < 0) {  // A lone pixel.
+      add_edge_points(x, y);
+      break;
+    }
+    const int new_x = x + kNeighborX[next];
+    const int new_y = y + kNeighborY[next];
+    if (x == start_x && y == start_y) {
+      if (second_x < 0) {
+	second_x = new_x;
+	second_y = new_y;
+      } else if (new_x == second_x && new_y == second_y) {
+	break;
+      }
+    }
+    add_edge_points(x, y);
+    // The neighbor checked just before next, seen from the new pixel.
+    const int previous = (next + 7) % 8;
+    backtrack = kDirection[y + kNeighborY[previous] - new_y + 1]
+			  [x + kNeighborX[previous] - new_x + 1];
+    x = new_x;
+    y = new_y;
+  }
+  TRACE_COUNT("contour_points", xs.size());
+
+  return FitCircle(xs, ys, fit);
+}
+
+template bool FitSphereContour(const ImageView<uint8_t> &, int, CircleFit *);
+template bool FitSphereContour(const ImageView<uint16_t> &, int,
+			       CircleFit *);
+
+template <typename PixelType>
+void ComputeLightDirections(const vector<ImageView<PixelType>> &images,
+			    const SphereParameters &sphere,
+			    int highlight_band,
+			    vector<vector<double>> *directions) {
+  if (directions == nullptr) abort();
+  TRACE_SCOPE("brightest_pixel");
+  const size_t num_images = images.size();
+  directions->assign(num_images, vector<double>(3, 0.0));
+  if (num_images == 0) return;
+  const int num_rows = images[0].num_rows();
+  const int num_columns = images[0].num_columns();
+  for (size_t k = 1; k < num_images; ++k)
+    if (static_cast<int>(images[k].num_rows()) != num_rows ||
+	static_cast<int>(images[k].num_columns()) != num_columns) abort();
+
+  // The disc's rows, and the columns [begins[i], ends[i]) of each of
+  // them, clipped to the image.
+  const double radius = sphere.radius;
+  const int first_row =
+    max(0, static_cast<int>(ceil(sphere.center_y - radius)));
+  const int last_row =
+    min(num_rows - 1, static_cast<int>(floor(sphere.center_y + radius)));
+  if (first_row > last_row) return;
+  const size_t disc_rows = last_row - first_row + 1;
+  vector<int> begins(disc_rows), ends(disc_rows);
+  size_t disc_pixels = 0;
+  for (size_t i = 0; i < disc_rows; ++i) {
+    const double dy = static_cast<double>(first_row + i) - sphere.center_y;
+    const double half = sqrt(max(0.0, radius * radius - dy * dy));
+    begins[i] = max(0, static_cast<int>(ceil(sphere.center_x - half)));
+    ends[i] = min(num_columns,
+		  static_cast<int>(floor(sphere.center_x + half)) + 1);
+    if (ends[i] > begins[i]) disc_pixels += ends[i] - begins[i];
+  }
+  TRACE_COUNT("pixels_searched", num_images * disc_pixels);
+
+  // First pass, over every image at once: the brightest gray level of
+  // each, and of each of its rows, for the second pass to skip the rows
+  // with no highlight.
+  vector<PixelType> brightest(num_images, 0);
+  vector<PixelType> row_brightest(num_images * disc_rows, 0);
+  for (size_t i = 0; i < disc_rows; ++i) {
+    if (ends[i] <= begins[i]) continue;
+    for (size_t k = 0; k < num_images; ++k) {
+      const PixelType value =
+	RowMaximum(images[k].Row(first_row + i) + begins[i],
+		   ends[i] - begins[i]);
+      row_brightest[k * disc_rows + i] = value;
+      brightest[k] = max(brightest[k], value);
+    }
+  }
+
+  // Second pass, image by image over the highlight's rows: the centroid
+  // of the pixels within the band, weighted from 1 at its floor up.
+  for (size_t k = 0; k < num_images; ++k) {
+    if (brightest[k] <= 0) continue;
+    const double floor_level =
+      max(0.0, static_cast<double>(brightest[k]) - max(0, highlight_band));
+    double sum_weights = 0, sum_x = 0, sum_y = 0;
+    for (size_t i = 0; i < disc_rows; ++i) {
+      if (row_brightest[k * disc_rows + i] < floor_level) continue;
+      const PixelType *row = images[k].Row(first_row + i);
+      for (int j = begins[i]; j < ends[i]; ++j) {
+	if (row[j] < floor_level) continue;
+	const double weight = row[j] - floor_level + 1;
+	sum_weights += weight;
+	sum_x += weight * j;
+	sum_y += weight * (first_row + i);
+      }
+    }
+
+    // The normal there follows from the sphere equation
+    // r^2 = (x-cx)^2 + (y-cy)^2 + (z-cz)^2.
+    const double x = (sum_x / sum_weights - sphere.center_x) / radius;
+    const double y = (sum_y / sum_weights - sphere.center_y) / radius;
+    const double z = sqrt(max(0.0, 1.0 - x * x - y * y));
+    (*directions)[k][0] = x * brightest[k];
+    (*directions)[k][1] = y * brightest[k];
+    (*directions)[k][2] = z * brightest[k];
+  }
+}
+
+template void ComputeLightDirections(const vector<ImageView<uint8_t>> &,
+				     const SphereParameters &, int,
+				     vector<vector<double>> *);
+template void ComputeLightDirections(const vector<ImageView<uint16_t>> &,
+				     const SphereParameters &, int,
+				     vector<vector<double>> *);
+
+template <typename PixelType>
+void ComputeLightDirection(const ImageView<PixelType> &an_image,
+			   const SphereParameters &sphere,
+			   double direction[3]) {
+  vector<vector<double>> directions;
+  ComputeLightDirections(vector<ImageView<PixelType>>(1, an_image), sphere,
+			 0, &directions);
+  copy(directions[0].begin(), directions[0].end(), direction);
+}
+
+template void ComputeLightDirection(const ImageView<uint8_t> &,
+				    const SphereParameters &, double[3]);
+template void ComputeLightDirection(const ImageView<uint16_t> &,
+				    const SphereParameters &, double[3]);
+
+}  // namespace ComputerVisionProjects
@@ -0,0 +1,142 @@
+// Kernels for locating the calibration sphere in a gray-scale image and
+// for finding the light directions from its highlights.
+// To be used in Computer Vision class.
+
+#ifndef SPHERE_H
+#define SPHERE_H
+
+#include <cstdint>
+#include <vector>
+#include "image.h"
+#include "tiled_image.h"
+
+namespace ComputerVisionProjects {
+
+// Summary of the pixels whose gray level is at or above a threshold:
+// how many there are, the sums of their coordinates and their bounding
+// box. The sums are 64-bit so that they cannot overflow on large sensors.
+struct BlobStats {
+  uint64_t count;
+  uint64_t sum_x;   // Sum of the column indices.
+  uint64_t sum_y;   // Sum of the row indices.
+  int min_x, max_x; // Bounding box; min > max when count == 0.
+  int min_y, max_y;
+};
+
+// Thresholds an_image and gathers the BlobStats of the foreground in a
+// single pass, without building the binary image. 8-bit images use
+// AVX2 or SSE2 when the compiler targets them.
+template <typename PixelType>
+BlobStats ComputeBlobStats(const ImageView<PixelType> &an_image,
+			   int threshold);
+
+// ComputeBlobStats() a tile core at a time, for images too large to
+// hold in memory: the same result, with the tiles' statistics merged.
+template <typename PixelType>
+BlobStats ComputeBlobStats(const TiledImage<PixelType> &an_image,
+			   int threshold);
+
+// Center and radius of the calibration sphere in the image, in pixels.
+struct SphereParameters {
+  int center_x;
+  int center_y;
+  double radius;
+};
+
+// Locates the sphere from the pixels of an_image at or above threshold:
+// the (truncated) centroid of those pixels, and the radius averaged over
+// the width and height of their bounding box.
+// Returns true if  everyhing is OK, false if no pixel reaches threshold.
+template <typename PixelType>
+bool LocateSphere(const ImageView<PixelType> &an_image, int threshold,
+		  SphereParameters *sphere);
+template <typename PixelType>
+bool LocateSphere(const TiledImage<PixelType> &an_image, int threshold,
+		  SphereParameters *sphere);
+
+// Locates the count largest spheres in an_image, for rigs that carry
+// several: the connected components of the pixels at or above threshold
+// are labeled (see LabelComponents()), and each of the count largest
+// gives a sphere as LocateSphere() would from its pixels alone, so
+// specks and reflections elsewhere leave it alone. spheres gets them
+// left to right (top to bottom where their centers share a column);
+// other_components, if not nullptr, the number of smaller components
+// left out.
+// Returns true if  everyhing is OK, false if there are fewer than count
+// components.
+template <typename PixelType>
+bool LocateSpheres(const ImageView<PixelType> &an_image, int threshold,
+		   size_t count, std::vector<SphereParameters> *spheres,
+		   size_t *other_components);
+
+// Locates the sphere as LocateSphere() does, coarse to fine, reading
+// only part of the image of reader. The bounding box of the foreground
+// is found first on a 1/factor downsample (every factor-th pixel of
+// every factor-th row); the pixels are then thresholded at full
+// resolution only in a window around it, grown until no foreground
+// touches its edges. Only the sampled rows and the window are decoded,
+// so the cost hardly depends on the sensor's resolution. The result is
+// LocateSphere()'s unless some blob of foreground has no pixel in the
+// downsample (then it is left out); if none of the downsample reaches
+// threshold, every pixel is scanned instead.
+// Returns true if  everyhing is OK, false if no pixel reaches threshold.
+template <typename PixelType>
+bool LocateSphereCoarseToFine(const ImageReader &reader, int threshold,
+			      size_t factor, SphereParameters *sphere);
+
+// A circle fit to the outline of the sphere, in pixels.
+struct CircleFit {
+  double center_x;
+  double center_y;
+  double radius;
+  // Root mean square distance of the edge points from the circle: a
+  // quality check, as a clean round outline fits within a fraction of a
+  // pixel.
+  double residual;
+  size_t num_points;  // Edge points fit.
+};
+
+// Fits a circle to the outline of the sphere in an_image, visiting only
+// pixels near it rather than the whole area. A sparse grid of samples
+// finds the sphere and the longest run of foreground (pixels at or above
+// threshold) across it gives a first boundary pixel; Moore-neighbor
+// tracing then follows the outer contour from there. Each contour pixel
+// gives an edge point, interpolated to where the gray level crosses the
+// threshold, towards each of its background 4-neighbors, and the circle
+// is fit to those points algebraically (Pratt's fit, starting from
+// Kasa's). Foreground apart from the sphere is never visited, so it does
+// not bias the fit, and a sphere cut off by the image border is fit to
+// the arc that remains.
+// Returns true if  everyhing is OK, false if no pixel reaches threshold
+// or the outline is too short to fit.
+template <typename PixelType>
+bool FitSphereContour(const ImageView<PixelType> &an_image, int threshold,
+		      CircleFit *fit);
+
+// Finds the lights that lit the sphere images images (all of the same
+// size), in two passes over the sphere's disc in each, whatever the
+// image size: the images are read in lockstep, a row of the disc at a
+// time, for their brightest gray level, and then only the rows that
+// reach within highlight_band gray levels of it are read again for the
+// highlight's centroid, each pixel weighted by how far above that band's
+// floor it is. As the highlight is a plateau wherever the sensor
+// saturates, its centroid, not its first pixel, is where the normal
+// faces the light, and it falls between pixels. directions gets one
+// entry per image: the sphere's normal at the centroid, scaled by the
+// brightest gray level (zero for a black image).
+template <typename PixelType>
+void ComputeLightDirections(const std::vector<ImageView<PixelType>> &images,
+			    const SphereParameters &sphere,
+			    int highlight_band,
+			    std::vector<std::vector<double>> *directions);
+
+// ComputeLightDirections() for the one sphere image an_image, taking
+// only the pixels at its brightest gray level as the highlight.
+template <typename PixelType>
+void ComputeLightDirection(const ImageView<PixelType> &an_image,
+			   const SphereParameters &sphere,
+			   double direction[3]);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // SPHERE_H
@@ -0,0 +1,381 @@
+// Solves a continuous sequence of frame groups, as a capture rig produces
+// them: every N consecutive pgm frames (N = the number of light
+// directions) are the images of one object. The frames come
+// concatenated on stdin, or as files written to a watched directory
+// (each file holding one or more frames, taken in the order they are
+// closed; a file named "end" ends the stream).
+//
+// Three stages run on their own threads, connected by bounded lock-free
+// queues (see bounded_queue.h): reading and parsing the frames, solving
+// them on the thread pool, and encoding and writing the outputs. The
+// light matrix is computed once, and the frame and output buffers cycle
+// between the stages, so memory stays at what the queues hold however
+// long the stream runs. Group k is written as normals_<k>.pgm and
+// albedo_<k>.pgm in the output directory, or, with "-", as two
+// concatenated pgm frames (normals, then albedo) on stdout.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "bounded_queue.h"
+#include "image.h"
+#include "photometric.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace ComputerVisionProjects;
+
+// The raw pgm frames of one object, one per light, read but not decoded:
+// the solve decodes them in place
+struct FrameGroup {
+    size_t sequence;
+    std::vector<std::vector<char>> frames;
+};
+
+// The outputs of one object
+struct SolvedGroup {
+    size_t sequence;
+    bool solved;
+    Image normals, albedo;
+};
+
+// Reads pgm frames one after another from a file descriptor
+class FrameInput {
+public:
+    explicit FrameInput(int fd): fd_(fd), begin_(0), end_(0), buffer_(1 << 16) {}
+
+    // Reads the next frame, header and samples, into frame, whose buffer is reused.
+    // Returns 1 for a frame, 0 at the end of the input and -1 for a malformed or truncated frame.
+    int next(std::vector<char> &frame) {
+        // The header is taken a byte at a time until it parses; it is short
+        header_.clear();
+        PgmHeader header;
+        char c;
+        while (true) {
+            if (!get(c)) return header_.empty() ? 0 : -1;
+            header_.push_back(c);
+            if (header_.size() > kMaxHeaderSize) return -1;
+            if (std::isspace(static_cast<unsigned char>(c)) && ParsePgmHeader(header_.data(), header_.size(), &header)) break;
+        }
+        // A "\r\n" after maxval ends the header with the "\n"
+        if (c == '\r') {
+            if (!get(c)) return -1;
+            if (c == '\n') {
+                header_.push_back(c);
+            } else {
+                --begin_;
+            }
+        }
+        if (!header.binary) {
+            std::cerr << "Error: Only binary (P5) frames can be streamed." << std::endl;
+            return -1;
+        }
+
+        // The samples: what is buffered, then the rest straight from the file. The header's size is not
+        // trusted: frame grows a chunk at a time as the samples arrive, so a corrupt one ends in a truncated
+        // frame rather than in allocating what it claims
+        const size_t sampleSize = header.num_gray_levels > 255 ? 2 : 1;
+        const size_t size = header_.size() + header.num_rows * header.num_columns * sampleSize;
+        frame.resize(std::min(size, header_.size() + kChunkSize));
+        std::memcpy(frame.data(), header_.data(), header_.size());
+        size_t filled = header_.size();
+        const size_t buffered = std::min(end_ - begin_, frame.size() - filled);
+        std::memcpy(&frame[filled], &buffer_[begin_], buffered);
+        begin_ += buffered;
+        filled += buffered;
+        while (filled < size) {
+            if (filled == frame.size()) frame.resize(std::min(size, std::max(frame.capacity(), filled + kChunkSize)));
+            const ssize_t count = read(fd_, &frame[filled], frame.size() - filled);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return -1;
+            filled += count;
+        }
+        return 1;
+    }
+
+private:
+    static const size_t kMaxHeaderSize = 4096;
+    // Most bytes a frame's buffer grows by before they are read
+    static const size_t kChunkSize = 16 << 20;
+
+    bool get(char &c) {
+        if (begin_ == end_) {
+            ssize_t count;
+            do {
+                count = read(fd_, buffer_.data(), buffer_.size());
+            } while (count < 0 && errno == EINTR);
+            if (count <= 0) return false;
+            begin_ = 0;
+            end_ = count;
+        }
+        c = buffer_[begin_++];
+        return true;
+    }
+
+    int fd_;
+    size_t begin_, end_;  // The bytes of buffer_ not taken yet
+    std::vector<char> buffer_;
+    std::vector<char> header_;  // Of the frame being read
+};
+
+// The read stage: fills the groups it takes back from the solve stage with frames, in order
+class Reader {
+public:
+    Reader(size_t numLights, BoundedQueue<FrameGroup *> &full, BoundedQueue<FrameGroup *> &empty)
+        : numLights_(numLights), full_(full), empty_(empty), group_(nullptr), sequence_(0), frames_(0) {}
+
+    // Reads every frame of fd. Returns false if the input is malformed
+    bool readFrames(int fd) {
+        FrameInput input(fd);
+        while (true) {
+            if (group_ == nullptr) {
+                group_ = empty_.Pop();
+                group_->sequence = ++sequence_;
+                group_->frames.resize(numLights_);
+                frames_ = 0;
+            }
+            int result;
+            {
+                TRACE_SCOPE("read");
+                result = input.next(group_->frames[frames_]);
+            }
+            if (result <= 0) return result == 0;
+            TRACE_COUNT("bytes_read", group_->frames[frames_].size());
+            if (++frames_ == numLights_) {
+                full_.Push(group_);
+                group_ = nullptr;
+            }
+        }
+    }
+
+    // Ends the stream; returns the number of frames of an incomplete last group, which are dropped
+    size_t finish() {
+        full_.Push(nullptr);
+        return group_ == nullptr ? 0 : frames_;
+    }
+
+    size_t groups() const { return sequence_ - (group_ == nullptr ? 0 : 1); }
+
+private:
+    size_t numLights_;
+    BoundedQueue<FrameGroup *> &full_, &empty_;
+    FrameGroup *group_;  // Being filled, if not nullptr
+    size_t sequence_, frames_;
+};
+
+// Reads the files written to directory as they are closed, in that order, until one named "end" appears.
+// Files already there are read first, in name order. Returns false on the first malformed file.
+bool readWatchedDirectory(const std::string &directory, Reader &reader) {
+    const int watch = inotify_init1(IN_CLOEXEC);
+    if (watch < 0 || inotify_add_watch(watch, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cerr << "Error: Cannot watch directory " << directory << std::endl;
+        if (watch >= 0) close(watch);
+        return false;
+    }
+
+    // Files there before the watch get an event too if they were still being written; they are read once.
+    // Only their names are remembered, so that memory does not grow with the stream
+    std::vector<std::string> names;
+    if (DIR *listing = opendir(directory.c_str())) {
+        while (struct dirent *entry = readdir(listing)) {
+            if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+        }
+        closedir(listing);
+    }
+    std::sort(names.begin(), names.end());
+    std::set<std::string> listed(names.begin(), names.end());
+
+    std::vector<char> events(64 * 1024);
+    while (true) {
+        for (size_t k = 0; k < names.size(); ++k) {
+            if (names[k] == "end") {
+                close(watch);
+                return true;
+            }
+            const std::string path = directory + "/" + names[k];
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "Error: Cannot open " << path << std::endl;
+                close(watch);
+                return false;
+            }
+            const bool ok = reader.readFrames(fd);
+            close(fd);
+            if (!ok) {
+                std::cerr << "Error: Malformed frame in " << path << std::endl;
+                close(watch);
+                return false;
+            }
+        }
+        names.clear();
+
+        const ssize_t count = read(watch, events.data(), events.size());
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        for (ssize_t pos = 0; pos < count; ) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(&events[pos]);
+            if (event->len > 0 && event->name[0] != '.' && listed.erase(event->name) == 0) names.push_back(event->name);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    close(watch);
+    return false;
+}
+
+// The solve stage: decodes and solves every group, in order, until the end of the stream
+void solveGroups(const LightMatrix &lights, int threshold, ThreadPool &pool,
+                 BoundedQueue<FrameGroup *> &frames, BoundedQueue<FrameGroup *> &emptyFrames,
+                 BoundedQueue<SolvedGroup *> &solved, BoundedQueue<SolvedGroup *> &emptySolved) {
+    std::vector<ImageReader> readers(lights.num_lights);
+    ForegroundMask mask;
+    while (FrameGroup *group = frames.Pop()) {
+        SolvedGroup *output = emptySolved.Pop();
+        output->sequence = group->sequence;
+        output->solved = true;
+        for (size_t d = 0; d < readers.size() && output->solved; ++d) {
+            output->solved = OpenImageInMemory(group->frames[d].data(), group->frames[d].size(), &readers[d]) &&
+                readers[d].num_rows() == readers[0].num_rows() && readers[d].num_columns() == readers[0].num_columns();
+        }
+        if (output->solved) {
+            if (threshold >= 0) ComputeForegroundMask(readers, threshold, &pool, &mask);
+            ComputeNormalsAndAlbedo(readers, lights, threshold >= 0 ? &mask : nullptr, &pool, &output->normals, &output->albedo);
+        }
+        for (size_t d = 0; d < readers.size(); ++d) readers[d].Close();
+        emptyFrames.Push(group);
+        solved.Push(output);
+    }
+    solved.Push(nullptr);
+}
+
+// The write stage: writes every group's outputs, in order, until the end of the stream.
+// Returns the number of groups that could not be solved or written
+size_t writeGroups(const std::string &outputDirectory,
+                   BoundedQueue<SolvedGroup *> &solved, BoundedQueue<SolvedGroup *> &emptySolved) {
+    size_t failed = 0;
+    while (SolvedGroup *group = solved.Pop()) {
+        bool ok = group->solved;
+        if (!ok) {
+            std::cerr << "Group " << group->sequence << ": frames differ in size or are not pgm images." << std::endl;
+        } else if (outputDirectory == "-") {
+            ok = WriteImage(STDOUT_FILENO, group->normals.View()) && WriteImage(STDOUT_FILENO, group->albedo.View());
+        } else {
+            char number[32];
+            snprintf(number, sizeof number, "%06zu", group->sequence);
+            ok = WriteImage(outputDirectory + "/normals_" + number + ".pgm", group->normals) &&
+                WriteImage(outputDirectory + "/albedo_" + number + ".pgm", group->albedo);
+            if (!ok) std::cerr << "Group " << group->sequence << ": outputs not written." << std::endl;
+        }
+        if (!ok) ++failed;
+        emptySolved.Push(group);
+    }
+    return failed;
+}
+
+// Function to load light source directions from a file
+bool loadDirections(const std::string& filename, std::vector<std::vector<double>>& directions) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Error loading directions file!" << std::endl;
+        return false;
+    }
+    double x, y, z;
+    while (file >> x >> y >> z) {
+        directions.push_back({x, y, z});
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // Pull out the options, leaving the positional arguments
+    size_t threads = 0;  // One per hardware thread
+    size_t queueDepth = 2;
+    int threshold = -1;  // Every pixel is solved unless given
+    std::string watchDirectory;  // stdin unless given
+    std::string traceFile, metricsFile;  // No instrumentation output unless given
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "--queue-depth" && i + 1 < argc) {
+            queueDepth = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (std::string(argv[i]) == "--threshold" && i + 1 < argc) {
+            threshold = std::stoi(argv[++i]);
+        } else if (std::string(argv[i]) == "--watch" && i + 1 < argc) {
+            watchDirectory = argv[++i];
+        } else if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (std::string(argv[i]) == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() != 3) {
+        std::cerr << "Usage: stream [--threads N] [--queue-depth N] [--threshold T] [--watch DIR] [--trace FILE] [--metrics FILE] {directions file} {output directory | -}" << std::endl;
+        return 1;
+    }
+    const std::string outputDirectory = args[2];
+    // Progress goes to stderr when stdout carries the outputs
+    std::ostream &log = outputDirectory == "-" ? std::cerr : std::cout;
+
+    // The calibration stays resident for the whole stream
+    std::vector<std::vector<double>> directions;
+    if (!loadDirections(args[1], directions)) {
+        std::cerr << "Failed to load directions!" << std::endl;
+        return 1;
+    }
+    LightMatrix lights;
+    if (!ComputeLightMatrix(directions, &lights)) {
+        std::cerr << "Light directions do not determine the normals!" << std::endl;
+        return 1;
+    }
+
+    // Traces are written on return
+    TraceSession trace(traceFile, metricsFile);
+
+    // Every buffer the stages pass around exists from the start: the ones in the queues, plus one per stage
+    std::vector<FrameGroup> frameGroups(queueDepth + 2);
+    std::vector<SolvedGroup> solvedGroups(queueDepth + 2);
+    BoundedQueue<FrameGroup *> frames(queueDepth), emptyFrames(frameGroups.size());
+    BoundedQueue<SolvedGroup *> solved(queueDepth), emptySolved(solvedGroups.size());
+    for (size_t k = 0; k < frameGroups.size(); ++k) emptyFrames.Push(&frameGroups[k]);
+    for (size_t k = 0; k < solvedGroups.size(); ++k) emptySolved.Push(&solvedGroups[k]);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ThreadPool pool(threads);
+    std::thread solver(solveGroups, std::cref(lights), threshold, std::ref(pool),
+                       std::ref(frames), std::ref(emptyFrames), std::ref(solved), std::ref(emptySolved));
+    size_t failed = 0;
+    std::thread writer([&] { failed = writeGroups(outputDirectory, solved, emptySolved); });
+
+    // The read stage runs here
+    Reader reader(lights.num_lights, frames, emptyFrames);
+    const bool ok = watchDirectory.empty() ? reader.readFrames(STDIN_FILENO) : readWatchedDirectory(watchDirectory, reader);
+    if (!ok && watchDirectory.empty()) std::cerr << "Error: Malformed frame on stdin." << std::endl;
+    const size_t dropped = reader.finish();
+    solver.join();
+    writer.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (dropped > 0) std::cerr << "Warning: " << dropped << " frames of an incomplete group were dropped." << std::endl;
+    const size_t groups = reader.groups();
+    log << groups - failed << " groups solved, " << failed << " failures, " << groups / seconds << " groups/s." << std::endl;
+    // Where the stages waited: reading waits on a full queue when solving is the bottleneck, and so on
+    log << "Waits: read " << frames.full_waits() << ", solve " << frames.empty_waits() << " in, " << solved.full_waits()
+        << " out, write " << solved.empty_waits() << std::endl;
+    return ok && failed == 0 ? 0 : 1;
+}
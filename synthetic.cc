@@ -0,0 +1,162 @@
+// Synthetic photometric stereo scenes with known ground truth: Lambertian
+// calibration spheres and a height-field object, rendered for any image
+// size and set of lights. Used by the benchmarks.
+// To be used in Computer Vision class.
+
+#include "synthetic.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+const double kPi = 3.14159265358979323846;
+
+// A Gaussian bump of the object's height field, in coordinates where the
+// smaller side of the image spans [-1, 1].
+struct Bump {
+  double u, v;    // Center.
+  double height;  // Negative for a dent.
+  double sigma;
+};
+
+const Bump kBumps[] = {
+  {0.0, 0.0, 0.30, 0.45},
+  {-0.6, -0.4, 0.12, 0.20},
+  {0.5, 0.45, -0.10, 0.25},
+};
+
+// Converts a gray level to a pixel, rounding and clamping to [0, 255].
+inline uint8_t ToPixel(double gray_level) {
+  return static_cast<uint8_t>(min(255.0, max(0.0, gray_level + 0.5)));
+}
+
+// The sphere's normal at column j, row i; false outside the sphere.
+inline bool SphereNormal(const SphereParameters &sphere, size_t i, size_t j,
+			 double normal[3]) {
+  normal[0] = (static_cast<double>(j) - sphere.center_x) / sphere.radius;
+  normal[1] = (static_cast<double>(i) - sphere.center_y) / sphere.radius;
+  const double z2 = 1.0 - normal[0] * normal[0] - normal[1] * normal[1];
+  if (z2 < 0.0) return false;
+  normal[2] = sqrt(z2);
+  return true;
+}
+
+void AllocateScene(size_t num_rows, size_t num_columns, Image *an_image) {
+  if (an_image == nullptr) abort();
+  an_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+  an_image->SetNumberGrayLevels(255);
+}
+
+}  // namespace
+
+vector<vector<double>> MakeLightDirections(size_t num_lights,
+					    double elevation_degrees) {
+  const double elevation = elevation_degrees * kPi / 180.0;
+  vector<vector<double>> directions(num_lights, vector<double>(3));
+  for (size_t k = 0; k < num_lights; ++k) {
+    // Offset from the axes, so no light sits exactly on a pixel row.
+    const double azimuth = 2.0 * kPi * (k + 0.125) / num_lights;
+    directions[k][0] = sin(elevation) * cos(azimuth);
+    directions[k][1] = sin(elevation) * sin(azimuth);
+    directions[k][2] = cos(elevation);
+  }
+  return directions;
+}
+
+SphereParameters MakeSphere(size_t num_rows, size_t num_columns) {
+  SphereParameters sphere;
+  sphere.center_x = num_columns / 2 + num_columns / 16;
+  sphere.center_y = num_rows / 2 - num_rows / 16;
+  sphere.radius = min(num_rows, num_columns) / 4;
+  return sphere;
+}
+
+void RenderSphereMask(size_t num_rows, size_t num_columns,
+		      const SphereParameters &sphere, Image *an_image) {
+  AllocateScene(num_rows, num_columns, an_image);
+  for (size_t i = 0; i < num_rows; ++i) {
+    uint8_t *row = an_image->Row(i);
+    for (size_t j = 0; j < num_columns; ++j) {
+      double normal[3];
+      row[j] = SphereNormal(sphere, i, j, normal) ?
+	ToPixel(150.0 + 100.0 * normal[2]) : 10;
+    }
+  }
+}
+
+void RenderSphere(size_t num_rows, size_t num_columns,
+		  const SphereParameters &sphere, const double light[3],
+		  Image *an_image) {
+  AllocateScene(num_rows, num_columns, an_image);
+  for (size_t i = 0; i < num_rows; ++i) {
+    uint8_t *row = an_image->Row(i);
+    for (size_t j = 0; j < num_columns; ++j) {
+      double normal[3];
+      row[j] = SphereNormal(sphere, i, j, normal) ?
+	ToPixel(255.0 * (normal[0] * light[0] + normal[1] * light[1] +
+			 normal[2] * light[2])) : 0;
+    }
+  }
+}
+
+void ObjectNormalAndAlbedo(size_t num_rows, size_t num_columns,
+			   size_t i, size_t j, double normal[3],
+			   double *albedo) {
+  const double scale = min(num_rows, num_columns) / 2.0;
+  const double u = (j - num_columns / 2.0) / scale;
+  const double v = (i - num_rows / 2.0) / scale;
+
+  // Gradient of the height field; heights are in the same units as u and
+  // v, so it is also the slope in pixels.
+  double du = 0.0, dv = 0.0;
+  for (size_t b = 0; b < sizeof kBumps / sizeof kBumps[0]; ++b) {
+    const Bump &bump = kBumps[b];
+    const double s2 = bump.sigma * bump.sigma;
+    const double eu = u - bump.u, ev = v - bump.v;
+    const double h = bump.height * exp(-(eu * eu + ev * ev) / (2.0 * s2));
+    du -= h * eu / s2;
+    dv -= h * ev / s2;
+  }
+  const double norm = sqrt(du * du + dv * dv + 1.0);
+  normal[0] = -du / norm;
+  normal[1] = -dv / norm;
+  normal[2] = 1.0 / norm;
+  *albedo = 0.55 + 0.3 * sin(5.0 * u) * cos(4.0 * v);
+}
+
+double ObjectHeight(size_t num_rows, size_t num_columns, size_t i,
+		    size_t j) {
+  const double scale = min(num_rows, num_columns) / 2.0;
+  const double u = (j - num_columns / 2.0) / scale;
+  const double v = (i - num_rows / 2.0) / scale;
+  double height = 0.0;
+  for (size_t b = 0; b < sizeof kBumps / sizeof kBumps[0]; ++b) {
+    const Bump &bump = kBumps[b];
+    const double eu = u - bump.u, ev = v - bump.v;
+    height += bump.height *
+      exp(-(eu * eu + ev * ev) / (2.0 * bump.sigma * bump.sigma));
+  }
+  return height * scale;
+}
+
+void RenderObject(size_t num_rows, size_t num_columns,
+		  const double light[3], Image *an_image) {
+  AllocateScene(num_rows, num_columns, an_image);
+  for (size_t i = 0; i < num_rows; ++i) {
+    uint8_t *row = an_image->Row(i);
+    for (size_t j = 0; j < num_columns; ++j) {
+      double normal[3], albedo;
+      ObjectNormalAndAlbedo(num_rows, num_columns, i, j, normal, &albedo);
+      row[j] = ToPixel(255.0 * albedo * (normal[0] * light[0] +
+					 normal[1] * light[1] +
+					 normal[2] * light[2]));
+    }
+  }
+}
+
+}  // namespace ComputerVisionProjects
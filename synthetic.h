@@ -0,0 +1,59 @@
+// Synthetic photometric stereo scenes with known ground truth: Lambertian
+// calibration spheres and a height-field object, rendered for any image
+// size and set of lights. Used by the benchmarks.
+// To be used in Computer Vision class.
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <cstddef>
+#include <vector>
+#include "image.h"
+#include "sphere.h"
+
+namespace ComputerVisionProjects {
+
+// num_lights unit light directions on a cone of half-angle
+// elevation_degrees around the viewing direction (0, 0, 1), evenly
+// spread in azimuth. Coordinates follow the images: x along the columns,
+// y down the rows, z towards the camera.
+std::vector<std::vector<double>> MakeLightDirections(
+    size_t num_lights, double elevation_degrees);
+
+// The calibration sphere of a num_rows x num_columns scene: off center,
+// with a radius of a quarter of the smaller side.
+SphereParameters MakeSphere(size_t num_rows, size_t num_columns);
+
+// Renders the sphere for s1: uniformly lit (gray levels 150 to 250 from
+// rim to center) on a background of 10, so that any threshold between
+// 10 and 150 finds the whole disc.
+void RenderSphereMask(size_t num_rows, size_t num_columns,
+		      const SphereParameters &sphere, Image *an_image);
+
+// Renders the sphere lit by unit light direction light, with gray level
+// 255 * (n . l), for s2.
+void RenderSphere(size_t num_rows, size_t num_columns,
+		  const SphereParameters &sphere, const double light[3],
+		  Image *an_image);
+
+// Ground truth of the object at row i, column j of a num_rows x
+// num_columns scene: its unit normal and its albedo, in [0.25, 0.85].
+// The surface is a few smooth bumps gentle enough that lights within 30
+// degrees of the viewing direction never leave a pixel in shadow.
+void ObjectNormalAndAlbedo(size_t num_rows, size_t num_columns,
+			   size_t i, size_t j, double normal[3],
+			   double *albedo);
+
+// Ground truth height of the object at row i, column j, in pixels: the
+// surface whose normals ObjectNormalAndAlbedo() gives.
+double ObjectHeight(size_t num_rows, size_t num_columns, size_t i,
+		    size_t j);
+
+// Renders the object lit by unit light direction light, with gray level
+// 255 * albedo * (n . l), for s3.
+void RenderObject(size_t num_rows, size_t num_columns,
+		  const double light[3], Image *an_image);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // SYNTHETIC_H
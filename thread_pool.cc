@@ -0,0 +1,113 @@
+// A small work-stealing thread pool for data-parallel loops.
+// To be used in Computer Vision class.
+
+#include "thread_pool.h"
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : task_{nullptr}, generation_{0}, pending_{0}, stop_{false} {
+  if (num_threads == 0) num_threads = thread::hardware_concurrency();
+  if (num_threads == 0) num_threads = 1;
+  for (size_t i = 0; i < num_threads; ++i)
+    queues_.emplace_back(new Queue);
+  for (size_t i = 0; i + 1 < num_threads; ++i)
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i) threads_[i].join();
+}
+
+void ThreadPool::ParallelFor(size_t count,
+			     const function<void(size_t)> &task) {
+  if (count == 0) return;
+  if (queues_.size() == 1) {
+    for (size_t i = 0; i < count; ++i) task(i);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    task_ = &task;
+    pending_ = count;
+  }
+  // Deal the iterations out in contiguous blocks, so that neighbouring
+  // iterations (e.g. adjacent tiles) tend to run on the same thread.
+  // Workers still draining the previous loop may pick them up at once,
+  // which is why task_ is set first.
+  const size_t num_queues = queues_.size();
+  for (size_t q = 0; q < num_queues; ++q) {
+    lock_guard<mutex> lock(queues_[q]->mutex);
+    for (size_t i = count * q / num_queues; i < count * (q + 1) / num_queues;
+	 ++i)
+      queues_[q]->iterations.push_back(i);
+  }
+  {
+    lock_guard<mutex> lock(mutex_);
+    ++generation_;
+  }
+  wake_.notify_all();
+
+  while (RunOne(num_queues - 1)) { }
+
+  unique_lock<mutex> lock(mutex_);
+  done_.wait(lock, [this] { return pending_ == 0; });
+  task_ = nullptr;
+}
+
+bool ThreadPool::RunOne(size_t worker) {
+  const size_t num_queues = queues_.size();
+  size_t iteration = 0;
+  bool found = false;
+  {
+    Queue &own = *queues_[worker];
+    lock_guard<mutex> lock(own.mutex);
+    if (!own.iterations.empty()) {
+      iteration = own.iterations.back();
+      own.iterations.pop_back();
+      found = true;
+    }
+  }
+  for (size_t k = 1; !found && k < num_queues; ++k) {
+    Queue &victim = *queues_[(worker + k) % num_queues];
+    lock_guard<mutex> lock(victim.mutex);
+    if (!victim.iterations.empty()) {
+      iteration = victim.iterations.front();
+      victim.iterations.pop_front();
+      found = true;
+    }
+  }
+  if (!found) return false;
+
+  (*task_)(iteration);
+  if (--pending_ == 0) {
+    lock_guard<mutex> lock(mutex_);
+    done_.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::WorkerLoop(size_t worker) {
+  size_t seen_generation = 0;
+  for (;;) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      wake_.wait(lock, [&] {
+	return stop_ || generation_ != seen_generation;
+      });
+      if (stop_) return;
+      seen_generation = generation_;
+    }
+    while (RunOne(worker)) { }
+  }
+}
+
+}  // namespace ComputerVisionProjects
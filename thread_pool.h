@@ -0,0 +1,66 @@
+// A small work-stealing thread pool for data-parallel loops.
+// To be used in Computer Vision class.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ComputerVisionProjects {
+
+// Runs the iterations of a loop on a fixed set of threads.
+// Every thread owns a queue of iterations; it works from the back of its
+// own queue and, once that is empty, steals from the front of the
+// others', so uneven iterations still keep every thread busy.
+// Sample usage:
+//   ThreadPool pool(8);
+//   pool.ParallelFor(num_tiles, [&](size_t tile) { ProcessTile(tile); });
+class ThreadPool {
+ public:
+  // Uses num_threads threads in total, the caller of ParallelFor()
+  // included; 0 means one per hardware thread.
+  explicit ThreadPool(size_t num_threads);
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool& operator=(const ThreadPool &) = delete;
+  ~ThreadPool();
+
+  size_t num_threads() const { return queues_.size(); }
+
+  // Calls task(i) for every i in [0, count) and returns once all calls
+  // have finished. Only one ParallelFor() may run at a time.
+  void ParallelFor(size_t count, const std::function<void(size_t)> &task);
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> iterations;
+  };
+
+  void WorkerLoop(size_t worker);
+  // Runs one iteration, taken from queue worker or stolen from another.
+  // Returns false when there is nothing left to run.
+  bool RunOne(size_t worker);
+
+  std::vector<std::unique_ptr<Queue>> queues_;  // The caller's is last.
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(size_t)> *task_;
+  size_t generation_;
+  std::atomic<size_t> pending_;
+  bool stop_;
+};
+
+}  // namespace ComputerVisionProjects
+
+#endif  // THREAD_POOL_H
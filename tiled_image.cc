@@ -0,0 +1,224 @@
+// Out-of-core access to pgm images too large to hold in memory whole.
+// To be used in Computer Vision class.
+
+#include "tiled_image.h"
+#include "trace.h"
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+// The decoded tiles, keyed by their index in the tile grid (row-major),
+// and their order of use.
+template <typename PixelType>
+struct TiledImage<PixelType>::Cache {
+  struct Entry {
+    shared_ptr<BasicImage<PixelType>> pixels;
+    typename list<size_t>::iterator position;  // In recent.
+  };
+
+  // Drops the least recently used tile, which must exist, and returns
+  // its pixels.
+  shared_ptr<BasicImage<PixelType>> EvictOldest() {
+    auto oldest = entries.find(recent.back());
+    shared_ptr<BasicImage<PixelType>> pixels = oldest->second.pixels;
+    bytes -= pixels->num_rows() * pixels->stride() * sizeof(PixelType);
+    entries.erase(oldest);
+    recent.pop_back();
+    ++statistics.evictions;
+    TRACE_COUNT("tile_cache_evictions", 1);
+    return pixels;
+  }
+
+  mutex lock;  // Guards everything below.
+  unordered_map<size_t, Entry> entries;
+  list<size_t> recent;  // Most recently used first.
+  size_t bytes;
+  TileCacheStatistics statistics;
+};
+
+template <typename PixelType>
+TiledImage<PixelType>::TiledImage() { }
+
+template <typename PixelType>
+TiledImage<PixelType>::TiledImage(TiledImage &&a_tiled_image) noexcept
+    : reader_{std::move(a_tiled_image.reader_)},
+      options_{a_tiled_image.options_},
+      cache_{std::move(a_tiled_image.cache_)} { }
+
+template <typename PixelType>
+TiledImage<PixelType>&
+TiledImage<PixelType>::operator=(TiledImage &&a_tiled_image) noexcept {
+  if (this == &a_tiled_image) return *this;
+  reader_ = std::move(a_tiled_image.reader_);
+  options_ = a_tiled_image.options_;
+  cache_ = std::move(a_tiled_image.cache_);
+  return *this;
+}
+
+template <typename PixelType>
+TiledImage<PixelType>::~TiledImage() { }
+
+template <typename PixelType>
+size_t TiledImage<PixelType>::num_tile_rows() const {
+  return (num_rows() + options_.tile_size - 1) / options_.tile_size;
+}
+
+template <typename PixelType>
+size_t TiledImage<PixelType>::num_tile_columns() const {
+  return (num_columns() + options_.tile_size - 1) / options_.tile_size;
+}
+
+template <typename PixelType>
+size_t TiledImage<PixelType>::TileBytes() const {
+  // As BasicImage pads its rows.
+  const size_t per_line = Image::kRowAlignment / sizeof(PixelType);
+  const size_t side = options_.tile_size + 2 * options_.overlap;
+  return side * ((side + per_line - 1) / per_line * per_line) *
+    sizeof(PixelType);
+}
+
+template <typename PixelType>
+ImageTile<PixelType> TiledImage<PixelType>::GetTile(
+    size_t tile_row, size_t tile_column) const {
+  if (cache_ == nullptr || tile_row >= num_tile_rows() ||
+      tile_column >= num_tile_columns()) abort();
+  const size_t tile_size = options_.tile_size;
+  const size_t overlap = options_.overlap;
+  const size_t core_first_row = tile_row * tile_size;
+  const size_t core_first_column = tile_column * tile_size;
+
+  ImageTile<PixelType> tile;
+  tile.first_row = core_first_row - min(overlap, core_first_row);
+  tile.first_column = core_first_column - min(overlap, core_first_column);
+  tile.core_row = core_first_row - tile.first_row;
+  tile.core_column = core_first_column - tile.first_column;
+  tile.core_rows = min(tile_size, num_rows() - core_first_row);
+  tile.core_columns = min(tile_size, num_columns() - core_first_column);
+  const size_t rows =
+    min(num_rows(), core_first_row + tile.core_rows + overlap) -
+    tile.first_row;
+  const size_t columns =
+    min(num_columns(), core_first_column + tile.core_columns + overlap) -
+    tile.first_column;
+
+  const size_t key = tile_row * num_tile_columns() + tile_column;
+  {
+    lock_guard<mutex> hold(cache_->lock);
+    auto found = cache_->entries.find(key);
+    if (found != cache_->entries.end()) {
+      cache_->recent.splice(cache_->recent.begin(), cache_->recent,
+			    found->second.position);
+      ++cache_->statistics.hits;
+      TRACE_COUNT("tile_cache_hits", 1);
+      tile.pixels = found->second.pixels;
+      return tile;
+    }
+  }
+
+  // A full cache makes room first, and the pixels of the tile it drops
+  // are decoded over unless someone still holds them: in steady state
+  // tiles recycle the same buffers instead of going through the
+  // allocator, which would scatter them over a growing heap.
+  shared_ptr<BasicImage<PixelType>> pixels;
+  {
+    lock_guard<mutex> hold(cache_->lock);
+    if (!cache_->recent.empty() &&
+	cache_->bytes + TileBytes() > options_.memory_budget) {
+      shared_ptr<BasicImage<PixelType>> evicted = cache_->EvictOldest();
+      // Out of the cache, no one can take a new reference to it.
+      if (evicted.use_count() == 1) pixels = evicted;
+    }
+  }
+  if (pixels == nullptr) pixels.reset(new BasicImage<PixelType>);
+
+  // Decoded without the lock, so that threads missing different tiles
+  // decode them at the same time.
+  {
+    TRACE_SCOPE("tile_decode");
+    TRACE_COUNT("pixels_decoded", rows * columns);
+    pixels->AllocateSpaceAndSetSize(rows, columns);
+    pixels->SetNumberGrayLevels(num_gray_levels());
+    for (size_t i = 0; i < rows; ++i)
+      reader_.ReadRowSpan(tile.first_row + i, tile.first_column, columns,
+			  pixels->Row(i));
+    reader_.ReleaseRows(tile.first_row, rows);
+  }
+  const size_t bytes = rows * pixels->stride() * sizeof(PixelType);
+
+  lock_guard<mutex> hold(cache_->lock);
+  ++cache_->statistics.misses;
+  TRACE_COUNT("tile_cache_misses", 1);
+  auto found = cache_->entries.find(key);
+  if (found != cache_->entries.end()) {
+    // Another thread decoded it meanwhile; theirs is kept.
+    tile.pixels = found->second.pixels;
+    return tile;
+  }
+  while (!cache_->recent.empty() &&
+	 cache_->bytes + bytes > options_.memory_budget)
+    cache_->EvictOldest();
+  cache_->recent.push_front(key);
+  typename Cache::Entry entry;
+  entry.pixels = pixels;
+  entry.position = cache_->recent.begin();
+  cache_->entries.insert(make_pair(key, entry));
+  cache_->bytes += bytes;
+  cache_->statistics.peak_bytes =
+    max(cache_->statistics.peak_bytes, cache_->bytes);
+  tile.pixels = pixels;
+  return tile;
+}
+
+template <typename PixelType>
+TileCacheStatistics TiledImage<PixelType>::statistics() const {
+  if (cache_ == nullptr) return TileCacheStatistics();
+  lock_guard<mutex> hold(cache_->lock);
+  return cache_->statistics;
+}
+
+template <typename PixelType>
+void TiledImage<PixelType>::Close() {
+  cache_.reset();
+  reader_.Close();
+}
+
+template <typename PixelType>
+bool OpenTiledImage(const string &filename, const TileOptions &options,
+		    TiledImage<PixelType> *tiled_image) {
+  if (tiled_image == nullptr) abort();
+  tiled_image->Close();
+  if (options.tile_size == 0) {
+    cout << "OpenTiledImage: tile size must be at least 1" << endl;
+    return false;
+  }
+  if (!OpenImage(filename, &tiled_image->reader_)) return false;
+  if (tiled_image->num_gray_levels() > 255 && sizeof(PixelType) == 1) {
+    tiled_image->Close();
+    cout << "OpenTiledImage: 16-bit .pgm file needs a 16-bit image" << endl;
+    return false;
+  }
+  tiled_image->options_ = options;
+  tiled_image->cache_.reset(new typename TiledImage<PixelType>::Cache);
+  tiled_image->cache_->bytes = 0;
+  tiled_image->cache_->statistics = TileCacheStatistics();
+  return true;
+}
+
+template class TiledImage<uint8_t>;
+template class TiledImage<uint16_t>;
+template class TiledImage<float>;
+template bool OpenTiledImage(const string &, const TileOptions &,
+			     TiledImage<uint8_t> *);
+template bool OpenTiledImage(const string &, const TileOptions &,
+			     TiledImage<uint16_t> *);
+template bool OpenTiledImage(const string &, const TileOptions &,
+			     TiledImage<float> *);
+
+}  // namespace ComputerVisionProjects
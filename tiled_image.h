@@ -0,0 +1,128 @@
+// Out-of-core access to pgm images too large to hold in memory whole:
+// pixels are decoded from the mapped file a square tile at a time, and
+// decoded tiles are kept in a least-recently-used cache whose size is
+// bounded by a memory budget rather than by the image size.
+// To be used in Computer Vision class.
+
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "image.h"
+
+namespace ComputerVisionProjects {
+
+struct TileOptions {
+  TileOptions(): tile_size{512}, overlap{0},
+		 memory_budget{256 * 1024 * 1024} { }
+
+  // Rows and columns of a tile's core; the cores partition the image.
+  size_t tile_size;
+  // Pixels of the neighbouring tiles added on every side of a core (as
+  // far as the image goes), for kernels that look past the core, e.g.
+  // convolutions. Overlapping pixels are decoded once per tile.
+  size_t overlap;
+  // Bytes of decoded tiles the cache may hold. At least one tile is
+  // always kept, whatever the budget.
+  size_t memory_budget;
+};
+
+// One decoded tile of a TiledImage: its core grown by the overlap. The
+// pixels stay valid as long as the tile is held, even once the cache
+// has let them go.
+template <typename PixelType>
+struct ImageTile {
+  std::shared_ptr<const BasicImage<PixelType>> pixels;
+  size_t first_row;      // Image coordinates of pixel (0, 0).
+  size_t first_column;
+  size_t core_row;       // The core, in the coordinates of pixels.
+  size_t core_column;
+  size_t core_rows;
+  size_t core_columns;
+
+  ImageView<PixelType> View() const { return pixels->View(); }
+  // The core alone, without the overlap.
+  ImageView<PixelType> CoreView() const {
+    return ImageView<PixelType>(pixels->Row(core_row) + core_column,
+				core_rows, core_columns, pixels->stride(),
+				pixels->num_gray_levels());
+  }
+};
+
+// How a tile cache fared.
+struct TileCacheStatistics {
+  uint64_t hits;
+  uint64_t misses;       // Tiles decoded.
+  uint64_t evictions;
+  size_t peak_bytes;     // Most bytes of tiles cached at once.
+};
+
+template <typename PixelType> class TiledImage;
+
+// Opens pgm file input_filename for reading with tiled_image, tiles as
+// described by options. 16-bit files need a 16-bit or float PixelType.
+// Returns true if  everyhing is OK, false otherwise.
+template <typename PixelType>
+bool OpenTiledImage(const std::string &input_filename,
+		    const TileOptions &options,
+		    TiledImage<PixelType> *tiled_image);
+
+// A pgm file read a tile at a time, through a cache of decoded tiles.
+// Only the tiles asked for are decoded, and the mapped pages they came
+// from are released right away, so memory use stays within the budget
+// (plus the tiles callers still hold) however large the file. P2 files
+// are decoded whole when opened, as by ImageReader; only P5 files stay
+// out of core. GetTile() is safe to call from several threads at once.
+// Sample usage:
+//   TiledImage<uint8_t> image;
+//   if (!OpenTiledImage("scan.pgm", TileOptions(), &image)) ...;
+//   for (size_t r = 0; r < image.num_tile_rows(); ++r)
+//     for (size_t c = 0; c < image.num_tile_columns(); ++c) {
+//       const ImageTile<uint8_t> tile = image.GetTile(r, c);
+//       Process(tile.CoreView(), tile.first_row + tile.core_row, ...);
+//     }
+template <typename PixelType>
+class TiledImage {
+ public:
+  TiledImage();
+  TiledImage(const TiledImage &) = delete;
+  TiledImage& operator=(const TiledImage &) = delete;
+  TiledImage(TiledImage &&a_tiled_image) noexcept;
+  TiledImage& operator=(TiledImage &&a_tiled_image) noexcept;
+  ~TiledImage();
+
+  size_t num_rows() const { return reader_.num_rows(); }
+  size_t num_columns() const { return reader_.num_columns(); }
+  size_t num_gray_levels() const { return reader_.num_gray_levels(); }
+  const TileOptions &options() const { return options_; }
+  size_t num_tile_rows() const;
+  size_t num_tile_columns() const;
+
+  // The tile whose core is at row tile_row and column tile_column of the
+  // tile grid: from the cache, or decoded (and cached) if not there.
+  ImageTile<PixelType> GetTile(size_t tile_row, size_t tile_column) const;
+
+  // Bytes a tile with a full core takes once decoded.
+  size_t TileBytes() const;
+
+  TileCacheStatistics statistics() const;
+  void Close();
+
+ private:
+  friend bool OpenTiledImage<PixelType>(const std::string &,
+					const TileOptions &,
+					TiledImage<PixelType> *);
+
+  struct Cache;
+
+  ImageReader reader_;
+  TileOptions options_;
+  std::unique_ptr<Cache> cache_;
+};
+
+}  // namespace ComputerVisionProjects
+
+#endif  // TILED_IMAGE_H
@@ -0,0 +1,304 @@
+// Lightweight instrumentation of the hot paths: scoped timers, counters of
+// the pixels and bytes processed, and peak memory use, exported as a
+// Chrome trace (chrome://tracing, Perfetto) or as a flat metrics file.
+// To be used in Computer Vision class.
+
+#include "trace.h"
+#include <iostream>
+
+#ifdef CV_TRACE
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+#ifdef CV_TRACE
+
+namespace {
+
+// How often the resident set size is sampled.
+const chrono::milliseconds kSamplePeriod(10);
+
+struct Event {
+  const char *name;
+  uint64_t start;     // Nanoseconds since the trace started.
+  uint64_t duration;
+};
+
+// What one thread recorded. Only that thread writes to it; it is read once
+// the work is done, when the trace is exported.
+struct ThreadTrace {
+  int id;
+  vector<Event> events;
+  vector<pair<const char *, uint64_t>> counters;
+};
+
+struct MemorySample {
+  uint64_t time;
+  uint64_t resident_kb;
+};
+
+struct Registry {
+  Registry(): epoch{chrono::steady_clock::now()}, stop_sampling{false} { }
+
+  const chrono::steady_clock::time_point epoch;
+  mutex lock;  // Guards threads.
+  vector<shared_ptr<ThreadTrace>> threads;
+
+  // The memory sampler and what it found.
+  thread sampler;
+  mutex sampler_lock;
+  condition_variable sampler_wakeup;
+  bool stop_sampling;
+  vector<MemorySample> memory_samples;
+};
+
+// Never destroyed, so threads can still record while the program exits.
+Registry &GetRegistry() {
+  static Registry *registry = new Registry;
+  return *registry;
+}
+
+uint64_t Now() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - GetRegistry().epoch).count();
+}
+
+ThreadTrace &CurrentThread() {
+  thread_local shared_ptr<ThreadTrace> current;
+  if (!current) {
+    Registry &registry = GetRegistry();
+    current = make_shared<ThreadTrace>();
+    lock_guard<mutex> hold(registry.lock);
+    current->id = registry.threads.size();
+    registry.threads.push_back(current);
+  }
+  return *current;
+}
+
+// Current resident set size, from /proc/self/statm.
+uint64_t ResidentKilobytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr) return 0;
+  unsigned long long size = 0, resident = 0;
+  const int found = fscanf(statm, "%llu %llu", &size, &resident);
+  fclose(statm);
+  return found == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+uint64_t PeakResidentKilobytes() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // Already in kilobytes on Linux.
+}
+
+void SampleMemory() {
+  Registry &registry = GetRegistry();
+  unique_lock<mutex> hold(registry.sampler_lock);
+  while (!registry.stop_sampling) {
+    registry.memory_samples.push_back({Now(), ResidentKilobytes()});
+    registry.sampler_wakeup.wait_for(hold, kSamplePeriod);
+  }
+}
+
+// Stops the sampler, so its samples can be read.
+void StopSampling() {
+  Registry &registry = GetRegistry();
+  {
+    lock_guard<mutex> hold(registry.sampler_lock);
+    registry.stop_sampling = true;
+  }
+  registry.sampler_wakeup.notify_all();
+  if (registry.sampler.joinable()) registry.sampler.join();
+}
+
+// Per-name totals over every thread.
+struct ScopeTotals {
+  uint64_t calls;
+  uint64_t total;
+  uint64_t longest;
+};
+
+void MergeThreads(map<string, ScopeTotals> *scopes,
+		  map<string, uint64_t> *counters) {
+  Registry &registry = GetRegistry();
+  lock_guard<mutex> hold(registry.lock);
+  for (size_t t = 0; t < registry.threads.size(); ++t) {
+    const ThreadTrace &trace = *registry.threads[t];
+    for (size_t e = 0; e < trace.events.size(); ++e) {
+      ScopeTotals &totals = (*scopes)[trace.events[e].name];
+      ++totals.calls;
+      totals.total += trace.events[e].duration;
+      totals.longest = max(totals.longest, trace.events[e].duration);
+    }
+    for (size_t c = 0; c < trace.counters.size(); ++c)
+      (*counters)[trace.counters[c].first] += trace.counters[c].second;
+  }
+}
+
+}  // namespace
+
+TraceScope::TraceScope(const char *name): name_{name}, start_{Now()} { }
+
+TraceScope::~TraceScope() {
+  const uint64_t end = Now();
+  CurrentThread().events.push_back({name_, start_, end - start_});
+}
+
+void TraceCount(const char *name, uint64_t value) {
+  vector<pair<const char *, uint64_t>> &counters = CurrentThread().counters;
+  for (size_t c = 0; c < counters.size(); ++c) {
+    if (counters[c].first == name) {
+      counters[c].second += value;
+      return;
+    }
+  }
+  counters.push_back(make_pair(name, value));
+}
+
+void StartTracing() {
+  Registry &registry = GetRegistry();
+  lock_guard<mutex> hold(registry.sampler_lock);
+  if (!registry.sampler.joinable() && !registry.stop_sampling)
+    registry.sampler = thread(SampleMemory);
+}
+
+bool WriteChromeTrace(const string &filename) {
+  StopSampling();
+  const uint64_t end = Now();
+  FILE *output = fopen(filename.c_str(), "w");
+  if (output == nullptr) {
+    cout << "WriteChromeTrace: cannot open file" << endl;
+    return false;
+  }
+
+  // Times are in microseconds.
+  Registry &registry = GetRegistry();
+  fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(output, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	  "\"args\":{\"name\":\"pipeline\"}}");
+  {
+    lock_guard<mutex> hold(registry.lock);
+    for (size_t t = 0; t < registry.threads.size(); ++t) {
+      const ThreadTrace &trace = *registry.threads[t];
+      fprintf(output, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+	      "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+	      trace.id, trace.id);
+      for (size_t e = 0; e < trace.events.size(); ++e) {
+	const Event &event = trace.events[e];
+	fprintf(output, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+		"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name, trace.id,
+		event.start / 1e3, event.duration / 1e3);
+      }
+    }
+  }
+  for (size_t s = 0; s < registry.memory_samples.size(); ++s)
+    fprintf(output, ",\n{\"name\":\"memory\",\"ph\":\"C\",\"pid\":1,"
+	    "\"ts\":%.3f,\"args\":{\"resident_kb\":%llu}}",
+	    registry.memory_samples[s].time / 1e3,
+	    static_cast<unsigned long long>(
+		registry.memory_samples[s].resident_kb));
+
+  // Counters only have totals, shown at the end of the trace.
+  map<string, ScopeTotals> scopes;
+  map<string, uint64_t> counters;
+  MergeThreads(&scopes, &counters);
+  for (map<string, uint64_t>::const_iterator counter = counters.begin();
+       counter != counters.end(); ++counter)
+    fprintf(output, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,"
+	    "\"ts\":%.3f,\"args\":{\"total\":%llu}}", counter->first.c_str(),
+	    end / 1e3, static_cast<unsigned long long>(counter->second));
+  fprintf(output, ",\n{\"name\":\"peak_rss\",\"ph\":\"C\",\"pid\":1,"
+	  "\"ts\":%.3f,\"args\":{\"peak_rss_kb\":%llu}}\n]}\n", end / 1e3,
+	  static_cast<unsigned long long>(PeakResidentKilobytes()));
+
+  if (fclose(output) != 0) {
+    cout << "WriteChromeTrace: could not write" << endl;
+    return false;
+  }
+  return true;
+}
+
+bool WriteTraceMetrics(const string &filename) {
+  StopSampling();
+  const uint64_t end = Now();
+  FILE *output = fopen(filename.c_str(), "w");
+  if (output == nullptr) {
+    cout << "WriteTraceMetrics: cannot open file" << endl;
+    return false;
+  }
+
+  map<string, ScopeTotals> scopes;
+  map<string, uint64_t> counters;
+  MergeThreads(&scopes, &counters);
+  fprintf(output, "wall_ms %.3f\n", end / 1e6);
+  fprintf(output, "peak_rss_kb %llu\n",
+	  static_cast<unsigned long long>(PeakResidentKilobytes()));
+  for (map<string, ScopeTotals>::const_iterator scope = scopes.begin();
+       scope != scopes.end(); ++scope) {
+    const char *name = scope->first.c_str();
+    fprintf(output, "scope.%s.calls %llu\n", name,
+	    static_cast<unsigned long long>(scope->second.calls));
+    fprintf(output, "scope.%s.total_ms %.3f\n", name,
+	    scope->second.total / 1e6);
+    fprintf(output, "scope.%s.max_ms %.3f\n", name,
+	    scope->second.longest / 1e6);
+  }
+  for (map<string, uint64_t>::const_iterator counter = counters.begin();
+       counter != counters.end(); ++counter)
+    fprintf(output, "counter.%s %llu\n", counter->first.c_str(),
+	    static_cast<unsigned long long>(counter->second));
+
+  if (fclose(output) != 0) {
+    cout << "WriteTraceMetrics: could not write" << endl;
+    return false;
+  }
+  return true;
+}
+
+#else  // !CV_TRACE
+
+void StartTracing() { }
+
+bool WriteChromeTrace(const string &) {
+  cout << "WriteChromeTrace: tracing is compiled out (build with TRACE=1)"
+       << endl;
+  return false;
+}
+
+bool WriteTraceMetrics(const string &) {
+  cout << "WriteTraceMetrics: tracing is compiled out (build with TRACE=1)"
+       << endl;
+  return false;
+}
+
+#endif  // CV_TRACE
+
+TraceSession::TraceSession(const string &chrome_trace_filename,
+			   const string &metrics_filename)
+  : chrome_trace_filename_{chrome_trace_filename},
+    metrics_filename_{metrics_filename} {
+  if (!chrome_trace_filename_.empty() || !metrics_filename_.empty())
+    StartTracing();
+}
+
+TraceSession::~TraceSession() {
+  if (!chrome_trace_filename_.empty())
+    WriteChromeTrace(chrome_trace_filename_);
+  if (!metrics_filename_.empty()) WriteTraceMetrics(metrics_filename_);
+}
+
+}  // namespace ComputerVisionProjects
@@ -0,0 +1,96 @@
+// Lightweight instrumentation of the hot paths: scoped timers, counters of
+// the pixels and bytes processed, and peak memory use, exported as a
+// Chrome trace (chrome://tracing, Perfetto) or as a flat metrics file.
+// Compiled in only with -DCV_TRACE (make TRACE=1); otherwise the macros
+// expand to nothing and the exporters just report that tracing is off.
+// To be used in Computer Vision class.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+namespace ComputerVisionProjects {
+
+// Sample usage:
+//   void Decode(...) {
+//     TRACE_SCOPE("decode");
+//     TRACE_COUNT("pixels_decoded", num_rows * num_columns);
+//     ...
+//   }
+//   int main() {
+//     StartTracing();
+//     ...
+//     WriteChromeTrace("trace.json");
+//   }
+// Scopes nest (a "gather" includes the "decode" of its rows), so their
+// totals can add up to more than the wall time. Every thread records its
+// own events; they are merged only when exported.
+#ifdef CV_TRACE
+
+// Records the time from construction to destruction as an event.
+class TraceScope {
+ public:
+  explicit TraceScope(const char *name);
+  TraceScope(const TraceScope &) = delete;
+  TraceScope& operator=(const TraceScope &) = delete;
+  ~TraceScope();
+
+ private:
+  const char *name_;  // Must outlive the trace: a string literal.
+  uint64_t start_;
+};
+
+// Adds value to counter name (a string literal).
+void TraceCount(const char *name, uint64_t value);
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) \
+  ::ComputerVisionProjects::TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_COUNT(name, value) \
+  ::ComputerVisionProjects::TraceCount(name, value)
+
+#else
+
+#define TRACE_SCOPE(name) do { } while (0)
+#define TRACE_COUNT(name, value) do { } while (0)
+
+#endif  // CV_TRACE
+
+// Starts the clock and a thread that samples the resident set size every
+// few milliseconds, until the trace is written.
+void StartTracing();
+
+// Writes every event, counter and memory sample recorded so far as a
+// Chrome trace JSON file.
+// Returns true if  everyhing is OK, false otherwise (always false when
+// tracing is compiled out).
+bool WriteChromeTrace(const std::string &output_filename);
+
+// Writes one "name value" line per metric: the wall time, the peak RSS,
+// the calls and total time of every scope and every counter's total.
+// Returns true if  everyhing is OK, false otherwise (always false when
+// tracing is compiled out).
+bool WriteTraceMetrics(const std::string &output_filename);
+
+// Starts tracing if either filename is set, and writes the Chrome trace
+// and the metrics to the files that are set when destroyed, e.g. on
+// return from main(). Empty filenames are skipped.
+class TraceSession {
+ public:
+  TraceSession(const std::string &chrome_trace_filename,
+	       const std::string &metrics_filename);
+  TraceSession(const TraceSession &) = delete;
+  TraceSession& operator=(const TraceSession &) = delete;
+  ~TraceSession();
+
+ private:
+  std::string chrome_trace_filename_;
+  std::string metrics_filename_;
+};
+
+}  // namespace ComputerVisionProjects
+
+#endif  // TRACE_H